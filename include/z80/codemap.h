@@ -0,0 +1,73 @@
+#ifndef Z80_CODEMAP_H
+#define Z80_CODEMAP_H
+
+#include "z80/z80.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/** How a byte of memory has been accessed. A byte may have any combination,
+ * as self-modifying code and data mixed with code do.
+ */
+enum Z80CodeMapFlags
+{
+    /** Fetched as the opcode of an instruction, or one of its prefixes. */
+    Z80_CODEMAP_OPCODE = 1 << 0,
+    /** Fetched as an immediate value or displacement of an instruction. */
+    Z80_CODEMAP_OPERAND = 1 << 1,
+    /** Read as data, including from the stack. */
+    Z80_CODEMAP_READ = 1 << 2,
+    /** Written as data, including to the stack. */
+    Z80_CODEMAP_WRITE = 1 << 3,
+};
+
+/** A code/data map, recording for each address of the Z80's 64 KB how it
+ * was accessed, for disassemblers and translators to tell code from data.
+ *
+ * Accesses are recorded only by the z80codemap library, which is z80 built
+ * with Z80_CODEMAP defined; z80 itself has the checks compiled out. A map
+ * may be attached to one Z80 at a time. Maps of separate runs are combined
+ * with z80_codemap_merge, or by loading each file saved into the same map.
+ */
+struct Z80CodeMap
+{
+    /** Combination of Z80CodeMapFlags for each address. */
+    uint8_t flags[65536];
+};
+
+/** Clears a map, and attaches it to the Z80.
+ * @param map
+ * @param z80
+ * @return 0 on success, or -1 if the library does not record accesses, in
+ *         which case the map is cleared but not attached.
+ */
+int z80_codemap_init(struct Z80CodeMap *map, struct Z80 *z80);
+
+/** Adds the accesses recorded in one map to another.
+ * @param map
+ * @param other
+ */
+void z80_codemap_merge(struct Z80CodeMap *map, struct Z80CodeMap const *other);
+
+/** Writes the map to a file, as the 65536 bytes of flags in address order.
+ * @param map
+ * @param path
+ * @return 0 on success, or -1 if the file cannot be written.
+ */
+int z80_codemap_save(struct Z80CodeMap const *map, char const *path);
+
+/** Adds the accesses saved in a file to the map, as z80_codemap_merge does.
+ * @param map
+ * @param path
+ * @return 0 on success, or -1 if the file cannot be read or is not a map.
+ */
+int z80_codemap_load(struct Z80CodeMap *map, char const *path);
+
+/** Writes one line for each run of addresses with the same flags, leaving
+ * out those never accessed, as the first and last address in hex and the
+ * flags as "xorw", with '-' for each flag clear: "0100-0102 xo--".
+ * @param map
+ * @param out
+ */
+void z80_codemap_write_ranges(struct Z80CodeMap const *map, FILE *out);
+
+#endif
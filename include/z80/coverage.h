@@ -0,0 +1,52 @@
+#ifndef Z80_COVERAGE_H
+#define Z80_COVERAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Opcode tables, one for each prefix. Coverage is recorded only when the
+ * library is built with Z80_COVERAGE defined (the Z80_COVERAGE CMake
+ * option).
+ */
+enum Z80CoverageTable
+{
+    Z80_COVERAGE_BASE,
+    Z80_COVERAGE_CB,
+    Z80_COVERAGE_ED,
+    Z80_COVERAGE_DD,
+    Z80_COVERAGE_FD,
+    Z80_COVERAGE_DDCB,
+    Z80_COVERAGE_FDCB,
+    Z80_COVERAGE_TABLES,
+};
+
+/** What is known about one opcode after a run.
+ */
+struct Z80CoverageEntry
+{
+    /** Number of times the opcode was executed. */
+    uint64_t count;
+    /** Flags which were set after at least one execution. */
+    uint8_t flags_set;
+    /** Flags which were clear after at least one execution. */
+    uint8_t flags_clear;
+};
+
+/** Returns the 256 entries of one opcode table. The tables are shared by
+ * every Z80 in the process, and are not synchronized between threads.
+ * @param table One of the Z80CoverageTable values.
+ * @return The table, or NULL if coverage was not built in.
+ */
+struct Z80CoverageEntry const *z80_coverage(int table);
+
+/** Clears every table.
+ */
+void z80_coverage_reset(void);
+
+/** Writes a coverage matrix for each table, followed by the flag outcomes of
+ * every opcode executed.
+ * @param out
+ */
+void z80_coverage_dump(FILE *out);
+
+#endif
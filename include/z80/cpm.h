@@ -0,0 +1,105 @@
+#ifndef Z80_CPM_H
+#define Z80_CPM_H
+
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#define Z80_CPM_MAX_FILES 16
+#define Z80_CPM_MAX_MATCHES 256
+
+/** Address of the BDOS entry point, which 0x0005 jumps to. The TPA runs from
+ * 0x0100 up to just below this.
+ */
+#define Z80_CPM_BDOS 0xfc06
+/** Address of the BIOS jump table, which 0x0000 jumps into. */
+#define Z80_CPM_BIOS 0xfe00
+
+enum Z80CpmStatus
+{
+    /** The program returned to CP/M through a warm boot or BDOS function 0. */
+    Z80_CPM_EXITED,
+    /** The cycle limit was reached. */
+    Z80_CPM_RUNNING,
+    /** The Z80 faulted. */
+    Z80_CPM_FAULT,
+};
+
+/** A host file, opened by the CP/M program and mapped into host memory.
+ */
+struct Z80CpmFile
+{
+    /** Host file name, in lower case, or empty if the slot is free. */
+    char name[13];
+    int fd;
+    uint8_t *map;
+    size_t mapped;
+    size_t size;
+    /** Opened and mapped for reading only, as the host file is read-only. */
+    int readonly;
+};
+
+/** A CP/M 2.2 environment for running .COM programs.
+ *
+ * The BDOS and BIOS are implemented in C, and are called through the Z80's
+ * trap when the program reaches their entry points. Files live in a single
+ * host directory, which is shared by all drives. Open files are mapped into
+ * host memory, so reading or writing a record is a memory copy.
+ *
+ * The runtime takes over the Z80's userdata, and its bus with a copy which
+ * adds the trap, so the port callbacks must be set before z80_cpm_init. It
+ * needs the Z80 to have attached memory.
+ */
+struct Z80Cpm
+{
+    struct Z80 *z80;
+    struct Z80Bus bus;
+    char const *directory;
+    FILE *console_in;
+    FILE *console_out;
+
+    uint16_t dma;
+    uint8_t drive;
+    uint8_t user;
+    uint8_t iobyte;
+    uint8_t exited;
+
+    struct Z80CpmFile files[Z80_CPM_MAX_FILES];
+
+    /** Directory entries found by search first, returned by search next. */
+    char matches[Z80_CPM_MAX_MATCHES][13];
+    int num_matches;
+    int next_match;
+};
+
+/** Initializes the CP/M environment, and installs page zero, the BDOS and
+ * BIOS entry points into the Z80's memory.
+ * @param cpm
+ * @param z80 A Z80 with attached memory.
+ * @param directory Host directory holding the CP/M files.
+ */
+void z80_cpm_init(struct Z80Cpm *cpm, struct Z80 *z80, char const *directory);
+
+/** Closes any files left open by the program.
+ * @param cpm
+ */
+void z80_cpm_free(struct Z80Cpm *cpm);
+
+/** Loads a .COM program at 0x0100, and prepares the registers, stack, command
+ * tail and default FCBs as the CCP would.
+ * @param cpm
+ * @param path Host path of the .COM file.
+ * @param args Command tail, or NULL.
+ * @return 0 on success, or -1 if the file could not be loaded.
+ */
+int z80_cpm_load(struct Z80Cpm *cpm, char const *path, char const *args);
+
+/** Runs the program until it exits, faults, or reaches `max_cycles`.
+ * @param cpm
+ * @param max_cycles The value of the Z80's cycle counter at which to stop.
+ * @return One of the Z80CpmStatus values.
+ */
+int z80_cpm_run(struct Z80Cpm *cpm, uint64_t max_cycles);
+
+#endif
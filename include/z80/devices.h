@@ -0,0 +1,117 @@
+#ifndef Z80_DEVICES_H
+#define Z80_DEVICES_H
+
+#include "z80/ports.h"
+#include "z80/z80.h"
+#include <stdint.h>
+
+#define Z80_DEVICES_MAX 32
+
+/** The deadline of a device with nothing to do until the CPU next accesses
+ * it.
+ */
+#define Z80_NO_DEADLINE UINT64_MAX
+
+struct Z80Device;
+struct Z80Devices;
+
+/** Brings a device from the time it was last synchronized to up to `now`, in
+ * one go, and sets its next deadline.
+ * @param z80
+ * @param device The device, whose `synced` is still the old time.
+ * @param now The cycle count to bring it up to.
+ */
+typedef void (*Z80DeviceSync)(struct Z80 *z80, struct Z80Device *device, uint64_t now);
+
+/** A device which does no work while the CPU leaves it alone.
+ *
+ * Rather than being ticked after every instruction, the device records the
+ * cycle it was last brought up to, and catches up on everything since in
+ * one call to `sync`, just before the CPU reads or writes one of its ports,
+ * or once its deadline has come, whichever is first. The work done is then
+ * in proportion to the accesses and deadlines, not to the instructions run.
+ */
+struct Z80Device
+{
+    /** Catches the device up. Required. */
+    Z80DeviceSync sync;
+    /** Called for reads of the device's ports, once it has caught up to the
+     * start of the reading instruction. NULL to leave reads to the Z80's
+     * port_load callback. */
+    Z80PortLoad load;
+    /** Called for writes, once the device has caught up. NULL to leave
+     * writes to the Z80's port_store callback. */
+    Z80PortStore store;
+    void *userdata;
+    /** The cycle count the device has been brought up to. Set by the host to
+     * the time the device starts from, and kept up to date after that. */
+    uint64_t synced;
+    /** The cycle count by which the device must next be brought up to date,
+     * as when a timer expires and raises an interrupt, or Z80_NO_DEADLINE.
+     * Kept by `sync` and the port handlers. */
+    uint64_t deadline;
+    /** The set the device was added to. */
+    struct Z80Devices *devices;
+};
+
+/** The devices of one Z80, dispatched through its Z80Ports table.
+ */
+struct Z80Devices
+{
+    struct Z80Ports *ports;
+    struct Z80Device *devices[Z80_DEVICES_MAX];
+    int num_devices;
+    /** Where the run in progress will stop, or 0 between runs. A handler
+     * which brings its device's deadline before this stops the run early. */
+    uint64_t stop;
+};
+
+/** Initializes a set with no devices.
+ * @param devices
+ * @param ports The table through which the devices' ports will be mapped,
+ * which must be attached to the Z80 they will be run with.
+ */
+void z80_devices_init(struct Z80Devices *devices, struct Z80Ports *ports);
+
+/** Adds a device to the set, without mapping any ports to it.
+ * @param devices
+ * @param device
+ * @return The device's index, or -1 if the set is full.
+ */
+int z80_devices_add(struct Z80Devices *devices, struct Z80Device *device);
+
+/** Maps every low port byte `p` for which `(p & mask) == (port & mask)` to a
+ * device which has been added to the set, as z80_ports_map does.
+ * @param devices
+ * @param device
+ * @param port
+ * @param mask Address lines decoded by the device; 0xff for a single port.
+ */
+void z80_devices_map(struct Z80Devices *devices, struct Z80Device *device, uint8_t port, uint8_t mask);
+
+/** Brings a device up to the Z80's current cycle count, if it is behind.
+ * @param z80
+ * @param device
+ */
+void z80_device_sync(struct Z80 *z80, struct Z80Device *device);
+
+/** Brings every device up to the Z80's current cycle count, as a host would
+ * before looking at their state, such as to draw a frame.
+ * @param devices
+ * @param z80
+ */
+void z80_devices_sync_all(struct Z80Devices *devices, struct Z80 *z80);
+
+/** Runs the Z80 as z80_run does, stopping at each deadline on the way to
+ * bring that device up to date, so that an interrupt it raises is taken at
+ * the first instruction boundary after its deadline, exactly as if it were
+ * ticked after every instruction. A deadline brought forward by a port
+ * access ends the run in progress through z80_stop.
+ * @param devices
+ * @param z80
+ * @param until The value of the cycle counter to run to.
+ * @return Number of cycles run, which may overshoot by part of an instruction.
+ */
+int64_t z80_devices_run(struct Z80Devices *devices, struct Z80 *z80, uint64_t until);
+
+#endif
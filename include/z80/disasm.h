@@ -0,0 +1,21 @@
+#ifndef Z80_DISASM_H
+#define Z80_DISASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The longest instruction, in bytes. */
+#define Z80_MAX_INSTR_LENGTH 4
+
+/** Disassembles one instruction into lowercase Zilog syntax, such as
+ * "ld (ix+0x05), 0x10". Opcodes which fault as illegal are written as the
+ * bytes they take, such as "db 0xed, 0x00".
+ * @param code The instruction, with Z80_MAX_INSTR_LENGTH bytes readable.
+ * @param addr Address of the instruction, for the targets of relative jumps.
+ * @param buf Receives the text, which is truncated to fit.
+ * @param size Size of `buf`.
+ * @return The length of the instruction in bytes.
+ */
+int z80_disassemble(uint8_t const *code, uint16_t addr, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef Z80_MEMORY_H
+#define Z80_MEMORY_H
+
+#include "z80/z80.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define Z80_PAGE_BITS 10
+#define Z80_PAGE_SIZE (1 << Z80_PAGE_BITS)
+#define Z80_PAGE_MASK (Z80_PAGE_SIZE - 1)
+#define Z80_NUM_PAGES (0x10000 >> Z80_PAGE_BITS)
+
+/** What happens when the Z80 writes to a page mapped from a Z80Rom.
+ */
+enum Z80RomWrites
+{
+    /** The write is dropped, as on real hardware. */
+    Z80_ROM_IGNORE,
+    /** The page is copied into the instance's own memory, which takes the
+     * write, and is no longer shared. */
+    Z80_ROM_COPY,
+};
+
+/** An immutable image, such as a ROM, which many instances can map without
+ * copying. It is freed when the last reference is released.
+ */
+struct Z80Rom
+{
+    /** Page aligned, and padded with zeroes to a whole number of pages. */
+    uint8_t *data;
+    uint32_t length;
+    atomic_int refs;
+    /** Set for the images made by z80_fork, which are copied on the first
+     * write whatever the memory's rom_writes says. */
+    uint8_t copy_on_write;
+};
+
+/** 64 KB of memory, accessed directly by the Z80 rather than through the
+ * mem_load and mem_store callbacks. Memory is split into pages, and each
+ * write by the Z80 marks its page as dirty, so that checkpoints need only
+ * copy what has changed.
+ *
+ * Pages may instead be mapped from a shared Z80Rom. The instance's own
+ * memory behind a ROM page is left untouched unless the page is copied, so
+ * if it was allocated lazily (by mmap or calloc) it costs nothing.
+ *
+ * Once z80_memory_enable_hashing has been called, the memory also keeps a
+ * 64-bit hash of its contents: the sum, over every address, of a mix of the
+ * address and the byte stored there. Each write adds the difference its
+ * byte makes, so reading the hash costs nothing however much has changed.
+ */
+struct Z80Memory
+{
+    /** Host memory backing each page. */
+    uint8_t *pages[Z80_NUM_PAGES];
+    /** One bit per page, set when the Z80 writes to the page. */
+    uint64_t dirty;
+    /** One bit per page mapped from a ROM. The Z80 never writes to these
+     * directly; see z80_memory_unshare. */
+    uint64_t shared;
+    /** One of the Z80RomWrites values. */
+    uint8_t rom_writes;
+    /** Set when hash and page_hashes are being kept. */
+    uint8_t hashing;
+    /** The instance's own 64 KB. */
+    uint8_t *data;
+    /** The ROM each shared page is mapped from. */
+    struct Z80Rom *roms[Z80_NUM_PAGES];
+    /** The hash of all 64 KB, and each page's part of it. */
+    uint64_t hash;
+    uint64_t page_hashes[Z80_NUM_PAGES];
+};
+
+/** A checkpoint of the Z80's registers and memory.
+ */
+struct Z80Snapshot
+{
+    struct Z80 z80;
+    uint8_t data[0x10000];
+};
+
+/** Initializes memory to use the given 64 KB buffer, and attaches it to the
+ * Z80, which will then bypass its mem_load and mem_store callbacks.
+ * @param mem
+ * @param z80 The Z80 to attach to, or NULL.
+ * @param data 64 KB of host memory.
+ */
+void z80_memory_init(struct Z80Memory *mem, struct Z80 *z80, uint8_t *data);
+
+/** Unmaps any ROMs, releasing the memory's references to them.
+ * @param mem
+ */
+void z80_memory_free(struct Z80Memory *mem);
+
+/** Creates a ROM from a copy of the given data, with one reference, which
+ * the caller releases once it has mapped the ROM where it is needed.
+ * @param data
+ * @param length At most 64 KB.
+ * @return The ROM, or NULL if out of memory.
+ */
+struct Z80Rom *z80_rom_create(void const *data, uint32_t length);
+
+/** Releases a reference to a ROM, freeing it if it was the last.
+ * @param rom
+ */
+void z80_rom_release(struct Z80Rom *rom);
+
+/** Maps every page of a ROM into memory from `addr` on, taking a reference
+ * to it for each page.
+ * @param mem
+ * @param rom
+ * @param addr Page aligned address.
+ * @return 0 on success, or -1 if `addr` is not page aligned or the ROM does
+ * not fit below 0x10000.
+ */
+int z80_memory_map_rom(struct Z80Memory *mem, struct Z80Rom *rom, uint16_t addr);
+
+/** Called before a write to a shared page. Depending on rom_writes, either
+ * refuses the write, or copies the page into the instance's own memory so
+ * that it can take the write.
+ * @param mem
+ * @param page
+ * @return Non-zero if the page may now be written.
+ */
+int z80_memory_unshare(struct Z80Memory *mem, int page);
+
+/** Starts keeping the hash of the memory's contents, computing it from
+ * scratch.
+ * @param mem
+ */
+void z80_memory_enable_hashing(struct Z80Memory *mem);
+
+/** Recomputes the hash of the given pages, after the host has changed them
+ * other than through z80_memory_write, such as through `data` directly.
+ * Does nothing unless hashing is enabled.
+ * @param mem
+ * @param pages One bit per page.
+ */
+void z80_memory_rehash(struct Z80Memory *mem, uint64_t pages);
+
+/** Updates the hash for a byte about to be written. Called by the core, and
+ * only while hashing is enabled.
+ * @param mem
+ * @param addr
+ * @param value The byte which will replace the one at `addr`.
+ */
+void z80_memory_hash_write(struct Z80Memory *mem, uint16_t addr, uint8_t value);
+
+/** Returns a fingerprint of the Z80's state: its registers, other than the
+ * cycle count, combined with the hash of its attached memory, if hashing is
+ * enabled. Equal states have equal fingerprints, wherever their memory is
+ * mapped from, so it can key a cache of results or detect states already
+ * explored. It takes the same time however much memory has changed.
+ * @param z80
+ */
+uint64_t z80_state_hash(struct Z80 const *z80);
+
+/** Copies a block of host data into memory, marking the pages it touches as
+ * dirty. Writes which run past 0xffff wrap around. Writes to shared pages
+ * are treated as the Z80's would be.
+ * @param mem
+ * @param addr The address to copy to.
+ * @param data
+ * @param length
+ */
+void z80_memory_write(struct Z80Memory *mem,
+                      uint16_t addr,
+                      void const *data,
+                      uint32_t length);
+
+/** Copies a block of memory out to the host. Reads which run past 0xffff
+ * wrap around.
+ * @param mem
+ * @param addr The address to copy from.
+ * @param data
+ * @param length
+ */
+void z80_memory_read(struct Z80Memory const *mem,
+                     uint16_t addr,
+                     void *data,
+                     uint32_t length);
+
+/** Clones a Z80 and its attached memory into `n` children. The parent's
+ * memory is copied once into an image which the children share, page by
+ * page, until each page's first write copies it into the writer's own
+ * memory. The parent is left untouched, and ROMs it has mapped are shared as
+ * they are. Children are independent of each other and of the parent, and
+ * may run on different threads; they keep the parent's bus, userdata
+ * and port table, but not its write log.
+ * @param parent A Z80 with attached memory.
+ * @param n
+ * @param children Receives the `n` children, each to be released with
+ * z80_fork_free.
+ * @return 0 on success, or -1 if out of memory, in which case no children
+ * are created.
+ */
+int z80_fork(struct Z80 const *parent, int n, struct Z80 *children[]);
+
+/** Releases a child made by z80_fork, and its memory.
+ * @param child
+ */
+void z80_fork_free(struct Z80 *child);
+
+/** Takes a full checkpoint of the Z80 and its attached memory, and clears
+ * the dirty pages.
+ * @param snapshot
+ * @param z80 A Z80 with attached memory.
+ */
+void z80_snapshot_init(struct Z80Snapshot *snapshot, struct Z80 *z80);
+
+/** Updates a checkpoint taken from the same Z80, copying only those pages
+ * written since the last checkpoint or restore.
+ * @param snapshot
+ * @param z80
+ */
+void z80_snapshot_take(struct Z80Snapshot *snapshot, struct Z80 *z80);
+
+/** Rolls the Z80 back to the checkpoint, copying back only those pages
+ * written since the last checkpoint or restore.
+ * @param z80
+ * @param snapshot
+ */
+void z80_snapshot_restore(struct Z80 *z80, struct Z80Snapshot const *snapshot);
+
+#endif
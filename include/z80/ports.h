@@ -0,0 +1,88 @@
+#ifndef Z80_PORTS_H
+#define Z80_PORTS_H
+
+#include "z80/z80.h"
+#include <stdint.h>
+
+/** Reads a port mapped into a Z80Ports table.
+ * @param z80
+ * @param port The full 16-bit port address.
+ * @param userdata The userdata the port was mapped with.
+ */
+typedef uint8_t (*Z80PortLoad)(struct Z80 *z80, uint16_t port, void *userdata);
+
+/** Writes a port mapped into a Z80Ports table.
+ * @param z80
+ * @param port The full 16-bit port address.
+ * @param val
+ * @param userdata The userdata the port was mapped with.
+ */
+typedef void (*Z80PortStore)(struct Z80 *z80, uint16_t port, uint8_t val, void *userdata);
+
+/** One entry of a Z80Ports table.
+ */
+struct Z80Port
+{
+    /** Called for reads, unless the port is constant. NULL to use the Z80's
+     * port_load callback. */
+    Z80PortLoad load;
+    /** Called for writes. NULL to use the Z80's port_store callback. */
+    Z80PortStore store;
+    void *userdata;
+    /** When set, reads return `value` without calling anything. */
+    uint8_t constant;
+    uint8_t value;
+};
+
+/** Handlers for each port, chosen by the low byte of the port address, as
+ * most Z80 systems decode it. Each device is mapped with the mask of the
+ * address lines it decodes, and so fills every entry it answers to. Reads and
+ * writes of entries without a handler go to the Z80's port_load and
+ * port_store callbacks, as they do when no table is attached.
+ */
+struct Z80Ports
+{
+    struct Z80Port entries[256];
+};
+
+/** Clears the table, and attaches it to the Z80, which will then dispatch
+ * through it.
+ * @param ports
+ * @param z80 The Z80 to attach to, or NULL.
+ */
+void z80_ports_init(struct Z80Ports *ports, struct Z80 *z80);
+
+/** Maps handlers to every low port byte `p` for which `(p & mask) == (port &
+ * mask)`, replacing whatever was mapped there.
+ * @param ports
+ * @param port
+ * @param mask Address lines decoded by the device; 0xff for a single port.
+ * @param load Handler for reads, or NULL.
+ * @param store Handler for writes, or NULL.
+ * @param userdata Passed to the handlers.
+ */
+void z80_ports_map(struct Z80Ports *ports,
+                   uint8_t port,
+                   uint8_t mask,
+                   Z80PortLoad load,
+                   Z80PortStore store,
+                   void *userdata);
+
+/** Makes reads of the ports matched as by z80_ports_map return `value`
+ * without calling anything. Their write handlers are left as they were.
+ * @param ports
+ * @param port
+ * @param mask
+ * @param value
+ */
+void z80_ports_set_constant(struct Z80Ports *ports, uint8_t port, uint8_t mask, uint8_t value);
+
+/** Returns the ports matched as by z80_ports_map to the port_load and
+ * port_store callbacks.
+ * @param ports
+ * @param port
+ * @param mask
+ */
+void z80_ports_unmap(struct Z80Ports *ports, uint8_t port, uint8_t mask);
+
+#endif
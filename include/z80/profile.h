@@ -0,0 +1,153 @@
+#ifndef Z80_PROFILE_H
+#define Z80_PROFILE_H
+
+#include "z80/z80.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/** Frames of the shadow call stack which are kept. Deeper calls are
+ * followed, but left out of the samples. */
+#define Z80_PROFILE_DEPTH 64
+
+/** A call, restart or interrupt which has not yet returned.
+ */
+struct Z80ProfileFrame
+{
+    /** The address called, or of the interrupt handler. */
+    uint16_t addr;
+    /** The return address. */
+    uint16_t from;
+    /** The stack pointer once the return address was pushed. */
+    uint16_t sp;
+};
+
+/** One distinct stack sampled, and how many times.
+ */
+struct Z80ProfileStack
+{
+    uint64_t count;
+    uint64_t hash;
+    /** In Z80Profile::addrs, the return address of the outermost frame, if
+     * any, then the address of each frame, outermost first, then the PC. */
+    uint32_t offset;
+    uint16_t length;
+};
+
+struct Z80ProfileSymbol
+{
+    uint16_t addr;
+    char *name;
+};
+
+/** A sampling profiler for the guest.
+ *
+ * The core reports each call, restart, interrupt and return to it, from
+ * which it keeps a shadow of the guest's call stack. Frames are matched by
+ * the stack pointer rather than one for one, so that code which drops its
+ * return address, or resets SP, unwinds the frames it abandoned at the next
+ * call or return. Every `interval` cycles, z80_profile_run samples the PC and
+ * the shadow stack, counting each distinct stack once, and
+ * z80_profile_write_folded writes them out in the folded format read by
+ * flamegraph.pl and similar tools.
+ */
+struct Z80Profile
+{
+    uint64_t interval;
+    /** The cycle count at which the next sample is due. */
+    uint64_t next_sample;
+    uint64_t samples;
+    /** Samples lost when the tables could not grow. */
+    uint64_t dropped;
+
+    struct Z80ProfileFrame frames[Z80_PROFILE_DEPTH];
+    /** Depth of the shadow stack, which may exceed Z80_PROFILE_DEPTH. */
+    int depth;
+
+    /** Open-addressed table of the distinct stacks sampled. */
+    struct Z80ProfileStack *stacks;
+    size_t num_stacks;
+    size_t stacks_capacity;
+    uint16_t *addrs;
+    size_t num_addrs;
+    size_t addrs_capacity;
+
+    struct Z80ProfileSymbol *symbols;
+    size_t num_symbols;
+    size_t symbols_capacity;
+    int symbols_sorted;
+};
+
+/** Initializes a profiler with an empty stack, and attaches it to the Z80.
+ * @param profile
+ * @param z80
+ * @param interval Cycles between samples.
+ * @return 0 on success, or -1 if out of memory.
+ */
+int z80_profile_init(struct Z80Profile *profile, struct Z80 *z80, uint64_t interval);
+
+/** Frees the profiler, detaching it from the Z80 if still attached.
+ * @param profile
+ * @param z80 The Z80 it was attached to, or NULL.
+ */
+void z80_profile_free(struct Z80Profile *profile, struct Z80 *z80);
+
+/** Pushes a frame. Called by the core.
+ * @param profile
+ * @param addr The address jumped to.
+ * @param from The return address.
+ * @param sp The stack pointer, holding the return address.
+ */
+void z80_profile_call(struct Z80Profile *profile, uint16_t addr, uint16_t from, uint16_t sp);
+
+/** Pops the frames returned from. Called by the core.
+ * @param profile
+ * @param sp The stack pointer, once the return address has been popped.
+ */
+void z80_profile_return(struct Z80Profile *profile, uint16_t sp);
+
+/** Records the PC and shadow stack as one sample.
+ * @param profile
+ * @param z80
+ */
+void z80_profile_sample(struct Z80Profile *profile, struct Z80 const *z80);
+
+/** Runs the Z80 as z80_run does, taking a sample each time another
+ * `interval` cycles have passed.
+ * @param profile
+ * @param z80
+ * @param until The value of the cycle counter to run to.
+ * @return Number of cycles run, which may overshoot by part of an instruction.
+ */
+int64_t z80_profile_run(struct Z80Profile *profile, struct Z80 *z80, uint64_t until);
+
+/** Names the code from an address up to the next symbol.
+ * @param profile
+ * @param addr
+ * @param name Copied.
+ * @return 0 on success, or -1 if out of memory.
+ */
+int z80_profile_add_symbol(struct Z80Profile *profile, uint16_t addr, char const *name);
+
+/** Adds the symbols of a map file, with one address in hex (optionally
+ * prefixed with 0x or $) and one name to each line. Lines which are blank,
+ * start with ';' or '#', or do not parse are skipped.
+ * @param profile
+ * @param path
+ * @return 0 on success, or -1 if the file cannot be read or out of memory.
+ */
+int z80_profile_load_symbols(struct Z80Profile *profile, char const *path);
+
+/** Writes one line for each distinct stack, in the folded format: the code
+ * which made the outermost call, the functions called from the outermost
+ * in, and the PC, separated by ';', then the number of samples. Addresses
+ * are written as the symbol at or below them, if any, and otherwise in hex;
+ * the PC is left out when it names the same function as the innermost
+ * call.
+ * @param profile
+ * @param out
+ * @return 0 on success, or -1 if out of memory.
+ */
+int z80_profile_write_folded(struct Z80Profile *profile, FILE *out);
+
+#endif
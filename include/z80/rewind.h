@@ -0,0 +1,106 @@
+#ifndef Z80_REWIND_H
+#define Z80_REWIND_H
+
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdint.h>
+
+/** Position and size of a frame held in the rewind buffer.
+ */
+struct Z80RewindFrame
+{
+    uint64_t cycles;
+    uint32_t offset;
+    uint32_t size;
+    uint8_t keyframe;
+};
+
+/** History of a Z80 and its attached memory.
+ *
+ * Frames are captured every `interval` cycles. Every `keyframe_interval`th
+ * frame is a keyframe holding the whole machine; the rest hold only the
+ * difference from the previous frame, as run-length encoded XOR deltas of the
+ * registers and of the pages written since. Frames are kept in a fixed-size
+ * buffer, and the oldest keyframe and its deltas are dropped to make room.
+ *
+ * Capturing consumes the dirty page bits of the attached memory, so the
+ * rewind buffer should not be used alongside z80_snapshot_take and
+ * z80_snapshot_restore on the same Z80.
+ */
+struct Z80Rewind
+{
+    uint64_t interval;
+    uint32_t keyframe_interval;
+    uint64_t next_capture;
+    uint32_t since_keyframe;
+
+    uint8_t *buffer;
+    uint32_t capacity;
+
+    struct Z80RewindFrame *frames;
+    uint32_t max_frames;
+    uint32_t first;
+    uint32_t count;
+
+    /** The machine as of the most recent frame, against which the next delta
+     * is computed. */
+    struct Z80 last;
+    uint8_t *last_memory;
+    uint8_t *scratch;
+};
+
+/** Initializes the rewind buffer, and captures a keyframe of the Z80's
+ * current state.
+ * @param rw
+ * @param z80 A Z80 with attached memory.
+ * @param interval Number of cycles between frames.
+ * @param keyframe_interval Number of frames between keyframes.
+ * @param capacity Size of the buffer holding the frames, in bytes.
+ * @return 0 on success, or -1 if memory could not be allocated or the Z80
+ * has no attached memory.
+ */
+int z80_rewind_init(struct Z80Rewind *rw,
+                    struct Z80 *z80,
+                    uint64_t interval,
+                    uint32_t keyframe_interval,
+                    uint32_t capacity);
+
+/** Releases the memory held by the rewind buffer.
+ * @param rw
+ */
+void z80_rewind_free(struct Z80Rewind *rw);
+
+/** Captures a frame if at least `interval` cycles have passed since the last
+ * one. This is cheap enough to call after every z80_step.
+ * @param rw
+ * @param z80
+ * @return 1 if a frame was captured, 0 if not, or -1 if the frame did not fit
+ * in the buffer.
+ */
+int z80_rewind_capture(struct Z80Rewind *rw, struct Z80 *z80);
+
+/** Returns the cycle count of the oldest frame in the buffer, which is the
+ * furthest back that z80_seek can go.
+ * @param rw
+ */
+uint64_t z80_rewind_oldest(struct Z80Rewind const *rw);
+
+/** Restores the Z80 to the latest frame at or before `cycles`, discarding any
+ * later frames, and then steps forward to the first instruction boundary at
+ * or after `cycles`. The host must supply the same port input during the
+ * replay as it did originally.
+ *
+ * The replay steps with nothing but z80_step. An interrupt pending when the
+ * frame was captured is restored with it, but one delivered afterwards, by
+ * z80_interrupt, z80_raise_irq or z80_raise_nmi, is not, so the run is
+ * reproduced only if none arrived between the frame and `cycles`. Hosts
+ * which interrupt on a schedule, such as once per video frame, can capture
+ * on the same schedule and seek only to those points.
+ * @param rw
+ * @param z80
+ * @param cycles The cycle count to seek to.
+ * @return 0 on success, or -1 if `cycles` is not within the history.
+ */
+int z80_seek(struct Z80Rewind *rw, struct Z80 *z80, uint64_t cycles);
+
+#endif
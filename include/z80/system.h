@@ -0,0 +1,101 @@
+#ifndef Z80_SYSTEM_H
+#define Z80_SYSTEM_H
+
+#include "z80/z80.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define Z80_SYSTEM_MAX_CORES 8
+
+struct Z80System;
+
+/** A Z80 owned by a system.
+ */
+struct Z80SystemCore
+{
+    struct Z80 *z80;
+    struct Z80System *system;
+    /** The cycle count at the start of the core's current instruction, or
+     * UINT64_MAX once it has finished the round. Read by other threads to
+     * order accesses to shared state. */
+    _Atomic uint64_t time;
+    pthread_t thread;
+};
+
+/** Several Z80s sharing memory or ports, run in rounds of a cycle quantum.
+ *
+ * Each round runs every core up to the same point in time, so no core is
+ * ever more than a quantum (plus one instruction) ahead of another. The
+ * quantum is the longest round; after a core touches shared state the
+ * rounds shrink to min_quantum, then double back up while the cores keep to
+ * themselves.
+ *
+ * Host callbacks must call z80_system_touch before accessing anything which
+ * another core can see. With threads, this blocks until every access due
+ * earlier (by cycle count, then by core index) has been made, so the
+ * results are the same from run to run, and the same as stepping the cores
+ * one instruction at a time in that order. Without threads, the cores run
+ * one after another for each round.
+ */
+struct Z80System
+{
+    struct Z80SystemCore cores[Z80_SYSTEM_MAX_CORES];
+    int num_cores;
+    int threaded;
+
+    uint64_t quantum;
+    uint64_t min_quantum;
+    /** Length of the next round. */
+    uint64_t slice;
+    /** Time which every core has reached. */
+    uint64_t time;
+    /** Set when a core touches shared state during a round. */
+    atomic_int touched;
+
+    /** Round handshake between z80_system_run and the core threads. */
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t round;
+    uint64_t target;
+    int pending;
+    int started;
+    int stopping;
+};
+
+/** Initializes a system with no cores.
+ * @param sys
+ * @param quantum Longest round, in cycles.
+ * @param threaded Non-zero to run each core on its own thread.
+ */
+void z80_system_init(struct Z80System *sys, uint64_t quantum, int threaded);
+
+/** Stops the core threads, if any.
+ * @param sys
+ */
+void z80_system_free(struct Z80System *sys);
+
+/** Adds a core to the system. Cores may only be added before the first run.
+ * @param sys
+ * @param z80
+ * @return The core's index, or -1 if the system is full.
+ */
+int z80_system_add(struct Z80System *sys, struct Z80 *z80);
+
+/** Runs every core until the system time reaches `until`. Faulted cores
+ * stop, and the others carry on.
+ * @param sys
+ * @param until The system time to run to.
+ * @return The system time reached.
+ */
+uint64_t z80_system_run(struct Z80System *sys, uint64_t until);
+
+/** Notes that a core is about to access shared memory or a mailbox port.
+ * Called from the core's callbacks.
+ * @param sys
+ * @param z80
+ */
+void z80_system_touch(struct Z80System *sys, struct Z80 const *z80);
+
+#endif
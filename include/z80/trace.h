@@ -0,0 +1,108 @@
+#ifndef Z80_TRACE_H
+#define Z80_TRACE_H
+
+#include "z80/z80.h"
+#include <pthread.h>
+#include <stdint.h>
+
+/** Streams a record of every instruction executed to a gzip file.
+ *
+ * Each record holds the change in PC and in the cycle count, the registers
+ * which changed, and the bytes written to memory. Records are encoded into
+ * one of two blocks; once a block fills, a background thread compresses it
+ * and appends it to the file while the other fills, so the emulation thread
+ * only compares and stores the registers. R is not recorded, as it changes
+ * with every instruction.
+ *
+ * The file decompresses (with zcat, say) to a header holding the state of
+ * the Z80, and of its memory if attached, followed by the records.
+ */
+struct Z80Trace
+{
+    void *file;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+
+    uint8_t *blocks[2];
+    uint32_t block_size;
+    /** Index of the block being filled, and bytes used in it. */
+    int current;
+    uint32_t used;
+    /** Bytes of the other block waiting to be written, if any. */
+    uint32_t pending;
+    int stopping;
+    int error;
+
+    /** Registers as of the last record. */
+    struct Z80 last;
+    struct Z80WriteLog log;
+    uint64_t records;
+    /** Number of writes which did not fit in the write log, and were lost. */
+    uint64_t dropped_writes;
+};
+
+/** The state of a traced Z80, as rebuilt from a trace.
+ */
+struct Z80TraceReader
+{
+    void *file;
+    /** Registers after the last record read. The callbacks are all NULL,
+     * and R is as it was when tracing started. */
+    struct Z80 z80;
+    /** Memory after the last record read, if it was attached when tracing
+     * started. */
+    uint8_t *memory;
+    /** Writes made by the last record read. */
+    struct Z80WriteLog writes;
+};
+
+/** Starts tracing the Z80 to a file, writing the header. A record must then
+ * be added with z80_trace_record after each z80_step, and after anything
+ * else which changes the Z80, such as z80_interrupt.
+ * @param tr
+ * @param z80
+ * @param path The file to create.
+ * @param block_size Bytes of records compressed at a time.
+ * @return 0 on success, or -1 if the file could not be created.
+ */
+int z80_trace_open(struct Z80Trace *tr,
+                   struct Z80 *z80,
+                   char const *path,
+                   uint32_t block_size);
+
+/** Adds a record of the changes made since the last one.
+ * @param tr
+ * @param z80
+ */
+void z80_trace_record(struct Z80Trace *tr, struct Z80 *z80);
+
+/** Writes any outstanding records, and closes the file.
+ * @param tr
+ * @param z80 The Z80 being traced, which is detached.
+ * @return 0 on success, or -1 if any part of the trace could not be written.
+ */
+int z80_trace_close(struct Z80Trace *tr, struct Z80 *z80);
+
+/** Opens a trace, reading its header.
+ * @param rd
+ * @param path
+ * @return 0 on success, or -1 if the file could not be read or is not a
+ * trace.
+ */
+int z80_trace_reader_open(struct Z80TraceReader *rd, char const *path);
+
+/** Reads the next record, updating the registers and memory.
+ * @param rd
+ * @return 1 if a record was read, 0 at the end of the trace, or -1 if the
+ * trace is corrupt.
+ */
+int z80_trace_next(struct Z80TraceReader *rd);
+
+/** Closes a trace.
+ * @param rd
+ */
+void z80_trace_reader_close(struct Z80TraceReader *rd);
+
+#endif
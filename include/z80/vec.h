@@ -0,0 +1,125 @@
+#ifndef Z80_VEC_H
+#define Z80_VEC_H
+
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define Z80_VEC_MAX_THREADS 64
+
+/** Registers which may be written to the observation buffer. Each is written
+ * as two little-endian bytes, in the order of this enum.
+ */
+enum Z80VecReg
+{
+    Z80_VEC_PC,
+    Z80_VEC_SP,
+    Z80_VEC_AF,
+    Z80_VEC_BC,
+    Z80_VEC_DE,
+    Z80_VEC_HL,
+    Z80_VEC_IX,
+    Z80_VEC_IY,
+    Z80_VEC_AFP,
+    Z80_VEC_BCP,
+    Z80_VEC_DEP,
+    Z80_VEC_HLP,
+    /** I in the high byte, R in the low byte. */
+    Z80_VEC_IR,
+    /** The fault code in the high byte, and 1 in the low byte if halted. */
+    Z80_VEC_STATUS,
+    Z80_VEC_NUM_REGS,
+};
+
+/** One environment: a Z80 with its own memory and ports. Port reads return
+ * `ports_in` for the low byte of the port address, which is how actions are
+ * fed in, and port writes are stored in `ports_out`.
+ */
+struct Z80VecInstance
+{
+    struct Z80 z80;
+    struct Z80Memory mem;
+    uint8_t ports_in[256];
+    uint8_t ports_out[256];
+    uint8_t memory[0x10000];
+};
+
+/** Steps many instances at once on a pool of threads, writing what each
+ * observes into one contiguous buffer.
+ */
+struct Z80Vec
+{
+    /** Bit (1 << reg) for each Z80VecReg to observe. */
+    uint32_t registers;
+    /** Window of memory to observe after the registers. */
+    uint16_t window_addr;
+    uint16_t window_length;
+
+    int num_threads;
+    pthread_t threads[Z80_VEC_MAX_THREADS];
+
+    /** The batch being run, shared with the pool. */
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t batch;
+    int pending;
+    int stopping;
+    struct Z80VecInstance *instances;
+    size_t count;
+    uint64_t cycles;
+    uint8_t *obs;
+    atomic_size_t next;
+};
+
+/** Initializes an instance: resets the Z80, clears memory and ports, and
+ * attaches them.
+ * @param inst
+ */
+void z80_vec_instance_init(struct Z80VecInstance *inst);
+
+/** Starts the thread pool. Observations are empty until set.
+ * @param vec
+ * @param num_threads Threads to run on, including the caller's.
+ */
+void z80_vec_init(struct Z80Vec *vec, int num_threads);
+
+/** Stops the thread pool.
+ * @param vec
+ */
+void z80_vec_free(struct Z80Vec *vec);
+
+/** Selects what each instance writes to the observation buffer.
+ * @param vec
+ * @param registers Bit (1 << reg) for each Z80VecReg to observe.
+ * @param window_addr Start of the memory window, which wraps past 0xffff.
+ * @param window_length Length of the memory window.
+ */
+void z80_vec_observe(struct Z80Vec *vec,
+                     uint32_t registers,
+                     uint16_t window_addr,
+                     uint16_t window_length);
+
+/** Returns the bytes of observation written for each instance.
+ * @param vec
+ */
+size_t z80_vec_obs_size(struct Z80Vec const *vec);
+
+/** Runs every instance for `cycles` more cycles (or until it faults), then
+ * writes its observation to `obs_out + i * z80_vec_obs_size(vec)`.
+ * @param vec
+ * @param instances
+ * @param n Number of instances.
+ * @param cycles Cycles to run each instance for, such as one frame.
+ * @param obs_out Output buffer, or NULL.
+ */
+void z80_vec_run(struct Z80Vec *vec,
+                 struct Z80VecInstance *instances,
+                 size_t n,
+                 uint64_t cycles,
+                 uint8_t *obs_out);
+
+#endif
@@ -1,31 +1,115 @@
+#ifndef Z80_Z80_H
+#define Z80_Z80_H
+
+#include <stdatomic.h>
 #include <stdint.h>
 
-/** State of the Z80 microprocessor.
+struct Z80;
+struct Z80Memory;
+struct Z80Ports;
+struct Z80Profile;
+
+/** Kinds of idle loop which z80_run may skip over. See Z80::skip_loops.
  */
-struct Z80
+enum Z80SkipLoops
+{
+    /** Skip loops, such as `jr $` and `djnz $`, whose iterations change
+     * nothing but the clock and R. The loop may read memory, so this must not
+     * be used where memory can change other than through the Z80. */
+    Z80_SKIP_SPIN = 1 << 0,
+    /** As Z80_SKIP_SPIN, but also skip loops which poll ports. The host must
+     * return the same values from port_load until the end of the run. */
+    Z80_SKIP_POLL = 1 << 1,
+};
+
+/** Bits of Z80::hooks, one for each of the cold pointers which the core
+ * calls out through. See z80_update_hooks.
+ */
+enum Z80Hooks
+{
+    Z80_HOOK_PORTS = 1 << 0,
+    Z80_HOOK_WRITE_LOG = 1 << 1,
+    Z80_HOOK_PROFILE = 1 << 2,
+    Z80_HOOK_CODEMAP = 1 << 3,
+};
+
+/** Reasons for which the Z80 may stop executing. A faulted Z80 executes no
+ * further instructions until the fault is cleared.
+ */
+enum Z80Fault
+{
+    Z80_FAULT_NONE = 0,
+    /** An opcode which the emulator does not implement was fetched. */
+    Z80_FAULT_ILLEGAL_OPCODE,
+    /** Raised by the host, typically from within one of the callbacks. */
+    Z80_FAULT_HOST,
+};
+
+/** Number of writes a Z80WriteLog holds. No instruction writes more than two
+ * bytes, so this is enough for anything but a whole z80_run.
+ */
+#define Z80_WRITE_LOG_SIZE 8
+
+/** Memory writes made by the Z80 since the host last emptied the log.
+ */
+struct Z80WriteLog
+{
+    /** Number of writes made, which may exceed Z80_WRITE_LOG_SIZE; only the
+     * first Z80_WRITE_LOG_SIZE are kept. */
+    uint32_t count;
+    uint16_t addr[Z80_WRITE_LOG_SIZE];
+    uint8_t value[Z80_WRITE_LOG_SIZE];
+};
+
+/* Accuracy is chosen when the library is built. Built with Z80_ACCURACY_FAST
+ * defined, as the z80fast library is, the undocumented X and Y flags are left
+ * clear and R changes only when written, saving work on every instruction for
+ * hosts which observe neither. Otherwise both are exact.
+ */
+
+/** Defined by versions of this header in which the callbacks are reached
+ * through Z80::bus, for code which is built against older versions too.
+ */
+#define Z80_HAS_BUS 1
+
+/** The callbacks through which a Z80 reaches the rest of the machine. A
+ * table is normally static and const, and shared by every Z80 of the same
+ * kind of machine, which tell the callbacks apart by Z80::userdata.
+ */
+struct Z80Bus
 {
     /** mem_load must be set to a function which will load an 8-bit value
-     * from the given address.
+     * from the given address, unless memory is attached.
      */
     uint8_t (*mem_load)(struct Z80 *, uint16_t);
     /** mem_store must be set to a function which will store an 8-bit value
-     * into the given address.
+     * into the given address, unless memory is attached.
      */
     void (*mem_store)(struct Z80 *, uint16_t, uint8_t);
     /** port_load must be set to a function which will read an 8-bit value
-     * from the given port.
+     * from the given port, unless the port is mapped by Z80::ports.
      */
     uint8_t (*port_load)(struct Z80 *, uint16_t);
     /** port_store must be set to a function which will write an 8-bit value
-     * to the given port.
+     * to the given port, unless the port is mapped by Z80::ports.
      */
     void (*port_store)(struct Z80 *z80, uint16_t, uint8_t);
 
     // Trap will be called on each instruction. Returning a truthy value
     // informs the emulator that the trap has handled the operation.
     uint8_t (*trap)(struct Z80 *z80, uint16_t, uint8_t);
-    void *userdata;
+};
 
+/** State of the Z80 microprocessor.
+ *
+ * The first 64 bytes hold everything that executing an instruction touches,
+ * so that a host stepping many Z80s in turn brings in one cache line for
+ * each, if it keeps them 64-byte aligned. The rest is cold: the core reads
+ * the ports table, write log, profiler and code map only when `hooks` says
+ * they are attached, and the callbacks themselves may use userdata.
+ */
+struct Z80
+{
     uint16_t pc;
     uint16_t sp;
     uint16_t ix;
@@ -107,7 +191,61 @@ struct Z80
     uint8_t iff1, iff2;
     uint8_t interrupt_delay;
     uint8_t halted;
+    uint8_t fault;
     uint64_t cycles;
+
+    /** The callbacks, which z80_init points at a table of none. */
+    struct Z80Bus const *bus;
+    /** When set, memory is accessed directly, and mem_load and mem_store
+     * are not called. See z80/memory.h.
+     */
+    struct Z80Memory *memory;
+    /** Combination of Z80Hooks flags, for those of ports, write_log,
+     * profile and codemap which are set. Kept by the functions which attach
+     * them, and by z80_run; see z80_update_hooks.
+     */
+    uint8_t hooks;
+    /** Set by each memory or port write, and by each port read, for z80_run
+     * to detect idle loops. */
+    uint8_t wrote;
+    uint8_t polled;
+    /** Interrupts raised by z80_raise_irq and z80_raise_nmi, which any
+     * thread may call, the data of the maskable one, and requests from
+     * z80_stop. Checked at each instruction boundary.
+     */
+    atomic_uint pending;
+
+    /* End of the hot fields. */
+
+    void *userdata;
+    /** When set, ports are dispatched through this table, which falls back
+     * to port_load and port_store for the ports it leaves unmapped. See
+     * z80/ports.h.
+     */
+    struct Z80Ports *ports;
+    /** When set, every memory write is also appended to this log, as used by
+     * z80/trace.h.
+     */
+    struct Z80WriteLog *write_log;
+    /** When set, calls, returns and interrupts are reported to this
+     * profiler, which keeps a shadow call stack. See z80/profile.h.
+     */
+    struct Z80Profile *profile;
+    /** When set, and the library is built with Z80_CODEMAP, how each byte of
+     * memory is accessed is recorded in this map. See z80/codemap.h.
+     */
+    struct Z80CodeMap *codemap;
+    uint16_t fault_pc;
+
+    /** Combination of Z80SkipLoops flags for z80_run. Loops are never skipped
+     * while a trap is set.
+     */
+    uint8_t skip_loops;
+    /** When set, z80_run executes common sequences of instructions, such as
+     * `dec b; jr nz`, in one go, with the same results as stepping through
+     * them. Only used while memory is attached and no trap is set.
+     */
+    uint8_t fuse;
 };
 
 /** Initializes a z80 struct to the default state.
@@ -115,24 +253,100 @@ struct Z80
  */
 void z80_init(struct Z80 *z80);
 
+/** Sets Z80::hooks from which of ports, write_log, profile and codemap are
+ * set. z80_run calls this itself, as do the functions which attach them, so
+ * it need only be called after setting one directly and before z80_step.
+ * @param z80
+ */
+void z80_update_hooks(struct Z80 *z80);
+
 /** Fetches and executes the next opcode.
  * @param z80
  * @return Number of cycles taken to execute the step.
  */
 int64_t z80_step(struct Z80 *z80);
 
+/** Runs until the cycle counter reaches `until`, the Z80 faults, or
+ * z80_stop is called. Time spent halted is skipped in one go, with R
+ * advanced as if each NOP had been executed, as are idle loops if enabled by
+ * skip_loops. `until` would usually be the time of the next interrupt or
+ * other event. Interrupts raised from other threads while time is being
+ * skipped are taken by the next run.
+ * @param z80
+ * @param until The value of the cycle counter to run to.
+ * @return Number of cycles run, which may overshoot by part of an instruction.
+ */
+int64_t z80_run(struct Z80 *z80, uint64_t until);
+
 /** Handle any pending interrupts.
  * @param z80
  * @param data The 8-bit value used for the interrupt in mode 0 and 2.
  */
 void z80_interrupt(struct Z80 *z80, uint8_t data);
 
+/** Raises the maskable interrupt, as a device asserting /INT. This, and
+ * z80_clear_irq and z80_raise_nmi, may be called from any thread while
+ * another runs the Z80, without locking. The interrupt is held until the Z80
+ * takes it at an instruction boundary, once interrupts are enabled, or until
+ * it is cleared. A later call replaces the data of one not yet taken.
+ * @param z80
+ * @param data The 8-bit value used for the interrupt in mode 0 and 2.
+ */
+void z80_raise_irq(struct Z80 *z80, uint8_t data);
+
+/** Withdraws a maskable interrupt raised by z80_raise_irq and not yet taken.
+ * @param z80
+ */
+void z80_clear_irq(struct Z80 *z80);
+
+/** Raises the non-maskable interrupt, which the Z80 takes at the next
+ * instruction boundary, calling 0x0066 whether or not interrupts are enabled.
+ * @param z80
+ */
+void z80_raise_nmi(struct Z80 *z80);
+
+/** Ends the z80_run in progress at the next instruction boundary, short of
+ * its `until`. May be called from the Z80's callbacks, or from any thread.
+ * A request made while no run is in progress ends the next one before it
+ * executes anything.
+ * @param z80
+ */
+void z80_stop(struct Z80 *z80);
+
 /** Checks if the Z80 is in a halted state.
  * @return true if the Z80 is halted.
  */
 int z80_is_halted(struct Z80 const *z80);
 
+/** Returns the current fault, if any.
+ * @param z80
+ * @return One of the Z80Fault values; Z80_FAULT_NONE if not faulted.
+ */
+int z80_fault(struct Z80 const *z80);
+
+/** Returns the address of the instruction which caused the current fault,
+ * that is of its first prefix or opcode byte.
+ * @param z80
+ */
+uint16_t z80_fault_pc(struct Z80 const *z80);
+
+/** Stops the Z80 with a fault. The first fault raised is kept until cleared;
+ * z80_step will execute nothing and return 0 while the Z80 is faulted. A
+ * fault raised by a callback is reported at the instruction which made the
+ * call, and one raised between instructions at the next.
+ * @param z80
+ * @param code The reason for the fault, usually Z80_FAULT_HOST.
+ */
+void z80_raise_fault(struct Z80 *z80, int code);
+
+/** Clears the current fault, allowing execution to resume.
+ * @param z80
+ */
+void z80_clear_fault(struct Z80 *z80);
+
 /** Writes the state of the Z80s registers and flags to the console.
  * @param z80
  */
 void z80_trace(struct Z80 *z80);
+
+#endif
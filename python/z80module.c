@@ -0,0 +1,426 @@
+/* Python bindings for the Z80 core.
+ *
+ * Each z80.Z80 object owns a Z80 with 64 KB of attached memory, which Python
+ * sees through the buffer protocol without copying. Ports are two 256-byte
+ * buffers: port reads return the value in `ports_in` for the low byte of the
+ * port address, and port writes are stored in `ports_out`. Nothing calls back
+ * into Python while the Z80 runs, so run() and run_many() release the GIL.
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define MEMORY_SIZE 65536
+#define NUM_PORTS 256
+
+typedef struct
+{
+    PyObject_HEAD
+    struct Z80 z80;
+    struct Z80Memory mem;
+    /** Set while the Z80 runs without the GIL, so that no other thread
+     * touches it. */
+    int busy;
+    uint8_t ports_in[NUM_PORTS];
+    uint8_t ports_out[NUM_PORTS];
+    uint8_t memory[MEMORY_SIZE];
+} Z80Object;
+
+/** A block of host memory exposed through the buffer protocol, and kept
+ * alive by a reference to the Z80 which owns it.
+ */
+typedef struct
+{
+    PyObject_HEAD
+    Z80Object *owner;
+    uint8_t *data;
+    Py_ssize_t length;
+} BlockObject;
+
+static PyTypeObject Z80Type;
+static PyTypeObject BlockType;
+
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    Z80Object const *self = z80->userdata;
+    return self->ports_in[port & 0xff];
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    Z80Object *self = z80->userdata;
+    self->ports_out[port & 0xff] = val;
+}
+
+static struct Z80Bus const bus = {
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+static void run_for(Z80Object *self, uint64_t const cycles)
+{
+    z80_run(&self->z80, self->z80.cycles + cycles);
+}
+
+static int check_idle(Z80Object const *self)
+{
+    if (self->busy)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "the Z80 is running in another thread");
+        return -1;
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int block_getbuffer(PyObject *obj, Py_buffer *view, int flags)
+{
+    BlockObject *self = (BlockObject *)obj;
+    return PyBuffer_FillInfo(view, obj, self->data, self->length, 0, flags);
+}
+
+static void block_dealloc(PyObject *obj)
+{
+    BlockObject *self = (BlockObject *)obj;
+    Py_XDECREF(self->owner);
+    Py_TYPE(obj)->tp_free(obj);
+}
+
+static PyBufferProcs block_as_buffer = {block_getbuffer, NULL};
+
+static PyTypeObject BlockType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "z80.Block",
+    .tp_basicsize = sizeof(BlockObject),
+    .tp_dealloc = block_dealloc,
+    .tp_as_buffer = &block_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Memory owned by a Z80, exposed through the buffer protocol.",
+};
+
+/** Returns a writable memoryview of part of a Z80 object.
+ */
+static PyObject *view(Z80Object *self, uint8_t *data, Py_ssize_t length)
+{
+    BlockObject *block = PyObject_New(BlockObject, &BlockType);
+    PyObject *result;
+
+    if (!block)
+        return NULL;
+
+    Py_INCREF(self);
+    block->owner = self;
+    block->data = data;
+    block->length = length;
+
+    result = PyMemoryView_FromObject((PyObject *)block);
+    Py_DECREF(block);
+    return result;
+}
+
+/*****************************************************************************/
+
+static PyObject *z80obj_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    Z80Object *self = (Z80Object *)type->tp_alloc(type, 0);
+    (void)args;
+    (void)kwds;
+
+    if (!self)
+        return NULL;
+
+    z80_init(&self->z80);
+    self->z80.bus = &bus;
+    self->z80.userdata = self;
+    z80_memory_init(&self->mem, &self->z80, self->memory);
+    return (PyObject *)self;
+}
+
+static PyObject *z80obj_step(Z80Object *self, PyObject *unused)
+{
+    (void)unused;
+    if (check_idle(self) < 0)
+        return NULL;
+    return PyLong_FromLongLong(z80_step(&self->z80));
+}
+
+static PyObject *z80obj_run(Z80Object *self, PyObject *arg)
+{
+    unsigned long long const cycles = PyLong_AsUnsignedLongLong(arg);
+    uint64_t const start = self->z80.cycles;
+
+    if (PyErr_Occurred() || check_idle(self) < 0)
+        return NULL;
+
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    run_for(self, cycles);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    return PyLong_FromUnsignedLongLong(self->z80.cycles - start);
+}
+
+static PyObject *z80obj_interrupt(Z80Object *self, PyObject *arg)
+{
+    long const data = PyLong_AsLong(arg);
+
+    if (PyErr_Occurred() || check_idle(self) < 0)
+        return NULL;
+
+    z80_interrupt(&self->z80, (uint8_t)data);
+    Py_RETURN_NONE;
+}
+
+static PyObject *z80obj_clear_fault(Z80Object *self, PyObject *unused)
+{
+    (void)unused;
+    z80_clear_fault(&self->z80);
+    Py_RETURN_NONE;
+}
+
+static PyObject *z80obj_get_memory(Z80Object *self, void *closure)
+{
+    (void)closure;
+    return view(self, self->memory, MEMORY_SIZE);
+}
+
+static PyObject *z80obj_get_ports_in(Z80Object *self, void *closure)
+{
+    (void)closure;
+    return view(self, self->ports_in, NUM_PORTS);
+}
+
+static PyObject *z80obj_get_ports_out(Z80Object *self, void *closure)
+{
+    (void)closure;
+    return view(self, self->ports_out, NUM_PORTS);
+}
+
+static PyMethodDef z80obj_methods[] = {
+    {"step",
+     (PyCFunction)z80obj_step,
+     METH_NOARGS,
+     "Executes one instruction, and returns the cycles it took."},
+    {"run",
+     (PyCFunction)z80obj_run,
+     METH_O,
+     "run(cycles): runs for at least the given number of cycles, or until "
+     "the Z80 faults, without holding the GIL. Returns the cycles run."},
+    {"interrupt",
+     (PyCFunction)z80obj_interrupt,
+     METH_O,
+     "interrupt(data): raises a maskable interrupt."},
+    {"clear_fault",
+     (PyCFunction)z80obj_clear_fault,
+     METH_NOARGS,
+     "Clears the fault, allowing execution to resume."},
+    {NULL}};
+
+#define REG(NAME, TYPE, DOC)                                                   \
+    {#NAME, TYPE, offsetof(Z80Object, z80.NAME), 0, DOC}
+
+static PyMemberDef z80obj_members[] = {
+    REG(pc, T_USHORT, "Program counter."),
+    REG(sp, T_USHORT, "Stack pointer."),
+    REG(ix, T_USHORT, NULL),
+    REG(iy, T_USHORT, NULL),
+    REG(af, T_USHORT, NULL),
+    REG(bc, T_USHORT, NULL),
+    REG(de, T_USHORT, NULL),
+    REG(hl, T_USHORT, NULL),
+    REG(afp, T_USHORT, "Alternate AF."),
+    REG(bcp, T_USHORT, "Alternate BC."),
+    REG(dep, T_USHORT, "Alternate DE."),
+    REG(hlp, T_USHORT, "Alternate HL."),
+    REG(a, T_UBYTE, NULL),
+    REG(f, T_UBYTE, NULL),
+    REG(b, T_UBYTE, NULL),
+    REG(c, T_UBYTE, NULL),
+    REG(d, T_UBYTE, NULL),
+    REG(e, T_UBYTE, NULL),
+    REG(h, T_UBYTE, NULL),
+    REG(l, T_UBYTE, NULL),
+    REG(i, T_UBYTE, "Interrupt vector."),
+    REG(r, T_UBYTE, "Memory refresh."),
+    REG(iff1, T_UBYTE, NULL),
+    REG(iff2, T_UBYTE, NULL),
+    REG(interrupt_mode, T_UBYTE, NULL),
+    REG(halted, T_UBYTE, NULL),
+    REG(skip_loops, T_UBYTE, "Z80_SKIP_* flags for idle-loop skipping."),
+    REG(cycles, T_ULONGLONG, "Cycle counter."),
+    {"fault", T_UBYTE, offsetof(Z80Object, z80.fault), READONLY, NULL},
+    {"fault_pc", T_USHORT, offsetof(Z80Object, z80.fault_pc), READONLY, NULL},
+    {NULL}};
+
+static PyGetSetDef z80obj_getset[] = {
+    {"memory",
+     (getter)z80obj_get_memory,
+     NULL,
+     "Writable view of the 64 KB of memory.",
+     NULL},
+    {"ports_in",
+     (getter)z80obj_get_ports_in,
+     NULL,
+     "Writable view of the 256 values returned by port reads.",
+     NULL},
+    {"ports_out",
+     (getter)z80obj_get_ports_out,
+     NULL,
+     "View of the last value written to each of the 256 ports.",
+     NULL},
+    {NULL}};
+
+static PyTypeObject Z80Type = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "z80.Z80",
+    .tp_basicsize = sizeof(Z80Object),
+    .tp_new = z80obj_new,
+    .tp_methods = z80obj_methods,
+    .tp_members = z80obj_members,
+    .tp_getset = z80obj_getset,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "A Z80 with 64 KB of memory and 256 ports.",
+};
+
+/*****************************************************************************/
+
+struct Batch
+{
+    Z80Object **z80s;
+    Py_ssize_t count;
+    uint64_t cycles;
+    atomic_long next;
+};
+
+static void *batch_worker(void *arg)
+{
+    struct Batch *batch = arg;
+    long index;
+
+    while ((index = atomic_fetch_add(&batch->next, 1)) < batch->count)
+        run_for(batch->z80s[index], batch->cycles);
+
+    return NULL;
+}
+
+static PyObject *run_many(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    static char *keywords[] = {"instances", "cycles", "threads", NULL};
+    PyObject *instances, *seq;
+    unsigned long long cycles;
+    int threads = 1;
+    struct Batch batch;
+    pthread_t *workers;
+    Py_ssize_t i;
+    (void)module;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kwds, "OK|i", keywords, &instances, &cycles, &threads))
+        return NULL;
+
+    seq = PySequence_Fast(instances, "instances must be a sequence of Z80s");
+    if (!seq)
+        return NULL;
+
+    batch.count = PySequence_Fast_GET_SIZE(seq);
+    batch.cycles = cycles;
+    atomic_init(&batch.next, 0);
+    batch.z80s = PyMem_Calloc(batch.count ? batch.count : 1, sizeof(Z80Object *));
+    if (threads < 1)
+        threads = 1;
+    if (threads > batch.count)
+        threads = batch.count ? (int)batch.count : 1;
+    workers = PyMem_Calloc(threads, sizeof(pthread_t));
+    if (!batch.z80s || !workers)
+    {
+        PyMem_Free(batch.z80s);
+        PyMem_Free(workers);
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+
+    // Claim every Z80 before letting go of the GIL. A Z80 listed twice is
+    // refused, as two threads would run it at once.
+    for (i = 0; i < batch.count; ++i)
+    {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyObject_TypeCheck(item, &Z80Type))
+        {
+            PyErr_SetString(PyExc_TypeError, "instances must be Z80 objects");
+            break;
+        }
+        batch.z80s[i] = (Z80Object *)item;
+        if (check_idle(batch.z80s[i]) < 0)
+            break;
+        batch.z80s[i]->busy = 1;
+    }
+
+    if (i == batch.count)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        for (int t = 1; t < threads; ++t)
+            pthread_create(&workers[t], NULL, batch_worker, &batch);
+        batch_worker(&batch);
+        for (int t = 1; t < threads; ++t)
+            pthread_join(workers[t], NULL);
+        Py_END_ALLOW_THREADS
+    }
+
+    while (i-- > 0)
+        batch.z80s[i]->busy = 0;
+
+    PyMem_Free(batch.z80s);
+    PyMem_Free(workers);
+    Py_DECREF(seq);
+
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+    {"run_many",
+     (PyCFunction)(void (*)(void))run_many,
+     METH_VARARGS | METH_KEYWORDS,
+     "run_many(instances, cycles, threads=1): runs each Z80 for the given "
+     "number of cycles, sharing them out between threads, without holding "
+     "the GIL."},
+    {NULL}};
+
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "z80",
+    .m_doc = "Zilog Z80 emulator.",
+    .m_size = -1,
+    .m_methods = module_methods,
+};
+
+PyMODINIT_FUNC PyInit_z80(void)
+{
+    PyObject *module;
+
+    if (PyType_Ready(&Z80Type) < 0 || PyType_Ready(&BlockType) < 0)
+        return NULL;
+
+    module = PyModule_Create(&module_def);
+    if (!module)
+        return NULL;
+
+    Py_INCREF(&Z80Type);
+    if (PyModule_AddObject(module, "Z80", (PyObject *)&Z80Type) < 0
+        || PyModule_AddIntConstant(module, "SKIP_SPIN", Z80_SKIP_SPIN) < 0
+        || PyModule_AddIntConstant(module, "SKIP_POLL", Z80_SKIP_POLL) < 0)
+    {
+        Py_DECREF(&Z80Type);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
+}
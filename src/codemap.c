@@ -0,0 +1,96 @@
+#include "z80/codemap.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAP_SIZE 65536
+#define ALL_FLAGS                                                              \
+    (Z80_CODEMAP_OPCODE | Z80_CODEMAP_OPERAND | Z80_CODEMAP_READ               \
+     | Z80_CODEMAP_WRITE)
+
+/** Checks that every byte of a map read from a file holds only known flags.
+ */
+static int is_valid(struct Z80CodeMap const *map)
+{
+    for (int addr = 0; addr < MAP_SIZE; ++addr)
+    {
+        if (map->flags[addr] & ~ALL_FLAGS)
+            return 0;
+    }
+    return 1;
+}
+
+int z80_codemap_init(struct Z80CodeMap *map, struct Z80 *z80)
+{
+    memset(map, 0, sizeof(*map));
+#ifdef Z80_CODEMAP
+    z80->codemap = map;
+    z80_update_hooks(z80);
+    return 0;
+#else
+    (void)z80;
+    return -1;
+#endif
+}
+
+void z80_codemap_merge(struct Z80CodeMap *map, struct Z80CodeMap const *other)
+{
+    for (int addr = 0; addr < MAP_SIZE; ++addr)
+        map->flags[addr] |= other->flags[addr];
+}
+
+int z80_codemap_save(struct Z80CodeMap const *map, char const *path)
+{
+    FILE *file = fopen(path, "wb");
+    int result = 0;
+
+    if (!file)
+        return -1;
+
+    if (fwrite(map->flags, 1, MAP_SIZE, file) != MAP_SIZE)
+        result = -1;
+    if (fclose(file) != 0)
+        result = -1;
+    return result;
+}
+
+int z80_codemap_load(struct Z80CodeMap *map, char const *path)
+{
+    struct Z80CodeMap *saved = malloc(sizeof(*saved));
+    FILE *file = fopen(path, "rb");
+    int result = -1;
+
+    if (saved && file && fread(saved->flags, 1, MAP_SIZE, file) == MAP_SIZE
+        && fgetc(file) == EOF && is_valid(saved))
+    {
+        z80_codemap_merge(map, saved);
+        result = 0;
+    }
+
+    if (file)
+        fclose(file);
+    free(saved);
+    return result;
+}
+
+void z80_codemap_write_ranges(struct Z80CodeMap const *map, FILE *out)
+{
+    static char const letters[] = "xorw";
+    int start = 0;
+
+    for (int addr = 1; addr <= MAP_SIZE; ++addr)
+    {
+        uint8_t const flags = map->flags[start];
+
+        if (addr < MAP_SIZE && map->flags[addr] == flags)
+            continue;
+
+        if (flags)
+        {
+            fprintf(out, "%04x-%04x ", start, addr - 1);
+            for (int bit = 0; bit < 4; ++bit)
+                fputc(flags & (1 << bit) ? letters[bit] : '-', out);
+            fputc('\n', out);
+        }
+        start = addr;
+    }
+}
@@ -0,0 +1,67 @@
+#include "z80/coverage.h"
+
+static char const *const table_names[Z80_COVERAGE_TABLES]
+    = {"base", "cb", "ed", "dd", "fd", "ddcb", "fdcb"};
+
+/** Flag letters, from bit 7 down, as printed by z80_trace. */
+static char const flag_names[] = "SZxHyPNC";
+
+static void format_flags(char *buf, uint8_t const flags)
+{
+    for (int i = 0; i < 8; ++i)
+        buf[i] = (flags & (0x80 >> i)) ? flag_names[i] : '-';
+    buf[8] = '\0';
+}
+
+void z80_coverage_dump(FILE *out)
+{
+    for (int table = 0; table < Z80_COVERAGE_TABLES; ++table)
+    {
+        struct Z80CoverageEntry const *entries = z80_coverage(table);
+        int executed = 0;
+
+        if (!entries)
+        {
+            fprintf(out, "coverage not built in\n");
+            return;
+        }
+
+        for (int i = 0; i < 256; ++i)
+            executed += entries[i].count != 0;
+
+        fprintf(out, "%s: %i/256 opcodes executed\n", table_names[table], executed);
+        fprintf(out, "    0123456789abcdef\n");
+        for (int row = 0; row < 16; ++row)
+        {
+            fprintf(out, "  %x ", row);
+            for (int col = 0; col < 16; ++col)
+                fputc(entries[row * 16 + col].count ? '#' : '.', out);
+            fputc('\n', out);
+        }
+        fputc('\n', out);
+    }
+
+    fprintf(out, "table opcode count set clear\n");
+    for (int table = 0; table < Z80_COVERAGE_TABLES; ++table)
+    {
+        struct Z80CoverageEntry const *entries = z80_coverage(table);
+
+        for (int i = 0; i < 256; ++i)
+        {
+            char set[9], clear[9];
+
+            if (!entries[i].count)
+                continue;
+
+            format_flags(set, entries[i].flags_set);
+            format_flags(clear, entries[i].flags_clear);
+            fprintf(out,
+                    "%s %02x %llu %s %s\n",
+                    table_names[table],
+                    i,
+                    (unsigned long long)entries[i].count,
+                    set,
+                    clear);
+        }
+    }
+}
@@ -0,0 +1,844 @@
+#include "z80/cpm.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORD_SIZE 128
+#define RECORDS_PER_EXTENT 128
+#define FCB_SIZE 36
+#define MIN_MAPPING 16384
+#define NUM_BIOS_ENTRIES 17
+
+#define TPA 0x0100
+#define DPB (Z80_CPM_BIOS + 0x80)
+#define ALLOCATION_VECTOR (Z80_CPM_BIOS + 0xa0)
+
+/* Offsets into the FCB. */
+#define FCB_EX 12
+#define FCB_S2 14
+#define FCB_RC 15
+#define FCB_NEW_NAME 16
+#define FCB_CR 32
+#define FCB_R0 33
+
+/* A plausible 8" single density disk, for programs which ask. */
+static uint8_t const disk_parameters[] = {
+    26, 0, 3, 7, 0, 242, 0, 63, 0, 0xc0, 0x00, 16, 0, 2, 0};
+
+static uint8_t peek(struct Z80Cpm *cpm, uint16_t const addr)
+{
+    uint8_t val;
+    z80_memory_read(cpm->z80->memory, addr, &val, 1);
+    return val;
+}
+
+static void poke(struct Z80Cpm *cpm, uint16_t const addr, uint8_t const val)
+{
+    z80_memory_write(cpm->z80->memory, addr, &val, 1);
+}
+
+static void ret(struct Z80 *z80)
+{
+    struct Z80Cpm *cpm = z80->userdata;
+    z80->pc = peek(cpm, z80->sp) | (peek(cpm, z80->sp + 1) << 8);
+    z80->sp += 2;
+    z80->cycles += 10;
+}
+
+static void set_result(struct Z80Cpm *cpm, uint16_t const result)
+{
+    struct Z80 *z80 = cpm->z80;
+    z80->hl = result;
+    z80->a = z80->l;
+    z80->b = z80->h;
+}
+
+/*****************************************************************************/
+
+/** Converts the name in an FCB into a lower case host file name.
+ * @return 0 on success, or -1 if the name is blank or contains wildcards.
+ */
+static int fcb_name(uint8_t const *fcb, char *name)
+{
+    char *out = name;
+
+    for (int i = 1; i <= 11; ++i)
+    {
+        char const c = fcb[i] & 0x7f;
+        if (c == '?')
+            return -1;
+        if (i == 9 && (fcb[9] & 0x7f) != ' ')
+            *out++ = '.';
+        if (c != ' ')
+            *out++ = tolower((unsigned char)c);
+    }
+
+    *out = '\0';
+    return name[0] && name[0] != '.' ? 0 : -1;
+}
+
+/** Converts a host file name into the padded upper case form used in FCBs
+ * and directory entries.
+ * @return 0 on success, or -1 if the name is not a valid CP/M name.
+ */
+static int cpm_name(char const *name, uint8_t *padded)
+{
+    char const *dot = strchr(name, '.');
+    size_t const length = dot ? (size_t)(dot - name) : strlen(name);
+    size_t const type_length = dot ? strlen(dot + 1) : 0;
+
+    if (length == 0 || length > 8 || type_length > 3
+        || (dot && strchr(dot + 1, '.')))
+        return -1;
+
+    memset(padded, ' ', 11);
+    for (size_t i = 0; i < length; ++i)
+        padded[i] = toupper((unsigned char)name[i]);
+    for (size_t i = 0; i < type_length; ++i)
+        padded[8 + i] = toupper((unsigned char)dot[1 + i]);
+
+    for (int i = 0; i < 11; ++i)
+    {
+        if (padded[i] <= ' ' && padded[i] != ' ')
+            return -1;
+        if (strchr("<>.,;:=?*[]", padded[i]))
+            return -1;
+    }
+
+    return 0;
+}
+
+static void host_path(struct Z80Cpm *cpm,
+                      char const *name,
+                      char *path,
+                      size_t size)
+{
+    snprintf(path, size, "%s/%s", cpm->directory, name);
+}
+
+/** Opens the host file, trying the lower and then the upper case name.
+ */
+static int open_host(struct Z80Cpm *cpm, char const *name, int flags)
+{
+    char path[4096];
+    char upper[13];
+    int fd;
+
+    host_path(cpm, name, path, sizeof(path));
+    if ((fd = open(path, flags, 0644)) >= 0 || (flags & O_CREAT))
+        return fd;
+
+    for (int i = 0; i < 13; ++i)
+        upper[i] = toupper((unsigned char)name[i]);
+    host_path(cpm, upper, path, sizeof(path));
+    return open(path, flags);
+}
+
+static struct Z80CpmFile *find_file(struct Z80Cpm *cpm, char const *name)
+{
+    for (int i = 0; i < Z80_CPM_MAX_FILES; ++i)
+    {
+        if (strcmp(cpm->files[i].name, name) == 0)
+            return &cpm->files[i];
+    }
+    return NULL;
+}
+
+static void close_file(struct Z80CpmFile *file)
+{
+    if (file->map)
+        munmap(file->map, file->mapped);
+    if (!file->readonly && ftruncate(file->fd, file->size) != 0)
+        perror("ftruncate");
+    close(file->fd);
+    memset(file, 0, sizeof(*file));
+}
+
+/** Returns the open file with the given name, opening and mapping the host
+ * file if necessary. Host files which cannot be written are opened read-only.
+ */
+static struct Z80CpmFile *open_file(struct Z80Cpm *cpm,
+                                    char const *name,
+                                    int create)
+{
+    struct Z80CpmFile *file = find_file(cpm, name);
+    struct stat st;
+    int readonly = 0;
+    int fd;
+
+    if (file && !create)
+        return file;
+    if (file)
+        close_file(file);
+
+    file = find_file(cpm, "");
+    if (!file)
+        return NULL;
+
+    fd = open_host(cpm, name, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR);
+    if (fd < 0 && !create)
+    {
+        fd = open_host(cpm, name, O_RDONLY);
+        readonly = 1;
+    }
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    strcpy(file->name, name);
+    file->fd = fd;
+    file->size = st.st_size;
+    file->mapped = 0;
+    file->map = NULL;
+    file->readonly = readonly;
+
+    if (file->size)
+    {
+        int const prot = readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+        file->map = mmap(NULL, file->size, prot, MAP_SHARED, fd, 0);
+        if (file->map == MAP_FAILED)
+        {
+            close(fd);
+            memset(file, 0, sizeof(*file));
+            return NULL;
+        }
+        file->mapped = file->size;
+    }
+
+    return file;
+}
+
+/** Grows the file and its mapping so that it holds at least `size` bytes.
+ */
+static int reserve(struct Z80CpmFile *file, size_t const size)
+{
+    size_t mapped = file->mapped < MIN_MAPPING ? MIN_MAPPING : file->mapped;
+    uint8_t *map;
+
+    if (size <= file->mapped)
+        return 0;
+
+    while (mapped < size)
+        mapped *= 2;
+
+    if (ftruncate(file->fd, mapped) != 0)
+        return -1;
+
+    map = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    if (file->map)
+        munmap(file->map, file->mapped);
+    file->map = map;
+    file->mapped = mapped;
+    return 0;
+}
+
+static uint32_t records(struct Z80CpmFile const *file)
+{
+    return (file->size + RECORD_SIZE - 1) / RECORD_SIZE;
+}
+
+static uint32_t fcb_record(uint8_t const *fcb)
+{
+    uint32_t const extent = ((fcb[FCB_S2] & 0x3f) << 5) | (fcb[FCB_EX] & 0x1f);
+    return extent * RECORDS_PER_EXTENT + (fcb[FCB_CR] & 0x7f);
+}
+
+static uint32_t fcb_random_record(uint8_t const *fcb)
+{
+    return fcb[FCB_R0] | (fcb[FCB_R0 + 1] << 8) | (fcb[FCB_R0 + 2] << 16);
+}
+
+/** Sets the FCB's current record, and its record count for that extent.
+ */
+static void fcb_seek(uint8_t *fcb,
+                     struct Z80CpmFile const *file,
+                     uint32_t const record)
+{
+    uint32_t const extent = record / RECORDS_PER_EXTENT;
+    int64_t in_extent = (int64_t)records(file) - extent * RECORDS_PER_EXTENT;
+
+    if (in_extent < 0)
+        in_extent = 0;
+    if (in_extent > RECORDS_PER_EXTENT)
+        in_extent = RECORDS_PER_EXTENT;
+
+    fcb[FCB_CR] = record % RECORDS_PER_EXTENT;
+    fcb[FCB_EX] = extent & 0x1f;
+    fcb[FCB_S2] = (extent >> 5) & 0x3f;
+    fcb[FCB_RC] = in_extent;
+}
+
+static int read_record(struct Z80Cpm *cpm,
+                       struct Z80CpmFile const *file,
+                       uint32_t const record)
+{
+    uint8_t buffer[RECORD_SIZE];
+    size_t const offset = (size_t)record * RECORD_SIZE;
+    size_t length;
+
+    if (offset >= file->size)
+        return 1;
+
+    length = file->size - offset;
+    if (length > RECORD_SIZE)
+        length = RECORD_SIZE;
+
+    memcpy(buffer, file->map + offset, length);
+    memset(buffer + length, 0x1a, RECORD_SIZE - length);
+    z80_memory_write(cpm->z80->memory, cpm->dma, buffer, RECORD_SIZE);
+    return 0;
+}
+
+static int write_record(struct Z80Cpm *cpm,
+                        struct Z80CpmFile *file,
+                        uint32_t const record)
+{
+    size_t const offset = (size_t)record * RECORD_SIZE;
+
+    if (file->readonly)
+        return 0xff;
+    if (reserve(file, offset + RECORD_SIZE) != 0)
+        return 2;
+
+    if (offset > file->size)
+        memset(file->map + file->size, 0, offset - file->size);
+
+    z80_memory_read(
+        cpm->z80->memory, cpm->dma, file->map + offset, RECORD_SIZE);
+    if (offset + RECORD_SIZE > file->size)
+        file->size = offset + RECORD_SIZE;
+    return 0;
+}
+
+/*****************************************************************************/
+
+/** Collects the directory entries matching the FCB's (possibly wildcard)
+ * name.
+ */
+static void search(struct Z80Cpm *cpm, uint8_t const *fcb)
+{
+    DIR *dir = opendir(cpm->directory);
+    struct dirent *entry;
+    uint8_t padded[11];
+
+    cpm->num_matches = 0;
+    cpm->next_match = 0;
+
+    if (!dir)
+        return;
+
+    while ((entry = readdir(dir)) && cpm->num_matches < Z80_CPM_MAX_MATCHES)
+    {
+        int match = strlen(entry->d_name) < 13
+                    && cpm_name(entry->d_name, padded) == 0;
+
+        for (int i = 0; match && i < 11 && fcb[0] != '?'; ++i)
+        {
+            uint8_t const c = toupper(fcb[1 + i] & 0x7f);
+            match = (c == '?' || c == padded[i]);
+        }
+
+        if (match)
+            strcpy(cpm->matches[cpm->num_matches++], entry->d_name);
+    }
+
+    closedir(dir);
+}
+
+static uint16_t search_next(struct Z80Cpm *cpm)
+{
+    uint8_t entry[32] = {0};
+    char path[4096];
+    struct stat st;
+    uint32_t count;
+
+    while (cpm->next_match < cpm->num_matches)
+    {
+        char const *name = cpm->matches[cpm->next_match++];
+
+        host_path(cpm, name, path, sizeof(path));
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        count = (st.st_size + RECORD_SIZE - 1) / RECORD_SIZE;
+        entry[0] = cpm->user;
+        cpm_name(name, entry + 1);
+        entry[FCB_EX] = count > 0 ? ((count - 1) / RECORDS_PER_EXTENT) & 0x1f : 0;
+        entry[FCB_RC] = count ? (count - 1) % RECORDS_PER_EXTENT + 1 : 0;
+        z80_memory_write(cpm->z80->memory, cpm->dma, entry, sizeof(entry));
+        return 0;
+    }
+
+    return 0xff;
+}
+
+static uint16_t delete_files(struct Z80Cpm *cpm, uint8_t const *fcb)
+{
+    char path[4096];
+    uint16_t result = 0xff;
+
+    search(cpm, fcb);
+    for (int i = 0; i < cpm->num_matches; ++i)
+    {
+        char lower[13];
+        for (int j = 0; j < 13; ++j)
+            lower[j] = tolower((unsigned char)cpm->matches[i][j]);
+
+        struct Z80CpmFile *file = find_file(cpm, lower);
+        if (file)
+            close_file(file);
+
+        host_path(cpm, cpm->matches[i], path, sizeof(path));
+        if (unlink(path) == 0)
+            result = 0;
+    }
+
+    cpm->num_matches = 0;
+    return result;
+}
+
+static uint16_t rename_file(struct Z80Cpm *cpm, uint8_t const *fcb)
+{
+    char from[13], to[13];
+    char from_path[4096], to_path[4096];
+    struct Z80CpmFile *file;
+
+    if (fcb_name(fcb, from) != 0 || fcb_name(fcb + FCB_NEW_NAME, to) != 0)
+        return 0xff;
+
+    if ((file = find_file(cpm, from)))
+        close_file(file);
+
+    host_path(cpm, from, from_path, sizeof(from_path));
+    host_path(cpm, to, to_path, sizeof(to_path));
+    return rename(from_path, to_path) == 0 ? 0 : 0xff;
+}
+
+/*****************************************************************************/
+
+static void read_line(struct Z80Cpm *cpm, uint16_t const addr)
+{
+    uint8_t const max = peek(cpm, addr);
+    uint8_t count = 0;
+    int c;
+
+    while (count < max && (c = fgetc(cpm->console_in)) != EOF && c != '\n')
+    {
+        if (c != '\r')
+            poke(cpm, addr + 2 + count++, c);
+    }
+
+    poke(cpm, addr + 1, count);
+}
+
+static int console_in(struct Z80Cpm *cpm)
+{
+    int const c = fgetc(cpm->console_in);
+    if (c == EOF)
+        return 0x1a;
+    return c == '\n' ? '\r' : c;
+}
+
+/** Reads a character for BDOS function 1, echoing it to the console as CP/M
+ * does. End of input is not echoed.
+ */
+static int console_echo(struct Z80Cpm *cpm)
+{
+    int const c = console_in(cpm);
+    if (c != 0x1a)
+        fputc(c == '\r' ? '\n' : c, cpm->console_out);
+    return c;
+}
+
+static uint16_t file_function(struct Z80Cpm *cpm,
+                              uint8_t const function,
+                              uint8_t *fcb)
+{
+    struct Z80CpmFile *file;
+    char name[13];
+    uint32_t record;
+    uint16_t result;
+    int fd;
+
+    if (fcb_name(fcb, name) != 0)
+        return 0xff;
+
+    switch (function)
+    {
+        case 15: // open file
+            if (!(file = open_file(cpm, name, 0)))
+                return 0xff;
+            record = fcb[FCB_CR];
+            fcb_seek(fcb, file, fcb_record(fcb) & ~0x7f);
+            fcb[FCB_CR] = record;
+            return 0;
+
+        case 16: // close file
+            if ((file = find_file(cpm, name)))
+                close_file(file);
+            else if ((fd = open_host(cpm, name, O_RDONLY)) >= 0)
+                close(fd);
+            else
+                return 0xff;
+            return 0;
+
+        case 22: // make file
+            if (!(file = open_file(cpm, name, 1)))
+                return 0xff;
+            fcb[FCB_EX] = fcb[FCB_S2] = fcb[FCB_RC] = fcb[FCB_CR] = 0;
+            return 0;
+    }
+
+    if (!(file = open_file(cpm, name, 0)))
+        return function == 35 ? 0xff : 9;
+
+    switch (function)
+    {
+        case 20: // read sequential
+            record = fcb_record(fcb);
+            if ((result = read_record(cpm, file, record)) == 0)
+                ++record;
+            fcb_seek(fcb, file, record);
+            return result;
+
+        case 21: // write sequential
+            record = fcb_record(fcb);
+            if ((result = write_record(cpm, file, record)) == 0)
+                ++record;
+            fcb_seek(fcb, file, record);
+            return result;
+
+        case 33: // read random
+            record = fcb_random_record(fcb);
+            if (record > 0xffff)
+                return 6;
+            fcb_seek(fcb, file, record);
+            return read_record(cpm, file, record);
+
+        case 34: // write random
+        case 40: // write random with zero fill
+            record = fcb_random_record(fcb);
+            if (record > 0xffff)
+                return 6;
+            result = write_record(cpm, file, record);
+            fcb_seek(fcb, file, record);
+            return result;
+
+        case 35: // compute file size
+            record = records(file);
+            fcb[FCB_R0] = record;
+            fcb[FCB_R0 + 1] = record >> 8;
+            fcb[FCB_R0 + 2] = record >> 16;
+            return 0;
+
+        case 36: // set random record
+            record = fcb_record(fcb);
+            fcb[FCB_R0] = record;
+            fcb[FCB_R0 + 1] = record >> 8;
+            fcb[FCB_R0 + 2] = record >> 16;
+            return 0;
+    }
+
+    return 0xff;
+}
+
+static void bdos(struct Z80Cpm *cpm)
+{
+    struct Z80 *z80 = cpm->z80;
+    uint8_t const function = z80->c;
+    uint8_t fcb[FCB_SIZE];
+    uint16_t result = 0;
+
+    switch (function)
+    {
+        case 0: cpm->exited = 1; break;                     // system reset
+        case 1: result = console_echo(cpm); break;          // console input
+        case 2: fputc(z80->e, cpm->console_out); break;     // console output
+        case 3: result = 0x1a; break;                       // reader input
+        case 4:                                             // punch output
+        case 5: break;                                      // list output
+        case 6:                                             // direct console
+            if (z80->e == 0xff)
+                result = console_in(cpm) & 0xff;
+            else if (z80->e != 0xfe)
+                fputc(z80->e, cpm->console_out);
+            break;
+        case 7: result = cpm->iobyte; break;                // get iobyte
+        case 8: cpm->iobyte = z80->e; break;                // set iobyte
+        case 9: {                                           // print string
+            uint16_t addr = z80->de;
+            uint8_t c;
+            while ((c = peek(cpm, addr++)) != '$')
+                fputc(c, cpm->console_out);
+            break;
+        }
+        case 10: read_line(cpm, z80->de); break;            // read buffer
+        case 11: result = 0; break;                         // console status
+        case 12: result = 0x0022; break;                    // version
+        case 13: cpm->dma = 0x80; cpm->drive = 0; break;    // reset disks
+        case 14: cpm->drive = z80->e & 0x0f; break;         // select disk
+        case 17:                                            // search first
+            z80_memory_read(z80->memory, z80->de, fcb, FCB_SIZE);
+            search(cpm, fcb);
+            result = search_next(cpm);
+            break;
+        case 18: result = search_next(cpm); break;          // search next
+        case 19:                                            // delete file
+            z80_memory_read(z80->memory, z80->de, fcb, FCB_SIZE);
+            result = delete_files(cpm, fcb);
+            break;
+        case 23:                                            // rename file
+            z80_memory_read(z80->memory, z80->de, fcb, FCB_SIZE);
+            result = rename_file(cpm, fcb);
+            break;
+        case 24: result = 0x0001; break;                    // login vector
+        case 25: result = cpm->drive; break;                // current disk
+        case 26: cpm->dma = z80->de; break;                 // set dma
+        case 27: result = ALLOCATION_VECTOR; break;         // allocation
+        case 28: break;                                     // write protect
+        case 29: result = 0; break;                         // r/o vector
+        case 30: result = 0; break;                         // attributes
+        case 31: result = DPB; break;                       // disk params
+        case 32:                                            // user code
+            if (z80->e == 0xff)
+                result = cpm->user;
+            else
+                cpm->user = z80->e & 0x0f;
+            break;
+        case 15:
+        case 16:
+        case 20:
+        case 21:
+        case 22:
+        case 33:
+        case 34:
+        case 35:
+        case 36:
+        case 40:
+            z80_memory_read(z80->memory, z80->de, fcb, FCB_SIZE);
+            result = file_function(cpm, function, fcb);
+            z80_memory_write(z80->memory, z80->de, fcb, FCB_SIZE);
+            break;
+        default: result = 0xff; break;
+    }
+
+    set_result(cpm, result);
+}
+
+static void bios(struct Z80Cpm *cpm, int const function)
+{
+    struct Z80 *z80 = cpm->z80;
+
+    switch (function)
+    {
+        case 0:                                            // boot
+        case 1: cpm->exited = 1; break;                    // wboot
+        case 2: z80->a = 0; break;                         // const
+        case 3: z80->a = console_in(cpm); break;           // conin
+        case 4: fputc(z80->c, cpm->console_out); break;    // conout
+        case 5:                                            // list
+        case 6: break;                                     // punch
+        case 7: z80->a = 0x1a; break;                      // reader
+        case 9: z80->hl = 0; break;                        // seldsk
+        case 15: z80->a = 0xff; break;                     // listst
+        case 16: z80->hl = z80->bc; break;                 // sectran
+        default: z80->a = 1; break;                        // disk i/o
+    }
+}
+
+static uint8_t trap(struct Z80 *z80, uint16_t const pc, uint8_t const opcode)
+{
+    struct Z80Cpm *cpm = z80->userdata;
+    (void)opcode;
+
+    if (pc < Z80_CPM_BDOS)
+        return 0;
+
+    if (pc == Z80_CPM_BDOS)
+    {
+        bdos(cpm);
+        ret(z80);
+        return 1;
+    }
+
+    if (pc >= Z80_CPM_BIOS && pc < Z80_CPM_BIOS + 3 * NUM_BIOS_ENTRIES
+        && (pc - Z80_CPM_BIOS) % 3 == 0)
+    {
+        bios(cpm, (pc - Z80_CPM_BIOS) / 3);
+        ret(z80);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+
+/** Parses the next command tail argument into an FCB, expanding '*'.
+ */
+static char const *parse_fcb(char const *args, uint8_t *fcb)
+{
+    int i = 1;
+    int end = 9;
+
+    memset(fcb, 0, 16);
+    memset(fcb + 1, ' ', 11);
+
+    while (*args == ' ')
+        ++args;
+
+    if (args[0] && args[1] == ':')
+    {
+        fcb[0] = toupper((unsigned char)args[0]) - 'A' + 1;
+        args += 2;
+    }
+
+    while (*args && *args != ' ')
+    {
+        char const c = toupper((unsigned char)*args++);
+        if (c == '.')
+        {
+            i = 9;
+            end = 12;
+        }
+        else if (c == '*')
+        {
+            while (i < end)
+                fcb[i++] = '?';
+        }
+        else if (i < end)
+        {
+            fcb[i++] = c;
+        }
+    }
+
+    return args;
+}
+
+void z80_cpm_init(struct Z80Cpm *cpm, struct Z80 *z80, char const *directory)
+{
+    uint8_t const page_zero[] = {0xc3,
+                                 (Z80_CPM_BIOS + 3) & 0xff,
+                                 (Z80_CPM_BIOS + 3) >> 8,
+                                 0x00,
+                                 0x00,
+                                 0xc3,
+                                 Z80_CPM_BDOS & 0xff,
+                                 Z80_CPM_BDOS >> 8};
+
+    memset(cpm, 0, sizeof(*cpm));
+    cpm->z80 = z80;
+    cpm->directory = directory;
+    cpm->console_in = stdin;
+    cpm->console_out = stdout;
+    cpm->dma = 0x80;
+
+    cpm->bus = *z80->bus;
+    cpm->bus.trap = trap;
+    z80->bus = &cpm->bus;
+    z80->userdata = cpm;
+
+    z80_memory_write(z80->memory, 0x0000, page_zero, sizeof(page_zero));
+    poke(cpm, Z80_CPM_BDOS, 0xc9);
+    for (int i = 0; i < NUM_BIOS_ENTRIES; ++i)
+        poke(cpm, Z80_CPM_BIOS + 3 * i, 0xc9);
+    z80_memory_write(
+        z80->memory, DPB, disk_parameters, sizeof(disk_parameters));
+}
+
+void z80_cpm_free(struct Z80Cpm *cpm)
+{
+    for (int i = 0; i < Z80_CPM_MAX_FILES; ++i)
+    {
+        if (cpm->files[i].name[0])
+            close_file(&cpm->files[i]);
+    }
+}
+
+int z80_cpm_load(struct Z80Cpm *cpm, char const *path, char const *args)
+{
+    struct Z80 *z80 = cpm->z80;
+    uint8_t tail[RECORD_SIZE] = {0};
+    uint8_t fcbs[0x80 - 0x5c] = {0};
+    struct stat st;
+    void *image;
+    size_t length;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    length = st.st_size;
+    if (length > Z80_CPM_BDOS - 6 - TPA)
+        length = Z80_CPM_BDOS - 6 - TPA;
+
+    image = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return -1;
+
+    z80_memory_write(z80->memory, TPA, image, length);
+    munmap(image, length);
+
+    if (args)
+    {
+        size_t n = 0;
+        tail[++n] = ' ';
+        for (char const *c = args; *c && n < RECORD_SIZE - 2; ++c)
+            tail[++n] = toupper((unsigned char)*c);
+        tail[0] = n;
+
+        parse_fcb(parse_fcb(args, fcbs), fcbs + 0x10);
+    }
+    else
+    {
+        memset(fcbs + 1, ' ', 11);
+        memset(fcbs + 0x11, ' ', 11);
+    }
+
+    z80_memory_write(z80->memory, 0x5c, fcbs, sizeof(fcbs));
+    z80_memory_write(z80->memory, 0x80, tail, sizeof(tail));
+
+    cpm->dma = 0x80;
+    cpm->exited = 0;
+
+    z80->halted = 0;
+    z80->pc = TPA;
+    z80->sp = Z80_CPM_BDOS - 6;
+    z80->sp -= 2;
+    poke(cpm, z80->sp, 0x00);
+    poke(cpm, z80->sp + 1, 0x00);
+
+    return 0;
+}
+
+int z80_cpm_run(struct Z80Cpm *cpm, uint64_t max_cycles)
+{
+    struct Z80 *z80 = cpm->z80;
+
+    while (!cpm->exited && z80->cycles < max_cycles)
+    {
+        if (z80_fault(z80))
+            return Z80_CPM_FAULT;
+        z80_step(z80);
+    }
+
+    fflush(cpm->console_out);
+    return cpm->exited ? Z80_CPM_EXITED : Z80_CPM_RUNNING;
+}
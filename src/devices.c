@@ -0,0 +1,105 @@
+#include "z80/devices.h"
+#include <string.h>
+
+/** Stops the run in progress if an access has brought the device's deadline
+ * before its end.
+ */
+static void check_deadline(struct Z80 *z80, struct Z80Device const *device)
+{
+    if (device->deadline < device->devices->stop)
+        z80_stop(z80);
+}
+
+static uint8_t device_load(struct Z80 *z80, uint16_t port, void *userdata)
+{
+    struct Z80Device *device = userdata;
+
+    z80_device_sync(z80, device);
+    uint8_t const val = device->load(z80, port, device->userdata);
+    check_deadline(z80, device);
+    return val;
+}
+
+static void device_store(struct Z80 *z80, uint16_t port, uint8_t val, void *userdata)
+{
+    struct Z80Device *device = userdata;
+
+    z80_device_sync(z80, device);
+    device->store(z80, port, val, device->userdata);
+    check_deadline(z80, device);
+}
+
+/** Brings up to date every device whose deadline has come.
+ */
+static void sync_due(struct Z80Devices *devices, struct Z80 *z80)
+{
+    for (int i = 0; i < devices->num_devices; ++i)
+    {
+        if (devices->devices[i]->deadline <= z80->cycles)
+            z80_device_sync(z80, devices->devices[i]);
+    }
+}
+
+void z80_devices_init(struct Z80Devices *devices, struct Z80Ports *ports)
+{
+    memset(devices, 0, sizeof(*devices));
+    devices->ports = ports;
+}
+
+int z80_devices_add(struct Z80Devices *devices, struct Z80Device *device)
+{
+    if (devices->num_devices == Z80_DEVICES_MAX)
+        return -1;
+
+    device->devices = devices;
+    devices->devices[devices->num_devices] = device;
+    return devices->num_devices++;
+}
+
+void z80_devices_map(struct Z80Devices *devices, struct Z80Device *device, uint8_t port, uint8_t mask)
+{
+    z80_ports_map(devices->ports,
+                  port,
+                  mask,
+                  device->load ? device_load : NULL,
+                  device->store ? device_store : NULL,
+                  device);
+}
+
+void z80_device_sync(struct Z80 *z80, struct Z80Device *device)
+{
+    if (z80->cycles <= device->synced)
+        return;
+
+    device->sync(z80, device, z80->cycles);
+    device->synced = z80->cycles;
+}
+
+void z80_devices_sync_all(struct Z80Devices *devices, struct Z80 *z80)
+{
+    for (int i = 0; i < devices->num_devices; ++i)
+        z80_device_sync(z80, devices->devices[i]);
+}
+
+int64_t z80_devices_run(struct Z80Devices *devices, struct Z80 *z80, uint64_t const until)
+{
+    uint64_t const start = z80->cycles;
+
+    sync_due(devices, z80);
+    while (z80->cycles < until && !z80->fault)
+    {
+        devices->stop = until;
+        for (int i = 0; i < devices->num_devices; ++i)
+        {
+            uint64_t const deadline = devices->devices[i]->deadline;
+            if (deadline > z80->cycles && deadline < devices->stop)
+                devices->stop = deadline;
+        }
+
+        z80_run(z80, devices->stop);
+        sync_due(devices, z80);
+    }
+    devices->stop = 0;
+
+    return z80->cycles - start;
+}
@@ -0,0 +1,121 @@
+#include "z80/disasm.h"
+#include <stdio.h>
+
+/** Opcode tables, in the order generate.lua emits them. */
+enum Table
+{
+    BASE,
+    CB,
+    ED,
+    DD,
+    FD,
+    DDCB,
+    FDCB,
+};
+
+/* Mnemonics and lengths generated from src/opcodes/opcodes.in. */
+#include "z80-disasm.inc"
+
+/** Text being written to the caller's buffer.
+ */
+struct Output
+{
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+/** Appends one formatted value, truncating at the end of the buffer.
+ */
+static void append(struct Output *out, char const *fmt, int val)
+{
+    if (out->len + 1 < out->size)
+    {
+        int const n = snprintf(out->buf + out->len, out->size - out->len, fmt, val);
+        if (n > 0)
+            out->len += (size_t)n;
+        if (out->len >= out->size)
+            out->len = out->size - 1;
+    }
+}
+
+int z80_disassemble(uint8_t const *code, uint16_t addr, char *buf, size_t size)
+{
+    struct Output out = {buf, size, 0};
+    enum Table table = BASE;
+    uint8_t opcode = code[0];
+    uint8_t const *operand = code + 1;
+
+    switch (code[0])
+    {
+        case 0xcb: table = CB; break;
+        case 0xed: table = ED; break;
+        case 0xdd: table = code[1] == 0xcb ? DDCB : DD; break;
+        case 0xfd: table = code[1] == 0xcb ? FDCB : FD; break;
+    }
+
+    if (table == DDCB || table == FDCB)
+    {
+        // The displacement comes before the opcode.
+        opcode = code[3];
+        operand = code + 2;
+    }
+    else if (table != BASE)
+    {
+        opcode = code[1];
+        operand = code + 2;
+    }
+
+    char const *mnemonic = mnemonics[table][opcode];
+    int const length = lengths[table][opcode];
+
+    if (size)
+        buf[0] = '\0';
+
+    if (!mnemonic)
+    {
+        for (int i = 0; i < length; ++i)
+            append(&out, i ? ", 0x%02x" : "db 0x%02x", code[i]);
+        return length;
+    }
+
+    for (char const *c = mnemonic; *c; ++c)
+    {
+        if (*c != '$')
+        {
+            append(&out, "%c", *c);
+            continue;
+        }
+
+        switch (*++c)
+        {
+            case 'n':
+                if (c[1] == 'n')
+                {
+                    append(&out, "0x%04x", operand[0] | operand[1] << 8);
+                    operand += 2;
+                    ++c;
+                }
+                else
+                {
+                    append(&out, "0x%02x", *operand++);
+                }
+                break;
+
+            case 'd': {
+                int const d = (int8_t)*operand++;
+                // Follows a '+', which becomes a '-' for negative offsets.
+                if (d < 0 && out.len > 0 && buf[out.len - 1] == '+')
+                    buf[out.len - 1] = '-';
+                append(&out, "0x%02x", d < 0 ? -d : d);
+                break;
+            }
+
+            case 'e':
+                append(&out, "0x%04x", (uint16_t)(addr + length + (int8_t)*operand++));
+                break;
+        }
+    }
+
+    return length;
+}
@@ -0,0 +1,418 @@
+#include "z80/memory.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/** Alignment of ROM data, so that ROM pages share no cache lines or host
+ * pages with anything else.
+ */
+#define ROM_ALIGN 4096
+
+#define MEMORY_SIZE 0x10000
+
+/** Mixes a value into 64 well spread bits (the splitmix64 finalizer).
+ */
+static uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/** The part of the memory hash for one byte.
+ */
+static uint64_t hash_byte(uint16_t addr, uint8_t value)
+{
+    return mix(((uint64_t)addr << 8 | value) + 0x9e3779b97f4a7c15ull);
+}
+
+/** Points a page back at the instance's own memory, dropping any ROM.
+ */
+static void unmap(struct Z80Memory *mem, int page)
+{
+    mem->pages[page] = mem->data + (page << Z80_PAGE_BITS);
+
+    if (mem->roms[page])
+    {
+        z80_rom_release(mem->roms[page]);
+        mem->roms[page] = NULL;
+    }
+    mem->shared &= ~((uint64_t)1 << page);
+}
+
+void z80_memory_init(struct Z80Memory *mem, struct Z80 *z80, uint8_t *data)
+{
+    for (int page = 0; page < Z80_NUM_PAGES; ++page)
+    {
+        mem->pages[page] = data + (page << Z80_PAGE_BITS);
+        mem->roms[page] = NULL;
+    }
+
+    mem->dirty = 0;
+    mem->shared = 0;
+    mem->rom_writes = Z80_ROM_IGNORE;
+    mem->hashing = 0;
+    mem->data = data;
+    mem->hash = 0;
+    memset(mem->page_hashes, 0, sizeof(mem->page_hashes));
+
+    if (z80)
+        z80->memory = mem;
+}
+
+void z80_memory_free(struct Z80Memory *mem)
+{
+    uint64_t const shared = mem->shared;
+
+    for (int page = 0; page < Z80_NUM_PAGES; ++page)
+        unmap(mem, page);
+    z80_memory_rehash(mem, shared);
+}
+
+/** Allocates a ROM of `length` bytes, with one reference, leaving the data
+ * up to the caller.
+ */
+static struct Z80Rom *rom_alloc(uint32_t length)
+{
+    uint32_t const padded = (length + ROM_ALIGN - 1) & ~(uint32_t)(ROM_ALIGN - 1);
+    struct Z80Rom *rom = malloc(sizeof(*rom));
+
+    if (!rom)
+        return NULL;
+
+    rom->data = aligned_alloc(ROM_ALIGN, padded);
+    if (!rom->data)
+    {
+        free(rom);
+        return NULL;
+    }
+
+    memset(rom->data + length, 0, padded - length);
+    rom->length = length;
+    rom->copy_on_write = 0;
+    atomic_init(&rom->refs, 1);
+    return rom;
+}
+
+struct Z80Rom *z80_rom_create(void const *data, uint32_t length)
+{
+    struct Z80Rom *rom;
+
+    if (length == 0 || length > 0x10000)
+        return NULL;
+
+    rom = rom_alloc(length);
+    if (rom)
+        memcpy(rom->data, data, length);
+    return rom;
+}
+
+void z80_rom_release(struct Z80Rom *rom)
+{
+    if (atomic_fetch_sub(&rom->refs, 1) == 1)
+    {
+        free(rom->data);
+        free(rom);
+    }
+}
+
+int z80_memory_map_rom(struct Z80Memory *mem, struct Z80Rom *rom, uint16_t addr)
+{
+    int const first = addr >> Z80_PAGE_BITS;
+    int const count = (rom->length + Z80_PAGE_SIZE - 1) >> Z80_PAGE_BITS;
+
+    if ((addr & Z80_PAGE_MASK) || first + count > Z80_NUM_PAGES)
+        return -1;
+
+    for (int i = 0; i < count; ++i)
+    {
+        unmap(mem, first + i);
+        atomic_fetch_add(&rom->refs, 1);
+        mem->roms[first + i] = rom;
+        mem->pages[first + i] = rom->data + (i << Z80_PAGE_BITS);
+        mem->shared |= (uint64_t)1 << (first + i);
+        mem->dirty &= ~((uint64_t)1 << (first + i));
+        z80_memory_rehash(mem, (uint64_t)1 << (first + i));
+    }
+
+    return 0;
+}
+
+int z80_memory_unshare(struct Z80Memory *mem, int page)
+{
+    uint8_t const *src = mem->pages[page];
+
+    if (mem->rom_writes == Z80_ROM_IGNORE && !mem->roms[page]->copy_on_write)
+        return 0;
+
+    memcpy(mem->data + (page << Z80_PAGE_BITS), src, Z80_PAGE_SIZE);
+    unmap(mem, page);
+    return 1;
+}
+
+void z80_memory_enable_hashing(struct Z80Memory *mem)
+{
+    mem->hashing = 1;
+    z80_memory_rehash(mem, ~(uint64_t)0);
+}
+
+void z80_memory_rehash(struct Z80Memory *mem, uint64_t pages)
+{
+    if (!mem->hashing)
+        return;
+
+    for (; pages; pages &= pages - 1)
+    {
+        int const page = __builtin_ctzll(pages);
+        uint16_t const base = page << Z80_PAGE_BITS;
+        uint64_t hash = 0;
+
+        for (int i = 0; i < Z80_PAGE_SIZE; ++i)
+            hash += hash_byte(base + i, mem->pages[page][i]);
+
+        mem->hash += hash - mem->page_hashes[page];
+        mem->page_hashes[page] = hash;
+    }
+}
+
+void z80_memory_hash_write(struct Z80Memory *mem, uint16_t addr, uint8_t value)
+{
+    int const page = addr >> Z80_PAGE_BITS;
+    uint8_t const old = mem->pages[page][addr & Z80_PAGE_MASK];
+    uint64_t const delta = hash_byte(addr, value) - hash_byte(addr, old);
+
+    mem->page_hashes[page] += delta;
+    mem->hash += delta;
+}
+
+uint64_t z80_state_hash(struct Z80 const *z80)
+{
+    uint16_t const regs[] = {
+        z80->pc,
+        z80->sp,
+        z80->ix,
+        z80->iy,
+        z80->af,
+        z80->bc,
+        z80->de,
+        z80->hl,
+        z80->afp,
+        z80->bcp,
+        z80->dep,
+        z80->hlp,
+        (uint16_t)(z80->i << 8 | z80->r),
+        (uint16_t)(z80->interrupt_mode << 8 | z80->interrupt_delay),
+        (uint16_t)(z80->iff1 << 8 | z80->iff2),
+        (uint16_t)(z80->halted << 8 | z80->fault),
+    };
+    struct Z80Memory const *mem = z80->memory;
+    uint64_t hash = mem && mem->hashing ? mem->hash : 0;
+
+    for (size_t i = 0; i < sizeof(regs) / sizeof(regs[0]); ++i)
+        hash = mix(hash ^ ((uint64_t)i << 16 | regs[i]));
+    return hash;
+}
+
+void z80_memory_write(struct Z80Memory *mem,
+                      uint16_t addr,
+                      void const *data,
+                      uint32_t length)
+{
+    uint8_t const *src = data;
+
+    while (length)
+    {
+        uint32_t const offset = addr & Z80_PAGE_MASK;
+        uint32_t chunk = Z80_PAGE_SIZE - offset;
+        if (chunk > length)
+            chunk = length;
+
+        int const page = addr >> Z80_PAGE_BITS;
+        if (!(mem->shared & ((uint64_t)1 << page))
+            || z80_memory_unshare(mem, page))
+        {
+            if (mem->hashing)
+            {
+                for (uint32_t i = 0; i < chunk; ++i)
+                    z80_memory_hash_write(mem, addr + i, src[i]);
+            }
+            memcpy(mem->pages[page] + offset, src, chunk);
+            mem->dirty |= (uint64_t)1 << page;
+        }
+
+        src += chunk;
+        length -= chunk;
+        addr += chunk;
+    }
+}
+
+void z80_memory_read(struct Z80Memory const *mem,
+                     uint16_t addr,
+                     void *data,
+                     uint32_t length)
+{
+    uint8_t *dst = data;
+
+    while (length)
+    {
+        uint32_t const offset = addr & Z80_PAGE_MASK;
+        uint32_t chunk = Z80_PAGE_SIZE - offset;
+        if (chunk > length)
+            chunk = length;
+
+        memcpy(dst, mem->pages[addr >> Z80_PAGE_BITS] + offset, chunk);
+
+        dst += chunk;
+        length -= chunk;
+        addr += chunk;
+    }
+}
+
+/** A Z80 made by z80_fork, with the memory it was given. */
+struct Z80Fork
+{
+    struct Z80 z80;
+    struct Z80Memory mem;
+};
+
+int z80_fork(struct Z80 const *parent, int n, struct Z80 *children[])
+{
+    struct Z80Memory const *pmem = parent->memory;
+    struct Z80Rom *rom = rom_alloc(MEMORY_SIZE);
+    int made = 0;
+
+    if (!rom)
+        return -1;
+    z80_memory_read(pmem, 0, rom->data, MEMORY_SIZE);
+    rom->copy_on_write = 1;
+
+    for (; made < n; ++made)
+    {
+        struct Z80Fork *child = malloc(sizeof(*child));
+        // Anonymous pages are only backed once written.
+        uint8_t *data = mmap(NULL,
+                             MEMORY_SIZE,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS,
+                             -1,
+                             0);
+
+        if (!child || data == MAP_FAILED)
+        {
+            free(child);
+            if (data != MAP_FAILED)
+                munmap(data, MEMORY_SIZE);
+            break;
+        }
+
+        child->z80 = *parent;
+        child->z80.memory = &child->mem;
+        child->z80.write_log = NULL;
+        child->z80.profile = NULL;
+        child->z80.codemap = NULL;
+        z80_update_hooks(&child->z80);
+        z80_memory_init(&child->mem, NULL, data);
+        child->mem.rom_writes = pmem->rom_writes;
+        child->mem.dirty = 0;
+        child->mem.hashing = pmem->hashing;
+        child->mem.hash = pmem->hash;
+        memcpy(child->mem.page_hashes, pmem->page_hashes, sizeof(pmem->page_hashes));
+
+        for (int page = 0; page < Z80_NUM_PAGES; ++page)
+        {
+            uint64_t const bit = (uint64_t)1 << page;
+            struct Z80Rom *from = (pmem->shared & bit) ? pmem->roms[page] : rom;
+
+            atomic_fetch_add(&from->refs, 1);
+            child->mem.roms[page] = from;
+            child->mem.pages[page]
+                = from == rom ? rom->data + (page << Z80_PAGE_BITS) : pmem->pages[page];
+            child->mem.shared |= bit;
+        }
+
+        children[made] = &child->z80;
+    }
+
+    z80_rom_release(rom);
+    if (made < n)
+    {
+        while (made > 0)
+            z80_fork_free(children[--made]);
+        return -1;
+    }
+    return 0;
+}
+
+void z80_fork_free(struct Z80 *child)
+{
+    struct Z80Fork *fork = (struct Z80Fork *)child;
+
+    z80_memory_free(&fork->mem);
+    munmap(fork->mem.data, MEMORY_SIZE);
+    free(fork);
+}
+
+void z80_snapshot_init(struct Z80Snapshot *snapshot, struct Z80 *z80)
+{
+    struct Z80Memory *mem = z80->memory;
+
+    for (int page = 0; page < Z80_NUM_PAGES; ++page)
+    {
+        memcpy(snapshot->data + (page << Z80_PAGE_BITS),
+               mem->pages[page],
+               Z80_PAGE_SIZE);
+    }
+
+    mem->dirty = 0;
+    snapshot->z80 = *z80;
+}
+
+void z80_snapshot_take(struct Z80Snapshot *snapshot, struct Z80 *z80)
+{
+    struct Z80Memory *mem = z80->memory;
+    uint64_t dirty = mem->dirty;
+
+    while (dirty)
+    {
+        int const page = __builtin_ctzll(dirty);
+        memcpy(snapshot->data + (page << Z80_PAGE_BITS),
+               mem->pages[page],
+               Z80_PAGE_SIZE);
+        dirty &= dirty - 1;
+    }
+
+    mem->dirty = 0;
+    snapshot->z80 = *z80;
+}
+
+void z80_snapshot_restore(struct Z80 *z80, struct Z80Snapshot const *snapshot)
+{
+    struct Z80Memory *mem = z80->memory;
+    struct Z80Ports *ports = z80->ports;
+    struct Z80WriteLog *log = z80->write_log;
+    struct Z80Profile *profile = z80->profile;
+    struct Z80CodeMap *codemap = z80->codemap;
+    // Shared pages can't have changed, and mustn't be written.
+    uint64_t const restored = mem->dirty & ~mem->shared;
+    uint64_t dirty = restored;
+
+    while (dirty)
+    {
+        int const page = __builtin_ctzll(dirty);
+        memcpy(mem->pages[page],
+               snapshot->data + (page << Z80_PAGE_BITS),
+               Z80_PAGE_SIZE);
+        dirty &= dirty - 1;
+    }
+
+    z80_memory_rehash(mem, restored);
+    mem->dirty = 0;
+    *z80 = snapshot->z80;
+    z80->memory = mem;
+    z80->ports = ports;
+    z80->write_log = log;
+    z80->profile = profile;
+    z80->codemap = codemap;
+    z80_update_hooks(z80);
+}
@@ -0,0 +1,257 @@
+if #arg < 2 then
+  print("usage generate.lua <opcodes.in> <output directory>")
+  os.exit(1)
+end
+
+local output_dir = arg[2]
+
+-- The opcode tables, in the order they are emitted.
+local tables = {'base', 'cb', 'ed', 'dd', 'fd', 'ddcb', 'fdcb'}
+
+-- Bytes of each instruction other than its operands: the prefixes and the
+-- opcode.
+local fixed_lengths = {base = 1, cb = 2, ed = 2, dd = 2, fd = 2, ddcb = 3, fdcb = 3}
+
+-- Bytes taken by each kind of operand in a mnemonic.
+local operand_lengths = {n = 1, nn = 2, d = 1, e = 1}
+
+-- Bit weights of an opcode, from bit 7 down.
+local weights = {128, 64, 32, 16, 8, 4, 2, 1}
+
+local header = '/* Generated by generate.lua from opcodes.in. Do not edit. */\n\n'
+
+local function trim(s) return s:match('^%s*(.-)%s*$') end
+
+-- Splits the string `s` at each '|', trimming the pieces.
+--
+local function split(s)
+  local t = {}
+  for field in (s .. '|'):gmatch('([^|]*)|') do t[#t + 1] = trim(field) end
+  return t
+end
+
+-- Returns the opcodes matched by `pattern`, which is two hex digits or eight
+-- bits with fields named by letters, along with the value of each field.
+--
+local function expand(pattern)
+  if #pattern == 2 then
+    return {{opcode = assert(tonumber(pattern, 16)), fields = {}}}
+  end
+  assert(#pattern == 8, 'bad opcode ' .. pattern)
+
+  local matches = {}
+  for opcode = 0, 255 do
+    local fields = {}
+    local matched = true
+    for i = 1, 8 do
+      local c = pattern:sub(i, i)
+      local bit = math.floor(opcode / weights[i]) % 2
+      if c == '0' or c == '1' then
+        matched = matched and bit == tonumber(c)
+      else
+        fields[c] = (fields[c] or 0) * 2 + bit
+      end
+    end
+    if matched then matches[#matches + 1] = {opcode = opcode, fields = fields} end
+  end
+  return matches
+end
+
+local lists = {}
+
+-- Replaces the {list[field]} and {field} references in `text`.
+--
+local function substitute(text, fields)
+  text = text:gsub('{(%w+)%[(%a)%]}', function(list, field)
+    local value = assert(lists[list], 'unknown list ' .. list)[fields[field] + 1]
+    return assert(value, 'no ' .. list .. ' ' .. fields[field])
+  end)
+  return (text:gsub('{(%a)}', function(field)
+    return string.format('%d', assert(fields[field], 'unknown field ' .. field))
+  end))
+end
+
+-- Returns the cycles given by `spec` for an opcode, picking the (hl) form of
+-- `4/7` when a field selects (hl) from the r list in `mnemonic`.
+--
+local function cycles(spec, mnemonic, fields)
+  local normal, hl = spec:match('^(%d+)/(%d+)$')
+  if not normal then return assert(tonumber(spec), 'bad cycles ' .. spec) end
+
+  for field in mnemonic:gmatch('{r%[(%a)%]}') do
+    if fields[field] == 6 then return tonumber(hl) end
+  end
+  return tonumber(normal)
+end
+
+-- Returns the length in bytes of the instruction with `mnemonic`.
+--
+local function length(name, mnemonic)
+  local n = fixed_lengths[name]
+  for operand in mnemonic:gmatch('%$(%a+)') do
+    n = n + assert(operand_lengths[operand], 'unknown operand ' .. operand)
+  end
+  return n
+end
+
+-- Reads the specification
+
+local entries = {}
+local defaults = {}
+for _, name in ipairs(tables) do entries[name] = {} end
+
+for line in io.lines(arg[1]) do
+  line = trim(line)
+  if line ~= '' and line:sub(1, 1) ~= '#' then
+    local head, rest = line:match('^([^|]*)|?(.*)$')
+    local words = {}
+    for word in head:gmatch('%S+') do words[#words + 1] = word end
+
+    if words[1] == 'list' then
+      local items = split(rest)
+      lists[words[2]] = items
+    else
+      local name, pattern, spec = words[1], words[2], words[3]
+      local mnemonic, handler = rest:match('^([^|]*)|?(.*)$')
+      mnemonic, handler = trim(mnemonic), trim(handler)
+      assert(entries[name] and name ~= 'fd' and name ~= 'fdcb',
+             'unknown table ' .. name)
+
+      if pattern == '*' then
+        defaults[name] = assert(tonumber(spec), 'bad cycles ' .. spec)
+      else
+        for _, match in ipairs(expand(pattern)) do
+          if not entries[name][match.opcode] then
+            local entry = {cycles = cycles(spec, mnemonic, match.fields)}
+            if mnemonic ~= '' then
+              entry.mnemonic = substitute(mnemonic, match.fields)
+            end
+            if name == 'base' then
+              entry.handler = substitute(handler, match.fields)
+            end
+            entries[name][match.opcode] = entry
+          end
+        end
+      end
+    end
+  end
+end
+
+-- Copies the dd tables to the fd tables
+
+for _, copy in ipairs({{'dd', 'fd'}, {'ddcb', 'fdcb'}}) do
+  local from, to = copy[1], copy[2]
+  defaults[to] = defaults[from]
+  for opcode, entry in pairs(entries[from]) do
+    entries[to][opcode] = {
+      cycles = entry.cycles,
+      mnemonic = entry.mnemonic and (entry.mnemonic:gsub('ix', 'iy'))
+    }
+  end
+end
+
+-- Fills in the opcodes each table leaves out and works out the lengths
+
+for _, name in ipairs(tables) do
+  for opcode = 0, 255 do
+    local entry = entries[name][opcode]
+    if not entry then
+      entry = {
+        cycles = assert(defaults[name], string.format('no %s %02x', name, opcode))
+      }
+      local base = entries.base[opcode]
+      if (name == 'dd' or name == 'fd') and base.mnemonic then
+        entry.mnemonic = base.mnemonic
+        entry.length = 1 + base.length
+      end
+      entries[name][opcode] = entry
+    end
+
+    if not entry.length then
+      if entry.mnemonic then
+        entry.length = length(name, entry.mnemonic)
+      elseif name == 'ed' then
+        entry.length = 2
+      else
+        entry.length = 1
+      end
+    end
+
+    assert(name ~= 'base' or entry.handler,
+           string.format('no handler for base %02x', opcode))
+  end
+end
+
+-- Returns the entries of table `name`, each formatted by `format`, as the rows
+-- of a C array.
+--
+local function rows(name, format)
+  local t = {}
+  for row = 0, 15 do
+    local columns = {}
+    for column = 0, 15 do
+      columns[#columns + 1] = format(entries[name][row * 16 + column])
+    end
+    t[#t + 1] = table.concat(columns, ', ')
+  end
+  return t
+end
+
+local function cycles_of(entry) return string.format('%d', entry.cycles) end
+
+local function length_of(entry) return string.format('%d', entry.length) end
+
+local function write(filename, text)
+  local output = assert(io.open(output_dir .. '/' .. filename, 'w'))
+  output:write(header, text)
+  output:close()
+end
+
+-- Cycle tables for z80.c
+
+local buf = {'/* clang-format off */\n'}
+for _, t in ipairs({
+  {'base', 'opcode_cycles'}, {'cb', 'cb_opcode_cycles'},
+  {'ed', 'ed_opcode_cycles'}, {'dd', 'index_opcode_cycles'},
+  {'ddcb', 'indexcb_opcode_cycles'}
+}) do
+  buf[#buf + 1] = '\nstatic const uint8_t ' .. t[2] .. '[256]\n    = {' ..
+                      table.concat(rows(t[1], cycles_of), ',\n       ') .. '};\n'
+end
+buf[#buf + 1] = '\n/* clang-format on */\n'
+write('z80-cycles.inc', table.concat(buf))
+
+-- Cases of the switch in exec_instr
+
+buf = {'/* clang-format off */\n'}
+for opcode = 0, 255 do
+  local entry = entries.base[opcode]
+  local comment = ''
+  if entry.mnemonic then comment = ' // ' .. entry.mnemonic:gsub('%$', '') end
+  local handler = 'break;'
+  if entry.handler ~= '' then handler = entry.handler .. ' break;' end
+  buf[#buf + 1] = string.format('        case 0x%02x: %s%s\n', opcode, handler, comment)
+end
+buf[#buf + 1] = '/* clang-format on */\n'
+write('z80-exec.inc', table.concat(buf))
+
+-- Disassembly tables for disasm.c
+
+buf = {'/* clang-format off */\n\nstatic char const *const mnemonics[][256] = {\n'}
+for _, name in ipairs(tables) do
+  buf[#buf + 1] = '    /* ' .. name .. ' */\n    {\n'
+  for opcode = 0, 255 do
+    local mnemonic = entries[name][opcode].mnemonic
+    buf[#buf + 1] = string.format('        %s, /* %02x */\n',
+                                  mnemonic and '"' .. mnemonic .. '"' or 'NULL',
+                                  opcode)
+  end
+  buf[#buf + 1] = '    },\n'
+end
+buf[#buf + 1] = '};\n\nstatic uint8_t const lengths[][256] = {\n'
+for _, name in ipairs(tables) do
+  buf[#buf + 1] = '    /* ' .. name .. ' */\n    {' ..
+                      table.concat(rows(name, length_of), ',\n     ') .. '},\n'
+end
+buf[#buf + 1] = '};\n\n/* clang-format on */\n'
+write('z80-disasm.inc', table.concat(buf))
@@ -0,0 +1,51 @@
+#include "z80/ports.h"
+#include <string.h>
+
+void z80_ports_init(struct Z80Ports *ports, struct Z80 *z80)
+{
+    memset(ports, 0, sizeof(*ports));
+
+    if (z80)
+    {
+        z80->ports = ports;
+        z80_update_hooks(z80);
+    }
+}
+
+void z80_ports_map(struct Z80Ports *ports,
+                   uint8_t port,
+                   uint8_t mask,
+                   Z80PortLoad load,
+                   Z80PortStore store,
+                   void *userdata)
+{
+    for (int p = 0; p < 256; ++p)
+    {
+        if ((p & mask) != (port & mask))
+            continue;
+
+        struct Z80Port *entry = &ports->entries[p];
+        entry->load = load;
+        entry->store = store;
+        entry->userdata = userdata;
+        entry->constant = 0;
+        entry->value = 0;
+    }
+}
+
+void z80_ports_set_constant(struct Z80Ports *ports, uint8_t port, uint8_t mask, uint8_t value)
+{
+    for (int p = 0; p < 256; ++p)
+    {
+        if ((p & mask) != (port & mask))
+            continue;
+
+        ports->entries[p].constant = 1;
+        ports->entries[p].value = value;
+    }
+}
+
+void z80_ports_unmap(struct Z80Ports *ports, uint8_t port, uint8_t mask)
+{
+    z80_ports_map(ports, port, mask, NULL, NULL, NULL);
+}
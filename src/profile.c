@@ -0,0 +1,406 @@
+#include "z80/profile.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_STACKS 1024
+#define INITIAL_ADDRS 8192
+#define MAX_NAME 256
+
+/** A folded line, before lines naming the same functions are merged.
+ */
+struct Folded
+{
+    char *text;
+    uint64_t count;
+};
+
+static uint64_t hash_addrs(uint16_t const *addrs, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < length; ++i)
+        hash = (hash ^ addrs[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+/** Moves the distinct stacks into a table twice the size.
+ * @return 0 on success, or -1 if out of memory.
+ */
+static int grow_stacks(struct Z80Profile *profile)
+{
+    size_t const capacity = profile->stacks_capacity * 2;
+    struct Z80ProfileStack *stacks = calloc(capacity, sizeof(*stacks));
+
+    if (!stacks)
+        return -1;
+
+    for (size_t i = 0; i < profile->stacks_capacity; ++i)
+    {
+        struct Z80ProfileStack const *stack = &profile->stacks[i];
+        size_t slot = stack->hash & (capacity - 1);
+
+        if (!stack->count)
+            continue;
+        while (stacks[slot].count)
+            slot = (slot + 1) & (capacity - 1);
+        stacks[slot] = *stack;
+    }
+
+    free(profile->stacks);
+    profile->stacks = stacks;
+    profile->stacks_capacity = capacity;
+    return 0;
+}
+
+/** Makes room for `length` more addresses in the pool.
+ * @return 0 on success, or -1 if out of memory.
+ */
+static int reserve_addrs(struct Z80Profile *profile, size_t length)
+{
+    size_t capacity = profile->addrs_capacity;
+    uint16_t *addrs;
+
+    if (profile->num_addrs + length <= capacity)
+        return 0;
+    while (profile->num_addrs + length > capacity)
+        capacity *= 2;
+    if (capacity > UINT32_MAX)
+        return -1;
+
+    addrs = realloc(profile->addrs, capacity * sizeof(*addrs));
+    if (!addrs)
+        return -1;
+
+    profile->addrs = addrs;
+    profile->addrs_capacity = capacity;
+    return 0;
+}
+
+static int compare_symbols(void const *a, void const *b)
+{
+    struct Z80ProfileSymbol const *x = a;
+    struct Z80ProfileSymbol const *y = b;
+    return (int)x->addr - (int)y->addr;
+}
+
+static int compare_folded(void const *a, void const *b)
+{
+    struct Folded const *x = a;
+    struct Folded const *y = b;
+    return strcmp(x->text, y->text);
+}
+
+/** Finds the symbol at or below an address.
+ * @return The symbol, or NULL if there is none.
+ */
+static struct Z80ProfileSymbol const *lookup(struct Z80Profile const *profile, uint16_t addr)
+{
+    size_t lo = 0;
+    size_t hi = profile->num_symbols;
+
+    while (lo < hi)
+    {
+        size_t const mid = lo + (hi - lo) / 2;
+        if (profile->symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? &profile->symbols[lo - 1] : NULL;
+}
+
+static void write_name(struct Z80Profile const *profile, uint16_t addr, FILE *out)
+{
+    struct Z80ProfileSymbol const *symbol = lookup(profile, addr);
+
+    if (symbol)
+        fputs(symbol->name, out);
+    else
+        fprintf(out, "0x%04x", addr);
+}
+
+/** Writes the names of a stack, leaving out the PC if it is within the
+ * innermost function called, by symbol.
+ */
+static void write_stack(struct Z80Profile const *profile,
+                        struct Z80ProfileStack const *stack,
+                        FILE *out)
+{
+    uint16_t const *addrs = profile->addrs + stack->offset;
+    uint16_t length = stack->length;
+
+    if (length > 1)
+    {
+        struct Z80ProfileSymbol const *pc = lookup(profile, addrs[length - 1]);
+        if (pc && pc == lookup(profile, addrs[length - 2]))
+            --length;
+    }
+
+    for (uint16_t i = 0; i < length; ++i)
+    {
+        if (i)
+            fputc(';', out);
+        write_name(profile, addrs[i], out);
+    }
+}
+
+int z80_profile_init(struct Z80Profile *profile, struct Z80 *z80, uint64_t interval)
+{
+    memset(profile, 0, sizeof(*profile));
+    profile->interval = interval ? interval : 1;
+    profile->next_sample = z80->cycles + profile->interval;
+    profile->stacks = calloc(INITIAL_STACKS, sizeof(*profile->stacks));
+    profile->addrs = malloc(INITIAL_ADDRS * sizeof(*profile->addrs));
+    profile->stacks_capacity = INITIAL_STACKS;
+    profile->addrs_capacity = INITIAL_ADDRS;
+    profile->symbols_sorted = 1;
+
+    if (!profile->stacks || !profile->addrs)
+    {
+        z80_profile_free(profile, NULL);
+        return -1;
+    }
+
+    z80->profile = profile;
+    z80_update_hooks(z80);
+    return 0;
+}
+
+void z80_profile_free(struct Z80Profile *profile, struct Z80 *z80)
+{
+    if (z80 && z80->profile == profile)
+    {
+        z80->profile = NULL;
+        z80_update_hooks(z80);
+    }
+
+    for (size_t i = 0; i < profile->num_symbols; ++i)
+        free(profile->symbols[i].name);
+    free(profile->symbols);
+    free(profile->stacks);
+    free(profile->addrs);
+    profile->symbols = NULL;
+    profile->stacks = NULL;
+    profile->addrs = NULL;
+    profile->num_symbols = 0;
+    profile->num_stacks = 0;
+}
+
+void z80_profile_call(struct Z80Profile *profile, uint16_t addr, uint16_t from, uint16_t sp)
+{
+    int depth = profile->depth;
+
+    // Frames whose return address is at or above the new one were abandoned.
+    while (depth > 0 && depth <= Z80_PROFILE_DEPTH
+           && profile->frames[depth - 1].sp <= sp)
+        --depth;
+
+    if (depth < Z80_PROFILE_DEPTH)
+    {
+        profile->frames[depth].addr = addr;
+        profile->frames[depth].from = from;
+        profile->frames[depth].sp = sp;
+    }
+    profile->depth = depth + 1;
+}
+
+void z80_profile_return(struct Z80Profile *profile, uint16_t sp)
+{
+    if (profile->depth > Z80_PROFILE_DEPTH)
+    {
+        --profile->depth;
+        return;
+    }
+
+    // Pops the frame returned from, and any abandoned above it.
+    while (profile->depth > 0 && profile->frames[profile->depth - 1].sp < sp)
+        --profile->depth;
+}
+
+void z80_profile_sample(struct Z80Profile *profile, struct Z80 const *z80)
+{
+    int const depth = profile->depth < Z80_PROFILE_DEPTH ? profile->depth
+                                                         : Z80_PROFILE_DEPTH;
+    size_t const length = depth ? depth + 2 : 1;
+    uint16_t *addrs;
+    uint64_t hash;
+    size_t slot;
+
+    ++profile->samples;
+    if ((profile->num_stacks + 1) * 2 > profile->stacks_capacity
+        && grow_stacks(profile) != 0)
+    {
+        ++profile->dropped;
+        return;
+    }
+    if (reserve_addrs(profile, length) != 0)
+    {
+        ++profile->dropped;
+        return;
+    }
+
+    // Built at the end of the pool, and kept there only if it is new.
+    addrs = profile->addrs + profile->num_addrs;
+    if (depth)
+        addrs[0] = profile->frames[0].from;
+    for (int i = 0; i < depth; ++i)
+        addrs[i + 1] = profile->frames[i].addr;
+    addrs[length - 1] = z80->pc;
+    hash = hash_addrs(addrs, length);
+
+    slot = hash & (profile->stacks_capacity - 1);
+    for (;; slot = (slot + 1) & (profile->stacks_capacity - 1))
+    {
+        struct Z80ProfileStack *stack = &profile->stacks[slot];
+
+        if (!stack->count)
+        {
+            stack->count = 1;
+            stack->hash = hash;
+            stack->offset = (uint32_t)profile->num_addrs;
+            stack->length = (uint16_t)length;
+            profile->num_addrs += length;
+            ++profile->num_stacks;
+            return;
+        }
+        if (stack->hash == hash && stack->length == length
+            && memcmp(profile->addrs + stack->offset, addrs, length * sizeof(*addrs)) == 0)
+        {
+            ++stack->count;
+            return;
+        }
+    }
+}
+
+int64_t z80_profile_run(struct Z80Profile *profile, struct Z80 *z80, uint64_t const until)
+{
+    uint64_t const start = z80->cycles;
+
+    while (z80->cycles < until && !z80->fault)
+    {
+        z80_run(z80, profile->next_sample < until ? profile->next_sample : until);
+
+        if (z80->cycles >= profile->next_sample)
+        {
+            z80_profile_sample(profile, z80);
+            while (profile->next_sample <= z80->cycles)
+                profile->next_sample += profile->interval;
+        }
+    }
+
+    return z80->cycles - start;
+}
+
+int z80_profile_add_symbol(struct Z80Profile *profile, uint16_t addr, char const *name)
+{
+    char *copy;
+
+    if (profile->num_symbols == profile->symbols_capacity)
+    {
+        size_t const capacity = profile->symbols_capacity ? profile->symbols_capacity * 2 : 64;
+        struct Z80ProfileSymbol *symbols = realloc(profile->symbols, capacity * sizeof(*symbols));
+        if (!symbols)
+            return -1;
+        profile->symbols = symbols;
+        profile->symbols_capacity = capacity;
+    }
+
+    copy = strdup(name);
+    if (!copy)
+        return -1;
+
+    profile->symbols[profile->num_symbols].addr = addr;
+    profile->symbols[profile->num_symbols].name = copy;
+    ++profile->num_symbols;
+    profile->symbols_sorted = 0;
+    return 0;
+}
+
+int z80_profile_load_symbols(struct Z80Profile *profile, char const *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[MAX_NAME + 32];
+    int result = 0;
+
+    if (!file)
+        return -1;
+
+    while (result == 0 && fgets(line, sizeof(line), file))
+    {
+        char name[MAX_NAME];
+        char *text = line;
+        char *end;
+        unsigned long addr;
+
+        while (*text == ' ' || *text == '\t')
+            ++text;
+        if (*text == ';' || *text == '#')
+            continue;
+        if (*text == '$')
+            ++text;
+
+        addr = strtoul(text, &end, 16);
+        if (end == text || addr > 0xffff || sscanf(end, "%255s", name) != 1)
+            continue;
+
+        result = z80_profile_add_symbol(profile, (uint16_t)addr, name);
+    }
+
+    fclose(file);
+    return result;
+}
+
+int z80_profile_write_folded(struct Z80Profile *profile, FILE *out)
+{
+    struct Folded *lines = calloc(profile->num_stacks ? profile->num_stacks : 1, sizeof(*lines));
+    size_t num_lines = 0;
+    int result = 0;
+
+    if (!lines)
+        return -1;
+
+    if (!profile->symbols_sorted)
+    {
+        qsort(profile->symbols, profile->num_symbols, sizeof(*profile->symbols), compare_symbols);
+        profile->symbols_sorted = 1;
+    }
+
+    for (size_t i = 0; i < profile->stacks_capacity && result == 0; ++i)
+    {
+        struct Z80ProfileStack const *stack = &profile->stacks[i];
+        size_t size;
+        FILE *text;
+
+        if (!stack->count)
+            continue;
+
+        text = open_memstream(&lines[num_lines].text, &size);
+        if (!text)
+        {
+            result = -1;
+            break;
+        }
+        write_stack(profile, stack, text);
+        fclose(text);
+        lines[num_lines++].count = stack->count;
+    }
+
+    // Stacks which differ only within functions fold into one line.
+    qsort(lines, num_lines, sizeof(*lines), compare_folded);
+    for (size_t i = 0; i < num_lines; ++i)
+    {
+        uint64_t count = lines[i].count;
+
+        while (i + 1 < num_lines && strcmp(lines[i].text, lines[i + 1].text) == 0)
+        {
+            free(lines[i].text);
+            count += lines[++i].count;
+        }
+        if (result == 0)
+            fprintf(out, "%s %llu\n", lines[i].text, (unsigned long long)count);
+        free(lines[i].text);
+    }
+
+    free(lines);
+    return result;
+}
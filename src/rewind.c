@@ -0,0 +1,348 @@
+#include "z80/rewind.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 0x10000
+#define MIN_FRAME_SIZE 64
+
+/* The largest encoded frame: the registers and every page, where no byte
+ * matches, along with the run headers and the page mask. */
+#define SCRATCH_SIZE (2 * (sizeof(struct Z80) + MEMORY_SIZE) + 64)
+
+static uint8_t *put_varint(uint8_t *dst, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        *dst++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *dst++ = value;
+    return dst;
+}
+
+static uint8_t const *get_varint(uint8_t const *src, uint32_t *value)
+{
+    uint32_t result = 0;
+    int shift = 0;
+
+    while (*src & 0x80)
+    {
+        result |= (uint32_t)(*src++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *value = result | ((uint32_t)*src++ << shift);
+    return src;
+}
+
+/** Encodes `a ^ b` as alternating runs of zero and literal bytes. A NULL `a`
+ * is taken to be all zeros.
+ */
+static uint8_t *encode(uint8_t *dst,
+                       uint8_t const *a,
+                       uint8_t const *b,
+                       uint32_t const length)
+{
+    uint32_t i = 0;
+
+    while (i < length)
+    {
+        uint32_t const zeros_start = i;
+        while (i < length && (a ? a[i] : 0) == b[i])
+            ++i;
+
+        uint32_t const literal_start = i;
+        while (i < length && (a ? a[i] : 0) != b[i])
+            ++i;
+
+        dst = put_varint(dst, literal_start - zeros_start);
+        dst = put_varint(dst, i - literal_start);
+        for (uint32_t j = literal_start; j < i; ++j)
+            *dst++ = (a ? a[j] : 0) ^ b[j];
+    }
+
+    return dst;
+}
+
+/** XORs an encoded delta into `dst`.
+ */
+static uint8_t const *apply(uint8_t *dst,
+                            uint8_t const *src,
+                            uint32_t const length)
+{
+    uint32_t i = 0;
+
+    while (i < length)
+    {
+        uint32_t zeros, literals;
+        src = get_varint(src, &zeros);
+        src = get_varint(src, &literals);
+        i += zeros;
+        for (uint32_t j = 0; j < literals; ++j)
+            dst[i++] ^= *src++;
+    }
+
+    return src;
+}
+
+static struct Z80RewindFrame *frame(struct Z80Rewind *rw, uint32_t index)
+{
+    return &rw->frames[(rw->first + index) % rw->max_frames];
+}
+
+/** Drops the oldest keyframe, and the deltas which depend upon it.
+ */
+static void evict_group(struct Z80Rewind *rw)
+{
+    do
+    {
+        rw->first = (rw->first + 1) % rw->max_frames;
+        --rw->count;
+    } while (rw->count && !frame(rw, 0)->keyframe);
+}
+
+/** True if the oldest group of frames is the one being added to.
+ */
+static int single_group(struct Z80Rewind *rw)
+{
+    for (uint32_t i = 1; i < rw->count; ++i)
+    {
+        if (frame(rw, i)->keyframe)
+            return 0;
+    }
+    return 1;
+}
+
+/** Finds room for a frame of the given size after the newest frame, evicting
+ * old frames as needed.
+ * @return The offset of the space, or -1 if a delta frame would lose its
+ * keyframe.
+ */
+static int64_t allocate(struct Z80Rewind *rw,
+                        uint32_t const size,
+                        int const keyframe)
+{
+    for (;;)
+    {
+        if (rw->count == 0)
+            return size <= rw->capacity ? 0 : -1;
+
+        if (rw->count < rw->max_frames)
+        {
+            struct Z80RewindFrame const *newest = frame(rw, rw->count - 1);
+            uint32_t const oldest = frame(rw, 0)->offset;
+            uint32_t const end = newest->offset + newest->size;
+
+            if (oldest < end)
+            {
+                if (end + size <= rw->capacity)
+                    return end;
+                if (size <= oldest)
+                    return 0;
+            }
+            else if (end + size <= oldest)
+            {
+                return end;
+            }
+        }
+
+        if (!keyframe && single_group(rw))
+            return -1;
+
+        evict_group(rw);
+    }
+}
+
+static int capture(struct Z80Rewind *rw, struct Z80 *z80, int keyframe)
+{
+    struct Z80Memory *mem = z80->memory;
+    uint64_t const dirty = mem->dirty;
+    uint64_t const pages = keyframe ? ~(uint64_t)0 : dirty;
+    uint8_t *dst = rw->scratch;
+    int64_t offset;
+
+    dst = encode(dst,
+                 keyframe ? NULL : (uint8_t const *)&rw->last,
+                 (uint8_t const *)z80,
+                 sizeof(struct Z80));
+
+    memcpy(dst, &pages, sizeof(pages));
+    dst += sizeof(pages);
+
+    for (uint64_t p = pages; p; p &= p - 1)
+    {
+        int const page = __builtin_ctzll(p);
+        dst = encode(dst,
+                     keyframe ? NULL : rw->last_memory + (page << Z80_PAGE_BITS),
+                     mem->pages[page],
+                     Z80_PAGE_SIZE);
+    }
+
+    offset = allocate(rw, dst - rw->scratch, keyframe);
+    if (offset < 0)
+    {
+        if (keyframe)
+            return -1;
+        return capture(rw, z80, 1);
+    }
+
+    memcpy(rw->buffer + offset, rw->scratch, dst - rw->scratch);
+
+    struct Z80RewindFrame *f = frame(rw, rw->count++);
+    f->cycles = z80->cycles;
+    f->offset = offset;
+    f->size = dst - rw->scratch;
+    f->keyframe = keyframe;
+
+    for (uint64_t p = dirty; p; p &= p - 1)
+    {
+        int const page = __builtin_ctzll(p);
+        memcpy(rw->last_memory + (page << Z80_PAGE_BITS),
+               mem->pages[page],
+               Z80_PAGE_SIZE);
+    }
+    rw->last = *z80;
+    mem->dirty = 0;
+
+    rw->since_keyframe = keyframe ? 1 : rw->since_keyframe + 1;
+    rw->next_capture = z80->cycles + rw->interval;
+    return 1;
+}
+
+int z80_rewind_init(struct Z80Rewind *rw,
+                    struct Z80 *z80,
+                    uint64_t interval,
+                    uint32_t keyframe_interval,
+                    uint32_t capacity)
+{
+    memset(rw, 0, sizeof(*rw));
+
+    if (!z80->memory)
+        return -1;
+
+    rw->interval = interval;
+    rw->keyframe_interval = keyframe_interval ? keyframe_interval : 1;
+    rw->capacity = capacity;
+    rw->max_frames = capacity / MIN_FRAME_SIZE + 1;
+    rw->buffer = malloc(capacity);
+    rw->frames = malloc(rw->max_frames * sizeof(struct Z80RewindFrame));
+    rw->last_memory = malloc(MEMORY_SIZE);
+    rw->scratch = malloc(SCRATCH_SIZE);
+
+    if (!rw->buffer || !rw->frames || !rw->last_memory || !rw->scratch)
+    {
+        z80_rewind_free(rw);
+        return -1;
+    }
+
+    for (int page = 0; page < Z80_NUM_PAGES; ++page)
+    {
+        memcpy(rw->last_memory + (page << Z80_PAGE_BITS),
+               z80->memory->pages[page],
+               Z80_PAGE_SIZE);
+    }
+
+    if (capture(rw, z80, 1) < 0)
+    {
+        z80_rewind_free(rw);
+        return -1;
+    }
+
+    return 0;
+}
+
+void z80_rewind_free(struct Z80Rewind *rw)
+{
+    free(rw->buffer);
+    free(rw->frames);
+    free(rw->last_memory);
+    free(rw->scratch);
+    memset(rw, 0, sizeof(*rw));
+}
+
+int z80_rewind_capture(struct Z80Rewind *rw, struct Z80 *z80)
+{
+    if (z80->cycles < rw->next_capture)
+        return 0;
+
+    return capture(rw, z80, rw->since_keyframe >= rw->keyframe_interval);
+}
+
+uint64_t z80_rewind_oldest(struct Z80Rewind const *rw)
+{
+    return rw->frames[rw->first].cycles;
+}
+
+int z80_seek(struct Z80Rewind *rw, struct Z80 *z80, uint64_t cycles)
+{
+    struct Z80Memory *mem = z80->memory;
+    struct Z80Ports *ports = z80->ports;
+    struct Z80WriteLog *log = z80->write_log;
+    struct Z80Profile *profile = z80->profile;
+    struct Z80CodeMap *codemap = z80->codemap;
+    uint32_t target = rw->count;
+    uint32_t key;
+
+    if (rw->count == 0 || cycles > z80->cycles
+        || cycles < z80_rewind_oldest(rw))
+        return -1;
+
+    while (target > 0 && frame(rw, target - 1)->cycles > cycles)
+        --target;
+    --target;
+
+    key = target;
+    while (!frame(rw, key)->keyframe)
+        --key;
+
+    memset(&rw->last, 0, sizeof(rw->last));
+    memset(rw->last_memory, 0, MEMORY_SIZE);
+
+    for (uint32_t i = key; i <= target; ++i)
+    {
+        struct Z80RewindFrame const *f = frame(rw, i);
+        uint8_t const *src = rw->buffer + f->offset;
+        uint64_t pages;
+
+        src = apply((uint8_t *)&rw->last, src, sizeof(struct Z80));
+        memcpy(&pages, src, sizeof(pages));
+        src += sizeof(pages);
+
+        for (; pages; pages &= pages - 1)
+        {
+            int const page = __builtin_ctzll(pages);
+            src = apply(rw->last_memory + (page << Z80_PAGE_BITS),
+                        src,
+                        Z80_PAGE_SIZE);
+        }
+    }
+
+    for (int page = 0; page < Z80_NUM_PAGES; ++page)
+    {
+        // Shared pages can't have changed, and mustn't be written.
+        if (mem->shared & ((uint64_t)1 << page))
+            continue;
+
+        memcpy(mem->pages[page],
+               rw->last_memory + (page << Z80_PAGE_BITS),
+               Z80_PAGE_SIZE);
+    }
+    z80_memory_rehash(mem, ~mem->shared);
+    mem->dirty = 0;
+
+    *z80 = rw->last;
+    z80->memory = mem;
+    z80->ports = ports;
+    z80->write_log = log;
+    z80->profile = profile;
+    z80->codemap = codemap;
+    z80_update_hooks(z80);
+
+    rw->count = target + 1;
+    rw->since_keyframe = target - key + 1;
+    rw->next_capture = z80->cycles + rw->interval;
+
+    while (z80->cycles < cycles && !z80_fault(z80))
+        z80_step(z80);
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include "z80/system.h"
+#include <sched.h>
+#include <string.h>
+
+/** Runs a core to the end of the round, publishing the time at the start of
+ * each instruction for z80_system_touch.
+ */
+static void run_core(struct Z80SystemCore *core, uint64_t const target)
+{
+    struct Z80 *z80 = core->z80;
+
+    while (z80->cycles < target && !z80->fault)
+    {
+        atomic_store_explicit(&core->time, z80->cycles, memory_order_release);
+        if (z80->halted && !z80->interrupt_delay)
+            z80_run(z80, target);
+        else
+            z80_step(z80);
+    }
+
+    atomic_store_explicit(&core->time, UINT64_MAX, memory_order_release);
+}
+
+static void *core_thread(void *arg)
+{
+    struct Z80SystemCore *core = arg;
+    struct Z80System *sys = core->system;
+    uint64_t round = 0;
+
+    for (;;)
+    {
+        uint64_t target;
+
+        pthread_mutex_lock(&sys->lock);
+        while (sys->round == round && !sys->stopping)
+            pthread_cond_wait(&sys->start, &sys->lock);
+        if (sys->stopping)
+        {
+            pthread_mutex_unlock(&sys->lock);
+            return NULL;
+        }
+        round = sys->round;
+        target = sys->target;
+        pthread_mutex_unlock(&sys->lock);
+
+        run_core(core, target);
+
+        pthread_mutex_lock(&sys->lock);
+        if (--sys->pending == 0)
+            pthread_cond_signal(&sys->done);
+        pthread_mutex_unlock(&sys->lock);
+    }
+}
+
+static void start_threads(struct Z80System *sys)
+{
+    for (int i = 0; i < sys->num_cores; ++i)
+        pthread_create(&sys->cores[i].thread, NULL, core_thread, &sys->cores[i]);
+    sys->started = 1;
+}
+
+/*****************************************************************************/
+
+void z80_system_init(struct Z80System *sys, uint64_t quantum, int threaded)
+{
+    memset(sys, 0, sizeof(*sys));
+    sys->threaded = threaded;
+    sys->quantum = quantum ? quantum : 1;
+    sys->min_quantum = sys->quantum / 16 ? sys->quantum / 16 : 1;
+    sys->slice = sys->quantum;
+    pthread_mutex_init(&sys->lock, NULL);
+    pthread_cond_init(&sys->start, NULL);
+    pthread_cond_init(&sys->done, NULL);
+}
+
+void z80_system_free(struct Z80System *sys)
+{
+    if (sys->started)
+    {
+        pthread_mutex_lock(&sys->lock);
+        sys->stopping = 1;
+        pthread_cond_broadcast(&sys->start);
+        pthread_mutex_unlock(&sys->lock);
+
+        for (int i = 0; i < sys->num_cores; ++i)
+            pthread_join(sys->cores[i].thread, NULL);
+        sys->started = 0;
+    }
+
+    pthread_cond_destroy(&sys->done);
+    pthread_cond_destroy(&sys->start);
+    pthread_mutex_destroy(&sys->lock);
+}
+
+int z80_system_add(struct Z80System *sys, struct Z80 *z80)
+{
+    struct Z80SystemCore *core;
+
+    if (sys->num_cores == Z80_SYSTEM_MAX_CORES || sys->started)
+        return -1;
+
+    core = &sys->cores[sys->num_cores];
+    core->z80 = z80;
+    core->system = sys;
+    atomic_init(&core->time, UINT64_MAX);
+    return sys->num_cores++;
+}
+
+uint64_t z80_system_run(struct Z80System *sys, uint64_t const until)
+{
+    if (sys->threaded && !sys->started)
+        start_threads(sys);
+
+    while (sys->time < until)
+    {
+        uint64_t target = sys->time + sys->slice;
+        if (target > until)
+            target = until;
+
+        /* Publish every core's time before any of them starts, so that none
+         * sees a stale UINT64_MAX from the last round and runs ahead. */
+        for (int i = 0; i < sys->num_cores; ++i)
+        {
+            struct Z80 const *z80 = sys->cores[i].z80;
+            atomic_store(&sys->cores[i].time,
+                         z80->cycles < target && !z80->fault ? z80->cycles
+                                                             : UINT64_MAX);
+        }
+        atomic_store(&sys->touched, 0);
+
+        if (sys->threaded)
+        {
+            pthread_mutex_lock(&sys->lock);
+            sys->target = target;
+            sys->pending = sys->num_cores;
+            ++sys->round;
+            pthread_cond_broadcast(&sys->start);
+            while (sys->pending)
+                pthread_cond_wait(&sys->done, &sys->lock);
+            pthread_mutex_unlock(&sys->lock);
+        }
+        else
+        {
+            for (int i = 0; i < sys->num_cores; ++i)
+                run_core(&sys->cores[i], target);
+        }
+
+        sys->time = target;
+
+        if (atomic_load(&sys->touched))
+            sys->slice = sys->min_quantum;
+        else if (sys->slice < sys->quantum / 2)
+            sys->slice *= 2;
+        else
+            sys->slice = sys->quantum;
+    }
+
+    return sys->time;
+}
+
+void z80_system_touch(struct Z80System *sys, struct Z80 const *z80)
+{
+    int self = 0;
+    uint64_t time;
+
+    atomic_store_explicit(&sys->touched, 1, memory_order_relaxed);
+    if (!sys->threaded)
+        return;
+
+    while (sys->cores[self].z80 != z80)
+        ++self;
+    time = atomic_load_explicit(&sys->cores[self].time, memory_order_relaxed);
+
+    /* Wait for every core whose current instruction comes first, as the
+     * core with the earliest instruction never waits. */
+    for (int i = 0; i < sys->num_cores; ++i)
+    {
+        for (;;)
+        {
+            uint64_t const other = atomic_load_explicit(&sys->cores[i].time,
+                                                        memory_order_acquire);
+            if (i == self || other > time || (other == time && i > self))
+                break;
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,431 @@
+#include "z80/trace.h"
+#include "z80/memory.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define MEMORY_SIZE 65536
+#define TRACE_VERSION 1
+#define TRACE_HAS_MEMORY 0x01
+
+/** Largest encoding of a record: the change mask, PC and cycle deltas, every
+ * register and every write.
+ */
+#define MAX_RECORD 64
+
+/** Minimum block size, so that a block always holds a record. */
+#define MIN_BLOCK_SIZE 4096
+
+static char const magic[8] = "Z80TRACE";
+
+/** 16-bit registers, in the order of their bits in a record's change mask.
+ * The bit after them is for the miscellaneous state, and the bits above that
+ * count the writes.
+ */
+static size_t const registers[] = {
+    offsetof(struct Z80, sp),
+    offsetof(struct Z80, ix),
+    offsetof(struct Z80, iy),
+    offsetof(struct Z80, af),
+    offsetof(struct Z80, bc),
+    offsetof(struct Z80, de),
+    offsetof(struct Z80, hl),
+    offsetof(struct Z80, afp),
+    offsetof(struct Z80, bcp),
+    offsetof(struct Z80, dep),
+    offsetof(struct Z80, hlp),
+};
+
+#define NUM_REGISTERS (sizeof(registers) / sizeof(registers[0]))
+#define MISC_BIT (1u << NUM_REGISTERS)
+#define WRITES_SHIFT (NUM_REGISTERS + 1)
+
+static uint16_t *reg(struct Z80 *z80, int i)
+{
+    return (uint16_t *)((uint8_t *)z80 + registers[i]);
+}
+
+/** Packs the interrupt state and halt flag into one byte.
+ */
+static uint8_t misc_flags(struct Z80 const *z80)
+{
+    return (z80->iff1 & 1) | (z80->iff2 & 1) << 1 | (z80->halted & 1) << 2
+           | (z80->interrupt_mode & 3) << 3;
+}
+
+static int misc_changed(struct Z80 const *a, struct Z80 const *b)
+{
+    return a->i != b->i || misc_flags(a) != misc_flags(b);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t val)
+{
+    while (val >= 0x80)
+    {
+        *p++ = (uint8_t)val | 0x80;
+        val >>= 7;
+    }
+    *p++ = (uint8_t)val;
+    return p;
+}
+
+static uint8_t *put_word(uint8_t *p, uint16_t val)
+{
+    *p++ = val & 0xff;
+    *p++ = val >> 8;
+    return p;
+}
+
+/** Encodes the registers, flags and cycle count written at the start of a
+ * trace.
+ * @return The end of the encoding.
+ */
+static uint8_t *put_state(uint8_t *p, struct Z80 *z80)
+{
+    p = put_word(p, z80->pc);
+    for (size_t i = 0; i < NUM_REGISTERS; ++i)
+        p = put_word(p, *reg(z80, i));
+    *p++ = z80->i;
+    *p++ = z80->r;
+    *p++ = misc_flags(z80);
+    for (int i = 0; i < 8; ++i)
+        *p++ = z80->cycles >> (8 * i);
+    return p;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct Z80Trace *tr = arg;
+
+    pthread_mutex_lock(&tr->lock);
+    for (;;)
+    {
+        while (!tr->pending && !tr->stopping)
+            pthread_cond_wait(&tr->ready, &tr->lock);
+        if (!tr->pending)
+            break;
+
+        // The block being filled only changes once this one is written.
+        uint8_t const *block = tr->blocks[tr->current ^ 1];
+        uint32_t const length = tr->pending;
+        pthread_mutex_unlock(&tr->lock);
+
+        int const ok = gzwrite(tr->file, block, length) == (int)length;
+
+        pthread_mutex_lock(&tr->lock);
+        if (!ok)
+            tr->error = 1;
+        tr->pending = 0;
+        pthread_cond_signal(&tr->done);
+    }
+    pthread_mutex_unlock(&tr->lock);
+    return NULL;
+}
+
+/** Hands the block being filled to the writer thread, waiting for it to
+ * finish with the other one first, and starts filling that.
+ */
+static void submit(struct Z80Trace *tr)
+{
+    pthread_mutex_lock(&tr->lock);
+    while (tr->pending)
+        pthread_cond_wait(&tr->done, &tr->lock);
+    tr->pending = tr->used;
+    tr->current ^= 1;
+    pthread_cond_signal(&tr->ready);
+    pthread_mutex_unlock(&tr->lock);
+
+    tr->used = 0;
+}
+
+/*****************************************************************************/
+
+int z80_trace_open(struct Z80Trace *tr,
+                   struct Z80 *z80,
+                   char const *path,
+                   uint32_t block_size)
+{
+    uint8_t header[sizeof(magic) + 2 + 64];
+    uint8_t *p = header;
+    uint8_t *memory = NULL;
+    int ok;
+
+    memset(tr, 0, sizeof(*tr));
+    tr->block_size = block_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : block_size;
+    tr->blocks[0] = malloc(tr->block_size);
+    tr->blocks[1] = malloc(tr->block_size);
+    // Compression runs behind the emulation, so favor speed over size.
+    tr->file = gzopen(path, "wb1");
+    if (z80->memory)
+        memory = malloc(MEMORY_SIZE);
+
+    if (!tr->blocks[0] || !tr->blocks[1] || !tr->file
+        || (z80->memory && !memory))
+        goto fail;
+
+    memcpy(p, magic, sizeof(magic));
+    p += sizeof(magic);
+    *p++ = TRACE_VERSION;
+    *p++ = memory ? TRACE_HAS_MEMORY : 0;
+    p = put_state(p, z80);
+
+    ok = gzwrite(tr->file, header, p - header) == (int)(p - header);
+    if (ok && memory)
+    {
+        z80_memory_read(z80->memory, 0, memory, MEMORY_SIZE);
+        ok = gzwrite(tr->file, memory, MEMORY_SIZE) == MEMORY_SIZE;
+    }
+    free(memory);
+    memory = NULL;
+    if (!ok)
+        goto fail;
+
+    tr->last = *z80;
+    z80->write_log = &tr->log;
+    z80_update_hooks(z80);
+
+    pthread_mutex_init(&tr->lock, NULL);
+    pthread_cond_init(&tr->ready, NULL);
+    pthread_cond_init(&tr->done, NULL);
+    pthread_create(&tr->thread, NULL, writer_thread, tr);
+    return 0;
+
+fail:
+    if (tr->file)
+        gzclose(tr->file);
+    free(memory);
+    free(tr->blocks[0]);
+    free(tr->blocks[1]);
+    memset(tr, 0, sizeof(*tr));
+    return -1;
+}
+
+void z80_trace_record(struct Z80Trace *tr, struct Z80 *z80)
+{
+    uint8_t *const start = tr->blocks[tr->current] + tr->used;
+    uint8_t *p = start;
+    uint32_t mask = 0;
+    uint32_t writes = tr->log.count;
+    uint16_t values[NUM_REGISTERS];
+
+    if (writes > Z80_WRITE_LOG_SIZE)
+    {
+        tr->dropped_writes += writes - Z80_WRITE_LOG_SIZE;
+        writes = Z80_WRITE_LOG_SIZE;
+    }
+
+    for (size_t i = 0; i < NUM_REGISTERS; ++i)
+    {
+        values[i] = *reg(z80, i);
+        if (values[i] != *reg(&tr->last, i))
+        {
+            *reg(&tr->last, i) = values[i];
+            mask |= 1u << i;
+        }
+    }
+    if (misc_changed(z80, &tr->last))
+        mask |= MISC_BIT;
+    mask |= writes << WRITES_SHIFT;
+
+    p = put_varint(p, mask);
+    // Zigzag encoded, so that short jumps back are short too.
+    int16_t const pc_delta = (int16_t)(z80->pc - tr->last.pc);
+    p = put_varint(p, (uint16_t)((pc_delta << 1) ^ (pc_delta >> 15)));
+    p = put_varint(p, z80->cycles - tr->last.cycles);
+
+    for (size_t i = 0; i < NUM_REGISTERS; ++i)
+    {
+        if (mask & (1u << i))
+            p = put_word(p, values[i]);
+    }
+    if (mask & MISC_BIT)
+    {
+        *p++ = z80->i;
+        *p++ = misc_flags(z80);
+    }
+    for (uint32_t i = 0; i < writes; ++i)
+    {
+        p = put_word(p, tr->log.addr[i]);
+        *p++ = tr->log.value[i];
+    }
+
+    tr->last.pc = z80->pc;
+    tr->last.cycles = z80->cycles;
+    tr->last.i = z80->i;
+    tr->last.iff1 = z80->iff1;
+    tr->last.iff2 = z80->iff2;
+    tr->last.halted = z80->halted;
+    tr->last.interrupt_mode = z80->interrupt_mode;
+    tr->log.count = 0;
+    ++tr->records;
+
+    tr->used += p - start;
+    if (tr->used + MAX_RECORD > tr->block_size)
+        submit(tr);
+}
+
+int z80_trace_close(struct Z80Trace *tr, struct Z80 *z80)
+{
+    int error;
+
+    if (tr->used)
+        submit(tr);
+
+    pthread_mutex_lock(&tr->lock);
+    tr->stopping = 1;
+    pthread_cond_signal(&tr->ready);
+    pthread_mutex_unlock(&tr->lock);
+    pthread_join(tr->thread, NULL);
+
+    error = tr->error;
+    if (gzclose(tr->file) != Z_OK)
+        error = 1;
+
+    if (z80->write_log == &tr->log)
+    {
+        z80->write_log = NULL;
+        z80_update_hooks(z80);
+    }
+
+    pthread_mutex_destroy(&tr->lock);
+    pthread_cond_destroy(&tr->ready);
+    pthread_cond_destroy(&tr->done);
+    free(tr->blocks[0]);
+    free(tr->blocks[1]);
+    tr->blocks[0] = tr->blocks[1] = NULL;
+    tr->file = NULL;
+    return error ? -1 : 0;
+}
+
+/*****************************************************************************/
+
+/** Reads a varint.
+ * @return 0 on success, or -1 at the end of the file.
+ */
+static int get_varint(gzFile file, uint64_t *val)
+{
+    *val = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int const c = gzgetc(file);
+        if (c < 0)
+            return -1;
+        *val |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static int get_bytes(gzFile file, uint8_t *buf, unsigned length)
+{
+    return gzread(file, buf, length) == (int)length ? 0 : -1;
+}
+
+static void set_misc(struct Z80 *z80, uint8_t i, uint8_t flags)
+{
+    z80->i = i;
+    z80->iff1 = flags & 1;
+    z80->iff2 = flags >> 1 & 1;
+    z80->halted = flags >> 2 & 1;
+    z80->interrupt_mode = flags >> 3 & 3;
+}
+
+int z80_trace_reader_open(struct Z80TraceReader *rd, char const *path)
+{
+    uint8_t header[sizeof(magic) + 2];
+    uint8_t state[2 + 2 * NUM_REGISTERS + 3 + 8];
+    uint8_t const *p = state;
+
+    memset(rd, 0, sizeof(*rd));
+    rd->file = gzopen(path, "rb");
+    if (!rd->file)
+        return -1;
+
+    if (get_bytes(rd->file, header, sizeof(header)) != 0
+        || memcmp(header, magic, sizeof(magic)) != 0
+        || header[sizeof(magic)] != TRACE_VERSION
+        || get_bytes(rd->file, state, sizeof(state)) != 0)
+        goto fail;
+
+    rd->z80.pc = p[0] | p[1] << 8;
+    p += 2;
+    for (size_t i = 0; i < NUM_REGISTERS; ++i, p += 2)
+        *reg(&rd->z80, i) = p[0] | p[1] << 8;
+    rd->z80.r = p[1];
+    set_misc(&rd->z80, p[0], p[2]);
+    p += 3;
+    for (int i = 0; i < 8; ++i)
+        rd->z80.cycles |= (uint64_t)p[i] << (8 * i);
+
+    if (header[sizeof(magic) + 1] & TRACE_HAS_MEMORY)
+    {
+        rd->memory = malloc(MEMORY_SIZE);
+        if (!rd->memory || get_bytes(rd->file, rd->memory, MEMORY_SIZE) != 0)
+            goto fail;
+    }
+    return 0;
+
+fail:
+    z80_trace_reader_close(rd);
+    return -1;
+}
+
+int z80_trace_next(struct Z80TraceReader *rd)
+{
+    uint64_t mask, pc_delta, cycles;
+    uint8_t buf[2 * NUM_REGISTERS + 2 + 3 * Z80_WRITE_LOG_SIZE];
+    uint8_t const *p = buf;
+    unsigned length = 0;
+    uint32_t writes;
+
+    if (get_varint(rd->file, &mask) != 0)
+        return 0;
+    writes = mask >> WRITES_SHIFT;
+    if (writes > Z80_WRITE_LOG_SIZE)
+        return -1;
+    if (get_varint(rd->file, &pc_delta) != 0 || get_varint(rd->file, &cycles) != 0)
+        return -1;
+
+    for (size_t i = 0; i < NUM_REGISTERS; ++i)
+        length += mask & (1u << i) ? 2 : 0;
+    length += mask & MISC_BIT ? 2 : 0;
+    length += 3 * writes;
+    if (get_bytes(rd->file, buf, length) != 0)
+        return -1;
+
+    rd->z80.pc += (uint16_t)((pc_delta >> 1) ^ -(pc_delta & 1));
+    rd->z80.cycles += cycles;
+    for (size_t i = 0; i < NUM_REGISTERS; ++i)
+    {
+        if (mask & (1u << i))
+        {
+            *reg(&rd->z80, i) = p[0] | p[1] << 8;
+            p += 2;
+        }
+    }
+    if (mask & MISC_BIT)
+    {
+        set_misc(&rd->z80, p[0], p[1]);
+        p += 2;
+    }
+
+    rd->writes.count = writes;
+    for (uint32_t i = 0; i < writes; ++i, p += 3)
+    {
+        rd->writes.addr[i] = p[0] | p[1] << 8;
+        rd->writes.value[i] = p[2];
+    }
+    for (uint32_t i = 0; rd->memory && i < writes; ++i)
+        rd->memory[rd->writes.addr[i]] = rd->writes.value[i];
+    return 1;
+}
+
+void z80_trace_reader_close(struct Z80TraceReader *rd)
+{
+    if (rd->file)
+        gzclose(rd->file);
+    free(rd->memory);
+    memset(rd, 0, sizeof(*rd));
+}
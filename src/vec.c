@@ -0,0 +1,209 @@
+#include "z80/vec.h"
+#include <string.h>
+
+/** Instances claimed by a thread at a time, enough to keep the threads off
+ * each other's cache lines without starving the last of them.
+ */
+#define CHUNK 8
+
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    struct Z80VecInstance const *inst = z80->userdata;
+    return inst->ports_in[port & 0xff];
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    struct Z80VecInstance *inst = z80->userdata;
+    inst->ports_out[port & 0xff] = val;
+}
+
+static struct Z80Bus const bus = {
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+static uint16_t reg_value(struct Z80 const *z80, int reg)
+{
+    switch (reg)
+    {
+        case Z80_VEC_PC: return z80->pc;
+        case Z80_VEC_SP: return z80->sp;
+        case Z80_VEC_AF: return z80->af;
+        case Z80_VEC_BC: return z80->bc;
+        case Z80_VEC_DE: return z80->de;
+        case Z80_VEC_HL: return z80->hl;
+        case Z80_VEC_IX: return z80->ix;
+        case Z80_VEC_IY: return z80->iy;
+        case Z80_VEC_AFP: return z80->afp;
+        case Z80_VEC_BCP: return z80->bcp;
+        case Z80_VEC_DEP: return z80->dep;
+        case Z80_VEC_HLP: return z80->hlp;
+        case Z80_VEC_IR: return (uint16_t)(z80->i << 8 | z80->r);
+        case Z80_VEC_STATUS: return (uint16_t)(z80->fault << 8 | (z80->halted != 0));
+        default: return 0;
+    }
+}
+
+static void observe(struct Z80Vec const *vec,
+                    struct Z80VecInstance const *inst,
+                    uint8_t *out)
+{
+    for (int reg = 0; reg < Z80_VEC_NUM_REGS; ++reg)
+    {
+        if (vec->registers & (1u << reg))
+        {
+            uint16_t const val = reg_value(&inst->z80, reg);
+            *out++ = val & 0xff;
+            *out++ = val >> 8;
+        }
+    }
+
+    // Read through the pages, which may be ROMs or shared with a parent.
+    z80_memory_read(&inst->mem, vec->window_addr, out, vec->window_length);
+}
+
+/** Runs chunks of the current batch until none are left.
+ */
+static void run_chunks(struct Z80Vec *vec)
+{
+    size_t const obs_size = z80_vec_obs_size(vec);
+    size_t start;
+
+    while ((start = atomic_fetch_add(&vec->next, CHUNK)) < vec->count)
+    {
+        size_t const end = start + CHUNK < vec->count ? start + CHUNK : vec->count;
+
+        for (size_t i = start; i < end; ++i)
+        {
+            struct Z80VecInstance *inst = &vec->instances[i];
+            z80_run(&inst->z80, inst->z80.cycles + vec->cycles);
+            if (vec->obs)
+                observe(vec, inst, vec->obs + i * obs_size);
+        }
+    }
+}
+
+static void *pool_thread(void *arg)
+{
+    struct Z80Vec *vec = arg;
+    uint64_t batch = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&vec->lock);
+        while (vec->batch == batch && !vec->stopping)
+            pthread_cond_wait(&vec->start, &vec->lock);
+        if (vec->stopping)
+        {
+            pthread_mutex_unlock(&vec->lock);
+            return NULL;
+        }
+        batch = vec->batch;
+        pthread_mutex_unlock(&vec->lock);
+
+        run_chunks(vec);
+
+        pthread_mutex_lock(&vec->lock);
+        if (--vec->pending == 0)
+            pthread_cond_signal(&vec->done);
+        pthread_mutex_unlock(&vec->lock);
+    }
+}
+
+/*****************************************************************************/
+
+void z80_vec_instance_init(struct Z80VecInstance *inst)
+{
+    memset(inst, 0, sizeof(*inst));
+    z80_init(&inst->z80);
+    inst->z80.bus = &bus;
+    inst->z80.userdata = inst;
+    z80_memory_init(&inst->mem, &inst->z80, inst->memory);
+}
+
+void z80_vec_init(struct Z80Vec *vec, int num_threads)
+{
+    memset(vec, 0, sizeof(*vec));
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > Z80_VEC_MAX_THREADS)
+        num_threads = Z80_VEC_MAX_THREADS;
+
+    vec->num_threads = num_threads;
+    atomic_init(&vec->next, 0);
+    pthread_mutex_init(&vec->lock, NULL);
+    pthread_cond_init(&vec->start, NULL);
+    pthread_cond_init(&vec->done, NULL);
+
+    // The caller is the first thread.
+    for (int i = 1; i < num_threads; ++i)
+        pthread_create(&vec->threads[i], NULL, pool_thread, vec);
+}
+
+void z80_vec_free(struct Z80Vec *vec)
+{
+    pthread_mutex_lock(&vec->lock);
+    vec->stopping = 1;
+    pthread_cond_broadcast(&vec->start);
+    pthread_mutex_unlock(&vec->lock);
+
+    for (int i = 1; i < vec->num_threads; ++i)
+        pthread_join(vec->threads[i], NULL);
+
+    pthread_cond_destroy(&vec->done);
+    pthread_cond_destroy(&vec->start);
+    pthread_mutex_destroy(&vec->lock);
+}
+
+void z80_vec_observe(struct Z80Vec *vec,
+                     uint32_t registers,
+                     uint16_t window_addr,
+                     uint16_t window_length)
+{
+    vec->registers = registers & ((1u << Z80_VEC_NUM_REGS) - 1);
+    vec->window_addr = window_addr;
+    vec->window_length = window_length;
+}
+
+size_t z80_vec_obs_size(struct Z80Vec const *vec)
+{
+    size_t size = vec->window_length;
+
+    for (int reg = 0; reg < Z80_VEC_NUM_REGS; ++reg)
+        size += (vec->registers & (1u << reg)) ? 2 : 0;
+
+    return size;
+}
+
+void z80_vec_run(struct Z80Vec *vec,
+                 struct Z80VecInstance *instances,
+                 size_t n,
+                 uint64_t cycles,
+                 uint8_t *obs_out)
+{
+    vec->instances = instances;
+    vec->count = n;
+    vec->cycles = cycles;
+    vec->obs = obs_out;
+    atomic_store(&vec->next, 0);
+
+    if (vec->num_threads == 1 || n <= CHUNK)
+    {
+        run_chunks(vec);
+        return;
+    }
+
+    pthread_mutex_lock(&vec->lock);
+    vec->pending = vec->num_threads - 1;
+    ++vec->batch;
+    pthread_cond_broadcast(&vec->start);
+    pthread_mutex_unlock(&vec->lock);
+
+    run_chunks(vec);
+
+    pthread_mutex_lock(&vec->lock);
+    while (vec->pending)
+        pthread_cond_wait(&vec->done, &vec->lock);
+    pthread_mutex_unlock(&vec->lock);
+}
@@ -1,8 +1,12 @@
 #include "z80/z80.h"
-#include <assert.h>
+#include "z80/codemap.h"
+#include "z80/coverage.h"
+#include "z80/memory.h"
+#include "z80/ports.h"
+#include "z80/profile.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 
 #define S_FLAG (1 << 7)
@@ -14,82 +18,46 @@
 #define N_FLAG (1 << 1)
 #define C_FLAG (1 << 0)
 
-/* clang-format off */
-
-static const uint8_t opcode_cycles[256]
-    = {4, 10, 7, 6, 4, 4, 7, 4, 4, 11, 7, 6, 4, 4, 7, 4,
-       8, 10, 7, 6, 4, 4, 7, 4, 12, 11, 7, 6, 4, 4, 7, 4,
-       7, 10, 16, 6, 4, 4, 7, 4, 7, 11, 16, 6, 4, 4, 7, 4,
-       7, 10, 16, 6, 11, 11, 10, 4, 7, 11, 13, 6, 4, 4, 7, 4,
-       4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
-       4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
-       4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
-       7, 7, 7, 7, 7, 7, 4, 7, 4, 4, 4, 4, 4, 4, 7, 4,
-       4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
-       4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
-       4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
-       4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
-       5, 10, 10, 10, 10, 11, 7, 11, 5, 10, 10, 0, 10, 17, 7, 11,
-       5, 10, 10, 11, 10, 11, 7, 11, 5, 4, 10, 11, 10, 0, 7, 11,
-       5, 10, 10, 19, 10, 11, 7, 11, 5, 4, 10, 4, 10, 0, 7, 11,
-       5, 10, 10, 4, 10, 11, 7, 11, 5, 6, 10, 4, 10, 0, 7, 11};
-
-static const uint8_t ed_opcode_cycles[256]
-    = {8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       12, 12, 15, 20, 8, 14, 8, 9, 12, 12, 15, 20, 8, 14, 8, 9,
-       12, 12, 15, 20, 8, 8, 8, 9, 12, 12, 15, 20, 8, 14, 8, 9,
-       12, 12, 15, 20, 8, 8, 8, 18, 12, 12, 15, 20, 8, 8, 8, 18,
-       12, 12, 15, 20, 8, 8, 8, 8, 12, 12, 15, 20, 8, 8, 8, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       16, 16, 16, 16, 8, 8, 8, 8, 16, 16, 16, 16, 8, 8, 8, 8,
-       16, 16, 16, 16, 8, 8, 8, 8, 16, 16, 16, 16, 8, 8, 8, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       16, 16, 16, 16, 8, 8, 8, 8, 16, 16, 16, 16, 8, 8, 8, 8,
-       16, 16, 16, 16, 8, 8, 8, 8, 16, 16, 16, 16, 8, 8, 8, 8};
-
-static const uint8_t index_opcode_cycles[256]
-    = {8, 8, 8, 8, 8, 8, 11, 8, 8, 15, 8, 8, 8, 8, 11, 8,
-       8, 8, 8, 8, 8, 8, 11, 8, 8, 15, 8, 8, 8, 8, 11, 8,
-       8, 14, 20, 10, 8, 8, 11, 8, 8, 15, 20, 10, 8, 8, 11, 8,
-       8, 8, 8, 8, 23, 23, 19, 8, 8, 15, 8, 8, 8, 8, 11, 8,
-       8, 8, 8, 8, 8, 8, 19, 8, 8, 8, 8, 8, 8, 8, 19, 8,
-       8, 8, 8, 8, 8, 8, 19, 8, 8, 8, 8, 8, 8, 8, 19, 8,
-       8, 8, 8, 8, 8, 8, 19, 8, 8, 8, 8, 8, 8, 8, 19, 8,
-       19, 19, 19, 19, 19, 19, 8, 19, 8, 8, 8, 8, 8, 8, 19, 8,
-       8, 8, 8, 8, 8, 8, 19, 8, 8, 8, 8, 8, 8, 8, 19, 8,
-       8, 8, 8, 8, 8, 8, 19, 8, 8, 8, 8, 8, 8, 8, 19, 8,
-       8, 8, 8, 8, 8, 8, 19, 8, 8, 8, 8, 8, 8, 8, 19, 8,
-       8, 8, 8, 8, 8, 8, 19, 8, 8, 8, 8, 8, 8, 8, 19, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       8, 14, 8, 23, 8, 15, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-       8, 8, 8, 8, 8, 8, 8, 8, 8, 10, 8, 8, 8, 8, 8, 8};
-
-/* clang-format on */
-
-static uint8_t set(uint8_t byte, uint8_t bits)
-{
-    return byte | bits;
-}
-
-static uint8_t reset(uint8_t byte, uint8_t bits)
-{
-    return byte & ~bits;
-}
-
-static uint8_t mask(uint8_t byte, uint8_t bits, int condition)
-{
-    return condition ? set(byte, bits) : reset(byte, bits);
+/* Bits of Z80::pending. */
+#define PENDING_DATA 0xffu
+#define PENDING_IRQ (1u << 8)
+#define PENDING_NMI (1u << 9)
+#define PENDING_STOP (1u << 10)
+#define PENDING_INTERRUPTS (PENDING_IRQ | PENDING_NMI)
+
+/* Cycle tables generated from src/opcodes/opcodes.in. */
+#include "z80-cycles.inc"
+
+#ifdef Z80_CODEMAP
+/** Records an access to a byte in the code/data map, if one is attached.
+ * Compiled in only with Z80_CODEMAP, so that the core otherwise pays nothing
+ * for telling fetches from data.
+ */
+static void record(struct Z80 *z80, uint16_t const addr, uint8_t const flag)
+{
+    if (z80->hooks & Z80_HOOK_CODEMAP)
+        z80->codemap->flags[addr] |= flag;
+}
+#else
+#define record(z80, addr, flag) ((void)0)
+#endif
+
+/** Reads a byte without recording how it was used, for fetches, which
+ * record it themselves, and for reading ahead.
+ */
+static uint8_t loadb(struct Z80 *z80, uint16_t const addr)
+{
+    struct Z80Memory const *mem = z80->memory;
+    if (mem)
+        return mem->pages[addr >> Z80_PAGE_BITS][addr & Z80_PAGE_MASK];
+
+    return z80->bus->mem_load(z80, addr);
 }
 
 static uint8_t readb(struct Z80 *z80, uint16_t const addr)
 {
-    return z80->mem_load(z80, addr);
+    record(z80, addr, Z80_CODEMAP_READ);
+    return loadb(z80, addr);
 }
 
 static uint16_t readw(struct Z80 *z80, uint16_t const addr)
@@ -97,9 +65,45 @@ static uint16_t readw(struct Z80 *z80, uint16_t const addr)
     return readb(z80, addr) + (readb(z80, addr + 1) << 8);
 }
 
+/** Appends a memory write to the attached write log.
+ */
+static void log_write(struct Z80 *z80, uint16_t const addr, uint8_t const value)
+{
+    struct Z80WriteLog *log = z80->write_log;
+    if (log->count < Z80_WRITE_LOG_SIZE)
+    {
+        log->addr[log->count] = addr;
+        log->value[log->count] = value;
+    }
+    ++log->count;
+}
+
 static void writeb(struct Z80 *z80, uint16_t const addr, uint8_t const value)
 {
-    z80->mem_store(z80, addr, value);
+    struct Z80Memory *mem = z80->memory;
+    record(z80, addr, Z80_CODEMAP_WRITE);
+    z80->wrote = 1;
+    if (mem)
+    {
+        uint64_t const bit = (uint64_t)1 << (addr >> Z80_PAGE_BITS);
+        if ((mem->shared & bit)
+            && !z80_memory_unshare(mem, addr >> Z80_PAGE_BITS))
+            return;
+
+        // Logged only once it is certain to land, so that replays match.
+        if (z80->hooks & Z80_HOOK_WRITE_LOG)
+            log_write(z80, addr, value);
+
+        if (mem->hashing)
+            z80_memory_hash_write(mem, addr, value);
+        mem->dirty |= bit;
+        mem->pages[addr >> Z80_PAGE_BITS][addr & Z80_PAGE_MASK] = value;
+        return;
+    }
+
+    if (z80->hooks & Z80_HOOK_WRITE_LOG)
+        log_write(z80, addr, value);
+    z80->bus->mem_store(z80, addr, value);
 }
 
 static void writew(struct Z80 *z80, uint16_t const addr, uint16_t const value)
@@ -108,16 +112,27 @@ static void writew(struct Z80 *z80, uint16_t const addr, uint16_t const value)
     writeb(z80, addr + 1, value >> 8);
 }
 
+/** Fetches an opcode, or a prefix.
+ */
+static uint8_t fetchb(struct Z80 *z80)
+{
+    record(z80, z80->pc, Z80_CODEMAP_OPCODE);
+    return loadb(z80, z80->pc++);
+}
+
+/** Reads an operand byte from the current instruction.
+ */
 static uint8_t instrb(struct Z80 *z80)
 {
-    return readb(z80, z80->pc++);
+    record(z80, z80->pc, Z80_CODEMAP_OPERAND);
+    return loadb(z80, z80->pc++);
 }
 
 /** Reads a displacement byte from the current instruction.
  * */
 static int8_t dispb(struct Z80 *z80)
 {
-    return (int8_t)readb(z80, z80->pc++);
+    return (int8_t)instrb(z80);
 }
 
 static uint16_t instrw(struct Z80 *z80)
@@ -130,9 +145,17 @@ static uint8_t szflags(uint8_t const val)
     return val ? (val & S_FLAG) : Z_FLAG;
 }
 
+/** The undocumented X and Y flags, which are copies of bits 5 and 3 of `val`.
+ * At Z80_ACCURACY_FAST they are left clear.
+ */
 static uint8_t xyflags(uint8_t const val)
 {
+#ifdef Z80_ACCURACY_FAST
+    (void)val;
+    return 0;
+#else
     return val & (X_FLAG | Y_FLAG);
+#endif
 }
 
 static uint8_t parity(uint8_t const val)
@@ -289,11 +312,31 @@ static void jr(struct Z80 *z80, int test)
     }
 }
 
-static void call(struct Z80 *z80)
+
+/** Tells the profiler, if any, that a return has just popped its address.
+ */
+static void profile_return(struct Z80 *z80)
 {
-    uint16_t const addr = instrw(z80);
-    push(z80, z80->pc);
+    if (z80->hooks & Z80_HOOK_PROFILE)
+        z80_profile_return(z80->profile, z80->sp);
+}
+
+/** Pushes the return address and jumps, as calls, restarts and interrupts
+ * do, telling the profiler, if any.
+ */
+static void call_addr(struct Z80 *z80, uint16_t const addr)
+{
+    uint16_t const from = z80->pc;
+
+    push(z80, from);
     z80->pc = addr;
+    if (z80->hooks & Z80_HOOK_PROFILE)
+        z80_profile_call(z80->profile, addr, from, z80->sp);
+}
+
+static void call(struct Z80 *z80)
+{
+    call_addr(z80, instrw(z80));
 }
 
 static void callc(struct Z80 *z80, int test)
@@ -301,29 +344,53 @@ static void callc(struct Z80 *z80, int test)
     uint16_t const addr = instrw(z80);
     if (test)
     {
-        push(z80, z80->pc);
-        z80->pc = addr;
+        call_addr(z80, addr);
         z80->cycles += 7;
     }
 }
 
+static void ret(struct Z80 *z80)
+{
+    z80->pc = pop(z80);
+    profile_return(z80);
+}
+
 static void retc(struct Z80 *z80, int test)
 {
     if (test)
     {
-        z80->pc = pop(z80);
+        ret(z80);
         z80->cycles += 6;
     }
 }
 
 static uint8_t in(struct Z80 *z80, uint16_t const port)
 {
-    return z80->port_load(z80, port);
+    z80->polled = 1;
+    if (z80->hooks & Z80_HOOK_PORTS)
+    {
+        struct Z80Port const *entry = &z80->ports->entries[port & 0xff];
+        if (entry->constant)
+            return entry->value;
+        if (entry->load)
+            return entry->load(z80, port, entry->userdata);
+    }
+    return z80->bus->port_load(z80, port);
 }
 
 static void out(struct Z80 *z80, uint16_t const port, uint8_t const val)
 {
-    z80->port_store(z80, port, val);
+    z80->wrote = 1;
+    if (z80->hooks & Z80_HOOK_PORTS)
+    {
+        struct Z80Port const *entry = &z80->ports->entries[port & 0xff];
+        if (entry->store)
+        {
+            entry->store(z80, port, val, entry->userdata);
+            return;
+        }
+    }
+    z80->bus->port_store(z80, port, val);
 }
 
 static void ldd(struct Z80 *z80)
@@ -336,7 +403,7 @@ static void ldd(struct Z80 *z80)
     --z80->bc;
 
     z80->f &= ~(X_FLAG | H_FLAG | Y_FLAG | P_FLAG | N_FLAG);
-    z80->f |= ((result & 0x02) << 4) | result & 0x08;
+    z80->f |= xyflags(((result & 0x02) << 4) | (result & 0x08));
     if (z80->bc > 0)
         z80->f |= P_FLAG;
 }
@@ -361,7 +428,7 @@ static void ldi(struct Z80 *z80)
     --z80->bc;
 
     z80->f &= ~(X_FLAG | H_FLAG | Y_FLAG | P_FLAG | N_FLAG);
-    z80->f |= ((result & 0x02) << 4) | result & 0x08;
+    z80->f |= xyflags(((result & 0x02) << 4) | (result & 0x08));
     if (z80->bc > 0)
         z80->f |= P_FLAG;
 }
@@ -505,9 +572,7 @@ static void cpd(struct Z80 *z80)
     if (z80->bc > 0)
         z80->f |= P_FLAG;
 
-    z80->f |= (result & Y_FLAG);
-    if (result & 0x02)
-        z80->f |= X_FLAG;
+    z80->f |= xyflags(((result & 0x02) << 4) | (result & Y_FLAG));
 }
 
 static void cpdr(struct Z80 *z80)
@@ -537,9 +602,7 @@ static void cpi(struct Z80 *z80)
     if (z80->bc > 0)
         z80->f |= P_FLAG;
 
-    z80->f |= (result & Y_FLAG);
-    if (result & 0x02)
-        z80->f |= X_FLAG;
+    z80->f |= xyflags(((result & 0x02) << 4) | (result & Y_FLAG));
 }
 
 static void cpir(struct Z80 *z80)
@@ -726,7 +789,7 @@ static void cpl(struct Z80 *z80)
 {
     z80->a = ~z80->a;
     z80->f &= ~(X_FLAG | Y_FLAG);
-    z80->f |= (H_FLAG | N_FLAG) | (z80->a & (X_FLAG | Y_FLAG));
+    z80->f |= (H_FLAG | N_FLAG) | xyflags(z80->a);
 }
 
 static void ccf(struct Z80 *z80)
@@ -734,13 +797,13 @@ static void ccf(struct Z80 *z80)
     uint8_t prev_carry = (z80->f & C_FLAG) << 4;
     z80->f ^= C_FLAG;
     z80->f &= ~(N_FLAG | H_FLAG | X_FLAG | Y_FLAG);
-    z80->f |= prev_carry | (z80->a & (X_FLAG | Y_FLAG));
+    z80->f |= prev_carry | xyflags(z80->a);
 }
 
 static void scf(struct Z80 *z80)
 {
     z80->f &= ~(H_FLAG | N_FLAG | X_FLAG | Y_FLAG);
-    z80->f |= C_FLAG | (z80->a & (X_FLAG | Y_FLAG));
+    z80->f |= C_FLAG | xyflags(z80->a);
 }
 
 static uint8_t inbc(struct Z80 *z80)
@@ -751,9 +814,145 @@ static uint8_t inbc(struct Z80 *z80)
     return val;
 }
 
+/** Records a fault. Only the first fault is kept, so that the host sees the
+ * original cause rather than any knock-on effects. A fault raised part way
+ * through an instruction is moved to its first byte once it has been
+ * executed; see step.
+ */
+static void fault(struct Z80 *z80, uint8_t const code)
+{
+    if (z80->fault == Z80_FAULT_NONE)
+    {
+        z80->fault = code;
+        z80->fault_pc = z80->pc;
+    }
+}
+
+#ifdef Z80_COVERAGE
+static struct Z80CoverageEntry coverage[Z80_COVERAGE_TABLES][256];
+
+/** Records an executed opcode, and the flags it left behind.
+ */
+static void cover(struct Z80 const *z80, int const table, uint8_t const opcode)
+{
+    struct Z80CoverageEntry *entry = &coverage[table][opcode];
+
+    if (z80->fault)
+        return;
+
+    ++entry->count;
+    entry->flags_set |= z80->f;
+    entry->flags_clear |= (uint8_t)~z80->f;
+}
+#else
+#define cover(z80, table, opcode) ((void)0)
+#endif
+
+/** Counts an opcode fetch in the refresh register. At Z80_ACCURACY_FAST, R
+ * only changes when written.
+ */
 static void incr(struct Z80 *z80)
 {
+#ifdef Z80_ACCURACY_FAST
+    (void)z80;
+#else
     z80->r = (z80->r & 0x80) | ((z80->r & 0x7F) + 1);
+#endif
+}
+
+/* Opcodes decode into the fields x (bits 7-6), y (bits 5-3) and z (bits
+ * 2-0). Where y or z names an 8-bit register, it indexes reg_offsets, with 6
+ * standing for (hl). */
+static size_t const reg_offsets[8] = {offsetof(struct Z80, b),
+                                      offsetof(struct Z80, c),
+                                      offsetof(struct Z80, d),
+                                      offsetof(struct Z80, e),
+                                      offsetof(struct Z80, h),
+                                      offsetof(struct Z80, l),
+                                      0,
+                                      offsetof(struct Z80, a)};
+
+static uint8_t *reg8(struct Z80 *z80, uint8_t const r)
+{
+    return (uint8_t *)z80 + reg_offsets[r];
+}
+
+static uint8_t get_r(struct Z80 *z80, uint8_t const r)
+{
+    return r == 6 ? readb(z80, z80->hl) : *reg8(z80, r);
+}
+
+static void set_r(struct Z80 *z80, uint8_t const r, uint8_t const val)
+{
+    if (r == 6)
+        writeb(z80, z80->hl, val);
+    else
+        *reg8(z80, r) = val;
+}
+
+/** The eight ALU operations on A, selected by y.
+ */
+static void alu(struct Z80 *z80, uint8_t const y, uint8_t const val)
+{
+    switch (y)
+    {
+        case 0: z80->a = addb(z80, z80->a, val, 0); break;               // add
+        case 1: z80->a = addb(z80, z80->a, val, z80->f & C_FLAG); break; // adc
+        case 2: z80->a = subb(z80, z80->a, val, 0); break;               // sub
+        case 3: z80->a = subb(z80, z80->a, val, z80->f & C_FLAG); break; // sbc
+        case 4: and(z80, val); break;                                    // and
+        case 5: xor(z80, val); break;                                    // xor
+        case 6: or (z80, val); break;                                    // or
+        case 7: cp(z80, val); break;                                     // cp
+    }
+}
+
+/** The CB-prefixed rotations and shifts, selected by y. */
+static uint8_t (*const rotations[8])(struct Z80 *, uint8_t)
+    = {rlc, rrc, rl, rr, sla, sra, sll, srl};
+
+static void ex_af(struct Z80 *z80)
+{
+    uint16_t const af = z80->af;
+    z80->af = z80->afp;
+    z80->afp = af;
+}
+
+static void exx(struct Z80 *z80)
+{
+    uint16_t const bc = z80->bc;
+    uint16_t const de = z80->de;
+    uint16_t const hl = z80->hl;
+    z80->bc = z80->bcp;
+    z80->de = z80->dep;
+    z80->hl = z80->hlp;
+    z80->bcp = bc;
+    z80->dep = de;
+    z80->hlp = hl;
+}
+
+static void ex_de_hl(struct Z80 *z80)
+{
+    uint16_t const de = z80->de;
+    z80->de = z80->hl;
+    z80->hl = de;
+}
+
+/** Swaps `val` with the word on top of the stack.
+ * @return The word which was on the stack.
+ */
+static uint16_t ex_sp(struct Z80 *z80, uint16_t const val)
+{
+    uint16_t const top = readw(z80, z80->sp);
+    writew(z80, z80->sp, val);
+    return top;
+}
+
+static void ei(struct Z80 *z80)
+{
+    z80->iff1 = z80->iff2 = 1;
+    if (z80->interrupt_delay == 0)
+        z80->interrupt_delay = 2;
 }
 
 static void exec_instr(struct Z80 *z80, uint8_t const opcode);
@@ -776,28 +975,65 @@ static void handle_interrupts(struct Z80 *z80, uint8_t const data)
 
             case 1: {
                 z80->cycles += 13;
-                push(z80, z80->pc);
-                z80->pc = 0x38;
+                call_addr(z80, 0x38);
                 break;
             }
 
             case 2: {
                 z80->cycles += 19;
-                push(z80, z80->pc);
-                z80->pc = readw(z80, ((z80->i << 8) | data) & 0xFFFE);
+                call_addr(z80, readw(z80, ((z80->i << 8) | data) & 0xFFFE));
                 break;
             }
         }
     }
 }
 
+static void handle_nmi(struct Z80 *z80)
+{
+    z80->halted = 0;
+    z80->iff1 = 0;
+    z80->cycles += 11;
+    call_addr(z80, 0x66);
+}
+
+/** Takes those interrupts raised through Z80::pending which can be taken.
+ * Called at instruction boundaries, once a relaxed load has found any.
+ */
+static void take_pending(struct Z80 *z80)
+{
+    unsigned const pending = atomic_load_explicit(&z80->pending, memory_order_relaxed);
+
+    if (pending & PENDING_NMI)
+    {
+        atomic_fetch_and_explicit(&z80->pending, ~PENDING_NMI, memory_order_acquire);
+        handle_nmi(z80);
+    }
+    else if ((pending & PENDING_IRQ) && z80->iff1 && !z80->interrupt_delay)
+    {
+        // The interrupt may have been cleared since it was seen.
+        unsigned const taken = atomic_fetch_and_explicit(
+            &z80->pending, ~(PENDING_IRQ | PENDING_DATA), memory_order_acquire);
+        if (taken & PENDING_IRQ)
+            handle_interrupts(z80, taken & PENDING_DATA);
+    }
+}
+
+/** Checks whether an interrupt raised from another thread would be taken
+ * now.
+ */
+static int can_take_pending(struct Z80 *z80)
+{
+    unsigned const pending = atomic_load_explicit(&z80->pending, memory_order_relaxed);
+    return (pending & PENDING_NMI) || ((pending & PENDING_IRQ) && z80->iff1);
+}
+
 static void exec_indexcb_instr(struct Z80 *z80, uint8_t const sel)
 {
     uint16_t *reg = sel == 0xdd ? &z80->ix : &z80->iy;
-    uint16_t const addr = *reg + (int8_t)instrb(z80);
-    uint8_t const opcode = instrb(z80);
+    uint16_t const addr = *reg + dispb(z80);
+    uint8_t const opcode = fetchb(z80);
 
-    uint8_t val = readw(z80, addr);
+    uint8_t val = readb(z80, addr);
 
     uint8_t const op = opcode >> 6;
     uint8_t const type = (opcode >> 3) & 0x7;
@@ -806,17 +1042,7 @@ static void exec_indexcb_instr(struct Z80 *z80, uint8_t const sel)
     {
         case 0x00: // rotation
         {
-            switch (type)
-            {
-                case 0x00: val = rlc(z80, val); break; // rlc
-                case 0x01: val = rrc(z80, val); break; // rrc
-                case 0x02: val = rl(z80, val); break;  // rl
-                case 0x03: val = rr(z80, val); break;  // rr
-                case 0x04: val = sla(z80, val); break; // sla
-                case 0x05: val = sra(z80, val); break; // sra
-                case 0x06: val = sll(z80, val); break; // sll
-                case 0x07: val = srl(z80, val); break; // srl
-            }
+            val = rotations[type](z80, val);
             break;
         }
         case 0x01: // bit
@@ -843,20 +1069,14 @@ static void exec_indexcb_instr(struct Z80 *z80, uint8_t const sel)
 
     if (op != 0x01)
     {
-        switch (dest)
-        {
-            case 0x00: z80->b = val; break;
-            case 0x01: z80->c = val; break;
-            case 0x02: z80->d = val; break;
-            case 0x03: z80->e = val; break;
-            case 0x04: z80->h = val; break;
-            case 0x05: z80->l = val; break;
-            case 0x06: writeb(z80, addr, val); break;
-            case 0x07: z80->a = val; break;
-        }
+        if (dest == 0x06)
+            writeb(z80, addr, val);
+        else
+            *reg8(z80, dest) = val;
     }
 
-    z80->cycles += (op == 0x01 ? 20 : 23);
+    z80->cycles += indexcb_opcode_cycles[opcode];
+    cover(z80, sel == 0xdd ? Z80_COVERAGE_DDCB : Z80_COVERAGE_FDCB, opcode);
 }
 
 static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const opcode)
@@ -885,12 +1105,12 @@ static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const o
         case 0x2e: *l = instrb(z80); break;                // ld i*l, n
         case 0x34: {                                       // inc (i* + d)
             uint16_t addr = *reg + dispb(z80);
-            writeb(z80, addr, incb(z80, readw(z80, addr)));
+            writeb(z80, addr, incb(z80, readb(z80, addr)));
             break;
         }
         case 0x35: { // dec (i* + d)
             uint16_t addr = *reg + dispb(z80);
-            writeb(z80, addr, decb(z80, readw(z80, addr)));
+            writeb(z80, addr, decb(z80, readb(z80, addr)));
             break;
         }
         case 0x36: {
@@ -903,22 +1123,22 @@ static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const o
         case 0x44: z80->b = *reg >> 8; break;   // ld b, i*h
         case 0x45: z80->b = *reg & 0xff; break; // ld b, i*l
         case 0x46:
-            z80->b = readw(z80, *reg + dispb(z80));
+            z80->b = readb(z80, *reg + dispb(z80));
             break;                              // ld b, (i* + d)
         case 0x4c: z80->c = *reg >> 8; break;   // ld c, i*h
         case 0x4d: z80->c = *reg & 0xff; break; // ld c, i*l
         case 0x4e:
-            z80->c = readw(z80, *reg + dispb(z80));
+            z80->c = readb(z80, *reg + dispb(z80));
             break;                              // ld c, (i* + d)
         case 0x54: z80->d = *reg >> 8; break;   // ld d, i*h
         case 0x55: z80->d = *reg & 0xff; break; // ld d, i*l
         case 0x56:
-            z80->d = readw(z80, *reg + dispb(z80));
+            z80->d = readb(z80, *reg + dispb(z80));
             break;                              // ld d, (i* + d)
         case 0x5c: z80->e = *reg >> 8; break;   // ld e, i*h
         case 0x5d: z80->e = *reg & 0xff; break; // ld e, i*l
         case 0x5e:
-            z80->e = readw(z80, *reg + dispb(z80));
+            z80->e = readb(z80, *reg + dispb(z80));
             break;                     // ld e, (i* + d)
         case 0x60: *h = z80->b; break; // ld i*h, b
         case 0x61: *h = z80->c; break; // ld i*h, c
@@ -927,7 +1147,7 @@ static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const o
         case 0x64: *h = *h; break;     // ld i*h, i*h
         case 0x65: *h = *l; break;     // ld i*h, i*l
         case 0x66:
-            z80->h = readw(z80, *reg + dispb(z80));
+            z80->h = readb(z80, *reg + dispb(z80));
             break;                     // ld h, (i* + d)
         case 0x67: *h = z80->a; break; // ld i*h, a
         case 0x68: *l = z80->b; break; // ld i*l, b
@@ -937,7 +1157,7 @@ static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const o
         case 0x6c: *l = *h; break;     // ld i*l, i*l
         case 0x6d: *l = *l; break;     // ld i*l, i*l
         case 0x6e:
-            z80->l = readw(z80, *reg + dispb(z80));
+            z80->l = readb(z80, *reg + dispb(z80));
             break;                     // ld l, (i* + d)
         case 0x6f: *l = z80->a; break; // ld i*l, a
         case 0x70:
@@ -962,7 +1182,7 @@ static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const o
             writeb(z80, *reg + dispb(z80), z80->a);
             break; // ld (i* + d), a
         case 0x7e:
-            z80->a = readw(z80, *reg + dispb(z80));
+            z80->a = readb(z80, *reg + dispb(z80));
             break;                              // ld a, (i* + d)
         case 0x7c: z80->a = *reg >> 8; break;   // ld a, (i*h)
         case 0x7d: z80->a = *reg & 0xff; break; // ld a, (i*l)
@@ -971,7 +1191,7 @@ static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const o
             break;                                             // add a, i*h
         case 0x85: z80->a = addb(z80, z80->a, *reg, 0); break; // add a, i*l
         case 0x86:
-            z80->a = addb(z80, z80->a, readw(z80, *reg + dispb(z80)), 0);
+            z80->a = addb(z80, z80->a, readb(z80, *reg + dispb(z80)), 0);
             break; // add a, (i* + d)
         case 0x8c:
             z80->a = addb(z80, z80->a, *reg >> 8, z80->f & C_FLAG);
@@ -980,14 +1200,14 @@ static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const o
             z80->a = addb(z80, z80->a, *reg, z80->f & C_FLAG);
             break; // adc a, i*l
         case 0x8e:
-            z80->a = addb(z80, z80->a, readw(z80, *reg + dispb(z80)), z80->f & C_FLAG);
+            z80->a = addb(z80, z80->a, readb(z80, *reg + dispb(z80)), z80->f & C_FLAG);
             break; // adc a, (i* + d)
         case 0x94:
             z80->a = subb(z80, z80->a, *reg >> 8, 0);
             break;                                             // sub a, i*h
         case 0x95: z80->a = subb(z80, z80->a, *reg, 0); break; // sub a, i*l
         case 0x96:
-            z80->a = subb(z80, z80->a, readw(z80, *reg + dispb(z80)), 0);
+            z80->a = subb(z80, z80->a, readb(z80, *reg + dispb(z80)), 0);
             break; // sub a, (i* + d)
         case 0x9c:
             z80->a = subb(z80, z80->a, *reg >> 8, z80->f & C_FLAG);
@@ -996,33 +1216,28 @@ static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const o
             z80->a = subb(z80, z80->a, *reg, z80->f & C_FLAG);
             break; // sbc a, i*l
         case 0x9e:
-            z80->a = subb(z80, z80->a, readw(z80, *reg + dispb(z80)), z80->f & C_FLAG);
+            z80->a = subb(z80, z80->a, readb(z80, *reg + dispb(z80)), z80->f & C_FLAG);
             break;                             // sbc a, (i* + d)
         case 0xa4: and(z80, *reg >> 8); break; // and i*h
         case 0xa5: and(z80, *reg); break;      // and i*l
         case 0xa6:
-            and(z80, readw(z80, *reg + dispb(z80)));
+            and(z80, readb(z80, *reg + dispb(z80)));
             break;                             // and (i* + d)
         case 0xac: xor(z80, *reg >> 8); break; // xor i*h
         case 0xad: xor(z80, *reg); break;      // xor i*l
         case 0xae:
-            xor(z80, readw(z80, *reg + dispb(z80)));
+            xor(z80, readb(z80, *reg + dispb(z80)));
             break;                             // xor (i* + d)
         case 0xb4: or (z80, *reg >> 8); break; // or i*h
         case 0xb5: or (z80, *reg); break;      // or i*l
         case 0xb6:
-            or (z80, readw(z80, *reg + dispb(z80)));
+            or (z80, readb(z80, *reg + dispb(z80)));
             break;                                                // or (i* + d)
         case 0xbc: cp(z80, *reg >> 8); break;                     // cp i*h
         case 0xbd: cp(z80, *reg); break;                          // cp i*l
-        case 0xbe: cp(z80, readw(z80, *reg + dispb(z80))); break; // cp (i* + d)
+        case 0xbe: cp(z80, readb(z80, *reg + dispb(z80))); break; // cp (i* + d)
         case 0xe1: *reg = pop(z80); break;                        // pop i*
-        case 0xe3: {
-            uint16_t tmp = *reg;
-            *reg = readw(z80, z80->sp);
-            writew(z80, z80->sp, tmp);
-            break;
-        }                                  // ex (sp), i*
+        case 0xe3: *reg = ex_sp(z80, *reg); break;                // ex (sp), i*
         case 0xe5: push(z80, *reg); break; // push i*
         case 0xe9: z80->pc = *reg; break;  // jp (i*)
         case 0xf9: z80->sp = *reg; break;  // ld sp, i*
@@ -1032,10 +1247,12 @@ static void exec_index_instr(struct Z80 *z80, uint8_t const sel, uint8_t const o
         default:
             z80->cycles += 4;
             exec_instr(z80, opcode);
+            cover(z80, sel == 0xdd ? Z80_COVERAGE_DD : Z80_COVERAGE_FD, opcode);
             return; // nop
     }
 
     z80->cycles += index_opcode_cycles[opcode];
+    cover(z80, sel == 0xdd ? Z80_COVERAGE_DD : Z80_COVERAGE_FD, opcode);
 }
 
 static void exec_cb_instr(struct Z80 *z80, uint8_t const opcode)
@@ -1047,33 +1264,13 @@ static void exec_cb_instr(struct Z80 *z80, uint8_t const opcode)
 
     incr(z80);
 
-    switch (dest)
-    {
-        case 0x00: val = z80->b; break;
-        case 0x01: val = z80->c; break;
-        case 0x02: val = z80->d; break;
-        case 0x03: val = z80->e; break;
-        case 0x04: val = z80->h; break;
-        case 0x05: val = z80->l; break;
-        case 0x06: val = readb(z80, z80->hl); break;
-        case 0x07: val = z80->a; break;
-    }
+    val = get_r(z80, dest);
 
     switch (op)
     {
         case 0x00: // rotation
         {
-            switch (type)
-            {
-                case 0x00: val = rlc(z80, val); break; // rlc
-                case 0x01: val = rrc(z80, val); break; // rrc
-                case 0x02: val = rl(z80, val); break;  // rl
-                case 0x03: val = rr(z80, val); break;  // rr
-                case 0x04: val = sla(z80, val); break; // sla
-                case 0x05: val = sra(z80, val); break; // sra
-                case 0x06: val = sll(z80, val); break; // sll
-                case 0x07: val = srl(z80, val); break; // srl
-            }
+            val = rotations[type](z80, val);
             break;
         }
         case 0x01: // bit
@@ -1099,25 +1296,11 @@ static void exec_cb_instr(struct Z80 *z80, uint8_t const opcode)
     }
 
     if (op != 0x01)
-    {
-        switch (dest)
-        {
-            case 0x00: z80->b = val; break;
-            case 0x01: z80->c = val; break;
-            case 0x02: z80->d = val; break;
-            case 0x03: z80->e = val; break;
-            case 0x04: z80->h = val; break;
-            case 0x05: z80->l = val; break;
-            case 0x06: writeb(z80, z80->hl, val); break;
-            case 0x07: z80->a = val; break;
-        }
+        set_r(z80, dest, val);
 
-        z80->cycles += (dest == 0x06 ? 15 : 8);
-    }
-    else
-    {
-        z80->cycles += (dest == 0x06 ? 12 : 8);
-    }
+    z80->cycles += cb_opcode_cycles[opcode];
+
+    cover(z80, Z80_COVERAGE_CB, opcode);
 }
 
 static void exec_ed_instr(struct Z80 *z80, uint8_t const opcode)
@@ -1138,7 +1321,7 @@ static void exec_ed_instr(struct Z80 *z80, uint8_t const opcode)
         case 0x65:
         case 0x75:
         case 0x7d:
-            z80->pc = pop(z80);
+            ret(z80);
             z80->iff1 = z80->iff2;
             break; // retn
         case 0x46:
@@ -1152,7 +1335,7 @@ static void exec_ed_instr(struct Z80 *z80, uint8_t const opcode)
         case 0x4b: z80->bc = readw(z80, instrw(z80)); break; // ld bc, (nn)
         case 0x4d:
         case 0x5d:
-        case 0x6d: z80->pc = pop(z80); break; // reti
+        case 0x6d: ret(z80); break; // reti
         case 0x4e:
         case 0x6e: z80->interrupt_mode = 0; break;   // im 0/1 [undoc]
         case 0x4f: z80->r = z80->a; break;           // ld r, a
@@ -1234,396 +1417,70 @@ static void exec_ed_instr(struct Z80 *z80, uint8_t const opcode)
         case 0xba: indr(z80); break; // indr
         case 0xbb: otdr(z80); break; // otdr
 
-        default:
-            printf("unimplemented opcode 0xed%02X at %x\n", opcode, z80->pc - 1);
-            assert(0);
-            exit(EXIT_FAILURE);
-            break;
+        default: fault(z80, Z80_FAULT_ILLEGAL_OPCODE); break;
     }
 
     z80->cycles += ed_opcode_cycles[opcode];
+    cover(z80, Z80_COVERAGE_ED, opcode);
 }
 
 static void exec_instr(struct Z80 *z80, uint8_t const opcode)
 {
+    // Handlers generated from src/opcodes/opcodes.in, specialized for each
+    // opcode.
     switch (opcode)
     {
-        case 0x00: break;                               // nop
-        case 0x01: z80->bc = instrw(z80); break;        // ld bc, nn
-        case 0x02: writeb(z80, z80->bc, z80->a); break; // ld (bc), a
-        case 0x03: ++z80->bc; break;                    // inc bc
-        case 0x04: z80->b = incb(z80, z80->b); break;   // inc b
-        case 0x05: z80->b = decb(z80, z80->b); break;   // dec b
-        case 0x06: z80->b = instrb(z80); break;         // ld b, n
-        case 0x07: rlca(z80); break;                    // rcla
-        case 0x08: {
-            uint16_t const af = z80->af;
-            z80->af = z80->afp;
-            z80->afp = af;
-            break;
-        }                                                        // ex af, af'
-        case 0x09: z80->hl = addw(z80, z80->hl, z80->bc); break; // add hl, bc
-        case 0x0a: z80->a = readb(z80, z80->bc); break;          // ld a, (bc)
-        case 0x0b: --z80->bc; break;                             // dec bc
-        case 0x0c: z80->c = incb(z80, z80->c); break;            // inc c
-        case 0x0d: z80->c = decb(z80, z80->c); break;            // dec c
-        case 0x0e: z80->c = instrb(z80); break;                  // ld c, n
-        case 0x0f: rrca(z80); break;                             // rrca
-        case 0x10:
-            --z80->b;
-            jr(z80, z80->b);
-            break;                                               // djnz d
-        case 0x11: z80->de = instrw(z80); break;                 // ld de, nn
-        case 0x12: writeb(z80, z80->de, z80->a); break;          // ld (de), a
-        case 0x13: ++z80->de; break;                             // inc de
-        case 0x14: z80->d = incb(z80, z80->d); break;            // inc d
-        case 0x15: z80->d = decb(z80, z80->d); break;            // dec d
-        case 0x16: z80->d = instrb(z80); break;                  // ld d, n
-        case 0x17: rla(z80); break;                              // rla
-        case 0x18: jr(z80, 1); break;                            // jr d
-        case 0x19: z80->hl = addw(z80, z80->hl, z80->de); break; // add hl, de
-        case 0x1a: z80->a = readb(z80, z80->de); break;          // ld a, (de)
-        case 0x1b: --z80->de; break;                             // dec de
-        case 0x1c: z80->e = incb(z80, z80->e); break;            // inc e
-        case 0x1d: z80->e = decb(z80, z80->e); break;            // dec e
-        case 0x1e: z80->e = instrb(z80); break;                  // ld e, n
-        case 0x1f: rra(z80); break;                              // rra
-        case 0x20: jr(z80, ~z80->f & Z_FLAG); break;             // jr nz, d
-        case 0x21: z80->hl = instrw(z80); break;                 // ld hl, nn
-        case 0x22: writew(z80, instrw(z80), z80->hl); break;     // ld (nn), hl
-        case 0x23: ++z80->hl; break;                             // inc hl
-        case 0x24: z80->h = incb(z80, z80->h); break;            // inc h
-        case 0x25: z80->h = decb(z80, z80->h); break;            // dec h
-        case 0x26: z80->h = instrb(z80); break;                  // ld h, n
-        case 0x27: daa(z80); break;                              // daa
-        case 0x28: jr(z80, z80->f & Z_FLAG); break;              // jr z, d
-        case 0x29: z80->hl = addw(z80, z80->hl, z80->hl); break; // add hl, hl
-        case 0x2a: z80->hl = readw(z80, instrw(z80)); break;     // ld hl, (nn)
-        case 0x2b: --z80->hl; break;                             // dec hl
-        case 0x2c: z80->l = incb(z80, z80->l); break;            // inc l
-        case 0x2d: z80->l = decb(z80, z80->l); break;            // dec l
-        case 0x2e: z80->l = instrb(z80); break;                  // ld l, n
-        case 0x2f: cpl(z80); break;                              // cpl
-        case 0x30: jr(z80, ~z80->f & C_FLAG); break;             // jr nc, d
-        case 0x31: z80->sp = instrw(z80); break;                 // ld sp, nn
-        case 0x32: writeb(z80, instrw(z80), z80->a); break;      // ld (nn), a
-        case 0x33: ++z80->sp; break;                             // inc sp
-        case 0x34:
-            writeb(z80, z80->hl, incb(z80, readb(z80, z80->hl)));
-            break; // inc (hl)
-        case 0x35:
-            writeb(z80, z80->hl, decb(z80, readb(z80, z80->hl)));
-            break;                                               // dec (hl)
-        case 0x36: writeb(z80, z80->hl, instrb(z80)); break;     // ld (hl), n
-        case 0x37: scf(z80); break;                              // scf
-        case 0x38: jr(z80, z80->f & C_FLAG); break;              // jr c, d
-        case 0x39: z80->hl = addw(z80, z80->hl, z80->sp); break; // add hl, sp
-        case 0x3a: z80->a = readb(z80, instrw(z80)); break;      // ld a, (nn)
-        case 0x3b: --z80->sp; break;                             // dec sp
-        case 0x3c: z80->a = incb(z80, z80->a); break;            // inc a
-        case 0x3d: z80->a = decb(z80, z80->a); break;            // dec a
-        case 0x3e: z80->a = instrb(z80); break;                  // ld a, n
-        case 0x3f: ccf(z80); break;                              // ccf
-        case 0x40: z80->b = z80->b; break;                       // ld b, b
-        case 0x41: z80->b = z80->c; break;                       // ld b, c
-        case 0x42: z80->b = z80->d; break;                       // ld b, d
-        case 0x43: z80->b = z80->e; break;                       // ld b, e
-        case 0x44: z80->b = z80->h; break;                       // ld b, h
-        case 0x45: z80->b = z80->l; break;                       // ld b, l
-        case 0x46: z80->b = readw(z80, z80->hl); break;          // ld b, (hl)
-        case 0x47: z80->b = z80->a; break;                       // ld b, a
-        case 0x48: z80->c = z80->b; break;                       // ld c, b
-        case 0x49: z80->c = z80->c; break;                       // ld c, c
-        case 0x4a: z80->c = z80->d; break;                       // ld c, d
-        case 0x4b: z80->c = z80->e; break;                       // ld c, e
-        case 0x4c: z80->c = z80->h; break;                       // ld c, h
-        case 0x4d: z80->c = z80->l; break;                       // ld c, l
-        case 0x4e: z80->c = readw(z80, z80->hl); break;          // ld c, (hl)
-        case 0x4f: z80->c = z80->a; break;                       // ld c, a
-        case 0x50: z80->d = z80->b; break;                       // ld d, b
-        case 0x51: z80->d = z80->c; break;                       // ld d, c
-        case 0x52: z80->d = z80->d; break;                       // ld d, d
-        case 0x53: z80->d = z80->e; break;                       // ld d, e
-        case 0x54: z80->d = z80->h; break;                       // ld d, h
-        case 0x55: z80->d = z80->l; break;                       // ld d, l
-        case 0x56: z80->d = readw(z80, z80->hl); break;          // ld d, (hl)
-        case 0x57: z80->d = z80->a; break;                       // ld d, a
-        case 0x58: z80->e = z80->b; break;                       // ld e, b
-        case 0x59: z80->e = z80->c; break;                       // ld e, c
-        case 0x5a: z80->e = z80->d; break;                       // ld e, d
-        case 0x5b: z80->e = z80->e; break;                       // ld e, e
-        case 0x5c: z80->e = z80->h; break;                       // ld e, h
-        case 0x5d: z80->e = z80->l; break;                       // ld e, l
-        case 0x5e: z80->e = readw(z80, z80->hl); break;          // ld e, (hl)
-        case 0x5f: z80->e = z80->a; break;                       // ld e, a
-        case 0x60: z80->h = z80->b; break;                       // ld h, b
-        case 0x61: z80->h = z80->c; break;                       // ld h, c
-        case 0x62: z80->h = z80->d; break;                       // ld h, d
-        case 0x63: z80->h = z80->e; break;                       // ld h, e
-        case 0x64: z80->h = z80->h; break;                       // ld h, h
-        case 0x65: z80->h = z80->l; break;                       // ld h, l
-        case 0x66: z80->h = readw(z80, z80->hl); break;          // ld h, (hl)
-        case 0x67: z80->h = z80->a; break;                       // ld h, a
-        case 0x68: z80->l = z80->b; break;                       // ld l, b
-        case 0x69: z80->l = z80->c; break;                       // ld l, c
-        case 0x6a: z80->l = z80->d; break;                       // ld l, d
-        case 0x6b: z80->l = z80->e; break;                       // ld l, e
-        case 0x6c: z80->l = z80->h; break;                       // ld l, h
-        case 0x6d: z80->l = z80->l; break;                       // ld l, l
-        case 0x6e: z80->l = readw(z80, z80->hl); break;          // ld l, (hl)
-        case 0x6f: z80->l = z80->a; break;                       // ld l, a
-        case 0x70: writeb(z80, z80->hl, z80->b); break;          // ld (hl), b
-        case 0x71: writeb(z80, z80->hl, z80->c); break;          // ld (hl), c
-        case 0x72: writeb(z80, z80->hl, z80->d); break;          // ld (hl), d
-        case 0x73: writeb(z80, z80->hl, z80->e); break;          // ld (hl), e
-        case 0x74: writeb(z80, z80->hl, z80->h); break;          // ld (hl), h
-        case 0x75: writeb(z80, z80->hl, z80->l); break;          // ld (hl), l
-        case 0x76: z80->halted = 1; break;                       // halt
-        case 0x77: writeb(z80, z80->hl, z80->a); break;          // ld (hl), a
-        case 0x78: z80->a = z80->b; break;                       // ld a, b
-        case 0x79: z80->a = z80->c; break;                       // ld a, c
-        case 0x7a: z80->a = z80->d; break;                       // ld a, d
-        case 0x7b: z80->a = z80->e; break;                       // ld a, e
-        case 0x7c: z80->a = z80->h; break;                       // ld a, h
-        case 0x7d: z80->a = z80->l; break;                       // ld a, l
-        case 0x7e: z80->a = readb(z80, z80->hl); break;          // ld a, (hl)
-        case 0x7f: z80->a = z80->a; break;                       // ld a, a
-        case 0x80: z80->a = addb(z80, z80->a, z80->b, 0); break; // add a, b
-        case 0x81: z80->a = addb(z80, z80->a, z80->c, 0); break; // add a, c
-        case 0x82: z80->a = addb(z80, z80->a, z80->d, 0); break; // add a, d
-        case 0x83: z80->a = addb(z80, z80->a, z80->e, 0); break; // add a, e
-        case 0x84: z80->a = addb(z80, z80->a, z80->h, 0); break; // add a, h
-        case 0x85: z80->a = addb(z80, z80->a, z80->l, 0); break; // add a, l
-        case 0x86:
-            z80->a = addb(z80, z80->a, readb(z80, z80->hl), 0);
-            break;                                               // add a, (hl)
-        case 0x87: z80->a = addb(z80, z80->a, z80->a, 0); break; // add a, a
-        case 0x88:
-            z80->a = addb(z80, z80->a, z80->b, z80->f & C_FLAG);
-            break; // adc a, b
-        case 0x89:
-            z80->a = addb(z80, z80->a, z80->c, z80->f & C_FLAG);
-            break; // adc a, c
-        case 0x8a:
-            z80->a = addb(z80, z80->a, z80->d, z80->f & C_FLAG);
-            break; // adc a, d
-        case 0x8b:
-            z80->a = addb(z80, z80->a, z80->e, z80->f & C_FLAG);
-            break; // adc a, e
-        case 0x8c:
-            z80->a = addb(z80, z80->a, z80->h, z80->f & C_FLAG);
-            break; // adc a, h
-        case 0x8d:
-            z80->a = addb(z80, z80->a, z80->l, z80->f & C_FLAG);
-            break; // adc a, l
-        case 0x8e:
-            z80->a = addb(z80, z80->a, readb(z80, z80->hl), z80->f & C_FLAG);
-            break; // adc a, (hl)
-        case 0x8f:
-            z80->a = addb(z80, z80->a, z80->a, z80->f & C_FLAG);
-            break;                                               // adc a, a
-        case 0x90: z80->a = subb(z80, z80->a, z80->b, 0); break; // sub a, b
-        case 0x91: z80->a = subb(z80, z80->a, z80->c, 0); break; // sub a, c
-        case 0x92: z80->a = subb(z80, z80->a, z80->d, 0); break; // sub a, d
-        case 0x93: z80->a = subb(z80, z80->a, z80->e, 0); break; // sub a, e
-        case 0x94: z80->a = subb(z80, z80->a, z80->h, 0); break; // sub a, h
-        case 0x95: z80->a = subb(z80, z80->a, z80->l, 0); break; // sub a, l
-        case 0x96:
-            z80->a = subb(z80, z80->a, readb(z80, z80->hl), 0);
-            break;                                               // sub a, (hl)
-        case 0x97: z80->a = subb(z80, z80->a, z80->a, 0); break; // sub a, a
-        case 0x98:
-            z80->a = subb(z80, z80->a, z80->b, z80->f & C_FLAG);
-            break; // sbc a, b
-        case 0x99:
-            z80->a = subb(z80, z80->a, z80->c, z80->f & C_FLAG);
-            break; // sbc a, c
-        case 0x9a:
-            z80->a = subb(z80, z80->a, z80->d, z80->f & C_FLAG);
-            break; // sbc a, d
-        case 0x9b:
-            z80->a = subb(z80, z80->a, z80->e, z80->f & C_FLAG);
-            break; // sbc a, e
-        case 0x9c:
-            z80->a = subb(z80, z80->a, z80->h, z80->f & C_FLAG);
-            break; // sbc a, h
-        case 0x9d:
-            z80->a = subb(z80, z80->a, z80->l, z80->f & C_FLAG);
-            break; // sbc a, l
-        case 0x9e:
-            z80->a = subb(z80, z80->a, readb(z80, z80->hl), z80->f & C_FLAG);
-            break; // sbc a, (hl)
-        case 0x9f:
-            z80->a = subb(z80, z80->a, z80->a, z80->f & C_FLAG);
-            break;                                       // sbc a, a
-        case 0xa0: and(z80, z80->b); break;              // and b
-        case 0xa1: and(z80, z80->c); break;              // and c
-        case 0xa2: and(z80, z80->d); break;              // and d
-        case 0xa3: and(z80, z80->e); break;              // and e
-        case 0xa4: and(z80, z80->h); break;              // and h
-        case 0xa5: and(z80, z80->l); break;              // and l
-        case 0xa6: and(z80, readw(z80, z80->hl)); break; // and (hl)
-        case 0xa7: and(z80, z80->a); break;              // and a
-        case 0xa8: xor(z80, z80->b); break;              // xor b
-        case 0xa9: xor(z80, z80->c); break;              // xor c
-        case 0xaa: xor(z80, z80->d); break;              // xor d
-        case 0xab: xor(z80, z80->e); break;              // xor e
-        case 0xac: xor(z80, z80->h); break;              // xor h
-        case 0xad: xor(z80, z80->l); break;              // xor l
-        case 0xae: xor(z80, readw(z80, z80->hl)); break; // xor (hl)
-        case 0xaf: xor(z80, z80->a); break;              // xor a
-        case 0xb0: or (z80, z80->b); break;              // or b
-        case 0xb1: or (z80, z80->c); break;              // or c
-        case 0xb2: or (z80, z80->d); break;              // or d
-        case 0xb3: or (z80, z80->e); break;              // or e
-        case 0xb4: or (z80, z80->h); break;              // or h
-        case 0xb5: or (z80, z80->l); break;              // or l
-        case 0xb6: or (z80, readw(z80, z80->hl)); break; // or (hl)
-        case 0xb7: or (z80, z80->a); break;              // or a
-        case 0xb8: cp(z80, z80->b); break;               // cp b
-        case 0xb9: cp(z80, z80->c); break;               // cp c
-        case 0xba: cp(z80, z80->d); break;               // cp d
-        case 0xbb: cp(z80, z80->e); break;               // cp e
-        case 0xbc: cp(z80, z80->h); break;               // cp h
-        case 0xbd: cp(z80, z80->l); break;               // cp l
-        case 0xbe: cp(z80, readw(z80, z80->hl)); break;  // cp (hl)
-        case 0xbf: cp(z80, z80->a); break;               // cp a
-        case 0xc0: retc(z80, ~z80->f & Z_FLAG); break;   // ret nz
-        case 0xc1: z80->bc = pop(z80); break;            // pop bc
-        case 0xc2: jp(z80, ~z80->f & Z_FLAG); break;     // jp nz, nn
-        case 0xc3: z80->pc = instrw(z80); break;         // jp nn
-        case 0xc4: callc(z80, ~z80->f & Z_FLAG); break;  // call nz, nn
-        case 0xc5: push(z80, z80->bc); break;            // push bc
-        case 0xc6:
-            z80->a = addb(z80, z80->a, instrb(z80), 0);
-            break;                                     // add a, n
-        case 0xc8: retc(z80, z80->f & Z_FLAG); break;  // ret z
-        case 0xc9: z80->pc = pop(z80); break;          // ret
-        case 0xca: jp(z80, z80->f & Z_FLAG); break;    // jp z, nn
-        case 0xcc: callc(z80, z80->f & Z_FLAG); break; // call z, nn
-        case 0xcd: call(z80); break;                   // call nn
-        case 0xce:
-            z80->a = addb(z80, z80->a, instrb(z80), z80->f & C_FLAG);
-            break;                                       // adc a, n
-        case 0xd0: retc(z80, ~z80->f & C_FLAG); break;   // ret nc
-        case 0xd1: z80->de = pop(z80); break;            // pop de
-        case 0xd2: jp(z80, ~z80->f & C_FLAG); break;     // jp nc, nn
-        case 0xd3: out(z80, instrb(z80), z80->a); break; // out (n), a
-        case 0xd4: callc(z80, ~z80->f & C_FLAG); break;  // call nc, nn
-        case 0xd5: push(z80, z80->de); break;            // push de
-        case 0xd6:
-            z80->a = subb(z80, z80->a, instrb(z80), 0);
-            break;                                    // adc a, n
-        case 0xd8: retc(z80, z80->f & C_FLAG); break; // ret c
-        case 0xd9: {
-            uint16_t const bc = z80->bc;
-            uint16_t const de = z80->de;
-            uint16_t const hl = z80->hl;
-            z80->bc = z80->bcp;
-            z80->de = z80->dep;
-            z80->hl = z80->hlp;
-            z80->bcp = bc;
-            z80->dep = de;
-            z80->hlp = hl;
-            break;
-        }
-        case 0xda: jp(z80, z80->f & C_FLAG); break; // jp c, nn
-        case 0xdb:
-            z80->a = in(z80, ((uint16_t)z80->a << 8) | instrb(z80));
-            break;                                     // in a, (n)
-        case 0xdc: callc(z80, z80->f & C_FLAG); break; // call c, nn
-        case 0xde:
-            z80->a = subb(z80, z80->a, instrb(z80), z80->f & C_FLAG);
-            break;                                     // sbc a, n
-        case 0xe0: retc(z80, ~z80->f & P_FLAG); break; // ret po
-        case 0xe1: z80->hl = pop(z80); break;          // pop hl
-        case 0xe2: jp(z80, ~z80->f & P_FLAG); break;   // jp po, nn
-        case 0xe3: {
-            uint16_t hl = z80->hl;
-            z80->hl = readw(z80, z80->sp);
-            writew(z80, z80->sp, hl);
-            break;
-        }                                               // ex (sp), hl
-        case 0xe4: callc(z80, ~z80->f & P_FLAG); break; // call po, nn
-        case 0xe5: push(z80, z80->hl); break;           // push hl
-        case 0xe6: and(z80, instrb(z80)); break;        // and n
-        case 0xe8: retc(z80, z80->f & P_FLAG); break;   // ret pe
-        case 0xe9: z80->pc = z80->hl; break;            // jp (hl)
-        case 0xea: jp(z80, z80->f & P_FLAG); break;     // jp pe, nn
-        case 0xeb: {
-            uint16_t de = z80->de;
-            z80->de = z80->hl;
-            z80->hl = de;
-            break;
-        }                                              // ex de, hl
-        case 0xec: callc(z80, z80->f & P_FLAG); break; // call pe, nn
-        case 0xed: exec_ed_instr(z80, instrb(z80)); break;
-        case 0xee: xor(z80, instrb(z80)); break;        // xor n
-        case 0xf0: retc(z80, ~z80->f & S_FLAG); break;  // ret p
-        case 0xf1: z80->af = pop(z80); break;           // pop af
-        case 0xf2: jp(z80, ~z80->f & S_FLAG); break;    // jp p, nn
-        case 0xf3: z80->iff1 = z80->iff2 = 0; break;    // di
-        case 0xf4: callc(z80, ~z80->f & S_FLAG); break; // call p, nn
-        case 0xf5: push(z80, z80->af); break;           // push af
-        case 0xf6: or (z80, instrb(z80)); break;        // or n
-        case 0xf8: retc(z80, z80->f & S_FLAG); break;   // ret m
-        case 0xf9: z80->sp = z80->hl; break;            // ld sp, hl
-        case 0xfa: jp(z80, z80->f & S_FLAG); break;     // jp m, nn
-        case 0xfb: {
-            z80->iff1 = z80->iff2 = 1;
-            if (z80->interrupt_delay == 0)
-                z80->interrupt_delay = 2;
-            break;
-        }                                              // ei
-        case 0xfc: callc(z80, z80->f & S_FLAG); break; // call m, nn
-        case 0xfe: cp(z80, instrb(z80)); break;        // cp n
-
-        case 0xc7:
-        case 0xcf:
-        case 0xd7:
-        case 0xdf:
-        case 0xe7:
-        case 0xef:
-        case 0xf7:
-        case 0xff:
-            push(z80, z80->pc);
-            z80->pc = 0x08 * ((opcode & 0x38) >> 3);
-            break;
-
-        case 0xcb: exec_cb_instr(z80, instrb(z80)); break;
-
-        case 0xdd:
-        case 0xfd: exec_index_instr(z80, opcode, instrb(z80)); break;
-
-        default:
-            printf("unimplemented opcode 0x%02x at 0x%04x\n", opcode, z80->pc - 1);
-            assert(0);
-            exit(EXIT_FAILURE);
-            break;
+#include "z80-exec.inc"
     }
 
     z80->cycles += opcode_cycles[opcode];
+    cover(z80, Z80_COVERAGE_BASE, opcode);
 }
 
 /*****************************************************************************/
 
+/* See struct Z80. Everything an instruction touches, up to the cold fields
+ * beginning with userdata, must fit in one cache line. The pointers after it
+ * are read only when Z80::hooks, before it, says they are set. */
+#define CACHE_LINE 64
+_Static_assert(offsetof(struct Z80, userdata) <= CACHE_LINE,
+               "the hot fields of struct Z80 must fit in a cache line");
+_Static_assert(sizeof(struct Z80) <= 2 * CACHE_LINE,
+               "struct Z80 must fit in two cache lines");
+
+/** The bus of a Z80 which has not been given one. */
+static struct Z80Bus const no_bus = {0};
+
 void z80_init(struct Z80 *z80)
 {
     memset(z80, 0, sizeof(struct Z80));
+    z80->bus = &no_bus;
+    atomic_init(&z80->pending, 0);
     z80->sp = 0xffff;
     z80->a = 0xff;
 }
 
-int64_t z80_step(struct Z80 *z80)
+void z80_update_hooks(struct Z80 *z80)
 {
-    int64_t const cycles = z80->cycles;
+    z80->hooks = (z80->ports ? Z80_HOOK_PORTS : 0)
+                 | (z80->write_log ? Z80_HOOK_WRITE_LOG : 0)
+                 | (z80->profile ? Z80_HOOK_PROFILE : 0)
+                 | (z80->codemap ? Z80_HOOK_CODEMAP : 0);
+}
+
+/** Executes the next instruction, once any pending interrupts have been
+ * taken.
+ */
+static void step(struct Z80 *z80)
+{
+    uint16_t const pc = z80->pc;
 
     incr(z80);
 
     if (!z80->halted)
     {
-        uint8_t const opcode = instrb(z80);
-        if (!z80->trap || !z80->trap(z80, z80->pc - 1, opcode))
+        uint8_t const opcode = fetchb(z80);
+        if (!z80->bus->trap || !z80->bus->trap(z80, z80->pc - 1, opcode))
             exec_instr(z80, opcode);
     }
     else
@@ -1631,26 +1488,436 @@ int64_t z80_step(struct Z80 *z80)
         exec_instr(z80, 0x00);
     }
 
+    // Report a fault at the start of the instruction, prefixes and all.
+    if (z80->fault)
+        z80->fault_pc = pc;
+
     if (z80->interrupt_delay)
     {
         if (--z80->interrupt_delay == 0)
             z80->iff1 = z80->iff2 = 1;
     }
+}
+
+int64_t z80_step(struct Z80 *z80)
+{
+    int64_t const cycles = z80->cycles;
+
+    if (z80->fault)
+        return 0;
+
+    if (atomic_load_explicit(&z80->pending, memory_order_relaxed) & PENDING_INTERRUPTS)
+        take_pending(z80);
+    step(z80);
 
     return z80->cycles - cycles;
 }
 
+/** Registers which must be unchanged by an iteration of a loop for it to be
+ * skipped.
+ */
+struct LoopState
+{
+    uint16_t pc, sp, ix, iy, af, bc, de, hl, afp, bcp, dep, hlp;
+    uint8_t i, interrupt_mode, iff1, iff2, interrupt_delay;
+    uint8_t r;
+    uint8_t wrote, polled;
+    uint64_t cycles;
+};
+
+static void save_loop_state(struct Z80 const *z80, struct LoopState *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->pc = z80->pc;
+    state->sp = z80->sp;
+    state->ix = z80->ix;
+    state->iy = z80->iy;
+    state->af = z80->af;
+    state->bc = z80->bc;
+    state->de = z80->de;
+    state->hl = z80->hl;
+    state->afp = z80->afp;
+    state->bcp = z80->bcp;
+    state->dep = z80->dep;
+    state->hlp = z80->hlp;
+    state->i = z80->i;
+    state->interrupt_mode = z80->interrupt_mode;
+    state->iff1 = z80->iff1;
+    state->iff2 = z80->iff2;
+    state->interrupt_delay = z80->interrupt_delay;
+    state->r = z80->r;
+    state->wrote = z80->wrote;
+    state->polled = z80->polled;
+    state->cycles = z80->cycles;
+}
+
+/** Advances the clock and the refresh register as if `n` iterations of a
+ * loop taking `cycles` and incrementing R by `r` had run. As in incr(), a
+ * carry out of the low seven bits of R sets bit 7.
+ */
+static void skip_iterations(struct Z80 *z80,
+                            uint64_t const n,
+                            uint64_t const cycles,
+                            uint8_t const r)
+{
+    z80->cycles += n * cycles;
+
+#ifdef Z80_ACCURACY_FAST
+    (void)r;
+#else
+    uint64_t const low = (z80->r & 0x7f) + n * r;
+    z80->r = (z80->r & 0x80) | (low > 0x7f ? 0x80 : 0) | (low & 0x7f);
+#endif
+}
+
+/** If the Z80 is at a `djnz $`, skips all but the final iteration, or as
+ * many as fit before `until`.
+ */
+static void skip_djnz(struct Z80 *z80, uint64_t const until)
+{
+    uint64_t n;
+
+    // Taking an interrupt may already have run the clock past `until`.
+    if (z80->cycles >= until)
+        return;
+
+    if (z80->b < 2 || loadb(z80, z80->pc) != 0x10
+        || loadb(z80, z80->pc + 1) != 0xfe)
+        return;
+
+    n = (until - z80->cycles) / 13;
+    if (n > z80->b - 1u)
+        n = z80->b - 1u;
+
+    skip_iterations(z80, n, 13, 1);
+    z80->b -= n;
+}
+
+/* Fused sequences. The tails of most loops set the flags and then branch on
+ * them, as in `dec b; jr nz` or `cp n; jp c`. z80_run recognizes these
+ * sequences and runs them without returning to its loop in between, unless
+ * an instruction takes the clock to `until`. Each instruction is fetched and
+ * retired just as z80_step would. The branch is read ahead, which only
+ * memory without callbacks allows; none of the instructions before it write
+ * memory, so it cannot change once read. */
+
+/** Fetches an opcode which has already been read ahead.
+ */
+static void fetch_fused(struct Z80 *z80)
+{
+    incr(z80);
+    record(z80, z80->pc, Z80_CODEMAP_OPCODE);
+    ++z80->pc;
+}
+
+static void retire_fused(struct Z80 *z80, uint8_t const opcode)
+{
+    z80->cycles += opcode_cycles[opcode];
+    cover(z80, Z80_COVERAGE_BASE, opcode);
+}
+
+/** Tests the condition of a `jr cc` or `jp cc` opcode on the Z or C flag. */
+static int branch_condition(struct Z80 const *z80, uint8_t const opcode)
+{
+    uint8_t const flag = (opcode & 0x10) ? C_FLAG : Z_FLAG;
+    return (opcode & 0x08) ? (z80->f & flag) : (~z80->f & flag);
+}
+
+static int is_branch(uint8_t const opcode)
+{
+    return (opcode & 0xe7) == 0x20 || (opcode & 0xe7) == 0xc2;
+}
+
+/** Runs a conditional jump, as the last of a sequence.
+ */
+static void branch_fused(struct Z80 *z80, uint8_t const opcode)
+{
+    fetch_fused(z80);
+    if (opcode & 0x80)
+        jp(z80, branch_condition(z80, opcode));
+    else
+        jr(z80, branch_condition(z80, opcode));
+    retire_fused(z80, opcode);
+}
+
+/** The opcodes which begin a sequence exec_fused() may fuse. */
+static uint8_t const fused_first[256] = {
+    [0x05] = 1, [0x0d] = 1, [0x15] = 1, [0x1d] = 1, [0x25] = 1, [0x2d] = 1,
+    [0x3d] = 1, [0xa7] = 1, [0xb7] = 1, [0xfe] = 1, [0x78] = 1,
+};
+
+/** Runs the opcode just fetched together with those following it, if they
+ * form a sequence which can be fused.
+ * @param op The opcode, one of fused_first.
+ * @return Non-zero if the sequence was run, or zero if `op` is still to run.
+ */
+static int exec_fused(struct Z80 *z80, uint8_t const op, uint64_t const until)
+{
+    uint16_t const pc = z80->pc;
+    uint8_t const next = loadb(z80, pc);
+    uint8_t branch = next;
+
+    if (z80->interrupt_delay)
+        return 0;
+
+    switch (op)
+    {
+        // dec r; jr/jp cc
+        case 0x05:
+            if (!is_branch(next))
+                return 0;
+            z80->b = decb(z80, z80->b);
+            break;
+        case 0x0d:
+            if (!is_branch(next))
+                return 0;
+            z80->c = decb(z80, z80->c);
+            break;
+        case 0x15:
+            if (!is_branch(next))
+                return 0;
+            z80->d = decb(z80, z80->d);
+            break;
+        case 0x1d:
+            if (!is_branch(next))
+                return 0;
+            z80->e = decb(z80, z80->e);
+            break;
+        case 0x25:
+            if (!is_branch(next))
+                return 0;
+            z80->h = decb(z80, z80->h);
+            break;
+        case 0x2d:
+            if (!is_branch(next))
+                return 0;
+            z80->l = decb(z80, z80->l);
+            break;
+        case 0x3d:
+            if (!is_branch(next))
+                return 0;
+            z80->a = decb(z80, z80->a);
+            break;
+
+        case 0xa7: // and a; jr/jp cc
+            if (!is_branch(next))
+                return 0;
+            and(z80, z80->a);
+            break;
+
+        case 0xb7: // or a; jr/jp cc
+            if (!is_branch(next))
+                return 0;
+            or(z80, z80->a);
+            break;
+
+        case 0xfe: // cp n; jr/jp cc
+            branch = loadb(z80, pc + 1);
+            if (!is_branch(branch))
+                return 0;
+            record(z80, z80->pc, Z80_CODEMAP_OPERAND);
+            ++z80->pc;
+            cp(z80, next);
+            break;
+
+        case 0x78: // ld a, b; or c; jr/jp cc
+            branch = loadb(z80, pc + 1);
+            if (next != 0xb1 || !is_branch(branch))
+                return 0;
+            z80->a = z80->b;
+            retire_fused(z80, op);
+            if (z80->cycles >= until)
+                return 1;
+            fetch_fused(z80);
+            or(z80, z80->c);
+            retire_fused(z80, next);
+            if (z80->cycles < until)
+                branch_fused(z80, branch);
+            return 1;
+
+        default: return 0;
+    }
+
+    retire_fused(z80, op);
+    if (z80->cycles < until)
+        branch_fused(z80, branch);
+    return 1;
+}
+
+/** Runs one instruction as step does, or a fused sequence beginning with
+ * it.
+ */
+static void step_fused(struct Z80 *z80, uint64_t const until)
+{
+    uint16_t const pc = z80->pc;
+    uint8_t opcode;
+
+    incr(z80);
+    opcode = fetchb(z80);
+    if (!fused_first[opcode] || !exec_fused(z80, opcode, until))
+        exec_instr(z80, opcode);
+
+    // Fused sequences cannot fault, so this can only be a single instruction.
+    if (z80->fault)
+        z80->fault_pc = pc;
+
+    if (z80->interrupt_delay)
+    {
+        if (--z80->interrupt_delay == 0)
+            z80->iff1 = z80->iff2 = 1;
+    }
+}
+
+/*****************************************************************************/
+
+int64_t z80_run(struct Z80 *z80, uint64_t const until)
+{
+    uint64_t const start = z80->cycles;
+    uint8_t const skip = z80->bus->trap ? 0 : z80->skip_loops;
+    int const fuse = z80->fuse && z80->memory && !z80->bus->trap;
+    struct LoopState loop;
+    int have_loop = 0;
+
+    z80_update_hooks(z80);
+    while (z80->cycles < until && !z80->fault)
+    {
+        uint16_t const pc = z80->pc;
+        unsigned const pending = atomic_load_explicit(&z80->pending, memory_order_relaxed);
+
+        if (pending)
+        {
+            if (pending & PENDING_STOP)
+            {
+                atomic_fetch_and_explicit(&z80->pending, ~PENDING_STOP, memory_order_relaxed);
+                break;
+            }
+            take_pending(z80);
+        }
+
+        if (z80->halted && !z80->interrupt_delay && !can_take_pending(z80))
+        {
+            // Taking an interrupt may already have run the clock past `until`.
+            if (z80->cycles < until)
+                skip_iterations(z80, (until - z80->cycles + 3) / 4, 4, 1);
+            break;
+        }
+
+        if (skip)
+            skip_djnz(z80, until);
+
+        if (fuse && !z80->halted)
+            step_fused(z80, until);
+        else
+            step(z80);
+
+        if (!skip || z80->pc > pc || pc - z80->pc > 0xff || z80->halted
+            || z80->cycles >= until)
+            continue;
+
+        /* A backward branch. If the last iteration of the loop changed
+         * nothing but the clock and R, the following ones won't either. */
+        if (have_loop && loop.pc == z80->pc)
+        {
+            struct LoopState state;
+            save_loop_state(z80, &state);
+            state.r = loop.r;
+            state.cycles = loop.cycles;
+            if (skip & Z80_SKIP_POLL)
+                state.polled = loop.polled;
+
+            if (memcmp(&state, &loop, sizeof(state)) == 0)
+            {
+                uint64_t const cycles = z80->cycles - loop.cycles;
+                uint64_t const n = (until - z80->cycles) / cycles;
+                skip_iterations(z80, n, cycles, (z80->r - loop.r) & 0x7f);
+            }
+        }
+
+        // Writes and port reads are flagged from here to the next iteration.
+        z80->wrote = z80->polled = 0;
+        save_loop_state(z80, &loop);
+        have_loop = 1;
+    }
+
+    return z80->cycles - start;
+}
+
 int z80_is_halted(struct Z80 const *z80)
 {
     return z80->halted;
 }
 
+int z80_fault(struct Z80 const *z80)
+{
+    return z80->fault;
+}
+
+uint16_t z80_fault_pc(struct Z80 const *z80)
+{
+    return z80->fault_pc;
+}
+
+void z80_raise_fault(struct Z80 *z80, int code)
+{
+    fault(z80, code);
+}
+
+void z80_clear_fault(struct Z80 *z80)
+{
+    z80->fault = Z80_FAULT_NONE;
+    z80->fault_pc = 0;
+}
+
 void z80_interrupt(struct Z80 *z80, uint8_t data)
 {
     if (z80->interrupt_delay == 0)
         handle_interrupts(z80, data);
 }
 
+void z80_raise_irq(struct Z80 *z80, uint8_t data)
+{
+    unsigned pending = atomic_load_explicit(&z80->pending, memory_order_relaxed);
+    unsigned raised;
+
+    do
+        raised = (pending & ~(PENDING_IRQ | PENDING_DATA)) | PENDING_IRQ | data;
+    while (!atomic_compare_exchange_weak_explicit(
+        &z80->pending, &pending, raised, memory_order_release, memory_order_relaxed));
+}
+
+void z80_clear_irq(struct Z80 *z80)
+{
+    atomic_fetch_and_explicit(&z80->pending, ~(PENDING_IRQ | PENDING_DATA), memory_order_relaxed);
+}
+
+void z80_raise_nmi(struct Z80 *z80)
+{
+    atomic_fetch_or_explicit(&z80->pending, PENDING_NMI, memory_order_release);
+}
+
+void z80_stop(struct Z80 *z80)
+{
+    atomic_fetch_or_explicit(&z80->pending, PENDING_STOP, memory_order_relaxed);
+}
+
+struct Z80CoverageEntry const *z80_coverage(int table)
+{
+#ifdef Z80_COVERAGE
+    if (table >= 0 && table < Z80_COVERAGE_TABLES)
+        return coverage[table];
+#else
+    (void)table;
+#endif
+    return NULL;
+}
+
+void z80_coverage_reset(void)
+{
+#ifdef Z80_COVERAGE
+    memset(coverage, 0, sizeof(coverage));
+#endif
+}
+
 void z80_trace(struct Z80 *z80)
 {
     printf("BC:0x%04X DE:0x%04X HL:0x%04X A:0x%02X\n", z80->bc, z80->de, z80->hl, z80->a);
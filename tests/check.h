@@ -0,0 +1,33 @@
+#ifndef Z80_TESTS_CHECK_H
+#define Z80_TESTS_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The checks shared by the tests, each of which is a single main.c. */
+
+/** The number of checks which have failed. */
+static int failures = 0;
+
+/** Counts a failed check, and reports its condition and line.
+ */
+#define CHECK(COND)                                                            \
+    do                                                                         \
+    {                                                                          \
+        if (!(COND))                                                           \
+        {                                                                      \
+            printf("  FAIL: %s (line %i)\n", #COND, __LINE__);                 \
+            ++failures;                                                        \
+        }                                                                      \
+    } while (0)
+
+/** Prints the number of failed checks.
+ * @return The exit status for main: EXIT_SUCCESS if none failed.
+ */
+static int check_report(void)
+{
+    printf("%i TESTS FAILED\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
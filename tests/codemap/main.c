@@ -0,0 +1,164 @@
+#include "check.h"
+#include "z80/codemap.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define MAP_PATH "codemap-test.map"
+#define RUN_CYCLES 1000
+
+#define X Z80_CODEMAP_OPCODE
+#define O Z80_CODEMAP_OPERAND
+#define R Z80_CODEMAP_READ
+#define W Z80_CODEMAP_WRITE
+
+static uint8_t const program[] = {
+    0x31, 0x00, 0x80,       // ld sp, 0x8000
+    0x21, 0x00, 0x90,       // ld hl, 0x9000
+    0xdd, 0x21, 0x00, 0xa0, // ld ix, 0xa000
+    0xdd, 0x7e, 0x05,       // ld a, (ix + 5)
+    0xdd, 0xcb, 0x02, 0xc6, // set 0, (ix + 2)
+    0x77,                   // ld (hl), a
+    0xcd, 0x20, 0x00,       // call negate
+    0x3a, 0x30, 0x00,       // ld a, (value)
+    0xfe, 0x05,             // cp 5
+    0x38, 0x01,             // jr c, done
+    0x00,                   // nop, jumped over
+    0x76,                   // done: halt
+};
+
+static uint8_t const negate[] = {
+    0xed, 0x44, // neg
+    0xc9,       // ret
+};
+
+static uint8_t memory[MEMORY_SIZE];
+static struct Z80CodeMap maps[3];
+
+static uint8_t mem_load(struct Z80 *z80, uint16_t addr)
+{
+    (void)z80;
+    return memory[addr];
+}
+
+static void mem_store(struct Z80 *z80, uint16_t addr, uint8_t value)
+{
+    (void)z80;
+    memory[addr] = value;
+}
+
+static struct Z80Bus const bus = {
+    .mem_load = mem_load,
+    .mem_store = mem_store,
+};
+
+static void boot(struct Z80 *z80, struct Z80CodeMap *map)
+{
+    memset(memory, 0, sizeof(memory));
+    memcpy(memory, program, sizeof(program));
+    memcpy(memory + 0x0020, negate, sizeof(negate));
+    memory[0x0030] = 0x03;
+
+    z80_init(z80);
+    z80->bus = &bus;
+    CHECK(z80_codemap_init(map, z80) == 0);
+    CHECK(z80->codemap == map);
+}
+
+/** Opcodes, operands, data reads and writes are each told apart, through
+ * the bus callbacks, attached memory, and fused instructions alike.
+ */
+static void test_record(void)
+{
+    struct Z80Memory mem;
+    struct Z80 z80;
+    struct Z80CodeMap const *map = &maps[0];
+
+    boot(&z80, &maps[0]);
+    while (!z80_is_halted(&z80))
+        z80_step(&z80);
+
+    CHECK(map->flags[0x0000] == X);
+    CHECK(map->flags[0x0001] == O && map->flags[0x0002] == O);
+    CHECK(map->flags[0x0006] == X && map->flags[0x0007] == X);
+    CHECK(map->flags[0x000c] == O);
+    CHECK(map->flags[0x000d] == X && map->flags[0x000e] == X);
+    CHECK(map->flags[0x000f] == O);
+    CHECK(map->flags[0x0010] == X);
+    CHECK(map->flags[0x001c] == 0);
+    CHECK(map->flags[0x001d] == X);
+    CHECK(map->flags[0x0020] == X && map->flags[0x0021] == X);
+    CHECK(map->flags[0x0030] == R);
+    CHECK(map->flags[0xa005] == R);
+    CHECK(map->flags[0xa006] == 0);
+    CHECK(map->flags[0xa002] == (R | W));
+    CHECK(map->flags[0x9000] == W);
+    CHECK(map->flags[0x7ffe] == (R | W) && map->flags[0x7fff] == (R | W));
+    CHECK(map->flags[0x7ffd] == 0);
+
+    boot(&z80, &maps[1]);
+    z80_memory_init(&mem, &z80, memory);
+    z80.fuse = 1;
+    z80_run(&z80, RUN_CYCLES);
+    CHECK(z80_is_halted(&z80));
+    CHECK(memcmp(&maps[0], &maps[1], sizeof(maps[0])) == 0);
+}
+
+static void test_files(void)
+{
+    FILE *file;
+    char ranges[64] = {0};
+
+    memset(&maps[1], 0, sizeof(maps[1]));
+    maps[1].flags[0x0001] = W;
+    maps[1].flags[0xffff] = R;
+    CHECK(z80_codemap_save(&maps[0], MAP_PATH) == 0);
+    CHECK(z80_codemap_load(&maps[1], MAP_PATH) == 0);
+    CHECK(maps[1].flags[0x0000] == X);
+    CHECK(maps[1].flags[0x0001] == (O | W));
+    CHECK(maps[1].flags[0xffff] == R);
+
+    memcpy(&maps[2], &maps[0], sizeof(maps[2]));
+    maps[2].flags[0x0001] |= W;
+    maps[2].flags[0xffff] |= R;
+    CHECK(memcmp(&maps[1], &maps[2], sizeof(maps[1])) == 0);
+    z80_codemap_merge(&maps[2], &maps[0]);
+    CHECK(memcmp(&maps[1], &maps[2], sizeof(maps[1])) == 0);
+
+    // Files which are not maps leave the map as it was.
+    file = fopen(MAP_PATH, "ab");
+    CHECK(file != NULL);
+    if (file)
+    {
+        fputc(0, file);
+        fclose(file);
+    }
+    CHECK(z80_codemap_load(&maps[1], MAP_PATH) == -1);
+    CHECK(z80_codemap_load(&maps[1], "no-such-file.map") == -1);
+    CHECK(memcmp(&maps[1], &maps[2], sizeof(maps[1])) == 0);
+    remove(MAP_PATH);
+
+    file = tmpfile();
+    CHECK(file != NULL);
+    if (!file)
+        return;
+    z80_codemap_write_ranges(&maps[1], file);
+    rewind(file);
+    CHECK(fread(ranges, 1, sizeof(ranges) - 1, file) > 0);
+    CHECK(strncmp(ranges, "0000-0000 x---\n0001-0001 -o-w\n0002-0002 -o--\n", 45) == 0);
+    fseek(file, -15, SEEK_END);
+    CHECK(fgets(ranges, sizeof(ranges), file) != NULL);
+    CHECK(strcmp(ranges, "ffff-ffff --r-\n") == 0);
+    fclose(file);
+}
+
+int main(void)
+{
+    test_record();
+    test_files();
+
+    return check_report();
+}
@@ -0,0 +1,245 @@
+#include "check.h"
+#include "z80/cpm.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MEMORY_SIZE 65536
+#define MAX_CYCLES 100000000
+#define FCB 0x5c
+#define BUFFER 0x2000
+
+static uint8_t memory[MEMORY_SIZE];
+/** Calls a BDOS function through a `call 5` at 0x0100, and returns A.
+ */
+static uint8_t bdos(struct Z80Cpm *cpm, uint8_t function, uint16_t de)
+{
+    static uint8_t const stub[] = {0xcd, 0x05, 0x00, 0x76}; // call 5; halt
+    struct Z80 *z80 = cpm->z80;
+
+    z80_memory_write(z80->memory, 0x0100, stub, sizeof(stub));
+    z80->pc = 0x0100;
+    z80->sp = 0xf000;
+    z80->halted = 0;
+    z80->c = function;
+    z80->de = de;
+    while (!z80_is_halted(z80))
+        z80_step(z80);
+
+    return z80->a;
+}
+
+static void set_fcb(struct Z80 *z80, char const *name)
+{
+    uint8_t fcb[36] = {0};
+    memcpy(fcb + 1, name, 11);
+    z80_memory_write(z80->memory, FCB, fcb, sizeof(fcb));
+}
+
+static void test_files(struct Z80 *z80, struct Z80Cpm *cpm, char const *dir)
+{
+    uint8_t record[128];
+    uint8_t fcb[36];
+    char path[4096];
+    FILE *file;
+
+    for (int i = 0; i < 128; ++i)
+        record[i] = i;
+
+    // Write three records sequentially, then close.
+    set_fcb(z80, "TEST    DAT");
+    CHECK(bdos(cpm, 22, FCB) == 0);
+    CHECK(bdos(cpm, 26, BUFFER) == 0);
+    for (int i = 0; i < 3; ++i)
+    {
+        record[0] = i;
+        z80_memory_write(z80->memory, BUFFER, record, sizeof(record));
+        CHECK(bdos(cpm, 21, FCB) == 0);
+    }
+    CHECK(bdos(cpm, 16, FCB) == 0);
+
+    snprintf(path, sizeof(path), "%s/test.dat", dir);
+    file = fopen(path, "rb");
+    CHECK(file != NULL);
+    if (file)
+    {
+        fseek(file, 0, SEEK_END);
+        CHECK(ftell(file) == 3 * 128);
+        fclose(file);
+    }
+
+    // Read them back sequentially, and run into the end of the file.
+    set_fcb(z80, "TEST    DAT");
+    CHECK(bdos(cpm, 15, FCB) == 0);
+    z80_memory_read(z80->memory, FCB, fcb, sizeof(fcb));
+    CHECK(fcb[15] == 3);
+    for (int i = 0; i < 3; ++i)
+    {
+        CHECK(bdos(cpm, 20, FCB) == 0);
+        CHECK(memory[BUFFER] == i && memory[BUFFER + 127] == 127);
+    }
+    CHECK(bdos(cpm, 20, FCB) == 1);
+
+    // Random access.
+    memory[FCB + 33] = 1;
+    memory[FCB + 34] = 0;
+    memory[FCB + 35] = 0;
+    CHECK(bdos(cpm, 33, FCB) == 0);
+    CHECK(memory[BUFFER] == 1);
+
+    memory[BUFFER] = 0xaa;
+    memory[FCB + 33] = 10;
+    CHECK(bdos(cpm, 34, FCB) == 0);
+    CHECK(bdos(cpm, 35, FCB) == 0);
+    CHECK(memory[FCB + 33] == 11 && memory[FCB + 34] == 0);
+    CHECK(bdos(cpm, 16, FCB) == 0);
+    // Closing a file which exists but is not open succeeds.
+    CHECK(bdos(cpm, 16, FCB) == 0);
+
+    // Directory search, rename and delete.
+    set_fcb(z80, "TEST    ???");
+    CHECK(bdos(cpm, 17, FCB) == 0);
+    CHECK(memcmp(memory + BUFFER + 1, "TEST    DAT", 11) == 0);
+    CHECK(bdos(cpm, 18, FCB) == 0xff);
+
+    set_fcb(z80, "TEST    DAT");
+    memcpy(memory + FCB + 17, "RENAMED DAT", 11);
+    CHECK(bdos(cpm, 23, FCB) == 0);
+    CHECK(bdos(cpm, 15, FCB) == 0xff);
+
+    set_fcb(z80, "RENAMED DAT");
+    CHECK(bdos(cpm, 15, FCB) == 0);
+    CHECK(bdos(cpm, 19, FCB) == 0);
+    CHECK(bdos(cpm, 15, FCB) == 0xff);
+    CHECK(bdos(cpm, 16, FCB) == 0xff);
+}
+
+/** Files which the host will not let us write are opened for reading only,
+ * and writing to them fails. Where the test runs with permission to write
+ * anyway, as root does, only the reads are checked.
+ */
+static void test_readonly(struct Z80 *z80, struct Z80Cpm *cpm, char const *dir)
+{
+    uint8_t record[128];
+    char path[4096];
+    FILE *file;
+
+    memset(record, 0x5a, sizeof(record));
+    snprintf(path, sizeof(path), "%s/readonly.dat", dir);
+    file = fopen(path, "wb");
+    CHECK(file != NULL);
+    if (!file)
+        return;
+    fwrite(record, 1, sizeof(record), file);
+    fclose(file);
+    chmod(path, 0444);
+
+    set_fcb(z80, "READONLYDAT");
+    CHECK(bdos(cpm, 26, BUFFER) == 0);
+    CHECK(bdos(cpm, 15, FCB) == 0);
+    CHECK(bdos(cpm, 20, FCB) == 0);
+    CHECK(memory[BUFFER] == 0x5a && memory[BUFFER + 127] == 0x5a);
+    if (access(path, W_OK) != 0)
+    {
+        memory[BUFFER] = 0xa5;
+        CHECK(bdos(cpm, 21, FCB) == 0xff);
+        memory[FCB + 33] = 0;
+        memory[FCB + 34] = 0;
+        memory[FCB + 35] = 0;
+        CHECK(bdos(cpm, 34, FCB) == 0xff);
+        CHECK(bdos(cpm, 33, FCB) == 0);
+        CHECK(memory[BUFFER] == 0x5a);
+    }
+    CHECK(bdos(cpm, 16, FCB) == 0);
+    unlink(path);
+}
+
+/** Console input echoes what it reads, and direct console input does not.
+ */
+static void test_console(struct Z80Cpm *cpm)
+{
+    char output[16] = {0};
+    FILE *in = tmpfile();
+    FILE *out = tmpfile();
+
+    CHECK(in != NULL && out != NULL);
+    if (!in || !out)
+        return;
+
+    fputs("ab\n", in);
+    rewind(in);
+    cpm->console_in = in;
+    cpm->console_out = out;
+
+    CHECK(bdos(cpm, 1, 0) == 'a');
+    CHECK(bdos(cpm, 6, 0xff) == 'b');
+    CHECK(bdos(cpm, 1, 0) == '\r');
+    CHECK(bdos(cpm, 1, 0) == 0x1a);
+
+    cpm->console_in = stdin;
+    cpm->console_out = stdout;
+    rewind(out);
+    CHECK(fread(output, 1, sizeof(output) - 1, out) == 2);
+    CHECK(strcmp(output, "a\n") == 0);
+    fclose(in);
+    fclose(out);
+}
+
+static void test_program(struct Z80 *z80, struct Z80Cpm *cpm, char const *rom)
+{
+    char output[4096] = {0};
+    FILE *out = tmpfile();
+
+    cpm->console_out = out;
+    CHECK(z80_cpm_load(cpm, rom, NULL) == 0);
+    CHECK(z80_cpm_run(cpm, z80->cycles + MAX_CYCLES) == Z80_CPM_EXITED);
+    cpm->console_out = stdout;
+
+    rewind(out);
+    fread(output, 1, sizeof(output) - 1, out);
+    fclose(out);
+    fputs(output, stdout);
+
+    CHECK(strstr(output, "Preliminary tests complete") != NULL);
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/z80-cpm-XXXXXX";
+    struct Z80Memory mem;
+    struct Z80Cpm cpm;
+    struct Z80 z80;
+
+    if (argc < 2)
+    {
+        printf("no rom file specified\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    z80_init(&z80);
+    z80_memory_init(&mem, &z80, memory);
+    z80_cpm_init(&cpm, &z80, dir);
+
+    CHECK(memory[0x0005] == 0xc3);
+    CHECK(bdos(&cpm, 12, 0) == 0x22);
+
+    test_files(&z80, &cpm, dir);
+    test_readonly(&z80, &cpm, dir);
+    test_console(&cpm);
+    test_program(&z80, &cpm, argv[1]);
+
+    z80_cpm_free(&cpm);
+    rmdir(dir);
+
+    return check_report();
+}
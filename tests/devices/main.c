@@ -0,0 +1,178 @@
+#include "check.h"
+#include "z80/devices.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define TIMER_PORT 0x40
+#define TICK 64
+#define RUN_CYCLES 200000
+
+/* Reads a timer between delays and halts, while its interrupt handler counts
+ * the interrupts and reloads it with varying periods. */
+static uint8_t const program[] = {
+    0x31, 0x00, 0x80, // ld sp, 0x8000
+    0xed, 0x56,       // im 1
+    0x3e, 0x05,       // ld a, 5
+    0xd3, 0x40,       // out (TIMER_PORT), a
+    0x21, 0x00, 0x40, // ld hl, 0x4000
+    0xfb,             // ei
+    0xdb, 0x40,       // loop: in a, (TIMER_PORT)
+    0x77,             // ld (hl), a
+    0x2c,             // inc l
+    0x06, 0x14,       // ld b, 20
+    0x10, 0xfe,       // djnz $
+    0xdb, 0x40,       // in a, (TIMER_PORT)
+    0x77,             // ld (hl), a
+    0x2c,             // inc l
+    0x76,             // halt
+    0x18, 0xf1,       // jr loop
+};
+
+static uint8_t const handler[] = {
+    0xf5,             // push af
+    0x3a, 0x00, 0x50, // ld a, (0x5000)
+    0x3c,             // inc a
+    0x32, 0x00, 0x50, // ld (0x5000), a
+    0xe6, 0x03,       // and 3
+    0xc6, 0x02,       // add a, 2
+    0xd3, 0x40,       // out (TIMER_PORT), a
+    0xf1,             // pop af
+    0xfb,             // ei
+    0xed, 0x4d,       // reti
+};
+
+/** A timer counting down in ticks of TICK cycles, which raises an interrupt
+ * and reloads itself when it reaches zero. Writing it sets the reload value
+ * and restarts it.
+ */
+struct Timer
+{
+    struct Z80Device device;
+    uint64_t expiry;
+    uint8_t reload;
+    int syncs;
+};
+
+static uint8_t memory[2][MEMORY_SIZE];
+
+static void timer_sync(struct Z80 *z80, struct Z80Device *device, uint64_t now)
+{
+    struct Timer *timer = device->userdata;
+
+    ++timer->syncs;
+    while (timer->expiry <= now)
+    {
+        z80_raise_irq(z80, 0xff);
+        timer->expiry += (uint64_t)timer->reload * TICK;
+    }
+    device->deadline = timer->expiry;
+}
+
+static uint8_t timer_load(struct Z80 *z80, uint16_t port, void *userdata)
+{
+    struct Timer const *timer = userdata;
+    (void)port;
+
+    if (timer->expiry == Z80_NO_DEADLINE)
+        return 0;
+    return (uint8_t)((timer->expiry - z80->cycles + TICK - 1) / TICK);
+}
+
+static void timer_store(struct Z80 *z80, uint16_t port, uint8_t val, void *userdata)
+{
+    struct Timer *timer = userdata;
+    (void)port;
+
+    timer->reload = val;
+    timer->expiry = val ? z80->cycles + (uint64_t)val * TICK : Z80_NO_DEADLINE;
+    timer->device.deadline = timer->expiry;
+}
+
+static void boot(struct Z80 *z80,
+                 struct Z80Memory *mem,
+                 struct Z80Ports *ports,
+                 struct Z80Devices *devices,
+                 struct Timer *timer,
+                 uint8_t *data)
+{
+    memset(data, 0, MEMORY_SIZE);
+    z80_init(z80);
+    z80_memory_init(mem, z80, data);
+    z80_memory_write(mem, 0x0000, program, sizeof(program));
+    z80_memory_write(mem, 0x0038, handler, sizeof(handler));
+
+    memset(timer, 0, sizeof(*timer));
+    timer->expiry = Z80_NO_DEADLINE;
+    timer->device.sync = timer_sync;
+    timer->device.load = timer_load;
+    timer->device.store = timer_store;
+    timer->device.userdata = timer;
+    timer->device.deadline = Z80_NO_DEADLINE;
+
+    z80_ports_init(ports, z80);
+    z80_devices_init(devices, ports);
+    CHECK(z80_devices_add(devices, &timer->device) == 0);
+    z80_devices_map(devices, &timer->device, TIMER_PORT, 0xff);
+}
+
+/** Runs the timer lazily, and again ticked after every instruction, which
+ * must give the same results with far fewer calls.
+ */
+static void test_timer(void)
+{
+    struct Z80Memory lazy_mem, eager_mem;
+    struct Z80Ports lazy_ports, eager_ports;
+    struct Z80Devices lazy_devices, eager_devices;
+    struct Timer lazy_timer, eager_timer;
+    struct Z80 lazy, eager;
+
+    boot(&lazy, &lazy_mem, &lazy_ports, &lazy_devices, &lazy_timer, memory[0]);
+    boot(&eager, &eager_mem, &eager_ports, &eager_devices, &eager_timer, memory[1]);
+
+    CHECK(z80_devices_run(&lazy_devices, &lazy, RUN_CYCLES) >= RUN_CYCLES);
+    while (eager.cycles < RUN_CYCLES)
+    {
+        z80_step(&eager);
+        z80_device_sync(&eager, &eager_timer.device);
+    }
+
+    CHECK(lazy.cycles == eager.cycles);
+    CHECK(lazy.pc == eager.pc);
+    CHECK(lazy.hl == eager.hl);
+    CHECK(lazy.r == eager.r);
+    CHECK(memory[0][0x5000] == memory[1][0x5000]);
+    CHECK(memory[0][0x5000] > 100);
+    CHECK(memcmp(memory[0], memory[1], MEMORY_SIZE) == 0);
+    CHECK(lazy_timer.syncs * 10 < eager_timer.syncs);
+    CHECK(lazy_devices.stop == 0);
+
+    z80_devices_sync_all(&lazy_devices, &lazy);
+    CHECK(lazy_timer.device.synced == lazy.cycles);
+}
+
+static void test_stop(void)
+{
+    struct Z80Memory mem;
+    struct Z80 z80;
+
+    memset(memory[0], 0, MEMORY_SIZE);
+    z80_init(&z80);
+    z80_memory_init(&mem, &z80, memory[0]);
+
+    z80_stop(&z80);
+    CHECK(z80_run(&z80, 1000) == 0);
+    CHECK(z80_run(&z80, 1000) >= 1000);
+    CHECK(atomic_load(&z80.pending) == 0);
+}
+
+int main(void)
+{
+    test_timer();
+    test_stop();
+
+    return check_report();
+}
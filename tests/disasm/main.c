@@ -0,0 +1,190 @@
+#include "check.h"
+#include "z80/disasm.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define ORIGIN 0x1000
+
+struct Expectation
+{
+    uint8_t code[Z80_MAX_INSTR_LENGTH];
+    uint16_t addr;
+    char const *text;
+    int length;
+};
+
+static struct Expectation const expectations[] = {
+    {{0x00}, 0, "nop", 1},
+    {{0x01, 0x34, 0x12}, 0, "ld bc, 0x1234", 3},
+    {{0x3e, 0x7f}, 0, "ld a, 0x7f", 2},
+    {{0x18, 0xfe}, 0x0100, "jr 0x0100", 2},
+    {{0x10, 0x10}, 0x0100, "djnz 0x0112", 2},
+    {{0x8e}, 0, "adc a, (hl)", 1},
+    {{0x96}, 0, "sub (hl)", 1},
+    {{0xc2, 0x00, 0x80}, 0, "jp nz, 0x8000", 3},
+    {{0xff}, 0, "rst 0x38", 1},
+    {{0xdb, 0x10}, 0, "in a, (0x10)", 2},
+    {{0x08}, 0, "ex af, af'", 1},
+    {{0xcb, 0x7e}, 0, "bit 7, (hl)", 2},
+    {{0xcb, 0x30}, 0, "sll b", 2},
+    {{0xed, 0xb0}, 0, "ldir", 2},
+    {{0xed, 0x4b, 0x00, 0x80}, 0, "ld bc, (0x8000)", 4},
+    {{0xed, 0x70}, 0, "in (c)", 2},
+    {{0xed, 0x00}, 0, "db 0xed, 0x00", 2},
+    {{0xdd, 0x36, 0xfb, 0x10}, 0, "ld (ix-0x05), 0x10", 4},
+    {{0xfd, 0x7e, 0x7f}, 0, "ld a, (iy+0x7f)", 3},
+    {{0xfd, 0x65}, 0, "ld iyh, iyl", 2},
+    {{0xdd, 0x00}, 0, "nop", 2},
+    {{0xdd, 0xdd}, 0, "db 0xdd", 1},
+    {{0xfd, 0xcb, 0x02, 0x46}, 0, "bit 0, (iy+0x02)", 4},
+    {{0xdd, 0xcb, 0x80, 0x00}, 0, "rlc (ix-0x80), b", 4},
+    {{0xdd, 0xcb, 0x01, 0xfe}, 0, "set 7, (ix+0x01)", 4},
+};
+
+static uint8_t memory[MEMORY_SIZE];
+
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    (void)z80;
+    (void)port;
+    return 0;
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    (void)z80;
+    (void)port;
+    (void)val;
+}
+
+static struct Z80Bus const bus = {
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+/** Returns whether an instruction can leave the PC somewhere other than the
+ * next instruction when its operands are zero.
+ */
+static int branches(char const *text)
+{
+    static char const *const prefixes[] = {"jp", "call", "ret", "rst"};
+    static char const *const repeats[]
+        = {"ldir", "cpir", "inir", "otir", "lddr", "cpdr", "indr", "otdr"};
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i)
+    {
+        if (strncmp(text, prefixes[i], strlen(prefixes[i])) == 0)
+            return 1;
+    }
+    for (size_t i = 0; i < sizeof(repeats) / sizeof(repeats[0]); ++i)
+    {
+        if (strcmp(text, repeats[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void test_expectations(void)
+{
+    for (size_t i = 0; i < sizeof(expectations) / sizeof(expectations[0]); ++i)
+    {
+        struct Expectation const *e = &expectations[i];
+        char text[64];
+        int const length = z80_disassemble(e->code, e->addr, text, sizeof(text));
+
+        if (strcmp(text, e->text) != 0 || length != e->length)
+        {
+            printf("  FAIL: expected \"%s\" (%i), got \"%s\" (%i)\n",
+                   e->text,
+                   e->length,
+                   text,
+                   length);
+            ++failures;
+        }
+    }
+}
+
+static void test_truncation(void)
+{
+    uint8_t const code[] = {0x01, 0x34, 0x12, 0x00};
+    char text[8];
+
+    memset(text, 'x', sizeof(text));
+    CHECK(z80_disassemble(code, 0, text, 4) == 3);
+    CHECK(strcmp(text, "ld ") == 0);
+    CHECK(text[4] == 'x');
+    CHECK(z80_disassemble(code, 0, NULL, 0) == 3);
+}
+
+/** Runs every instruction which does not branch, checking that the Z80 takes
+ * as many bytes as its disassembly says.
+ */
+static void test_lengths(void)
+{
+    static uint8_t const prefixes[][2] = {
+        {0}, {0xcb}, {0xed}, {0xdd}, {0xfd}, {0xdd, 0xcb}, {0xfd, 0xcb}};
+
+    for (size_t table = 0; table < sizeof(prefixes) / sizeof(prefixes[0]); ++table)
+    {
+        for (int opcode = 0; opcode < 256; ++opcode)
+        {
+            uint8_t code[Z80_MAX_INSTR_LENGTH] = {0};
+            struct Z80Memory mem;
+            struct Z80 z80;
+            char text[64];
+            int length;
+
+            if (table == 0)
+            {
+                code[0] = opcode;
+            }
+            else if (prefixes[table][1])
+            {
+                code[0] = prefixes[table][0];
+                code[1] = prefixes[table][1];
+                code[3] = opcode;
+            }
+            else
+            {
+                code[0] = prefixes[table][0];
+                code[1] = opcode;
+            }
+
+            length = z80_disassemble(code, ORIGIN, text, sizeof(text));
+            if (branches(text) || strncmp(text, "db ", 3) == 0)
+                continue;
+
+            memset(memory, 0, sizeof(memory));
+            z80_init(&z80);
+            z80.bus = &bus;
+            z80_memory_init(&mem, &z80, memory);
+            z80_memory_write(&mem, ORIGIN, code, sizeof(code));
+            z80.pc = ORIGIN;
+            z80.sp = 0x8000;
+            z80.bc = 2;
+
+            z80_step(&z80);
+            if (z80.pc != ORIGIN + length)
+            {
+                printf("  FAIL: \"%s\" is %i bytes, but ran %i\n",
+                       text,
+                       length,
+                       z80.pc - ORIGIN);
+                ++failures;
+            }
+        }
+    }
+}
+
+int main(void)
+{
+    test_expectations();
+    test_truncation();
+    test_lengths();
+
+    return check_report();
+}
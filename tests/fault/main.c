@@ -0,0 +1,138 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define GUARDED 0x8000
+#define RUN_CYCLES 1000
+
+static uint8_t memory[MEMORY_SIZE];
+
+static uint8_t mem_load(struct Z80 *z80, uint16_t addr)
+{
+    (void)z80;
+    return memory[addr];
+}
+
+/** Faults on writes to GUARDED, as a host might on a write to ROM.
+ */
+static void mem_store(struct Z80 *z80, uint16_t addr, uint8_t value)
+{
+    if (addr == GUARDED)
+        z80_raise_fault(z80, Z80_FAULT_HOST);
+    else
+        memory[addr] = value;
+}
+
+static struct Z80Bus const bus = {
+    .mem_load = mem_load,
+    .mem_store = mem_store,
+};
+
+/** Loads the program at `addr`, and steps the jump to it from 0x0000.
+ */
+static void boot(struct Z80 *z80,
+                 uint16_t addr,
+                 uint8_t const *program,
+                 size_t length)
+{
+    memset(memory, 0, sizeof(memory));
+    memory[0x0000] = 0xc3; // jp addr
+    memory[0x0001] = addr & 0xff;
+    memory[0x0002] = addr >> 8;
+    memcpy(memory + addr, program, length);
+
+    z80_init(z80);
+    z80->bus = &bus;
+    z80_step(z80);
+}
+
+/** Faults are reported at the first byte of the instruction which raised
+ * them, whatever prefixes it has and however far it had got.
+ */
+static void test_instruction_start(void)
+{
+    static uint8_t const illegal[] = {0xed, 0x00};
+    static uint8_t const prefixed[] = {0xdd, 0xed, 0x00};
+    static uint8_t const store[] = {0x32, GUARDED & 0xff, GUARDED >> 8};
+    struct Z80 z80;
+
+    boot(&z80, 0x0100, illegal, sizeof(illegal));
+    CHECK(z80_step(&z80) > 0);
+    CHECK(z80_fault(&z80) == Z80_FAULT_ILLEGAL_OPCODE);
+    CHECK(z80_fault_pc(&z80) == 0x0100);
+
+    boot(&z80, 0x0200, prefixed, sizeof(prefixed));
+    while (!z80_fault(&z80) && z80.pc < 0x0203)
+        z80_step(&z80);
+    CHECK(z80_fault(&z80) == Z80_FAULT_ILLEGAL_OPCODE);
+    CHECK(z80_fault_pc(&z80) == 0x0200);
+
+    boot(&z80, 0x0300, store, sizeof(store));
+    z80_step(&z80);
+    CHECK(z80_fault(&z80) == Z80_FAULT_HOST);
+    CHECK(z80_fault_pc(&z80) == 0x0300);
+
+    // Only the first fault is kept.
+    z80_raise_fault(&z80, Z80_FAULT_ILLEGAL_OPCODE);
+    CHECK(z80_fault(&z80) == Z80_FAULT_HOST);
+    CHECK(z80_fault_pc(&z80) == 0x0300);
+    CHECK(z80_step(&z80) == 0);
+
+    z80_clear_fault(&z80);
+    CHECK(z80_fault(&z80) == Z80_FAULT_NONE);
+    CHECK(z80_fault_pc(&z80) == 0);
+}
+
+/** Between instructions, a fault is reported at the next one.
+ */
+static void test_between(void)
+{
+    static uint8_t const nops[] = {0x00, 0x00};
+    struct Z80 z80;
+
+    boot(&z80, 0x0400, nops, sizeof(nops));
+    z80_step(&z80);
+    z80_raise_fault(&z80, Z80_FAULT_HOST);
+    CHECK(z80_fault_pc(&z80) == 0x0401);
+    CHECK(z80_step(&z80) == 0);
+    CHECK(z80.pc == 0x0401);
+}
+
+/** z80_run reports faults in the same way, with fused sequences or not.
+ */
+static void test_run(void)
+{
+    static uint8_t const loop[] = {
+        0x06, 0x03, // ld b, 3
+        0x05,       // loop: dec b
+        0x20, 0xfd, // jr nz, loop
+        0xfd, 0xed, // an illegal ED
+        0x00,       // behind a prefix
+    };
+    struct Z80Memory mem;
+    struct Z80 z80;
+
+    for (int fuse = 0; fuse < 2; ++fuse)
+    {
+        boot(&z80, 0x0500, loop, sizeof(loop));
+        z80_memory_init(&mem, &z80, memory);
+        z80.fuse = fuse;
+        z80_run(&z80, z80.cycles + RUN_CYCLES);
+        CHECK(z80_fault(&z80) == Z80_FAULT_ILLEGAL_OPCODE);
+        CHECK(z80_fault_pc(&z80) == 0x0505);
+        CHECK(z80.b == 0);
+    }
+}
+
+int main(void)
+{
+    test_instruction_start();
+    test_between();
+    test_run();
+
+    return check_report();
+}
@@ -0,0 +1,113 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define NUM_CHILDREN 4
+#define PAGE_BIT(ADDR) ((uint64_t)1 << ((ADDR) >> Z80_PAGE_BITS))
+
+/* Run from ROM: stores a counter to RAM, and tries to overwrite the ROM. */
+static uint8_t const program[] = {
+    0x32, 0x00, 0x40, // loop: ld (0x4000), a
+    0x32, 0x00, 0x00, // ld (0x0000), a
+    0x3c,             // inc a
+    0x18, 0xf7,       // jr loop
+};
+
+static uint8_t memory[MEMORY_SIZE];
+
+static uint8_t peek(struct Z80 const *z80, uint16_t addr)
+{
+    uint8_t val;
+    z80_memory_read(z80->memory, addr, &val, 1);
+    return val;
+}
+
+static void run(struct Z80 *z80, int steps)
+{
+    for (int i = 0; i < steps; ++i)
+        z80_step(z80);
+}
+
+static void test_fork(void)
+{
+    struct Z80 *children[NUM_CHILDREN];
+    struct Z80 *grandchild;
+    struct Z80WriteLog log = {0};
+    struct Z80Memory mem;
+    struct Z80 parent;
+    struct Z80Rom *rom = z80_rom_create(program, sizeof(program));
+    uint8_t const pattern = 0x5a;
+
+    memset(memory, 0, sizeof(memory));
+    z80_init(&parent);
+    z80_memory_init(&mem, &parent, memory);
+    CHECK(z80_memory_map_rom(&mem, rom, 0x0000) == 0);
+    z80_memory_write(&mem, 0x8000, &pattern, 1);
+    parent.a = 0;
+    run(&parent, 12);
+    CHECK(peek(&parent, 0x4000) == 2);
+
+    parent.write_log = &log;
+    CHECK(z80_fork(&parent, NUM_CHILDREN, children) == 0);
+    parent.write_log = NULL;
+    CHECK(atomic_load(&rom->refs) == 2 + NUM_CHILDREN);
+
+    for (int i = 0; i < NUM_CHILDREN; ++i)
+    {
+        struct Z80 *child = children[i];
+
+        CHECK(child->pc == parent.pc && child->cycles == parent.cycles);
+        CHECK(child->memory != parent.memory);
+        CHECK(child->write_log == NULL);
+        // Nothing is copied until written.
+        CHECK(child->memory->shared == ~(uint64_t)0);
+
+        child->a = 0x10 * (i + 1);
+        run(child, 3);
+    }
+
+    // The parent goes on without seeing the children.
+    z80_memory_write(&mem, 0x8000, "\x11", 1);
+    run(&parent, 3);
+    CHECK(peek(&parent, 0x4000) == 3);
+    CHECK(mem.shared == PAGE_BIT(0x0000));
+
+    for (int i = 0; i < NUM_CHILDREN; ++i)
+    {
+        struct Z80 const *child = children[i];
+
+        CHECK(peek(child, 0x4000) == 0x10 * (i + 1));
+        CHECK(peek(child, 0x8000) == pattern);
+        CHECK(peek(child, 0x0000) == 0x32);
+        CHECK(!(child->memory->shared & PAGE_BIT(0x4000)));
+        CHECK(child->memory->shared & PAGE_BIT(0x8000));
+        CHECK(child->memory->shared & PAGE_BIT(0x0000));
+    }
+
+    // Children fork as parents do, passing on what they have written.
+    CHECK(z80_fork(children[1], 1, &grandchild) == 0);
+    CHECK(peek(grandchild, 0x4000) == 0x20);
+    CHECK(peek(grandchild, 0x8000) == pattern);
+    run(grandchild, 3);
+    CHECK(peek(grandchild, 0x4000) == 0x21);
+    CHECK(peek(children[1], 0x4000) == 0x20);
+    z80_fork_free(grandchild);
+
+    for (int i = 0; i < NUM_CHILDREN; ++i)
+        z80_fork_free(children[i]);
+    CHECK(atomic_load(&rom->refs) == 2);
+
+    z80_memory_free(&mem);
+    z80_rom_release(rom);
+}
+
+int main(void)
+{
+    test_fork();
+
+    return check_report();
+}
@@ -1,4 +1,5 @@
 #include "fuse-tests.h"
+#include "z80/coverage.h"
 #include "z80/z80.h"
 #include <stdbool.h>
 #include <stdio.h>
@@ -15,6 +16,10 @@ static char const *const tests_to_skip[] = {"76", /* FUSE tests say PC doesn't
                                                    * increment on HALT. Not
                                                    * doing so break PAUSE on the
                                                    * 48k Spectrum. */
+#ifdef Z80_ACCURACY_FAST
+                                            "ed5f", /* R is not kept, so ld a, r
+                                                     * reads a stale value. */
+#endif
                                             NULL};
 /** True if the named test is in the skip list.
  */
@@ -89,6 +94,13 @@ void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
     (void)val;
 }
 
+static struct Z80Bus const bus = {
+    .mem_load = mem_load,
+    .mem_store = mem_store,
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
 int main(int argc, char **argv)
 {
     (void)argc;
@@ -107,10 +119,7 @@ int main(int argc, char **argv)
             continue;
 
         z80_init(&z80);
-        z80.mem_load = mem_load;
-        z80.mem_store = mem_store;
-        z80.port_load = port_load;
-        z80.port_store = port_store;
+        z80.bus = &bus;
 
         for (int i = 0; i < MEMORY_SIZE; i += 4)
         {
@@ -170,7 +179,9 @@ int main(int argc, char **argv)
         CHECK_REG(sp);
         CHECK_REG(pc);
         CHECK_REG(i);
+#ifndef Z80_ACCURACY_FAST
         CHECK_REG(r);
+#endif
         CHECK_REG(iff1);
         CHECK_REG(iff2);
 
@@ -178,6 +189,16 @@ int main(int argc, char **argv)
             ++failures;
     }
 
+#ifdef Z80_COVERAGE
+    FILE *out = fopen("fuse.coverage", "w");
+    if (out)
+    {
+        z80_coverage_dump(out);
+        fclose(out);
+        printf("coverage written to fuse.coverage\n");
+    }
+#endif
+
     printf("%i TESTS FAILED\n", failures);
     return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
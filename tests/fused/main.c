@@ -0,0 +1,225 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define COM_ORIGIN 0x0100
+#define MAX_UNTIL 2000
+#define PROGRAM_CYCLES 20000000
+
+struct Program
+{
+    char const *label;
+    uint8_t code[32];
+    size_t length;
+};
+
+static struct Program const programs[] = {
+    {"copy loop",
+     {
+         0x21, 0x00, 0x10, // ld hl, 0x1000
+         0x11, 0x00, 0x20, // ld de, 0x2000
+         0x01, 0x20, 0x00, // ld bc, 0x0020
+         0x7e,             // loop: ld a, (hl)
+         0x23,             // inc hl
+         0x12,             // ld (de), a
+         0x13,             // inc de
+         0x0b,             // dec bc
+         0x78,             // ld a, b
+         0xb1,             // or c
+         0x20, 0xf7,       // jr nz, loop
+         0x76,             // halt
+     },
+     20},
+    {"fill and read back",
+     {
+         0x21, 0x00, 0x30, // ld hl, 0x3000
+         0x3e, 0x5a,       // ld a, 0x5a
+         0x06, 0x10,       // ld b, 0x10
+         0x77,             // fill: ld (hl), a
+         0x23,             // inc hl
+         0x10, 0xfc,       // djnz fill
+         0x11, 0x00, 0x30, // ld de, 0x3000
+         0x1a,             // read: ld a, (de)
+         0x13,             // inc de
+         0x0d,             // dec c
+         0x20, 0xfb,       // jr nz, read
+         0x76,             // halt
+     },
+     20},
+    {"counters",
+     {
+         0x05,       // loop: dec b
+         0x20, 0xfd, // jr nz, loop
+         0x3c,       // inc a
+         0xfe, 0x40, // cp 0x40
+         0x38, 0xf8, // jr c, loop
+         0xb7,       // or a
+         0x28, 0x02, // jr z, done
+         0xa7,       // and a
+         0x20, 0xf3, // jr nz, loop
+         0x76,       // done: halt
+     },
+     15},
+};
+
+static uint8_t memory[2][MEMORY_SIZE];
+
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    (void)z80;
+    (void)port;
+    return 0;
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    (void)z80;
+    (void)port;
+    (void)val;
+}
+
+static struct Z80Bus const bus = {
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+static void boot(struct Z80 *z80,
+                 struct Z80Memory *mem,
+                 uint8_t *data,
+                 uint16_t origin,
+                 uint8_t const *code,
+                 size_t length)
+{
+    memset(data, 0, MEMORY_SIZE);
+    z80_init(z80);
+    z80->bus = &bus;
+    z80_memory_init(mem, z80, data);
+    z80_memory_write(mem, origin, code, length);
+    z80->pc = origin;
+}
+
+#define CHECK_REG(REG)                                                         \
+    if (fused->REG != plain->REG)                                              \
+    {                                                                          \
+        ok = 0;                                                                \
+        printf("  FAIL: " #REG " // expected 0x%04llx, actual 0x%04llx\n",    \
+               (unsigned long long)plain->REG,                                 \
+               (unsigned long long)fused->REG);                                \
+    }
+
+/** Checks that fusing left the Z80 where running it without fusing did.
+ */
+static int same(struct Z80 const *fused, struct Z80 const *plain)
+{
+    int ok = 1;
+
+    CHECK_REG(cycles);
+    CHECK_REG(pc);
+    CHECK_REG(sp);
+    CHECK_REG(r);
+    CHECK_REG(af);
+    CHECK_REG(bc);
+    CHECK_REG(de);
+    CHECK_REG(hl);
+    CHECK_REG(ix);
+    CHECK_REG(iy);
+    CHECK_REG(halted);
+
+    if (memcmp(memory[0], memory[1], MEMORY_SIZE) != 0)
+    {
+        ok = 0;
+        printf("  FAIL: memory differs\n");
+    }
+    return ok;
+}
+
+/** Runs each program to every cycle count up to MAX_UNTIL, so that runs end
+ * within each of its fused sequences.
+ */
+static void test_programs(void)
+{
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); ++i)
+    {
+        struct Program const *program = &programs[i];
+
+        for (uint64_t until = 1; until <= MAX_UNTIL; ++until)
+        {
+            struct Z80Memory fused_mem, plain_mem;
+            struct Z80 fused, plain;
+
+            boot(&fused, &fused_mem, memory[0], 0, program->code, program->length);
+            boot(&plain, &plain_mem, memory[1], 0, program->code, program->length);
+            fused.fuse = 1;
+
+            z80_run(&fused, until);
+            z80_run(&plain, until);
+
+            if (!same(&fused, &plain))
+            {
+                printf("%s, until %llu\n", program->label, (unsigned long long)until);
+                ++failures;
+                break;
+            }
+        }
+    }
+}
+
+/** Runs a CP/M program in slices of varying length, with BDOS calls
+ * returning at once, comparing after each slice.
+ */
+static void test_com(char const *path)
+{
+    static uint8_t const stubs[] = {0x76, 0x00, 0x00, 0x00, 0x00, 0xc9};
+    uint8_t *image = malloc(MEMORY_SIZE);
+    FILE *file = fopen(path, "rb");
+    struct Z80Memory fused_mem, plain_mem;
+    struct Z80 fused, plain;
+    uint32_t seed = 1;
+    size_t length;
+
+    if (!file || !image)
+    {
+        printf("  FAIL: cannot read %s\n", path);
+        ++failures;
+        free(image);
+        return;
+    }
+    length = fread(image, 1, MEMORY_SIZE - COM_ORIGIN, file);
+    fclose(file);
+
+    boot(&fused, &fused_mem, memory[0], COM_ORIGIN, image, length);
+    boot(&plain, &plain_mem, memory[1], COM_ORIGIN, image, length);
+    z80_memory_write(&fused_mem, 0, stubs, sizeof(stubs));
+    z80_memory_write(&plain_mem, 0, stubs, sizeof(stubs));
+    fused.fuse = 1;
+    free(image);
+
+    while (plain.cycles < PROGRAM_CYCLES)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint64_t const until = plain.cycles + 1 + (seed >> 16) % 1000;
+
+        z80_run(&fused, until);
+        z80_run(&plain, until);
+
+        if (!same(&fused, &plain))
+        {
+            printf("%s, until %llu\n", path, (unsigned long long)until);
+            ++failures;
+            return;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    test_programs();
+    if (argc > 1)
+        test_com(argv[1]);
+
+    return check_report();
+}
@@ -0,0 +1,317 @@
+/* Fuzz target for guest firmware.
+ *
+ * The fuzzer input is split into two parts: the first two bytes give the
+ * length of a block which is copied into RAM at RAM_BASE, and everything after
+ * that block is fed to the guest, one byte per port read. Each input runs for
+ * at most a bounded number of cycles.
+ *
+ * Between runs the machine is returned to its pristine state by copying back
+ * only the pages written during the previous run, and restoring the registers
+ * from a saved copy. No memset, full memory refill or ROM reload takes place.
+ *
+ * Built with Z80_LIBFUZZER this provides LLVMFuzzerTestOneInput, and any fault
+ * aborts so that libFuzzer records a crash. Otherwise, a standalone driver is
+ * built which runs each file named on the command line (suitable for AFL's
+ * `@@`), or a batch of random inputs when no files are given.
+ */
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MEMORY_SIZE 65536
+#define PAGE_BITS 10
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define ROM_SIZE 0x4000
+#define RAM_BASE 0x8000
+#define RAM_WINDOW 0x8000
+#define DEFAULT_CYCLES 100000
+
+/* A small command interpreter used when no firmware is supplied through the
+ * Z80_FUZZ_ROM environment variable. Port 0 supplies commands: 1 stores the
+ * byte from port 1 into the buffer at 0x8000, 2 writes the buffer's checksum
+ * to port 2, and 0xff halts.
+ */
+static uint8_t const default_rom[] = {
+    0x31, 0x00, 0x00, // ld sp, 0x0000
+    0x21, 0x00, 0x80, // ld hl, 0x8000
+    0xdb, 0x00,       // loop: in a, (0x00)
+    0xfe, 0x01,       // cp 0x01
+    0x28, 0x0a,       // jr z, store
+    0xfe, 0x02,       // cp 0x02
+    0x28, 0x0c,       // jr z, sum
+    0xfe, 0xff,       // cp 0xff
+    0x20, 0xf2,       // jr nz, loop
+    0x76,             // halt
+    0x00,             // nop
+    0xdb, 0x01,       // store: in a, (0x01)
+    0x77,             // ld (hl), a
+    0x2c,             // inc l
+    0x18, 0xea,       // jr loop
+    0xe5,             // sum: push hl
+    0x21, 0x00, 0x80, // ld hl, 0x8000
+    0x06, 0x00,       // ld b, 0x00
+    0xaf,             // xor a
+    0x86,             // sloop: add a, (hl)
+    0x23,             // inc hl
+    0x10, 0xfc,       // djnz sloop
+    0xd3, 0x02,       // out (0x02), a
+    0xe1,             // pop hl
+    0x18, 0xda,       // jr loop
+};
+
+static uint8_t pristine[MEMORY_SIZE];
+static uint8_t memory[MEMORY_SIZE];
+static uint64_t dirty;
+static struct Z80 boot;
+static struct Z80 z80;
+static int64_t cycle_limit = DEFAULT_CYCLES;
+
+static uint8_t const *feed;
+static size_t feed_length;
+
+static uint8_t mem_load(struct Z80 *z80, uint16_t const addr)
+{
+    (void)z80;
+    return memory[addr];
+}
+
+static void mem_store(struct Z80 *z80, uint16_t const addr, uint8_t const val)
+{
+    if (addr < ROM_SIZE)
+    {
+        z80_raise_fault(z80, Z80_FAULT_HOST);
+        return;
+    }
+
+    dirty |= (uint64_t)1 << (addr >> PAGE_BITS);
+    memory[addr] = val;
+}
+
+static uint8_t port_load(struct Z80 *z80, uint16_t const port)
+{
+    (void)z80;
+    (void)port;
+    if (feed_length == 0)
+        return 0xff;
+
+    --feed_length;
+    return *feed++;
+}
+
+static void port_store(struct Z80 *z80, uint16_t const port, uint8_t const val)
+{
+    (void)z80;
+    (void)port;
+    (void)val;
+}
+
+static struct Z80Bus const bus = {
+    .mem_load = mem_load,
+    .mem_store = mem_store,
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+/** Copies back only those pages written since the last reset.
+ */
+static void reset_machine(void)
+{
+    while (dirty)
+    {
+        int const page = __builtin_ctzll(dirty);
+        memcpy(memory + (page << PAGE_BITS),
+               pristine + (page << PAGE_BITS),
+               PAGE_SIZE);
+        dirty &= dirty - 1;
+    }
+
+    z80 = boot;
+}
+
+static void load_rom(void)
+{
+    char const *path = getenv("Z80_FUZZ_ROM");
+    char const *cycles = getenv("Z80_FUZZ_CYCLES");
+
+    if (cycles)
+        cycle_limit = strtoll(cycles, NULL, 0);
+
+    if (path)
+    {
+        FILE *romfile = fopen(path, "rb");
+        if (!romfile)
+        {
+            fprintf(stderr, "could not open rom file '%s'\n", path);
+            exit(EXIT_FAILURE);
+        }
+        fread(pristine, 1, ROM_SIZE, romfile);
+        fclose(romfile);
+    }
+    else
+    {
+        memcpy(pristine, default_rom, sizeof(default_rom));
+    }
+
+    memcpy(memory, pristine, sizeof(memory));
+
+    z80_init(&boot);
+    boot.bus = &bus;
+    z80 = boot;
+}
+
+/** Runs a single input, and returns the fault it raised, if any.
+ */
+static int run_input(uint8_t const *data, size_t size)
+{
+    size_t ram_length = 0;
+
+    reset_machine();
+
+    if (size >= 2)
+    {
+        ram_length = data[0] | (data[1] << 8);
+        data += 2;
+        size -= 2;
+    }
+    else
+    {
+        size = 0;
+    }
+
+    if (ram_length > size)
+        ram_length = size;
+    if (ram_length > RAM_WINDOW)
+        ram_length = RAM_WINDOW;
+
+    if (ram_length)
+    {
+        memcpy(memory + RAM_BASE, data, ram_length);
+        for (size_t page = RAM_BASE >> PAGE_BITS;
+             page <= (RAM_BASE + ram_length - 1) >> PAGE_BITS;
+             ++page)
+        {
+            dirty |= (uint64_t)1 << page;
+        }
+    }
+
+    feed = data + ram_length;
+    feed_length = size - ram_length;
+
+    while (z80.cycles < (uint64_t)cycle_limit && !z80_is_halted(&z80)
+           && !z80_fault(&z80))
+    {
+        z80_step(&z80);
+    }
+
+    return z80_fault(&z80);
+}
+
+#ifdef Z80_LIBFUZZER
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void)argc;
+    (void)argv;
+    load_rom();
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size)
+{
+    if (run_input(data, size))
+    {
+        fprintf(stderr,
+                "fault %i at 0x%04x\n",
+                z80_fault(&z80),
+                z80_fault_pc(&z80));
+        abort();
+    }
+
+    return 0;
+}
+
+#else
+
+#define NUM_RANDOM_INPUTS 200000
+#define MAX_RANDOM_INPUT 64
+
+static int run_file(char const *path)
+{
+    static uint8_t buffer[MEMORY_SIZE * 2];
+    FILE *file = fopen(path, "rb");
+    size_t size;
+
+    if (!file)
+    {
+        fprintf(stderr, "could not open input '%s'\n", path);
+        return EXIT_FAILURE;
+    }
+    size = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+
+    if (run_input(buffer, size))
+    {
+        printf("%s: fault %i at 0x%04x\n",
+               path,
+               z80_fault(&z80),
+               z80_fault_pc(&z80));
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t input[MAX_RANDOM_INPUT];
+    uint32_t seed = 0x2545f491;
+    int faults = 0;
+    clock_t start;
+    double elapsed;
+
+    load_rom();
+
+    if (argc > 1)
+    {
+        int result = EXIT_SUCCESS;
+        for (int i = 1; i < argc; ++i)
+        {
+            if (run_file(argv[i]) != EXIT_SUCCESS)
+                result = EXIT_FAILURE;
+        }
+        return result;
+    }
+
+    start = clock();
+    for (int i = 0; i < NUM_RANDOM_INPUTS; ++i)
+    {
+        size_t const size = 2 + i % (MAX_RANDOM_INPUT - 2);
+        for (size_t j = 0; j < size; ++j)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            input[j] = seed;
+        }
+        /* Keep the RAM block small, so that most of the input drives the
+         * ports. */
+        input[1] = 0;
+        input[0] &= 0x0f;
+
+        if (run_input(input, size))
+            ++faults;
+    }
+    elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%i executions in %.2fs (%.0f exec/s), %i faults\n",
+           NUM_RANDOM_INPUTS,
+           elapsed,
+           elapsed > 0 ? NUM_RANDOM_INPUTS / elapsed : 0.0,
+           faults);
+
+    return faults == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define NUM_STEPS 20000
+#define CHECK_EVERY 97
+
+/* Fills memory upwards from 0x4000 with a scrambled sequence. */
+static uint8_t const program[] = {
+    0x21, 0x00, 0x40, // ld hl, 0x4000
+    0x3e, 0x01,       // ld a, 1
+    0x77,             // loop: ld (hl), a
+    0x07,             // rlca
+    0xac,             // xor h
+    0x23,             // inc hl
+    0xc3, 0x05, 0x00, // jp loop
+};
+
+static uint8_t memory[2][MEMORY_SIZE];
+
+static void boot(struct Z80 *z80, struct Z80Memory *mem, uint8_t *data)
+{
+    memset(data, 0, MEMORY_SIZE);
+    z80_init(z80);
+    z80_memory_init(mem, z80, data);
+    z80_memory_write(mem, 0x0000, program, sizeof(program));
+    z80_memory_enable_hashing(mem);
+}
+
+static void run(struct Z80 *z80, int steps)
+{
+    for (int i = 0; i < steps; ++i)
+        z80_step(z80);
+}
+
+/** Checks that the hash kept through each write is the one computed from
+ * scratch.
+ */
+static int hash_is_current(struct Z80Memory *mem)
+{
+    uint64_t const kept = mem->hash;
+
+    z80_memory_rehash(mem, ~(uint64_t)0);
+    return mem->hash == kept;
+}
+
+static void test_incremental(void)
+{
+    struct Z80Memory mem;
+    struct Z80 z80;
+    uint8_t block[3000];
+
+    boot(&z80, &mem, memory[0]);
+    for (int step = 0; step < NUM_STEPS; step += CHECK_EVERY)
+    {
+        run(&z80, CHECK_EVERY);
+        CHECK(hash_is_current(&mem));
+    }
+
+    for (size_t i = 0; i < sizeof(block); ++i)
+        block[i] = (uint8_t)(i * 7);
+    z80_memory_write(&mem, 0xf800, block, sizeof(block));
+    CHECK(hash_is_current(&mem));
+
+    // Changes made behind the memory's back are picked up by a rehash.
+    memory[0][0x8000] ^= 0xff;
+    CHECK(!hash_is_current(&mem));
+    CHECK(hash_is_current(&mem));
+}
+
+/** The same state has the same hash, however it was reached.
+ */
+static void test_states(void)
+{
+    struct Z80Memory a_mem, b_mem;
+    struct Z80 a, b;
+    uint8_t const byte = 0x42;
+    uint8_t old;
+
+    boot(&a, &a_mem, memory[0]);
+    boot(&b, &b_mem, memory[1]);
+    run(&a, 1000);
+    run(&b, 1000);
+    b.cycles += 12345;
+    CHECK(a_mem.hash != 0);
+    CHECK(z80_state_hash(&a) == z80_state_hash(&b));
+
+    z80_memory_read(&b_mem, 0x9000, &old, 1);
+    z80_memory_write(&b_mem, 0x9000, &byte, 1);
+    CHECK(z80_state_hash(&a) != z80_state_hash(&b));
+    z80_memory_write(&b_mem, 0x9000, &old, 1);
+    CHECK(z80_state_hash(&a) == z80_state_hash(&b));
+
+    ++b.bc;
+    CHECK(z80_state_hash(&a) != z80_state_hash(&b));
+    --b.bc;
+    CHECK(z80_state_hash(&a) == z80_state_hash(&b));
+}
+
+static void test_snapshot(void)
+{
+    static struct Z80Snapshot snapshot;
+    struct Z80Memory mem;
+    struct Z80 z80;
+
+    boot(&z80, &mem, memory[0]);
+    run(&z80, 500);
+    z80_snapshot_init(&snapshot, &z80);
+    uint64_t const taken = z80_state_hash(&z80);
+
+    run(&z80, 5000);
+    CHECK(z80_state_hash(&z80) != taken);
+    z80_snapshot_restore(&z80, &snapshot);
+    CHECK(z80_state_hash(&z80) == taken);
+    CHECK(hash_is_current(&mem));
+}
+
+/** Memory mapped from a ROM hashes as its contents, and forks start with
+ * their parent's hash.
+ */
+static void test_rom_fork(void)
+{
+    struct Z80Memory rom_mem, ram_mem;
+    struct Z80 rom_z80, ram_z80;
+    struct Z80 *child;
+    struct Z80Rom *rom = z80_rom_create(program, sizeof(program));
+
+    boot(&ram_z80, &ram_mem, memory[0]);
+    memset(memory[1], 0, MEMORY_SIZE);
+    z80_init(&rom_z80);
+    z80_memory_init(&rom_mem, &rom_z80, memory[1]);
+    z80_memory_enable_hashing(&rom_mem);
+    CHECK(z80_memory_map_rom(&rom_mem, rom, 0x0000) == 0);
+    CHECK(rom_mem.hash == ram_mem.hash);
+
+    run(&rom_z80, 1000);
+    run(&ram_z80, 1000);
+    CHECK(z80_state_hash(&rom_z80) == z80_state_hash(&ram_z80));
+
+    CHECK(z80_fork(&rom_z80, 1, &child) == 0);
+    CHECK(z80_state_hash(child) == z80_state_hash(&rom_z80));
+    run(child, 100);
+    CHECK(z80_state_hash(child) != z80_state_hash(&rom_z80));
+    CHECK(hash_is_current(child->memory));
+    z80_fork_free(child);
+
+    z80_memory_free(&rom_mem);
+    CHECK(hash_is_current(&rom_mem));
+    z80_rom_release(rom);
+}
+
+int main(void)
+{
+    test_incremental();
+    test_states();
+    test_snapshot();
+    test_rom_fork();
+
+    return check_report();
+}
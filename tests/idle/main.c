@@ -0,0 +1,160 @@
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+
+struct Program
+{
+    char const *label;
+    uint8_t code[16];
+    size_t length;
+    uint8_t skip_loops;
+    uint64_t until;
+    /** Upper bound on the port reads made when the loop is skipped. */
+    uint32_t max_port_reads;
+};
+
+static struct Program const programs[] = {
+    {"halt", {0x76}, 1, 0, 100003, 0},
+    {"ei; halt", {0xfb, 0x76}, 2, 0, 100001, 0},
+    {"jr $", {0x18, 0xfe}, 2, Z80_SKIP_SPIN, 100005, 0},
+    {"jp $", {0xc3, 0x00, 0x00}, 3, Z80_SKIP_SPIN, 99999, 0},
+    {"djnz $ (to end)",
+     {0x06, 0xc8, 0x10, 0xfe, 0x76},
+     5,
+     Z80_SKIP_SPIN,
+     100000,
+     0},
+    {"djnz $ (part way)",
+     {0x06, 0xc8, 0x10, 0xfe, 0x76},
+     5,
+     Z80_SKIP_SPIN,
+     1001,
+     0},
+    {"poll port",
+     {0xdb, 0x10, 0xe6, 0x01, 0x28, 0xfa},
+     6,
+     Z80_SKIP_POLL,
+     1000000,
+     3},
+    {"poll port (not skipped)",
+     {0xdb, 0x10, 0xe6, 0x01, 0x28, 0xfa},
+     6,
+     Z80_SKIP_SPIN,
+     100000,
+     UINT32_MAX},
+    {"poll memory",
+     {0x3a, 0x00, 0x80, 0xb7, 0x28, 0xfa},
+     6,
+     Z80_SKIP_SPIN,
+     1000000,
+     0},
+    {"busy loop",
+     {0x21, 0x00, 0x80, 0x34, 0x18, 0xfd},
+     6,
+     Z80_SKIP_SPIN,
+     100000,
+     0},
+};
+
+static uint8_t memory[2][MEMORY_SIZE];
+
+/** Counts the port reads of each Z80 in its userdata. */
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    (void)port;
+    ++*(uint32_t *)z80->userdata;
+    return 0;
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    (void)z80;
+    (void)port;
+    (void)val;
+}
+
+static struct Z80Bus const bus = {
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+static void boot(struct Z80 *z80,
+                 struct Z80Memory *mem,
+                 uint8_t *data,
+                 uint32_t *port_reads,
+                 struct Program const *program)
+{
+    memset(data, 0, MEMORY_SIZE);
+    *port_reads = 0;
+    z80_init(z80);
+    z80->bus = &bus;
+    z80->userdata = port_reads;
+    z80_memory_init(mem, z80, data);
+    z80_memory_write(mem, 0x0000, program->code, program->length);
+}
+
+#define CHECK_REG(REG)                                                         \
+    if (fast.REG != slow.REG)                                                  \
+    {                                                                          \
+        ok = 0;                                                                \
+        printf("  FAIL: " #REG " // expected 0x%04llx, actual 0x%04llx\n",    \
+               (unsigned long long)slow.REG,                                   \
+               (unsigned long long)fast.REG);                                  \
+    }
+
+int main(void)
+{
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); ++i)
+    {
+        struct Program const *program = &programs[i];
+        struct Z80Memory fast_mem, slow_mem;
+        struct Z80 fast, slow;
+        uint32_t fast_reads, slow_reads;
+        int ok = 1;
+
+        boot(&fast, &fast_mem, memory[0], &fast_reads, program);
+        boot(&slow, &slow_mem, memory[1], &slow_reads, program);
+
+        fast.skip_loops = program->skip_loops;
+        z80_run(&fast, program->until);
+
+        while (slow.cycles < program->until)
+            z80_step(&slow);
+
+        CHECK_REG(cycles);
+        CHECK_REG(pc);
+        CHECK_REG(r);
+        CHECK_REG(af);
+        CHECK_REG(bc);
+        CHECK_REG(hl);
+        CHECK_REG(halted);
+        CHECK_REG(iff1);
+
+        if (memcmp(memory[0], memory[1], MEMORY_SIZE) != 0)
+        {
+            ok = 0;
+            printf("  FAIL: memory differs\n");
+        }
+
+        if (fast_reads > program->max_port_reads)
+        {
+            ok = 0;
+            printf("  FAIL: loop not skipped (%u port reads)\n", fast_reads);
+        }
+
+        if (!ok)
+        {
+            printf("%s\n", program->label);
+            ++failures;
+        }
+    }
+
+    printf("%i TESTS FAILED\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
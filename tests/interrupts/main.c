@@ -0,0 +1,241 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define VECTOR 0x10
+#define IRQ_COUNT 0x4000
+#define NMI_COUNT 0x4001
+#define SLICE 1000
+#define NUM_RAISES 200
+#define MAX_CYCLES 1000000000ull
+
+/* Waits in halt for mode 2 interrupts through the table at 0x4000, whose
+ * handler counts them and reports the count on port 0. */
+static uint8_t const program[] = {
+    0x31, 0x00, 0x80, // ld sp, 0x8000
+    0xed, 0x5e,       // im 2
+    0x3e, 0x40,       // ld a, 0x40
+    0xed, 0x47,       // ld i, a
+    0xfb,             // ei
+    0x76,             // loop: halt
+    0x18, 0xfd,       // jr loop
+};
+
+static uint8_t const irq_handler[] = {
+    0xf5,             // push af
+    0x3a, 0x00, 0x40, // ld a, (IRQ_COUNT)
+    0x3c,             // inc a
+    0x32, 0x00, 0x40, // ld (IRQ_COUNT), a
+    0xd3, 0x00,       // out (0), a
+    0xf1,             // pop af
+    0xfb,             // ei
+    0xed, 0x4d,       // reti
+};
+
+static uint8_t const nmi_handler[] = {
+    0xf5,             // push af
+    0x3a, 0x01, 0x40, // ld a, (NMI_COUNT)
+    0x3c,             // inc a
+    0x32, 0x01, 0x40, // ld (NMI_COUNT), a
+    0xf1,             // pop af
+    0xed, 0x45,       // retn
+};
+
+static uint8_t memory[MEMORY_SIZE];
+static atomic_int acks;
+
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    (void)z80;
+    (void)port;
+    return 0xff;
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    (void)z80;
+    (void)port;
+    atomic_store(&acks, val);
+}
+
+static struct Z80Bus const bus = {
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+static void boot(struct Z80 *z80, struct Z80Memory *mem)
+{
+    uint8_t const vector[] = {0x00, 0x01};
+
+    memset(memory, 0, sizeof(memory));
+    atomic_store(&acks, 0);
+    z80_init(z80);
+    z80->bus = &bus;
+    z80_memory_init(mem, z80, memory);
+    z80_memory_write(mem, 0x0000, program, sizeof(program));
+    z80_memory_write(mem, 0x0066, nmi_handler, sizeof(nmi_handler));
+    z80_memory_write(mem, 0x0100, irq_handler, sizeof(irq_handler));
+    z80_memory_write(mem, 0x4000 + VECTOR, vector, sizeof(vector));
+}
+
+static void run(struct Z80 *z80)
+{
+    z80_run(z80, z80->cycles + SLICE);
+}
+
+static void test_latch(void)
+{
+    struct Z80Memory mem;
+    struct Z80 z80;
+
+    boot(&z80, &mem);
+
+    // Raised before ei, and held until interrupts are enabled.
+    z80_raise_irq(&z80, VECTOR);
+    z80_step(&z80);
+    CHECK(z80.pc == 0x0003);
+    run(&z80);
+    CHECK(memory[IRQ_COUNT] == 1);
+    CHECK(z80.halted && z80.pc == 0x000b);
+    CHECK(atomic_load(&z80.pending) == 0);
+
+    // Withdrawn before it could be taken.
+    z80_raise_irq(&z80, VECTOR);
+    z80_clear_irq(&z80);
+    run(&z80);
+    CHECK(memory[IRQ_COUNT] == 1);
+    CHECK(z80.halted);
+
+    // Held while interrupts are disabled.
+    z80.iff1 = z80.iff2 = 0;
+    z80_raise_irq(&z80, VECTOR);
+    run(&z80);
+    CHECK(memory[IRQ_COUNT] == 1);
+    CHECK(z80.halted);
+    CHECK(atomic_load(&z80.pending) != 0);
+
+    // Taken whether or not interrupts are enabled, restoring them on retn.
+    z80_raise_nmi(&z80);
+    run(&z80);
+    CHECK(memory[NMI_COUNT] == 1);
+    CHECK(memory[IRQ_COUNT] == 1);
+    CHECK(z80.halted && !z80.iff1);
+
+    z80.iff1 = z80.iff2 = 1;
+    run(&z80);
+    CHECK(memory[IRQ_COUNT] == 2);
+    CHECK(atomic_load(&z80.pending) == 0);
+}
+
+/** Raising or clearing an interrupt keeps a stop requested before or after
+ * it, which ends the next run before it executes anything.
+ */
+static void test_stop(void)
+{
+    struct Z80Memory mem;
+    struct Z80 z80;
+
+    boot(&z80, &mem);
+    z80_stop(&z80);
+    z80_raise_irq(&z80, VECTOR);
+    CHECK(z80_run(&z80, z80.cycles + SLICE) == 0);
+    CHECK(z80.pc == 0x0000);
+
+    z80_raise_irq(&z80, VECTOR);
+    z80_stop(&z80);
+    z80_clear_irq(&z80);
+    CHECK(z80_run(&z80, z80.cycles + SLICE) == 0);
+    CHECK(z80.pc == 0x0000);
+
+    // The interrupt raised before the stop is still taken afterwards.
+    z80_raise_nmi(&z80);
+    z80_stop(&z80);
+    z80_raise_irq(&z80, VECTOR);
+    CHECK(z80_run(&z80, z80.cycles + SLICE) == 0);
+    run(&z80);
+    CHECK(memory[NMI_COUNT] == 1);
+    CHECK(memory[IRQ_COUNT] == 1);
+}
+
+/** An interrupt which halts the Z80, here through a halt on the data bus in
+ * mode 0, may run the clock past the end of the run, which must then end
+ * rather than skip the halts up to it.
+ */
+static void test_halt_past_end(void)
+{
+    static uint8_t const im0[] = {
+        0xed, 0x46, // im 0
+        0xfb,       // ei
+        0x00,       // nop
+    };
+    struct Z80Memory mem;
+    struct Z80 z80;
+    uint64_t until;
+    int64_t ran;
+
+    boot(&z80, &mem);
+    z80_memory_write(&mem, 0x0000, im0, sizeof(im0));
+    while (z80.pc != 0x0004)
+        z80_step(&z80);
+
+    z80_raise_irq(&z80, 0x76);
+    until = z80.cycles + 1;
+    ran = z80_run(&z80, until);
+    CHECK(ran >= 11 && ran < SLICE); // accepting alone takes 11 cycles
+    CHECK(z80.cycles >= until);
+    CHECK(z80_is_halted(&z80));
+    CHECK(z80.pc == 0x0004);
+}
+
+/** A device on its own thread, raising an interrupt each time the last has
+ * been handled.
+ */
+static void *device(void *arg)
+{
+    struct Z80 *z80 = arg;
+
+    for (int i = 1; i <= NUM_RAISES; ++i)
+    {
+        z80_raise_irq(z80, VECTOR);
+        while (atomic_load(&acks) < i)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    struct Z80Memory mem;
+    struct Z80 z80;
+    pthread_t thread;
+
+    boot(&z80, &mem);
+    CHECK(pthread_create(&thread, NULL, device, &z80) == 0);
+
+    while (atomic_load(&acks) < NUM_RAISES && z80.cycles < MAX_CYCLES)
+    {
+        run(&z80);
+        sched_yield();
+    }
+    pthread_join(thread, NULL);
+
+    CHECK(atomic_load(&acks) == NUM_RAISES);
+    CHECK(memory[IRQ_COUNT] == NUM_RAISES);
+}
+
+int main(void)
+{
+    test_latch();
+    test_stop();
+    test_halt_past_end();
+    test_threads();
+
+    return check_report();
+}
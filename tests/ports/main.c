@@ -0,0 +1,146 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/ports.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define MAX_STEPS 1000
+
+/* Reads and writes a device decoding the top four address lines, a constant
+ * port and an unmapped one, then block transfers to and from the device. */
+static uint8_t const program[] = {
+    0xdb, 0x10,       // in a, (0x10)
+    0x32, 0x00, 0x40, // ld (0x4000), a
+    0x3e, 0x12,       // ld a, 0x12
+    0xdb, 0x1f,       // in a, (0x1f)
+    0x32, 0x01, 0x40, // ld (0x4001), a
+    0xdb, 0x20,       // in a, (0x20)
+    0x32, 0x02, 0x40, // ld (0x4002), a
+    0xdb, 0x30,       // in a, (0x30)
+    0x32, 0x03, 0x40, // ld (0x4003), a
+    0x3e, 0x77,       // ld a, 0x77
+    0xd3, 0x11,       // out (0x11), a
+    0xd3, 0x20,       // out (0x20), a
+    0x21, 0x00, 0x50, // ld hl, 0x5000
+    0x01, 0x18, 0x04, // ld bc, 0x0418
+    0xed, 0xb2,       // inir
+    0x21, 0x00, 0x50, // ld hl, 0x5000
+    0x01, 0x13, 0x04, // ld bc, 0x0413
+    0xed, 0xb3,       // otir
+    0x76,             // halt
+};
+
+/** A device answering reads with a counter, and recording writes.
+ */
+struct Device
+{
+    uint8_t next;
+    int loads;
+    int stores;
+    uint16_t last_port;
+    uint8_t stored[8];
+};
+
+static uint8_t memory[MEMORY_SIZE];
+static int fallback_loads;
+static int fallback_stores;
+static uint16_t fallback_port;
+
+static uint8_t device_load(struct Z80 *z80, uint16_t port, void *userdata)
+{
+    struct Device *dev = userdata;
+    (void)z80;
+    dev->last_port = port;
+    ++dev->loads;
+    return dev->next++;
+}
+
+static void device_store(struct Z80 *z80, uint16_t port, uint8_t val, void *userdata)
+{
+    struct Device *dev = userdata;
+    (void)z80;
+    dev->last_port = port;
+    if (dev->stores < (int)sizeof(dev->stored))
+        dev->stored[dev->stores] = val;
+    ++dev->stores;
+}
+
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    (void)z80;
+    fallback_port = port;
+    ++fallback_loads;
+    return 0xee;
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    (void)z80;
+    (void)val;
+    fallback_port = port;
+    ++fallback_stores;
+}
+
+static struct Z80Bus const bus = {
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+static void test_dispatch(void)
+{
+    struct Device dev = {.next = 0x80};
+    struct Z80Memory mem;
+    struct Z80Ports ports;
+    struct Z80 z80;
+
+    memset(memory, 0, sizeof(memory));
+    z80_init(&z80);
+    z80.bus = &bus;
+    z80_memory_init(&mem, &z80, memory);
+    z80_memory_write(&mem, 0x0000, program, sizeof(program));
+
+    z80_ports_init(&ports, &z80);
+    CHECK(z80.ports == &ports);
+    z80_ports_map(&ports, 0x10, 0xf0, device_load, device_store, &dev);
+    z80_ports_set_constant(&ports, 0x20, 0xff, 0x5a);
+    CHECK(ports.entries[0x1a].userdata == &dev);
+    CHECK(ports.entries[0x21].load == NULL && !ports.entries[0x21].constant);
+
+    for (int i = 0; i < MAX_STEPS && !z80.halted; ++i)
+        z80_step(&z80);
+    CHECK(z80.halted);
+
+    CHECK(memory[0x4000] == 0x80);
+    CHECK(memory[0x4001] == 0x81);
+    CHECK(memory[0x4002] == 0x5a);
+    CHECK(memory[0x4003] == 0xee);
+    CHECK(fallback_loads == 1);
+    CHECK((fallback_port & 0xff) == 0x20);
+    CHECK(fallback_stores == 1);
+
+    // Two reads, then four by inir.
+    CHECK(dev.loads == 6);
+    CHECK(memory[0x5000] == 0x82 && memory[0x5003] == 0x85);
+
+    // One write, then four by otir.
+    CHECK(dev.stores == 5);
+    CHECK(dev.stored[0] == 0x77);
+    CHECK(dev.stored[1] == 0x82 && dev.stored[4] == 0x85);
+    CHECK((dev.last_port & 0xff) == 0x13);
+    // Constant ports call nothing, but still count as reads for idle loops.
+    CHECK(z80.polled);
+
+    z80_ports_unmap(&ports, 0x10, 0xf0);
+    CHECK(ports.entries[0x15].load == NULL && ports.entries[0x15].store == NULL);
+    CHECK(ports.entries[0x20].constant);
+}
+
+int main(void)
+{
+    test_dispatch();
+
+    return check_report();
+}
@@ -0,0 +1,201 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/profile.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define SYMBOLS_PATH "profile-test.sym"
+#define INTERVAL 97
+#define SLICE 5000
+#define RUN_CYCLES 2000000
+#define MAX_LINES 64
+
+/* A main loop calling through outer to inner, through a restart, and to a
+ * routine which drops its return address and jumps back, while interrupts
+ * come in. */
+static uint8_t const program[] = {
+    0x31, 0x00, 0x80, // ld sp, 0x8000
+    0xed, 0x56,       // im 1
+    0xfb,             // ei
+    0xcd, 0x20, 0x00, // main: call outer
+    0xd7,             // rst 0x10
+    0xcd, 0x40, 0x00, // call drop
+    0x18, 0xf7,       // jr main
+};
+
+static uint8_t const rst10[] = {
+    0x06, 0x32, // ld b, 50
+    0x10, 0xfe, // djnz $
+    0xc9,       // ret
+};
+
+static uint8_t const outer[] = {
+    0xcd, 0x30, 0x00, // call inner
+    0xc9,             // ret
+};
+
+static uint8_t const inner[] = {
+    0x06, 0xc8, // ld b, 200
+    0x10, 0xfe, // djnz $
+    0xc9,       // ret
+};
+
+static uint8_t const isr[] = {
+    0xfb,       // ei
+    0xed, 0x4d, // reti
+};
+
+static uint8_t const drop[] = {
+    0xe1,       // pop hl
+    0x06, 0x14, // ld b, 20
+    0x10, 0xfe, // djnz $
+    0xe9,       // jp (hl)
+};
+
+static char const symbols[] = "; generated by hand\n"
+                              "0x0006 main\n"
+                              "$0010 rst10\n"
+                              "0020 outer\n"
+                              "\n"
+                              "0030 inner\n"
+                              "0038 isr\n"
+                              "0040 drop\n";
+
+struct Line
+{
+    char stack[128];
+    unsigned long long count;
+};
+
+static uint8_t memory[MEMORY_SIZE];
+static struct Line lines[MAX_LINES];
+static int num_lines;
+
+static void boot(struct Z80 *z80, struct Z80Memory *mem)
+{
+    memset(memory, 0, sizeof(memory));
+    z80_init(z80);
+    z80_memory_init(mem, z80, memory);
+    z80_memory_write(mem, 0x0000, program, sizeof(program));
+    z80_memory_write(mem, 0x0010, rst10, sizeof(rst10));
+    z80_memory_write(mem, 0x0020, outer, sizeof(outer));
+    z80_memory_write(mem, 0x0030, inner, sizeof(inner));
+    z80_memory_write(mem, 0x0038, isr, sizeof(isr));
+    z80_memory_write(mem, 0x0040, drop, sizeof(drop));
+}
+
+/** Writes the folded stacks to a temporary file, and reads them back.
+ */
+static void fold(struct Z80Profile *profile)
+{
+    FILE *file = tmpfile();
+
+    num_lines = 0;
+    CHECK(file != NULL);
+    if (!file)
+        return;
+
+    CHECK(z80_profile_write_folded(profile, file) == 0);
+    rewind(file);
+    while (num_lines < MAX_LINES
+           && fscanf(file, "%127s %llu", lines[num_lines].stack, &lines[num_lines].count) == 2)
+        ++num_lines;
+    fclose(file);
+}
+
+/** Returns the samples of a folded stack, or 0 if there is no such line.
+ */
+static unsigned long long samples(char const *stack)
+{
+    for (int i = 0; i < num_lines; ++i)
+    {
+        if (strcmp(lines[i].stack, stack) == 0)
+            return lines[i].count;
+    }
+    return 0;
+}
+
+static void test_profile(void)
+{
+    struct Z80Profile profile;
+    struct Z80Memory mem;
+    struct Z80 z80;
+    FILE *file = fopen(SYMBOLS_PATH, "w");
+    unsigned long long total = 0;
+
+    CHECK(file != NULL);
+    if (!file)
+        return;
+    fputs(symbols, file);
+    fclose(file);
+
+    boot(&z80, &mem);
+    CHECK(z80_profile_init(&profile, &z80, INTERVAL) == 0);
+    CHECK(z80.profile == &profile);
+    CHECK(z80_profile_load_symbols(&profile, SYMBOLS_PATH) == 0);
+    CHECK(profile.num_symbols == 6);
+    CHECK(z80_profile_load_symbols(&profile, "no-such-file.sym") == -1);
+    remove(SYMBOLS_PATH);
+
+    while (z80.cycles < RUN_CYCLES)
+    {
+        z80_profile_run(&profile, &z80, z80.cycles + SLICE);
+        z80_raise_irq(&z80, 0xff);
+    }
+    CHECK(profile.samples >= RUN_CYCLES / INTERVAL - 1);
+    CHECK(profile.dropped == 0);
+    CHECK(profile.depth <= 3);
+
+    fold(&profile);
+    for (int i = 0; i < num_lines; ++i)
+    {
+        total += lines[i].count;
+        CHECK(strncmp(lines[i].stack, "0x", 2) != 0);
+        // The frame of drop is abandoned at the next call.
+        CHECK(strstr(lines[i].stack, "drop;outer") == NULL);
+        CHECK(strstr(lines[i].stack, "drop;rst10") == NULL);
+    }
+    CHECK(total == profile.samples);
+
+    // Time is shared in proportion to the cycles spent in each function.
+    CHECK(samples("main;outer;inner") > samples("main;rst10") * 3);
+    CHECK(samples("main;rst10") > samples("main;drop"));
+    CHECK(samples("main;drop") > 0);
+    CHECK(samples("main;outer;inner;isr") > 0);
+
+    z80_profile_free(&profile, &z80);
+    CHECK(z80.profile == NULL);
+}
+
+/** Without symbols, every address is written in hex, down to the PC.
+ */
+static void test_unnamed(void)
+{
+    struct Z80Profile profile;
+    struct Z80Memory mem;
+    struct Z80 z80;
+
+    boot(&z80, &mem);
+    CHECK(z80_profile_init(&profile, &z80, 1000000) == 0);
+    for (int i = 0; i < 12; ++i)
+        z80_step(&z80);
+    CHECK(profile.depth == 2);
+    z80_profile_sample(&profile, &z80);
+
+    fold(&profile);
+    CHECK(num_lines == 1);
+    CHECK(samples("0x0009;0x0020;0x0030;0x0032") == 1);
+
+    z80_profile_free(&profile, &z80);
+}
+
+int main(void)
+{
+    test_profile();
+    test_unnamed();
+
+    return check_report();
+}
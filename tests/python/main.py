@@ -0,0 +1,118 @@
+import sys
+
+import z80
+
+failures = 0
+
+
+def check(cond, what):
+    global failures
+    if not cond:
+        print("  FAIL: %s" % what)
+        failures += 1
+
+
+def load(machine, code, addr=0):
+    machine.memory[addr:addr + len(code)] = bytes(code)
+
+
+def test_registers():
+    m = z80.Z80()
+    check(m.sp == 0xffff and m.a == 0xff, "registers start in the reset state")
+    m.bc = 0x1234
+    check(m.b == 0x12 and m.c == 0x34, "byte registers alias the pairs")
+    m.cycles = 1000
+    check(m.cycles == 1000, "cycles can be set")
+
+
+def test_memory():
+    m = z80.Z80()
+    memory = m.memory
+    check(len(memory) == 0x10000 and not memory.readonly, "memory is 64 KB and writable")
+
+    # ld a, 0x5a; ld (0x8000), a; halt
+    load(m, [0x3e, 0x5a, 0x32, 0x00, 0x80, 0x76])
+    m.run(100)
+    check(m.halted, "program ran to the halt")
+    check(memory[0x8000] == 0x5a, "writes by the Z80 appear in an existing view")
+
+    memory[0x8000] = 0x33
+    check(m.memory[0x8000] == 0x33, "views share the same memory")
+
+    del m
+    check(memory[0x8000] == 0x33, "a view keeps its Z80 alive")
+
+
+def test_ports():
+    m = z80.Z80()
+    # in a, (0x10); out (0x20), a; halt
+    load(m, [0xdb, 0x10, 0xd3, 0x20, 0x76])
+    m.ports_in[0x10] = 0x42
+    m.run(100)
+    check(m.a == 0x42, "port reads return ports_in")
+    check(m.ports_out[0x20] == 0x42, "port writes land in ports_out")
+
+
+def test_run():
+    m = z80.Z80()
+    # ld b, 0; loop: djnz loop; halt
+    load(m, [0x06, 0x00, 0x10, 0xfe, 0x76])
+    ran = m.run(1000)
+    check(ran >= 1000 and m.cycles == ran, "run returns the cycles run")
+    m.run(1000000)
+    check(m.halted, "the loop finished")
+
+    before = m.cycles
+    check(m.run(10 ** 9) >= 10 ** 9, "halted time is skipped")
+    check(m.cycles - before < 10 ** 9 + 4, "halted time ends on time")
+
+    m = z80.Z80()
+    load(m, [0xed, 0x00])
+    m.run(1000)
+    check(m.fault != 0 and m.fault_pc == 0, "illegal opcodes fault")
+    check(m.cycles < 1000, "run stops at a fault")
+    m.clear_fault()
+    check(m.fault == 0, "faults can be cleared")
+
+
+def test_run_many():
+    # Each instance counts up HL until its budget runs out.
+    code = [0x23, 0x18, 0xfd]  # loop: inc hl; jr loop
+    machines = [z80.Z80() for _ in range(8)]
+    for i, m in enumerate(machines):
+        load(m, code)
+        m.hl = i
+
+    z80.run_many(machines, 100000, threads=4)
+    single = z80.Z80()
+    load(single, code)
+    single.run(100000)
+
+    for i, m in enumerate(machines):
+        check(m.hl == (single.hl + i) & 0xffff, "run_many ran instance %i" % i)
+        check(m.cycles == single.cycles, "run_many gave instance %i its cycles" % i)
+
+    try:
+        z80.run_many([machines[0], machines[0]], 100, threads=2)
+        check(False, "a Z80 listed twice is refused")
+    except RuntimeError:
+        pass
+
+    z80.run_many([machines[0]], 100)
+    check(machines[0].cycles > single.cycles, "a refused batch releases its Z80s")
+
+    try:
+        z80.run_many([machines[0], 1], 100)
+        check(False, "run_many takes only Z80s")
+    except TypeError:
+        pass
+
+
+test_registers()
+test_memory()
+test_ports()
+test_run()
+test_run_many()
+
+print("%i TESTS FAILED" % failures)
+sys.exit(1 if failures else 0)
@@ -0,0 +1,106 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/rewind.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define RUN_CYCLES 2000000
+#define INTERVAL 10000
+
+/* Scribbles over the upper 32 KB, touching a different page on most
+ * iterations. */
+static uint8_t const program[] = {
+    0x21, 0x00, 0x80, // ld hl, 0x8000
+    0x34,             // loop: inc (hl)
+    0x7e,             // ld a, (hl)
+    0x85,             // add a, l
+    0x6f,             // ld l, a
+    0x24,             // inc h
+    0xcb, 0xfc,       // set 7, h
+    0x18, 0xf7,       // jr loop
+};
+
+static uint8_t memory[MEMORY_SIZE];
+static uint8_t reference_memory[MEMORY_SIZE];
+
+static void boot(struct Z80 *z80, struct Z80Memory *mem, uint8_t *data)
+{
+    memset(data, 0, MEMORY_SIZE);
+    z80_init(z80);
+    z80_memory_init(mem, z80, data);
+    z80_memory_write(mem, 0x0000, program, sizeof(program));
+}
+
+/** Runs a fresh machine to `cycles`, and checks that it matches the rewound
+ * one.
+ */
+static void check_against_reference(struct Z80 const *z80, uint64_t cycles)
+{
+    struct Z80Memory mem;
+    struct Z80 reference;
+
+    boot(&reference, &mem, reference_memory);
+    while (reference.cycles < cycles)
+        z80_step(&reference);
+
+    CHECK(z80->cycles == reference.cycles);
+    CHECK(z80->pc == reference.pc);
+    CHECK(z80->af == reference.af);
+    CHECK(z80->hl == reference.hl);
+    CHECK(z80->r == reference.r);
+    CHECK(memcmp(memory, reference_memory, MEMORY_SIZE) == 0);
+}
+
+int main(void)
+{
+    struct Z80Memory mem;
+    struct Z80Rewind rw;
+    struct Z80 z80;
+    uint64_t target;
+
+    boot(&z80, &mem, memory);
+
+    // Small enough that old frames must be evicted.
+    if (z80_rewind_init(&rw, &z80, INTERVAL, 16, 256 * 1024) != 0)
+    {
+        printf("could not initialize rewind buffer\n");
+        return EXIT_FAILURE;
+    }
+
+    while (z80.cycles < RUN_CYCLES)
+    {
+        z80_step(&z80);
+        CHECK(z80_rewind_capture(&rw, &z80) >= 0);
+    }
+
+    CHECK(z80_rewind_oldest(&rw) > 0);
+    CHECK(rw.frames[rw.first].keyframe);
+    printf("%u frames covering %llu cycles\n",
+           rw.count,
+           (unsigned long long)(z80.cycles - z80_rewind_oldest(&rw)));
+
+    CHECK(z80_seek(&rw, &z80, 0) == -1);
+    CHECK(z80_seek(&rw, &z80, z80.cycles + 1) == -1);
+
+    // Seek to a point between frames, then continue and seek again.
+    target = z80.cycles - 3 * INTERVAL - 1234;
+    CHECK(z80_seek(&rw, &z80, target) == 0);
+    check_against_reference(&z80, target);
+
+    while (z80.cycles < target + 5 * INTERVAL)
+    {
+        z80_step(&z80);
+        CHECK(z80_rewind_capture(&rw, &z80) >= 0);
+    }
+
+    target = z80_rewind_oldest(&rw) + 777;
+    CHECK(z80_seek(&rw, &z80, target) == 0);
+    check_against_reference(&z80, target);
+
+    z80_rewind_free(&rw);
+
+    return check_report();
+}
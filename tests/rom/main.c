@@ -0,0 +1,184 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define ROM_SIZE 0x4000
+#define ROM_PAGES (ROM_SIZE / Z80_PAGE_SIZE)
+#define NUM_INSTANCES 1000
+
+/* Tries to overwrite the ROM at 0x0100, then copies what is there to RAM. */
+static uint8_t const program[] = {
+    0x21, 0x00, 0x01, // ld hl, 0x0100
+    0x36, 0xaa,       // ld (hl), 0xaa
+    0x7e,             // ld a, (hl)
+    0x32, 0x00, 0x80, // ld (0x8000), a
+    0x76,             // halt
+};
+
+struct Instance
+{
+    struct Z80 z80;
+    struct Z80Memory mem;
+    uint8_t *data;
+};
+
+static int all_zero(uint8_t const *data, size_t length)
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (data[i])
+            return 0;
+    }
+    return 1;
+}
+
+static void boot(struct Instance *inst, struct Z80Rom *rom, uint8_t rom_writes)
+{
+    inst->data = calloc(1, MEMORY_SIZE);
+    z80_init(&inst->z80);
+    z80_memory_init(&inst->mem, &inst->z80, inst->data);
+    inst->mem.rom_writes = rom_writes;
+    CHECK(z80_memory_map_rom(&inst->mem, rom, 0x0000) == 0);
+}
+
+static void run(struct Z80 *z80)
+{
+    while (!z80_is_halted(z80))
+        z80_step(z80);
+}
+
+static void test_ignore(struct Z80Rom *rom)
+{
+    static struct Instance instances[NUM_INSTANCES];
+
+    for (int i = 0; i < NUM_INSTANCES; ++i)
+        boot(&instances[i], rom, Z80_ROM_IGNORE);
+    CHECK(atomic_load(&rom->refs) == 1 + NUM_INSTANCES * ROM_PAGES);
+
+    for (int i = 0; i < NUM_INSTANCES; ++i)
+    {
+        struct Instance *inst = &instances[i];
+        run(&inst->z80);
+
+        CHECK(inst->data[0x8000] == 0x11);
+        CHECK(inst->mem.dirty == (uint64_t)1 << (0x8000 >> Z80_PAGE_BITS));
+        CHECK(inst->mem.pages[0] == rom->data);
+        CHECK(all_zero(inst->data, ROM_SIZE));
+    }
+    CHECK(rom->data[0x100] == 0x11);
+
+    for (int i = 0; i < NUM_INSTANCES; ++i)
+    {
+        z80_memory_free(&instances[i].mem);
+        free(instances[i].data);
+    }
+    CHECK(atomic_load(&rom->refs) == 1);
+}
+
+static void test_copy(struct Z80Rom *rom)
+{
+    static struct Z80Snapshot snapshot;
+    struct Instance inst;
+    uint64_t const page0 = (uint64_t)1 << (0x0100 >> Z80_PAGE_BITS);
+
+    boot(&inst, rom, Z80_ROM_COPY);
+    z80_snapshot_init(&snapshot, &inst.z80);
+    run(&inst.z80);
+
+    CHECK(inst.data[0x8000] == 0xaa);
+    CHECK(rom->data[0x100] == 0x11);
+    CHECK(inst.mem.pages[0] == inst.data);
+    CHECK(!(inst.mem.shared & page0) && (inst.mem.dirty & page0));
+    CHECK(inst.mem.shared == (((1u << ROM_PAGES) - 1) & ~page0));
+    CHECK(memcmp(inst.data, program, sizeof(program)) == 0);
+    CHECK(atomic_load(&rom->refs) == ROM_PAGES);
+
+    // The copied page rolls back to what the ROM held.
+    z80_snapshot_restore(&inst.z80, &snapshot);
+    CHECK(inst.data[0x100] == 0x11);
+    CHECK(inst.z80.pc == 0 && !z80_is_halted(&inst.z80));
+
+    // Host writes follow the same rules.
+    z80_memory_write(&inst.mem, 0x0800, "\x42", 1);
+    CHECK(inst.data[0x0800] == 0x42 && rom->data[0x0800] == 0x00);
+    inst.mem.rom_writes = Z80_ROM_IGNORE;
+    z80_memory_write(&inst.mem, 0x0c00, "\x42", 1);
+    CHECK(rom->data[0x0c00] == 0x00 && inst.data[0x0c00] == 0x00);
+
+    z80_memory_free(&inst.mem);
+    free(inst.data);
+    CHECK(atomic_load(&rom->refs) == 1);
+}
+
+/** Mapping a ROM over a page written since the snapshot leaves the ROM
+ * alone when the snapshot is restored.
+ */
+static void test_remap(void)
+{
+    static struct Z80Snapshot snapshot;
+    uint8_t image[Z80_PAGE_SIZE];
+    uint64_t const page = (uint64_t)1 << (0x4000 >> Z80_PAGE_BITS);
+    struct Instance inst;
+    struct Z80Rom *rom;
+
+    memset(image, 0xaa, sizeof(image));
+    rom = z80_rom_create(image, sizeof(image));
+    CHECK(rom != NULL);
+    if (!rom)
+        return;
+
+    inst.data = calloc(1, MEMORY_SIZE);
+    z80_init(&inst.z80);
+    z80_memory_init(&inst.mem, &inst.z80, inst.data);
+    z80_snapshot_init(&snapshot, &inst.z80);
+
+    z80_memory_write(&inst.mem, 0x4000, "\x00", 1);
+    CHECK(inst.mem.dirty & page);
+    CHECK(z80_memory_map_rom(&inst.mem, rom, 0x4000) == 0);
+    CHECK(!(inst.mem.dirty & page));
+
+    z80_snapshot_restore(&inst.z80, &snapshot);
+    CHECK(rom->data[0] == 0xaa);
+    CHECK(inst.mem.pages[0x4000 >> Z80_PAGE_BITS] == rom->data);
+
+    // Shared pages are skipped even if they are marked dirty.
+    inst.mem.dirty |= page;
+    z80_snapshot_restore(&inst.z80, &snapshot);
+    CHECK(rom->data[0] == 0xaa);
+
+    z80_memory_free(&inst.mem);
+    free(inst.data);
+    CHECK(atomic_load(&rom->refs) == 1);
+    z80_rom_release(rom);
+}
+
+int main(void)
+{
+    uint8_t image[ROM_SIZE] = {0};
+    struct Z80Rom *rom;
+    struct Z80Memory mem;
+
+    memcpy(image, program, sizeof(program));
+    image[0x100] = 0x11;
+
+    rom = z80_rom_create(image, ROM_SIZE);
+    CHECK(rom != NULL);
+    CHECK(((uintptr_t)rom->data & 0xfff) == 0);
+
+    z80_memory_init(&mem, NULL, image);
+    CHECK(z80_memory_map_rom(&mem, rom, 0x0100) == -1);
+    CHECK(z80_memory_map_rom(&mem, rom, 0xe000) == -1);
+    CHECK(atomic_load(&rom->refs) == 1);
+
+    test_ignore(rom);
+    test_copy(rom);
+    test_remap();
+
+    z80_rom_release(rom);
+
+    return check_report();
+}
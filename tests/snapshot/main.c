@@ -0,0 +1,80 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+
+/* Fills 0x9000-0x90ff with a descending count, then halts. */
+static uint8_t const program[] = {
+    0x21, 0x00, 0x90, // ld hl, 0x9000
+    0x06, 0x00,       // ld b, 0x00
+    0x70,             // loop: ld (hl), b
+    0x23,             // inc hl
+    0x10, 0xfc,       // djnz loop
+    0x76,             // halt
+};
+
+static uint8_t memory[MEMORY_SIZE];
+static uint8_t expected[MEMORY_SIZE];
+
+static void run(struct Z80 *z80)
+{
+    while (!z80_is_halted(z80))
+        z80_step(z80);
+}
+
+int main(void)
+{
+    static struct Z80Snapshot snapshot;
+    struct Z80Memory mem;
+    struct Z80 z80;
+
+    for (int i = 0; i < MEMORY_SIZE; ++i)
+        memory[i] = (uint8_t)(i * 7);
+
+    z80_init(&z80);
+    z80_memory_init(&mem, &z80, memory);
+    z80_memory_write(&mem, 0x0000, program, sizeof(program));
+    CHECK(mem.dirty == 1);
+
+    z80_snapshot_init(&snapshot, &z80);
+    CHECK(mem.dirty == 0);
+    memcpy(expected, memory, MEMORY_SIZE);
+
+    // Only the page at 0x9000 is written.
+    run(&z80);
+    CHECK(mem.dirty == (uint64_t)1 << (0x9000 >> Z80_PAGE_BITS));
+    CHECK(memory[0x9000] == 0x00 && memory[0x9001] == 0xff);
+
+    // Rolling back restores memory and registers.
+    z80_snapshot_restore(&z80, &snapshot);
+    CHECK(mem.dirty == 0);
+    CHECK(z80.pc == 0 && z80.hl == 0 && !z80_is_halted(&z80));
+    CHECK(memcmp(memory, expected, MEMORY_SIZE) == 0);
+    CHECK(z80.memory == &mem);
+
+    // An incremental checkpoint picks up only the page which changed.
+    run(&z80);
+    memcpy(expected, memory, MEMORY_SIZE);
+    z80_snapshot_take(&snapshot, &z80);
+    CHECK(memcmp(snapshot.data, expected, MEMORY_SIZE) == 0);
+
+    z80.halted = 0;
+    z80.pc = 0;
+    z80.sp = 0x4010;
+    z80_step(&z80);
+    CHECK(z80.hl == 0x9000);
+    z80.pc = 0x0100;
+    z80_memory_write(&mem, 0x0100, "\xe5", 1); // push hl
+    z80_step(&z80);
+    CHECK(mem.dirty == ((uint64_t)1 << (0x4000 >> Z80_PAGE_BITS) | 1));
+    z80_snapshot_restore(&z80, &snapshot);
+    CHECK(memcmp(memory, expected, MEMORY_SIZE) == 0);
+    CHECK(z80.hl == 0x9100 && z80_is_halted(&z80));
+
+    return check_report();
+}
@@ -0,0 +1,243 @@
+#include "check.h"
+#include "z80/system.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_CORES 3
+#define SHARED 0xc000
+#define MAILBOX 0x01
+#define MAX_MAILBOX 65536
+#define UNTIL 200000
+
+/** A core's private ROM and RAM, below SHARED.
+ */
+struct Core
+{
+    struct Z80System *sys;
+    int index;
+    uint8_t memory[SHARED];
+};
+
+static struct Core cores[NUM_CORES];
+static struct Z80 z80s[NUM_CORES];
+static uint8_t shared[0x10000 - SHARED];
+
+/** Values written to the mailbox port, tagged with the writing core. */
+static uint16_t mailbox[MAX_MAILBOX];
+static int mailbox_length;
+
+static void touch(struct Z80 *z80)
+{
+    struct Core *core = z80->userdata;
+    if (core->sys)
+        z80_system_touch(core->sys, z80);
+}
+
+static uint8_t mem_load(struct Z80 *z80, uint16_t addr)
+{
+    struct Core *core = z80->userdata;
+    if (addr < SHARED)
+        return core->memory[addr];
+
+    touch(z80);
+    return shared[addr - SHARED];
+}
+
+static void mem_store(struct Z80 *z80, uint16_t addr, uint8_t val)
+{
+    struct Core *core = z80->userdata;
+    if (addr < SHARED)
+    {
+        core->memory[addr] = val;
+        return;
+    }
+
+    touch(z80);
+    shared[addr - SHARED] = val;
+}
+
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    (void)z80;
+    (void)port;
+    return 0xff;
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    struct Core *core = z80->userdata;
+    if ((port & 0xff) != MAILBOX)
+        return;
+
+    touch(z80);
+    if (mailbox_length < MAX_MAILBOX)
+        mailbox[mailbox_length++] = (uint16_t)(core->index << 8 | val);
+}
+
+static struct Z80Bus const bus = {
+    .mem_load = mem_load,
+    .mem_store = mem_store,
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+/** Boots each core into a loop which increments a shared counter, adds its
+ * step (B) to a shared total, and posts the total to the mailbox. Each core
+ * pads its loop with a different number of NOPs, so the cores drift.
+ */
+static void boot(struct Z80System *sys)
+{
+    memset(shared, 0, sizeof(shared));
+    mailbox_length = 0;
+
+    for (int i = 0; i < NUM_CORES; ++i)
+    {
+        static uint8_t const head[] = {
+            0x31, 0x00, 0x80, // ld sp, 0x8000
+            0x21, 0x00, 0xc0, // ld hl, 0xc000
+            0x34,             // loop: inc (hl)
+            0x3a, 0x01, 0xc0, // ld a, (0xc001)
+            0x80,             // add a, b
+            0x32, 0x01, 0xc0, // ld (0xc001), a
+            0xd3, MAILBOX,    // out (MAILBOX), a
+        };
+        struct Core *core = &cores[i];
+        struct Z80 *z80 = &z80s[i];
+        size_t length = sizeof(head);
+
+        memset(core, 0, sizeof(*core));
+        core->sys = sys;
+        core->index = i;
+        memcpy(core->memory, head, length);
+        for (int j = 0; j < i * 3; ++j)
+            core->memory[length++] = 0x00;
+        core->memory[length] = 0x18; // jr loop
+        core->memory[length + 1] = (uint8_t)(6 - (int)(length + 2));
+
+        z80_init(z80);
+        z80->bus = &bus;
+        z80->userdata = core;
+        z80->b = (uint8_t)(i + 1);
+
+        if (sys)
+            z80_system_add(sys, z80);
+    }
+}
+
+/** Steps whichever core's next instruction comes first, by cycle count then
+ * index, which is the order that a threaded system must reproduce.
+ */
+static void run_lockstep(void)
+{
+    boot(NULL);
+
+    for (;;)
+    {
+        struct Z80 *next = NULL;
+        for (int i = 0; i < NUM_CORES; ++i)
+        {
+            if (z80s[i].cycles < UNTIL
+                && (!next || z80s[i].cycles < next->cycles))
+                next = &z80s[i];
+        }
+
+        if (!next)
+            break;
+        z80_step(next);
+    }
+}
+
+static void test_threaded(uint64_t quantum,
+                          uint16_t const *expected,
+                          int expected_length,
+                          uint8_t const *expected_shared)
+{
+    struct Z80System sys;
+
+    z80_system_init(&sys, quantum, 1);
+    boot(&sys);
+    CHECK(z80_system_run(&sys, UNTIL / 2) == UNTIL / 2);
+    CHECK(z80_system_run(&sys, UNTIL) == UNTIL);
+    z80_system_free(&sys);
+
+    for (int i = 0; i < NUM_CORES; ++i)
+        CHECK(z80s[i].cycles >= UNTIL && z80s[i].cycles < UNTIL + 23);
+
+    CHECK(mailbox_length == expected_length);
+    CHECK(memcmp(mailbox, expected, expected_length * sizeof(mailbox[0])) == 0);
+    CHECK(memcmp(shared, expected_shared, 2) == 0);
+}
+
+static void test_single_threaded(void)
+{
+    static uint16_t first[MAX_MAILBOX];
+    int first_length = 0;
+
+    for (int run = 0; run < 2; ++run)
+    {
+        struct Z80System sys;
+
+        z80_system_init(&sys, 1000, 0);
+        boot(&sys);
+        CHECK(z80_system_run(&sys, UNTIL) == UNTIL);
+        CHECK(sys.slice == sys.min_quantum);
+        z80_system_free(&sys);
+
+        for (int i = 0; i < NUM_CORES; ++i)
+            CHECK(z80s[i].cycles >= UNTIL && z80s[i].cycles < UNTIL + 23);
+
+        if (run == 0)
+        {
+            memcpy(first, mailbox, sizeof(mailbox));
+            first_length = mailbox_length;
+        }
+    }
+
+    CHECK(mailbox_length == first_length);
+    CHECK(memcmp(mailbox, first, mailbox_length * sizeof(mailbox[0])) == 0);
+}
+
+static void test_quantum(void)
+{
+    struct Z80System sys;
+    struct Z80 idle;
+
+    z80_system_init(&sys, 1024, 0);
+    CHECK(sys.min_quantum == 64);
+
+    z80_init(&idle);
+    idle.halted = 1;
+    CHECK(z80_system_add(&sys, &idle) == 0);
+
+    // With nothing shared, the rounds grow back to the full quantum.
+    sys.slice = sys.min_quantum;
+    z80_system_run(&sys, 64 + 128 + 256 + 512);
+    CHECK(sys.slice == 1024);
+    CHECK(idle.cycles >= sys.time);
+    z80_system_free(&sys);
+}
+
+int main(void)
+{
+    uint16_t *expected = malloc(sizeof(mailbox));
+    uint8_t expected_shared[2];
+    int expected_length;
+
+    run_lockstep();
+    memcpy(expected, mailbox, sizeof(mailbox));
+    memcpy(expected_shared, shared, sizeof(expected_shared));
+    expected_length = mailbox_length;
+    CHECK(expected_length > 1000);
+
+    test_threaded(1000, expected, expected_length, expected_shared);
+    test_threaded(64, expected, expected_length, expected_shared);
+    test_threaded(UNTIL, expected, expected_length, expected_shared);
+    test_single_threaded();
+    test_quantum();
+
+    free(expected);
+
+    return check_report();
+}
@@ -0,0 +1,228 @@
+#include "check.h"
+#include "z80/memory.h"
+#include "z80/trace.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define STEPS 200000
+#define INTERRUPT_INTERVAL 997
+#define TRACE_PATH "trace-test.gz"
+
+/* Copies a block, calls a subroutine which swaps through the stack, and
+ * counts, while being interrupted. */
+static uint8_t const program[] = {
+    0x31, 0x00, 0x80,       // ld sp, 0x8000
+    0xed, 0x56,             // im 1
+    0xfb,                   // ei
+    0x21, 0x00, 0x10,       // loop: ld hl, 0x1000
+    0x11, 0x00, 0x20,       // ld de, 0x2000
+    0x01, 0x40, 0x00,       // ld bc, 0x0040
+    0xed, 0xb0,             // ldir
+    0xcd, 0x20, 0x00,       // call sub
+    0x3c,                   // inc a
+    0x32, 0x00, 0x30,       // ld (0x3000), a
+    0xd9,                   // exx
+    0x18, 0xeb,             // jr loop
+    0x00, 0x00, 0x00, 0x00, //
+    0x00,                   //
+    0xe5,                   // sub: push hl
+    0xdd, 0x21, 0x34, 0x12, // ld ix, 0x1234
+    0xdd, 0xe3,             // ex (sp), ix
+    0xe1,                   // pop hl
+    0xc9,                   // ret
+};
+
+static uint8_t const handler[] = {
+    0xfb, // ei
+    0xc9, // ret
+};
+
+/** Registers after each record, to check the trace against.
+ */
+struct Expected
+{
+    uint64_t cycles;
+    uint16_t pc, sp, ix, iy, af, bc, de, hl, afp, bcp, dep, hlp;
+    uint8_t i, iff1, iff2, im, halted;
+    uint8_t writes;
+};
+
+static uint8_t memory[MEMORY_SIZE];
+static struct Expected expected[STEPS + STEPS / INTERRUPT_INTERVAL + 1];
+
+static struct Expected capture(struct Z80 const *z80, uint32_t writes)
+{
+    struct Expected e;
+
+    // Cleared first, as expectations are compared with memcmp.
+    memset(&e, 0, sizeof(e));
+    e.cycles = z80->cycles;
+    e.pc = z80->pc;
+    e.sp = z80->sp;
+    e.ix = z80->ix;
+    e.iy = z80->iy;
+    e.af = z80->af;
+    e.bc = z80->bc;
+    e.de = z80->de;
+    e.hl = z80->hl;
+    e.afp = z80->afp;
+    e.bcp = z80->bcp;
+    e.dep = z80->dep;
+    e.hlp = z80->hlp;
+    e.i = z80->i;
+    e.iff1 = z80->iff1;
+    e.iff2 = z80->iff2;
+    e.im = z80->interrupt_mode;
+    e.halted = z80->halted;
+    e.writes = writes;
+    return e;
+}
+
+static int matches(struct Expected const *e, struct Z80 const *z80)
+{
+    struct Expected const actual = capture(z80, e->writes);
+    return memcmp(e, &actual, sizeof(actual)) == 0;
+}
+
+/** Runs the program with tracing, and returns the number of records.
+ */
+static uint64_t record(struct Z80Memory *mem)
+{
+    struct Z80Trace trace;
+    struct Z80 z80;
+    uint64_t n = 0;
+
+    memset(memory, 0, sizeof(memory));
+    z80_init(&z80);
+    z80_memory_init(mem, &z80, memory);
+    z80_memory_write(mem, 0x0000, program, sizeof(program));
+    z80_memory_write(mem, 0x0038, handler, sizeof(handler));
+    for (int i = 0; i < 0x40; ++i)
+        memory[0x1000 + i] = i * 7;
+
+    // A small block, so that the writer is handed many of them.
+    CHECK(z80_trace_open(&trace, &z80, TRACE_PATH, 0) == 0);
+    CHECK(z80.write_log == &trace.log);
+
+    for (int i = 0; i < STEPS; ++i)
+    {
+        z80_step(&z80);
+        expected[n] = capture(&z80, trace.log.count);
+        z80_trace_record(&trace, &z80);
+        ++n;
+
+        if (i % INTERRUPT_INTERVAL == 0)
+        {
+            z80_interrupt(&z80, 0xff);
+            expected[n] = capture(&z80, trace.log.count);
+            z80_trace_record(&trace, &z80);
+            ++n;
+        }
+    }
+
+    CHECK(trace.records == n);
+    CHECK(trace.dropped_writes == 0);
+    CHECK(z80_trace_close(&trace, &z80) == 0);
+    CHECK(z80.write_log == NULL);
+    return n;
+}
+
+static void test_replay(void)
+{
+    struct Z80Memory mem;
+    struct Z80TraceReader reader;
+    uint64_t const n = record(&mem);
+    uint64_t i = 0;
+    int result;
+
+    CHECK(z80_trace_reader_open(&reader, TRACE_PATH) == 0);
+    CHECK(reader.memory != NULL);
+    CHECK(reader.z80.pc == 0 && reader.z80.sp == 0xffff && reader.z80.af == 0xff00);
+
+    while ((result = z80_trace_next(&reader)) == 1 && i < n)
+    {
+        if (!matches(&expected[i], &reader.z80)
+            || reader.writes.count != expected[i].writes)
+        {
+            printf("  FAIL: record %llu does not match\n", (unsigned long long)i);
+            ++failures;
+            break;
+        }
+        ++i;
+    }
+
+    CHECK(result == 0);
+    CHECK(i == n);
+    CHECK(memcmp(reader.memory, memory, MEMORY_SIZE) == 0);
+    z80_trace_reader_close(&reader);
+    remove(TRACE_PATH);
+}
+
+/** Writes which a ROM ignores are left out of the trace, so that the replay
+ * ends with the same memory.
+ */
+static void test_rom_writes(void)
+{
+    static uint8_t const image[Z80_PAGE_SIZE] = {
+        0x3e, 0x55,       // ld a, 0x55
+        0x32, 0x10, 0x00, // ld (0x0010), a
+        0x76,             // halt
+    };
+    struct Z80TraceReader reader;
+    struct Z80Trace trace;
+    struct Z80Memory mem;
+    struct Z80 z80;
+    struct Z80Rom *rom = z80_rom_create(image, sizeof(image));
+
+    CHECK(rom != NULL);
+    if (!rom)
+        return;
+
+    memset(memory, 0, sizeof(memory));
+    z80_init(&z80);
+    z80_memory_init(&mem, &z80, memory);
+    CHECK(z80_memory_map_rom(&mem, rom, 0x0000) == 0);
+
+    CHECK(z80_trace_open(&trace, &z80, TRACE_PATH, 0) == 0);
+    while (!z80_is_halted(&z80))
+    {
+        z80_step(&z80);
+        z80_trace_record(&trace, &z80);
+    }
+    CHECK(trace.log.count == 0);
+    CHECK(z80_trace_close(&trace, &z80) == 0);
+
+    CHECK(z80_trace_reader_open(&reader, TRACE_PATH) == 0);
+    while (z80_trace_next(&reader) == 1)
+        CHECK(reader.writes.count == 0);
+    CHECK(reader.z80.pc == 0x0006);
+    CHECK(reader.memory[0x0010] == 0x00);
+    z80_trace_reader_close(&reader);
+    remove(TRACE_PATH);
+
+    z80_memory_free(&mem);
+    z80_rom_release(rom);
+}
+
+static void test_not_a_trace(void)
+{
+    struct Z80TraceReader reader;
+    FILE *file = fopen(TRACE_PATH, "wb");
+
+    fputs("not a trace", file);
+    fclose(file);
+    CHECK(z80_trace_reader_open(&reader, TRACE_PATH) == -1);
+    remove(TRACE_PATH);
+}
+
+int main(void)
+{
+    test_replay();
+    test_rom_writes();
+    test_not_a_trace();
+
+    return check_report();
+}
@@ -0,0 +1,136 @@
+#include "check.h"
+#include "z80/vec.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_INSTANCES 100
+#define FRAME 70000
+
+/** Adds the action read from port 0 into a counter at 0x8000, forever.
+ */
+static void boot(struct Z80VecInstance *inst, uint8_t action)
+{
+    static uint8_t const program[] = {
+        0x21, 0x00, 0x80, // ld hl, 0x8000
+        0xdb, 0x00,       // loop: in a, (0)
+        0x86,             // add a, (hl)
+        0x77,             // ld (hl), a
+        0xd3, 0x01,       // out (1), a
+        0x18, 0xf8,       // jr loop
+    };
+
+    z80_vec_instance_init(inst);
+    z80_memory_write(&inst->mem, 0x0000, program, sizeof(program));
+    inst->ports_in[0] = action;
+}
+
+static uint8_t *run(int num_threads, struct Z80VecInstance *instances)
+{
+    struct Z80Vec vec;
+    uint8_t *obs;
+    size_t size;
+
+    z80_vec_init(&vec, num_threads);
+    z80_vec_observe(&vec,
+                    1u << Z80_VEC_PC | 1u << Z80_VEC_HL | 1u << Z80_VEC_STATUS,
+                    0xfffe,
+                    4);
+    size = z80_vec_obs_size(&vec);
+    CHECK(size == 10);
+
+    obs = calloc(NUM_INSTANCES, size);
+    for (int i = 0; i < NUM_INSTANCES; ++i)
+        boot(&instances[i], (uint8_t)i);
+
+    // Apply a second action part way through, as an agent would.
+    z80_vec_run(&vec, instances, NUM_INSTANCES, FRAME, NULL);
+    for (int i = 0; i < NUM_INSTANCES; ++i)
+        instances[i].ports_in[0] = 1;
+    z80_vec_run(&vec, instances, NUM_INSTANCES, FRAME, obs);
+
+    z80_vec_free(&vec);
+    return obs;
+}
+
+/** Observed memory is read through the pages, so a window over a ROM shows
+ * the ROM rather than the instance's RAM beneath it.
+ */
+static void test_rom(void)
+{
+    static uint8_t const image[Z80_PAGE_SIZE] = {
+        0x76, // halt
+        0x5a,
+    };
+    struct Z80VecInstance *inst = malloc(sizeof(*inst));
+    struct Z80Rom *rom = z80_rom_create(image, sizeof(image));
+    struct Z80Vec vec;
+    uint8_t obs[4];
+
+    CHECK(inst != NULL && rom != NULL);
+    if (!inst || !rom)
+    {
+        free(inst);
+        return;
+    }
+
+    z80_vec_instance_init(inst);
+    CHECK(z80_memory_map_rom(&inst->mem, rom, 0x0000) == 0);
+    inst->memory[0xffff] = 0xa5;
+
+    z80_vec_init(&vec, 1);
+    z80_vec_observe(&vec, 0, 0xffff, sizeof(obs));
+    z80_vec_run(&vec, inst, 1, FRAME, obs);
+    z80_vec_free(&vec);
+
+    CHECK(inst->z80.halted);
+    CHECK(obs[0] == 0xa5);
+    CHECK(obs[1] == 0x76 && obs[2] == 0x5a && obs[3] == 0x00);
+
+    z80_memory_free(&inst->mem);
+    z80_rom_release(rom);
+    free(inst);
+}
+
+int main(void)
+{
+    struct Z80VecInstance *serial = malloc(sizeof(*serial) * NUM_INSTANCES);
+    struct Z80VecInstance *parallel = malloc(sizeof(*parallel) * NUM_INSTANCES);
+    struct Z80VecInstance *reference = malloc(sizeof(*reference));
+    uint8_t *serial_obs = run(1, serial);
+    uint8_t *parallel_obs = run(4, parallel);
+
+    CHECK(memcmp(serial_obs, parallel_obs, NUM_INSTANCES * 10) == 0);
+
+    for (int i = 0; i < NUM_INSTANCES; ++i)
+    {
+        uint8_t const *obs = parallel_obs + i * 10;
+
+        boot(reference, (uint8_t)i);
+        z80_run(&reference->z80, FRAME);
+        reference->ports_in[0] = 1;
+        z80_run(&reference->z80, reference->z80.cycles + FRAME);
+
+        CHECK(parallel[i].z80.cycles == reference->z80.cycles);
+        CHECK(parallel[i].ports_out[1] == reference->ports_out[1]);
+        CHECK(memcmp(parallel[i].memory, reference->memory, 0x10000) == 0);
+
+        CHECK((obs[0] | obs[1] << 8) == reference->z80.pc);
+        CHECK((obs[2] | obs[3] << 8) == 0x8000);
+        CHECK(obs[4] == 0 && obs[5] == 0);
+        CHECK(obs[6] == reference->memory[0xfffe]);
+        CHECK(obs[7] == reference->memory[0xffff]);
+        CHECK(obs[8] == reference->memory[0x0000] && obs[9] == 0x00);
+    }
+
+    free(serial_obs);
+    free(parallel_obs);
+    free(reference);
+    free(parallel);
+    free(serial);
+
+    test_rom();
+
+    return check_report();
+}
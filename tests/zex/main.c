@@ -1,3 +1,4 @@
+#include "z80/coverage.h"
 #include "z80/z80.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,6 +41,13 @@ static void port_store(struct Z80 *z80, uint16_t port, uint8_t const val)
     }
 }
 
+static struct Z80Bus const bus = {
+    .mem_load = mem_load,
+    .mem_store = mem_store,
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
 int main(int argc, char **argv)
 {
     struct Z80 z80;
@@ -72,10 +80,7 @@ int main(int argc, char **argv)
     fclose(romfile);
     z80_init(&z80);
     z80.userdata = memory;
-    z80.mem_load = &mem_load;
-    z80.mem_store = &mem_store;
-    z80.port_load = &port_load;
-    z80.port_store = &port_store;
+    z80.bus = &bus;
 
     // Inject halt at 0x0000
     memory[0x0000] = 0x76;
@@ -86,12 +91,33 @@ int main(int argc, char **argv)
     memory[0x0007] = 0xC9;
 
     z80.pc = 0x100;
-    while (!z80_is_halted(&z80))
+    while (!z80_is_halted(&z80) && !z80_fault(&z80))
     {
         // printf("0x%04x: ", z80.pc);
         z80_step(&z80);
         // puts("");
     }
 
+    if (z80_fault(&z80))
+    {
+        printf("\nfault %i at 0x%04x\n", z80_fault(&z80), z80_fault_pc(&z80));
+        has_error = 1;
+    }
+
+#ifdef Z80_COVERAGE
+    {
+        char path[4096];
+        FILE *out;
+
+        snprintf(path, sizeof(path), "%s.coverage", argv[1]);
+        if ((out = fopen(path, "w")))
+        {
+            z80_coverage_dump(out);
+            fclose(out);
+            printf("\ncoverage written to %s\n", path);
+        }
+    }
+#endif
+
     return has_error ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,258 @@
+/* z80-bench: measures how fast the core runs a fixed mix of instructions,
+ * or a CP/M program such as zexdoc.
+ *
+ * Built twice, as z80-bench against the exact library and z80-bench-fast
+ * against z80fast, so that the accuracy levels can be compared. With --fuse,
+ * common instruction sequences are fused (see Z80::fuse). With --instances,
+ * that many Z80s are stepped in turn instead, as a host running many
+ * machines would, so that the time per step shows the cost of bringing each
+ * Z80's state into the cache. With --profile, the guest profiler samples
+ * every so many cycles, to show what it costs. Prints the emulated clock
+ * rate reached, in MHz.
+ */
+#include "z80/memory.h"
+#include "z80/profile.h"
+#include "z80/z80.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MEMORY_SIZE 65536
+#define DEFAULT_CYCLES 500000000ull
+#define COM_ORIGIN 0x0100
+#define CACHE_LINE 64
+
+#ifdef Z80_ACCURACY_FAST
+#define LEVEL "fast"
+#else
+#define LEVEL "exact"
+#endif
+
+/* Hashes 8 KB through the ALU, storing through IX, then copies 4 KB. */
+static uint8_t const program[] = {
+    0x21, 0x00, 0x40,       // start: ld hl, 0x4000
+    0x01, 0x00, 0x20,       // ld bc, 0x2000
+    0xdd, 0x21, 0x00, 0x80, // ld ix, 0x8000
+    0x7e,                   // loop: ld a, (hl)
+    0xab,                   // xor e
+    0x07,                   // rlca
+    0x82,                   // add a, d
+    0x5f,                   // ld e, a
+    0xcb, 0x3a,             // srl d
+    0xdd, 0x77, 0x00,       // ld (ix+0), a
+    0x23,                   // inc hl
+    0xdd, 0x23,             // inc ix
+    0x0b,                   // dec bc
+    0x78,                   // ld a, b
+    0xb1,                   // or c
+    0x20, 0xee,             // jr nz, loop
+    0x21, 0x00, 0x40,       // ld hl, 0x4000
+    0x11, 0x00, 0x60,       // ld de, 0x6000
+    0x01, 0x00, 0x10,       // ld bc, 0x1000
+    0xed, 0xb0,             // ldir
+    0xc3, 0x00, 0x00,       // jp start
+};
+
+static uint8_t memory[MEMORY_SIZE];
+
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    (void)z80;
+    (void)port;
+    return 0xff;
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    (void)z80;
+    (void)port;
+    (void)val;
+}
+
+static struct Z80Bus const bus = {
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Loads a CP/M program, whose BDOS calls return at once doing nothing.
+ * @return 0 on success, or -1 if it cannot be read.
+ */
+static int load_program(struct Z80 *z80, struct Z80Memory *mem, char const *path)
+{
+    static uint8_t const stubs[] = {0xc3, 0x00, 0x00, 0x00, 0x00, 0xc9};
+    uint8_t *image = malloc(MEMORY_SIZE);
+    FILE *file = fopen(path, "rb");
+    size_t length = 0;
+
+    if (file && image)
+        length = fread(image, 1, MEMORY_SIZE - COM_ORIGIN, file);
+    if (file)
+        fclose(file);
+    if (length > 0)
+    {
+        z80_memory_write(mem, COM_ORIGIN, image, length);
+        z80_memory_write(mem, 0x0000, stubs, sizeof(stubs));
+        z80->pc = COM_ORIGIN;
+    }
+
+    free(image);
+    return length > 0 ? 0 : -1;
+}
+
+/** A Z80 for the round-robin benchmark, starting a cache line so that its
+ * hot fields share one.
+ */
+struct Instance
+{
+    _Alignas(CACHE_LINE) struct Z80 z80;
+};
+
+/** Steps `n` Z80s in turn, one instruction each, all running the built-in
+ * program in one shared memory, until `cycles` have run between them.
+ * @return 0 on success, or -1 if the instances cannot be allocated.
+ */
+static int run_instances(struct Z80Memory *mem, long n, uint64_t cycles, int fuse)
+{
+    struct Instance *instances = aligned_alloc(CACHE_LINE, n * sizeof(struct Instance));
+    uint64_t total = 0;
+    uint64_t steps = 0;
+
+    if (!instances)
+        return -1;
+
+    for (long i = 0; i < n; ++i)
+    {
+        z80_init(&instances[i].z80);
+        instances[i].z80.bus = &bus;
+        instances[i].z80.memory = mem;
+    }
+
+    double const start = now();
+    while (total < cycles)
+    {
+        for (long i = 0; i < n; ++i)
+            total += z80_step(&instances[i].z80);
+        steps += n;
+    }
+    double const elapsed = now() - start;
+
+    printf("%s%s, %ld instances: %llu cycles in %.3f s, %.1f MHz, %.2f ns per step\n",
+           LEVEL,
+           fuse ? " fused" : "",
+           n,
+           (unsigned long long)total,
+           elapsed,
+           total / elapsed / 1e6,
+           elapsed * 1e9 / steps);
+    free(instances);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int fuse = 0;
+    long instances = 0;
+    uint64_t interval = 0;
+    uint64_t cycles = DEFAULT_CYCLES;
+    char const *path = NULL;
+    struct Z80Profile profile;
+    struct Z80Memory mem;
+    struct Z80 z80;
+
+    for (; argc > 1 && argv[1][0] == '-'; --argc, ++argv)
+    {
+        if (strcmp(argv[1], "--fuse") == 0)
+        {
+            fuse = 1;
+        }
+        else if (strcmp(argv[1], "--instances") == 0 && argc > 2)
+        {
+            instances = strtol(argv[2], NULL, 0);
+            --argc;
+            ++argv;
+        }
+        else if (strcmp(argv[1], "--profile") == 0 && argc > 2)
+        {
+            interval = strtoull(argv[2], NULL, 0);
+            --argc;
+            ++argv;
+        }
+        else
+        {
+            argc = 0;
+            break;
+        }
+    }
+    if (argc > 1)
+        cycles = strtoull(argv[1], NULL, 0);
+    if (argc > 2)
+        path = argv[2];
+
+    if (argc < 1 || argc > 3 || cycles == 0 || instances < 0 || (instances && path)
+        || (instances && interval))
+    {
+        fputs("usage: z80-bench [--fuse] [--profile interval] [cycles [program.com]]\n"
+              "       z80-bench --instances n [cycles]\n",
+              stderr);
+        return EXIT_FAILURE;
+    }
+
+    z80_init(&z80);
+    z80.bus = &bus;
+    z80.fuse = fuse;
+    z80_memory_init(&mem, &z80, memory);
+    if (!path)
+    {
+        z80_memory_write(&mem, 0x0000, program, sizeof(program));
+    }
+    else if (load_program(&z80, &mem, path) != 0)
+    {
+        fprintf(stderr, "z80-bench: cannot read %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    if (instances)
+    {
+        if (run_instances(&mem, instances, cycles, fuse) == 0)
+            return EXIT_SUCCESS;
+        fputs("z80-bench: out of memory\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (interval && z80_profile_init(&profile, &z80, interval) != 0)
+    {
+        fputs("z80-bench: out of memory\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    double const start = now();
+    if (interval)
+        z80_profile_run(&profile, &z80, cycles);
+    else
+        z80_run(&z80, cycles);
+    double const elapsed = now() - start;
+
+    printf("%s%s%s: %llu cycles in %.3f s, %.1f MHz\n",
+           LEVEL,
+           fuse ? " fused" : "",
+           interval ? " profiled" : "",
+           (unsigned long long)z80.cycles,
+           elapsed,
+           z80.cycles / elapsed / 1e6);
+    if (interval)
+    {
+        printf("%llu samples of %zu distinct stacks\n",
+               (unsigned long long)profile.samples,
+               profile.num_stacks);
+        z80_profile_free(&profile, &z80);
+    }
+    return z80.fault ? EXIT_FAILURE : EXIT_SUCCESS;
+}
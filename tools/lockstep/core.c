@@ -0,0 +1,177 @@
+/* Adapter built into every z80-lockstep module, against the headers of the
+ * core it is linked with. It only uses the fields of struct Z80 and the
+ * functions which every version of the library has, so that older trees can
+ * be compared against this one.
+ */
+#include "lockstep.h"
+#include "z80/z80.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE 65536
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/** A core and everything it can observe. Checkpoints are copies of the whole
+ * struct, which holds no pointers but to itself, its static bus and the input
+ * function.
+ */
+struct Core
+{
+    struct Z80 z80;
+    LockstepInput input;
+    uint64_t port_reads;
+    uint64_t port_writes;
+    uint64_t output_hash;
+    uint8_t memory[MEMORY_SIZE];
+};
+
+static uint8_t mem_load(struct Z80 *z80, uint16_t addr)
+{
+    return ((struct Core *)z80->userdata)->memory[addr];
+}
+
+static void mem_store(struct Z80 *z80, uint16_t addr, uint8_t val)
+{
+    ((struct Core *)z80->userdata)->memory[addr] = val;
+}
+
+static uint8_t port_load(struct Z80 *z80, uint16_t port)
+{
+    struct Core *core = z80->userdata;
+    return core->input(core->port_reads++, port);
+}
+
+static void port_store(struct Z80 *z80, uint16_t port, uint8_t val)
+{
+    struct Core *core = z80->userdata;
+    uint8_t const bytes[] = {port & 0xff, port >> 8, val};
+
+    for (size_t i = 0; i < sizeof(bytes); ++i)
+        core->output_hash = (core->output_hash ^ bytes[i]) * FNV_PRIME;
+    ++core->port_writes;
+}
+
+#ifdef Z80_HAS_BUS
+static struct Z80Bus const bus = {
+    .mem_load = mem_load,
+    .mem_store = mem_store,
+    .port_load = port_load,
+    .port_store = port_store,
+};
+#endif
+
+static void *create(LockstepInput input)
+{
+    struct Core *core = calloc(1, sizeof(struct Core));
+
+    if (!core)
+        return NULL;
+
+    z80_init(&core->z80);
+#ifdef Z80_HAS_BUS
+    core->z80.bus = &bus;
+#else
+    core->z80.mem_load = mem_load;
+    core->z80.mem_store = mem_store;
+    core->z80.port_load = port_load;
+    core->z80.port_store = port_store;
+#endif
+    core->z80.userdata = core;
+    core->input = input;
+    core->output_hash = FNV_OFFSET;
+    return core;
+}
+
+static void destroy(void *core)
+{
+    free(core);
+}
+
+static void load(void *ptr, uint16_t addr, uint8_t const *data, size_t length)
+{
+    struct Core *core = ptr;
+
+    for (size_t i = 0; i < length; ++i)
+        core->memory[(uint16_t)(addr + i)] = data[i];
+}
+
+static void start(void *ptr, uint16_t pc, uint16_t sp)
+{
+    struct Core *core = ptr;
+
+    core->z80.pc = pc;
+    core->z80.sp = sp;
+}
+
+static void step(void *ptr, uint64_t count)
+{
+    struct Core *core = ptr;
+
+    while (count--)
+        z80_step(&core->z80);
+}
+
+static void regs(void const *ptr, struct LockstepRegs *regs)
+{
+    struct Core const *core = ptr;
+    struct Z80 const *z80 = &core->z80;
+
+    memset(regs, 0, sizeof(*regs));
+    regs->cycles = z80->cycles;
+    regs->pc = z80->pc;
+    regs->sp = z80->sp;
+    regs->ix = z80->ix;
+    regs->iy = z80->iy;
+    regs->af = z80->af;
+    regs->bc = z80->bc;
+    regs->de = z80->de;
+    regs->hl = z80->hl;
+    regs->afp = z80->afp;
+    regs->bcp = z80->bcp;
+    regs->dep = z80->dep;
+    regs->hlp = z80->hlp;
+    regs->i = z80->i;
+    regs->r = z80->r;
+    regs->iff1 = z80->iff1;
+    regs->iff2 = z80->iff2;
+    regs->interrupt_mode = z80->interrupt_mode;
+    regs->halted = z80->halted;
+    regs->port_reads = core->port_reads;
+    regs->port_writes = core->port_writes;
+    regs->output_hash = core->output_hash;
+}
+
+static uint8_t const *memory(void const *ptr)
+{
+    return ((struct Core const *)ptr)->memory;
+}
+
+static void save(void const *core, void *state)
+{
+    memcpy(state, core, sizeof(struct Core));
+}
+
+static void restore(void *core, void const *state)
+{
+    memcpy(core, state, sizeof(struct Core));
+}
+
+static struct LockstepCore const interface = {
+    .abi_version = LOCKSTEP_ABI_VERSION,
+    .state_size = sizeof(struct Core),
+    .create = create,
+    .destroy = destroy,
+    .load = load,
+    .start = start,
+    .step = step,
+    .regs = regs,
+    .memory = memory,
+    .save = save,
+    .restore = restore,
+};
+
+LOCKSTEP_EXPORT struct LockstepCore const *z80_lockstep_core(void)
+{
+    return &interface;
+}
@@ -0,0 +1,73 @@
+#ifndef Z80_LOCKSTEP_H
+#define Z80_LOCKSTEP_H
+
+/* Interface between z80-lockstep and the cores it compares.
+ *
+ * Every core is built from its own sources into a loadable module, along with
+ * core.c, so two versions of the library (which share every symbol name and
+ * may disagree on the layout of struct Z80) can run in one process. Only the
+ * types below cross between the harness and a module.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+/** Bumped whenever struct LockstepCore changes. */
+#define LOCKSTEP_ABI_VERSION 1
+
+/** Name of the function each module exports. */
+#define LOCKSTEP_SYMBOL "z80_lockstep_core"
+
+/** Exports a symbol from a module built with hidden visibility. */
+#define LOCKSTEP_EXPORT __attribute__((visibility("default")))
+
+/** Supplies the value of a port read.
+ * @param index Number of ports the core has read before this one.
+ * @param port The port being read.
+ */
+typedef uint8_t (*LockstepInput)(uint64_t index, uint16_t port);
+
+/** Registers and I/O state compared between cores.
+ */
+struct LockstepRegs
+{
+    uint64_t cycles;
+    uint16_t pc, sp, ix, iy;
+    uint16_t af, bc, de, hl;
+    uint16_t afp, bcp, dep, hlp;
+    uint8_t i, r;
+    uint8_t iff1, iff2;
+    uint8_t interrupt_mode;
+    uint8_t halted;
+    uint64_t port_reads;
+    uint64_t port_writes;
+    /** FNV-1a hash of every (port, value) written, in order. */
+    uint64_t output_hash;
+};
+
+/** A core, with its memory and port feed.
+ */
+struct LockstepCore
+{
+    int abi_version;
+    /** Bytes taken by a checkpoint. */
+    size_t state_size;
+
+    /** Creates a core with zeroed memory, reading ports from `input`. */
+    void *(*create)(LockstepInput input);
+    void (*destroy)(void *core);
+    /** Copies `length` bytes to memory at `addr`, wrapping at 64K. */
+    void (*load)(void *core, uint16_t addr, uint8_t const *data, size_t length);
+    /** Sets the program counter and stack pointer. */
+    void (*start)(void *core, uint16_t pc, uint16_t sp);
+    /** Executes `count` instructions. */
+    void (*step)(void *core, uint64_t count);
+    void (*regs)(void const *core, struct LockstepRegs *regs);
+    /** Returns the core's 64K of memory. */
+    uint8_t const *(*memory)(void const *core);
+    void (*save)(void const *core, void *state);
+    void (*restore)(void *core, void const *state);
+};
+
+typedef struct LockstepCore const *(*LockstepEntry)(void);
+
+#endif
@@ -0,0 +1,449 @@
+/* z80-lockstep: runs one program on two cores in lockstep, and finds the
+ * first instruction after which they disagree.
+ *
+ * Each core is a module built by this directory's CMakeLists.txt, from this
+ * tree or from another checkout of the library. Both get their own memory and
+ * the same image, and read the same values from their ports. Every interval
+ * instructions their registers, memory and port writes are compared, and a
+ * checkpoint is taken while they agree. Once they differ, both are rewound to
+ * the last checkpoint and the interval is bisected down to one instruction.
+ */
+#include "lockstep.h"
+#include "z80/disasm.h"
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MEMORY_SIZE 65536
+#define COM_ORIGIN 0x0100
+
+enum Format
+{
+    FORMAT_AUTO,
+    FORMAT_RAW,
+    FORMAT_COM,
+};
+
+struct Options
+{
+    enum Format format;
+    uint64_t instructions;
+    uint64_t interval;
+    uint16_t origin;
+    int32_t entry;
+    uint8_t flags_mask;
+    int ignore_r;
+    uint64_t seed;
+};
+
+/** One of the two cores being compared.
+ */
+struct Side
+{
+    char const *name;
+    char const *path;
+    void *handle;
+    struct LockstepCore const *api;
+    void *core;
+    /** State after the last instruction count at which the cores agreed. */
+    void *checkpoint;
+};
+
+static struct Options options = {
+    .format = FORMAT_AUTO,
+    .instructions = 1000000000ull,
+    .interval = 1000000,
+    .origin = 0,
+    .entry = -1,
+    .flags_mask = 0xff,
+    .ignore_r = 0,
+    .seed = 0,
+};
+
+#define REG(NAME)                                                              \
+    {                                                                          \
+        #NAME, offsetof(struct LockstepRegs, NAME),                            \
+            sizeof(((struct LockstepRegs *)0)->NAME)                           \
+    }
+
+static struct
+{
+    char const *name;
+    size_t offset;
+    size_t size;
+} const registers[] = {
+    REG(pc),   REG(sp),   REG(ix),   REG(iy),          REG(af),
+    REG(bc),   REG(de),   REG(hl),   REG(afp),         REG(bcp),
+    REG(dep),  REG(hlp),  REG(i),    REG(r),           REG(iff1),
+    REG(iff2), REG(interrupt_mode),  REG(halted),      REG(cycles),
+    REG(port_reads),      REG(port_writes),            REG(output_hash),
+};
+
+#undef REG
+
+/** Value of the `index`th port read. Both cores are handed this function, so
+ * they see the same values for as long as they read the same ports.
+ */
+static uint8_t input(uint64_t index, uint16_t port)
+{
+    // splitmix64
+    uint64_t x = options.seed + (index + 1) * 0x9e3779b97f4a7c15ull + port;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return (uint8_t)(x ^ (x >> 31));
+}
+
+static int open_side(struct Side *side)
+{
+    LockstepEntry entry;
+
+    side->handle = dlopen(side->path, RTLD_NOW | RTLD_LOCAL);
+    if (!side->handle)
+    {
+        fprintf(stderr, "z80-lockstep: %s\n", dlerror());
+        return -1;
+    }
+
+    entry = (LockstepEntry)dlsym(side->handle, LOCKSTEP_SYMBOL);
+    if (!entry)
+    {
+        fprintf(stderr, "z80-lockstep: %s\n", dlerror());
+        return -1;
+    }
+
+    side->api = entry();
+    if (side->api->abi_version != LOCKSTEP_ABI_VERSION)
+    {
+        fprintf(stderr, "z80-lockstep: %s was built for another harness\n", side->path);
+        return -1;
+    }
+
+    side->core = side->api->create(input);
+    side->checkpoint = malloc(side->api->state_size);
+    if (!side->core || !side->checkpoint)
+    {
+        fprintf(stderr, "z80-lockstep: out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void close_side(struct Side *side)
+{
+    if (side->core)
+        side->api->destroy(side->core);
+    free(side->checkpoint);
+    if (side->handle)
+        dlclose(side->handle);
+}
+
+/** Loads the image into both cores.
+ * @return 0 on success, or -1 if the image cannot be read.
+ */
+static int load_image(char const *path, struct Side *sides)
+{
+    char const *ext = strrchr(path, '.');
+    enum Format format = options.format;
+    uint8_t *image = malloc(MEMORY_SIZE);
+    FILE *file = fopen(path, "rb");
+    size_t length;
+    uint16_t origin = options.origin;
+    uint16_t pc, sp = 0xffff;
+
+    if (!image || !file)
+    {
+        fprintf(stderr, "z80-lockstep: cannot read %s\n", path);
+        free(image);
+        if (file)
+            fclose(file);
+        return -1;
+    }
+    length = fread(image, 1, MEMORY_SIZE, file);
+    fclose(file);
+
+    if (format == FORMAT_AUTO)
+        format = ext && strcasecmp(ext, ".com") == 0 ? FORMAT_COM : FORMAT_RAW;
+    if (format == FORMAT_COM)
+        origin = COM_ORIGIN;
+    pc = origin;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        sides[i].api->load(sides[i].core, origin, image, length);
+        if (format == FORMAT_COM)
+        {
+            // Returning to 0 halts, and BDOS calls return at once, doing
+            // nothing. The return address is the zero at the top of memory.
+            static uint8_t const halt = 0x76, ret = 0xc9;
+            sides[i].api->load(sides[i].core, 0x0000, &halt, 1);
+            sides[i].api->load(sides[i].core, 0x0005, &ret, 1);
+            sp = 0xfffe;
+        }
+        sides[i].api->start(
+            sides[i].core, options.entry >= 0 ? options.entry : pc, sp);
+    }
+
+    free(image);
+    return 0;
+}
+
+static void get_regs(struct Side const *side, struct LockstepRegs *regs)
+{
+    side->api->regs(side->core, regs);
+    regs->af &= 0xff00 | options.flags_mask;
+    regs->afp &= 0xff00 | options.flags_mask;
+    if (options.ignore_r)
+        regs->r = 0;
+}
+
+static uint64_t field(struct LockstepRegs const *regs, size_t i)
+{
+    uint8_t const *p = (uint8_t const *)regs + registers[i].offset;
+
+    switch (registers[i].size)
+    {
+        case 1: return *p;
+        case 2: return *(uint16_t const *)p;
+        default: return *(uint64_t const *)p;
+    }
+}
+
+/** Compares the cores, printing each difference if `report` is set.
+ * @return Whether the cores agree.
+ */
+static int compare(struct Side const *sides, int report)
+{
+    struct LockstepRegs regs[2];
+    uint8_t const *a = sides[0].api->memory(sides[0].core);
+    uint8_t const *b = sides[1].api->memory(sides[1].core);
+    int same = 1;
+
+    get_regs(&sides[0], &regs[0]);
+    get_regs(&sides[1], &regs[1]);
+
+    for (size_t i = 0; i < sizeof(registers) / sizeof(registers[0]); ++i)
+    {
+        uint64_t const x = field(&regs[0], i), y = field(&regs[1], i);
+        if (x == y)
+            continue;
+        same = 0;
+        if (report)
+            printf("  %-14s %s 0x%llx, %s 0x%llx\n",
+                   registers[i].name,
+                   sides[0].name,
+                   (unsigned long long)x,
+                   sides[1].name,
+                   (unsigned long long)y);
+    }
+
+    if (memcmp(a, b, MEMORY_SIZE) != 0)
+    {
+        same = 0;
+        for (int addr = 0; report && addr < MEMORY_SIZE; ++addr)
+        {
+            if (a[addr] != b[addr])
+                printf("  (0x%04x)         %s 0x%02x, %s 0x%02x\n",
+                       addr,
+                       sides[0].name,
+                       a[addr],
+                       sides[1].name,
+                       b[addr]);
+        }
+    }
+
+    return same;
+}
+
+static void checkpoint(struct Side *sides)
+{
+    for (int i = 0; i < 2; ++i)
+        sides[i].api->save(sides[i].core, sides[i].checkpoint);
+}
+
+static void rewind_to_checkpoint(struct Side *sides)
+{
+    for (int i = 0; i < 2; ++i)
+        sides[i].api->restore(sides[i].core, sides[i].checkpoint);
+}
+
+static void step(struct Side *sides, uint64_t count)
+{
+    for (int i = 0; i < 2; ++i)
+        sides[i].api->step(sides[i].core, count);
+}
+
+/** Narrows a divergence down to one instruction. The cores must be at their
+ * checkpoint, `agree` instructions in, and disagree `disagree` instructions
+ * in. Prints the instruction and the differences it leaves behind.
+ */
+static void bisect(struct Side *sides, uint64_t agree, uint64_t disagree)
+{
+    struct LockstepRegs regs;
+    uint8_t code[Z80_MAX_INSTR_LENGTH];
+    char text[64];
+
+    while (disagree - agree > 1)
+    {
+        uint64_t const mid = agree + (disagree - agree) / 2;
+
+        step(sides, mid - agree);
+        if (compare(sides, 0))
+        {
+            checkpoint(sides);
+            agree = mid;
+        }
+        else
+        {
+            rewind_to_checkpoint(sides);
+            disagree = mid;
+        }
+    }
+
+    sides[0].api->regs(sides[0].core, &regs);
+    for (int i = 0; i < Z80_MAX_INSTR_LENGTH; ++i)
+        code[i] = sides[0].api->memory(sides[0].core)[(uint16_t)(regs.pc + i)];
+    z80_disassemble(code, regs.pc, text, sizeof(text));
+
+    printf("diverged at instruction %llu, pc 0x%04x: %s\n",
+           (unsigned long long)disagree,
+           regs.pc,
+           text);
+    step(sides, 1);
+    compare(sides, 1);
+}
+
+/** Runs the cores until they disagree, both halt, or the instruction limit.
+ * @return Whether they agreed throughout.
+ */
+static int run(struct Side *sides)
+{
+    uint64_t done = 0;
+
+    checkpoint(sides);
+    if (!compare(sides, 0))
+    {
+        printf("diverged before the first instruction\n");
+        compare(sides, 1);
+        return 0;
+    }
+
+    while (done < options.instructions)
+    {
+        struct LockstepRegs regs;
+        uint64_t count = options.instructions - done;
+
+        if (count > options.interval)
+            count = options.interval;
+
+        step(sides, count);
+        if (!compare(sides, 0))
+        {
+            rewind_to_checkpoint(sides);
+            bisect(sides, done, done + count);
+            return 0;
+        }
+
+        checkpoint(sides);
+        done += count;
+
+        // Nothing can interrupt a halt, so this is as far as they go.
+        sides[0].api->regs(sides[0].core, &regs);
+        if (regs.halted)
+        {
+            printf("no divergence, halted by instruction %llu\n",
+                   (unsigned long long)done);
+            return 1;
+        }
+    }
+
+    printf("no divergence in %llu instructions\n", (unsigned long long)done);
+    return 1;
+}
+
+static void usage(void)
+{
+    fputs("usage: z80-lockstep [options] reference.so candidate.so image\n"
+          "  -f, --format raw|com      image format (default: by extension)\n"
+          "  -n, --instructions N      stop after N instructions\n"
+          "  -i, --interval N          compare every N instructions\n"
+          "  -o, --origin ADDR         load address of raw images\n"
+          "  -e, --entry ADDR          initial program counter\n"
+          "  -m, --flags-mask MASK     compare only these bits of F and F'\n"
+          "  -r, --ignore-r            do not compare R\n"
+          "  -s, --seed N              seed of the values read from ports\n",
+          stderr);
+}
+
+static int parse_options(int argc, char **argv)
+{
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    {
+        char const *opt = argv[i];
+        char const *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+#define OPTION(SHORT, LONG) (strcmp(opt, SHORT) == 0 || strcmp(opt, LONG) == 0)
+        if (OPTION("-r", "--ignore-r"))
+        {
+            options.ignore_r = 1;
+            continue;
+        }
+        else if (!value)
+            return -1;
+        else if (OPTION("-f", "--format"))
+        {
+            if (strcmp(value, "raw") == 0)
+                options.format = FORMAT_RAW;
+            else if (strcmp(value, "com") == 0)
+                options.format = FORMAT_COM;
+            else
+                return -1;
+        }
+        else if (OPTION("-n", "--instructions"))
+            options.instructions = strtoull(value, NULL, 0);
+        else if (OPTION("-i", "--interval"))
+            options.interval = strtoull(value, NULL, 0);
+        else if (OPTION("-o", "--origin"))
+            options.origin = strtoul(value, NULL, 0);
+        else if (OPTION("-e", "--entry"))
+            options.entry = strtoul(value, NULL, 0) & 0xffff;
+        else if (OPTION("-m", "--flags-mask"))
+            options.flags_mask = strtoul(value, NULL, 0);
+        else if (OPTION("-s", "--seed"))
+            options.seed = strtoull(value, NULL, 0);
+        else
+            return -1;
+#undef OPTION
+        ++i;
+    }
+
+    return options.interval > 0 ? i : -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct Side sides[2] = {{.name = "reference"}, {.name = "candidate"}};
+    int first = parse_options(argc, argv);
+    int result = EXIT_FAILURE;
+
+    if (first < 0 || argc - first != 3)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    sides[0].path = argv[first];
+    sides[1].path = argv[first + 1];
+
+    if (open_side(&sides[0]) == 0 && open_side(&sides[1]) == 0
+        && load_image(argv[first + 2], sides) == 0)
+        result = run(sides) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    close_side(&sides[1]);
+    close_side(&sides[0]);
+    return result;
+}
@@ -0,0 +1,537 @@
+/* z80-run: runs Z80 images headlessly, and reports the results as JSON.
+ *
+ * Images are memory mapped and loaded as raw binaries, CP/M .COM programs
+ * (run under the z80cpm runtime) or Intel HEX files. Each runs until it halts,
+ * exits to CP/M, faults, or reaches the cycle limit or timeout. Many images
+ * may be given; they are shared out between worker threads, and the results
+ * are printed in the order given.
+ */
+#include "z80/cpm.h"
+#include "z80/memory.h"
+#include "z80/z80.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MEMORY_SIZE 65536
+#define TIMEOUT_CHECK_INTERVAL 65536
+
+enum Format
+{
+    FORMAT_AUTO,
+    FORMAT_RAW,
+    FORMAT_COM,
+    FORMAT_HEX,
+};
+
+enum Status
+{
+    STATUS_HALTED,
+    STATUS_EXITED,
+    STATUS_CYCLE_LIMIT,
+    STATUS_TIMEOUT,
+    STATUS_FAULT,
+    STATUS_ERROR,
+};
+
+static char const *const status_names[] = {
+    "halted", "exited", "cycle_limit", "timeout", "fault", "error"};
+
+struct Options
+{
+    enum Format format;
+    uint64_t max_cycles;
+    double timeout;
+    uint16_t origin;
+    int32_t entry;
+    int jobs;
+    char const *directory;
+    char const *args;
+};
+
+struct Job
+{
+    char const *path;
+    enum Status status;
+    char const *error;
+    struct Z80 z80;
+    uint64_t instructions;
+    double seconds;
+    char *output;
+    size_t output_length;
+};
+
+static struct Options options = {
+    .format = FORMAT_AUTO,
+    .max_cycles = 10000000000ull,
+    .timeout = 0,
+    .origin = 0,
+    .entry = -1,
+    .jobs = 0,
+    .directory = ".",
+    .args = NULL,
+};
+
+static struct Job *jobs;
+static int num_jobs;
+static atomic_int next_job;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint8_t port_load(struct Z80 *z80, uint16_t const port)
+{
+    (void)z80;
+    (void)port;
+    return 0xff;
+}
+
+static void port_store(struct Z80 *z80, uint16_t const port, uint8_t const val)
+{
+    (void)z80;
+    (void)port;
+    (void)val;
+}
+
+static struct Z80Bus const bus = {
+    .port_load = port_load,
+    .port_store = port_store,
+};
+
+static enum Format detect_format(char const *path)
+{
+    char const *ext = strrchr(path, '.');
+
+    if (options.format != FORMAT_AUTO)
+        return options.format;
+    if (ext && strcasecmp(ext, ".com") == 0)
+        return FORMAT_COM;
+    if (ext && (strcasecmp(ext, ".hex") == 0 || strcasecmp(ext, ".ihx") == 0))
+        return FORMAT_HEX;
+    return FORMAT_RAW;
+}
+
+static int hex_byte(char const *s, uint8_t *out)
+{
+    unsigned value;
+    char digits[3] = {s[0], s[1], '\0'};
+    char *end;
+
+    value = strtoul(digits, &end, 16);
+    if (end != digits + 2)
+        return -1;
+    *out = value;
+    return 0;
+}
+
+/** Loads an Intel HEX image.
+ * @return 0 on success, or -1 if the image is malformed.
+ */
+static int load_hex(struct Z80 *z80, char const *text, size_t length)
+{
+    char const *end = text + length;
+
+    while (text < end)
+    {
+        uint8_t record[4 + 255 + 1];
+        uint8_t sum = 0;
+        uint8_t count;
+
+        if (*text != ':')
+        {
+            ++text;
+            continue;
+        }
+        ++text;
+
+        if (end - text < 2 || hex_byte(text, &count) != 0
+            || end - text < 2 * (5 + count))
+            return -1;
+
+        for (int i = 0; i < 5 + count; ++i)
+        {
+            if (hex_byte(text + 2 * i, &record[i]) != 0)
+                return -1;
+            sum += record[i];
+        }
+        text += 2 * (5 + count);
+
+        if (sum != 0)
+            return -1;
+
+        uint16_t const addr = (record[1] << 8) | record[2];
+        switch (record[3])
+        {
+            case 0x00:
+                z80_memory_write(z80->memory, addr, record + 4, count);
+                break;
+            case 0x01: return 0;
+            case 0x03:
+                if (count == 4)
+                    z80->pc = (record[6] << 8) | record[7];
+                break;
+            case 0x05:
+                if (count == 4)
+                    z80->pc = (record[6] << 8) | record[7];
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static void run_job(struct Job *job)
+{
+    uint8_t *memory = calloc(1, MEMORY_SIZE);
+    enum Format const format = detect_format(job->path);
+    struct Z80Memory mem;
+    struct Z80Cpm cpm;
+    struct Z80 *z80 = &job->z80;
+    FILE *output = NULL;
+    double const start = now();
+    double const deadline = options.timeout > 0 ? start + options.timeout : 0;
+    struct stat st;
+    void *image = MAP_FAILED;
+    int fd;
+
+    job->status = STATUS_ERROR;
+
+    if (!memory)
+    {
+        job->error = "out of memory";
+        return;
+    }
+
+    z80_init(z80);
+    z80->bus = &bus;
+    z80_memory_init(&mem, z80, memory);
+
+    if (format == FORMAT_COM)
+    {
+        output = open_memstream(&job->output, &job->output_length);
+        z80_cpm_init(&cpm, z80, options.directory);
+        cpm.console_out = output;
+        cpm.console_in = fopen("/dev/null", "r");
+        if (!output || !cpm.console_in)
+        {
+            job->error = "could not open console";
+            goto done;
+        }
+        if (z80_cpm_load(&cpm, job->path, options.args) != 0)
+        {
+            job->error = "could not load image";
+            goto done;
+        }
+    }
+    else
+    {
+        if ((fd = open(job->path, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            job->error = "could not open image";
+            goto done;
+        }
+
+        if (st.st_size == 0)
+        {
+            close(fd);
+            job->error = "empty image";
+            goto done;
+        }
+
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (image == MAP_FAILED)
+        {
+            job->error = "could not map image";
+            goto done;
+        }
+
+        if (format == FORMAT_HEX)
+        {
+            if (load_hex(z80, image, st.st_size) != 0)
+                job->error = "malformed hex image";
+        }
+        else
+        {
+            size_t length = st.st_size;
+            if (length > (size_t)MEMORY_SIZE - options.origin)
+                length = MEMORY_SIZE - options.origin;
+            z80_memory_write(&mem, options.origin, image, length);
+            z80->pc = options.origin;
+        }
+        munmap(image, st.st_size);
+
+        if (job->error)
+            goto done;
+    }
+
+    if (options.entry >= 0)
+        z80->pc = options.entry;
+
+    for (;;)
+    {
+        uint64_t limit = z80->cycles + TIMEOUT_CHECK_INTERVAL;
+
+        if (limit > options.max_cycles)
+            limit = options.max_cycles;
+
+        while (z80->cycles < limit && !z80_is_halted(z80) && !z80_fault(z80)
+               && !(format == FORMAT_COM && cpm.exited))
+        {
+            z80_step(z80);
+            ++job->instructions;
+        }
+
+        if (format == FORMAT_COM && cpm.exited)
+        {
+            job->status = STATUS_EXITED;
+            break;
+        }
+        if (z80_is_halted(z80))
+        {
+            job->status = STATUS_HALTED;
+            break;
+        }
+        if (z80_fault(z80))
+        {
+            job->status = STATUS_FAULT;
+            break;
+        }
+        if (z80->cycles >= options.max_cycles)
+        {
+            job->status = STATUS_CYCLE_LIMIT;
+            break;
+        }
+        if (deadline && now() >= deadline)
+        {
+            job->status = STATUS_TIMEOUT;
+            break;
+        }
+    }
+
+done:
+    job->seconds = now() - start;
+
+    if (format == FORMAT_COM)
+    {
+        if (cpm.console_in)
+            fclose(cpm.console_in);
+        z80_cpm_free(&cpm);
+        if (output)
+            fclose(output);
+    }
+
+    z80->memory = NULL;
+    free(memory);
+}
+
+static void *worker(void *arg)
+{
+    int index;
+    (void)arg;
+
+    while ((index = atomic_fetch_add(&next_job, 1)) < num_jobs)
+        run_job(&jobs[index]);
+
+    return NULL;
+}
+
+static void print_string(char const *s, size_t length)
+{
+    putchar('"');
+    for (size_t i = 0; i < length; ++i)
+    {
+        unsigned char const c = s[i];
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c == '\n')
+            printf("\\n");
+        else if (c == '\r')
+            printf("\\r");
+        else if (c == '\t')
+            printf("\\t");
+        else if (c < 0x20 || c >= 0x7f)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void print_job(struct Job const *job)
+{
+    struct Z80 const *z80 = &job->z80;
+
+    printf("  {\n    \"image\": ");
+    print_string(job->path, strlen(job->path));
+    printf(",\n    \"status\": \"%s\",\n", status_names[job->status]);
+    if (job->error)
+    {
+        printf("    \"error\": ");
+        print_string(job->error, strlen(job->error));
+        printf("\n  }");
+        return;
+    }
+    if (job->status == STATUS_FAULT)
+    {
+        printf("    \"fault\": %i,\n    \"fault_pc\": %u,\n",
+               z80_fault(z80),
+               z80_fault_pc(z80));
+    }
+
+    printf("    \"cycles\": %llu,\n", (unsigned long long)z80->cycles);
+    printf("    \"instructions\": %llu,\n",
+           (unsigned long long)job->instructions);
+    printf("    \"seconds\": %.6f,\n", job->seconds);
+    printf("    \"mhz\": %.2f,\n",
+           job->seconds > 0 ? z80->cycles / job->seconds / 1e6 : 0.0);
+    printf("    \"registers\": {\"af\": %u, \"bc\": %u, \"de\": %u, "
+           "\"hl\": %u, \"af'\": %u, \"bc'\": %u, \"de'\": %u, "
+           "\"hl'\": %u, \"ix\": %u, \"iy\": %u, \"sp\": %u, \"pc\": %u, "
+           "\"i\": %u, \"r\": %u, \"iff1\": %u, \"iff2\": %u, \"im\": %u}",
+           z80->af,
+           z80->bc,
+           z80->de,
+           z80->hl,
+           z80->afp,
+           z80->bcp,
+           z80->dep,
+           z80->hlp,
+           z80->ix,
+           z80->iy,
+           z80->sp,
+           z80->pc,
+           z80->i,
+           z80->r,
+           z80->iff1,
+           z80->iff2,
+           z80->interrupt_mode);
+    if (job->output)
+    {
+        printf(",\n    \"output\": ");
+        print_string(job->output, job->output_length);
+    }
+    printf("\n  }");
+}
+
+static void usage(void)
+{
+    fputs("usage: z80-run [options] image...\n"
+          "  -f, --format raw|com|hex  image format (default: by extension)\n"
+          "  -c, --cycles N            stop after N cycles\n"
+          "  -t, --timeout SECONDS     stop after SECONDS of host time\n"
+          "  -o, --origin ADDR         load address of raw images\n"
+          "  -e, --entry ADDR          initial program counter\n"
+          "  -j, --jobs N              number of worker threads\n"
+          "  -d, --directory DIR       directory for CP/M files\n"
+          "  -a, --args TEXT           command tail for CP/M programs\n",
+          stderr);
+}
+
+static int parse_options(int argc, char **argv)
+{
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    {
+        char const *opt = argv[i];
+        char const *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+#define OPTION(SHORT, LONG) (strcmp(opt, SHORT) == 0 || strcmp(opt, LONG) == 0)
+        if (!value)
+            return -1;
+        else if (OPTION("-f", "--format"))
+        {
+            if (strcmp(value, "raw") == 0)
+                options.format = FORMAT_RAW;
+            else if (strcmp(value, "com") == 0)
+                options.format = FORMAT_COM;
+            else if (strcmp(value, "hex") == 0)
+                options.format = FORMAT_HEX;
+            else
+                return -1;
+        }
+        else if (OPTION("-c", "--cycles"))
+            options.max_cycles = strtoull(value, NULL, 0);
+        else if (OPTION("-t", "--timeout"))
+            options.timeout = strtod(value, NULL);
+        else if (OPTION("-o", "--origin"))
+            options.origin = strtoul(value, NULL, 0);
+        else if (OPTION("-e", "--entry"))
+            options.entry = strtoul(value, NULL, 0) & 0xffff;
+        else if (OPTION("-j", "--jobs"))
+            options.jobs = atoi(value);
+        else if (OPTION("-d", "--directory"))
+            options.directory = value;
+        else if (OPTION("-a", "--args"))
+            options.args = value;
+        else
+            return -1;
+#undef OPTION
+        ++i;
+    }
+
+    return i;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t *threads;
+    int first = parse_options(argc, argv);
+    int result = EXIT_SUCCESS;
+    int num_threads;
+
+    if (first < 0 || first >= argc)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    num_jobs = argc - first;
+    jobs = calloc(num_jobs, sizeof(struct Job));
+    for (int i = 0; i < num_jobs; ++i)
+        jobs[i].path = argv[first + i];
+
+    num_threads = options.jobs > 0 ? options.jobs
+                                   : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > num_jobs)
+        num_threads = num_jobs;
+
+    threads = calloc(num_threads, sizeof(pthread_t));
+    for (int i = 0; i < num_threads; ++i)
+        pthread_create(&threads[i], NULL, worker, NULL);
+    for (int i = 0; i < num_threads; ++i)
+        pthread_join(threads[i], NULL);
+
+    printf("[\n");
+    for (int i = 0; i < num_jobs; ++i)
+    {
+        print_job(&jobs[i]);
+        printf(i + 1 < num_jobs ? ",\n" : "\n");
+
+        if (jobs[i].status != STATUS_HALTED && jobs[i].status != STATUS_EXITED)
+            result = EXIT_FAILURE;
+        free(jobs[i].output);
+    }
+    printf("]\n");
+
+    free(threads);
+    free(jobs);
+    return result;
+}